@@ -0,0 +1,364 @@
+/*
+ * This file is part of txproto.
+ *
+ * txproto is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * txproto is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with txproto; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include <libavutil/time.h>
+
+#include "iosys_common.h"
+#include <libtxproto/utils.h>
+#include <libtxproto/log.h>
+#include "ctrl_template.h"
+#include "os_compat.h"
+#include "app_source.h"
+
+/* Nothing signals downstream FIFOs having room, so they get polled */
+#define DOWNSTREAM_POLL 2000
+
+typedef struct AppSource {
+    AVRational time_base;
+    AVRational frame_rate;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond; /* Signalled on any queue change */
+    AVFrame **queue;
+    int fifo_size;
+    int head;
+    int nb_queued;
+    int eos; /* The end has been queued */
+    int quit;
+
+    int64_t epoch;
+    pthread_t thread;
+
+    /* Stats */
+    int64_t pushed;
+    int dropped;
+    int64_t stats_start;
+    int64_t stats_pushed;
+} AppSource;
+
+static void update_stats(IOSysEntry *entry, AppSource *s)
+{
+    int64_t now = av_gettime_relative();
+
+    s->pushed++;
+    s->stats_pushed++;
+
+    if ((now - s->stats_start) < AV_TIME_BASE)
+        return;
+
+    double rate = s->stats_pushed * (double)AV_TIME_BASE / (now - s->stats_start);
+
+    pthread_mutex_lock(&s->lock);
+    int queued = s->nb_queued;
+    pthread_mutex_unlock(&s->lock);
+
+    SPGenericData entries[] = {
+        D_TYPE("rate", NULL, rate),
+        D_TYPE("queued", NULL, queued),
+        D_TYPE("frames", NULL, s->pushed),
+        D_TYPE("dropped_frames", NULL, s->dropped),
+        { 0 },
+    };
+    sp_eventlist_dispatch(entry, entry->events, SP_EVENT_ON_STATS, entries);
+
+    s->stats_start = now;
+    s->stats_pushed = 0;
+}
+
+static void *app_source_thread(void *arg)
+{
+    int err = 0;
+    IOSysEntry *entry = arg;
+    AppSource *s = entry->io_priv;
+
+    sp_set_thread_name_self(sp_class_get_name(entry));
+
+    sp_eventlist_dispatch(entry, entry->events, SP_EVENT_ON_INIT | SP_EVENT_ON_CONFIG, NULL);
+
+    s->stats_start = av_gettime_relative();
+
+    while (1) {
+        pthread_mutex_lock(&s->lock);
+
+        while (!s->nb_queued && !s->eos && !s->quit)
+            pthread_cond_wait(&s->cond, &s->lock);
+
+        if (s->quit || !s->nb_queued) {
+            pthread_mutex_unlock(&s->lock);
+            break;
+        }
+
+        AVFrame *f = s->queue[s->head];
+        s->head = (s->head + 1) % s->fifo_size;
+        s->nb_queued--;
+
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+
+        /* Frames without a timestamp are stamped on arrival */
+        if (f->pts == AV_NOPTS_VALUE)
+            f->pts = av_rescale_q(av_gettime_relative() - s->epoch,
+                                  AV_TIME_BASE_Q, s->time_base);
+
+        if (!f->opaque_ref) {
+            f->opaque_ref = av_buffer_allocz(sizeof(FormatExtraData));
+            if (!f->opaque_ref) {
+                av_frame_free(&f);
+                err = AVERROR(ENOMEM);
+                break;
+            }
+
+            FormatExtraData *fe = (FormatExtraData *)f->opaque_ref->data;
+            fe->time_base = s->time_base;
+            fe->avg_frame_rate = s->frame_rate;
+        }
+
+        /* Downstream refuses what it has no room for, so wait for it, which
+         * leaves the queue full and makes pushes wait in turn */
+        pthread_mutex_lock(&s->lock);
+        while (!s->quit && sp_frame_fifo_would_overflow(entry->frames)) {
+            int64_t deadline = av_gettime() + DOWNSTREAM_POLL;
+            struct timespec ts = {
+                .tv_sec  = deadline / 1000000,
+                .tv_nsec = (deadline % 1000000) * 1000,
+            };
+            pthread_cond_timedwait(&s->cond, &s->lock, &ts);
+        }
+        int quit = s->quit;
+        pthread_mutex_unlock(&s->lock);
+
+        if (quit) {
+            av_frame_free(&f);
+            break;
+        }
+
+        /* Can still be refused if something else pushes into the same FIFOs */
+        err = sp_frame_fifo_push(entry->frames, f);
+        av_frame_free(&f);
+        if (err == AVERROR(ENOBUFS)) {
+            s->dropped++;
+            sp_log(entry, SP_LOG_WARN, "Dropping frame (%i dropped so far)!\n",
+                   s->dropped);
+            err = 0;
+        } else if (err) {
+            sp_log(entry, SP_LOG_ERROR, "Unable to push frame to FIFO: %s!\n",
+                   av_err2str(err));
+            break;
+        }
+
+        update_stats(entry, s);
+    }
+
+    /* Makes any waiting pushes give up */
+    pthread_mutex_lock(&s->lock);
+    s->quit = 1;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+
+    /* EOS */
+    sp_frame_fifo_push(entry->frames, NULL);
+    sp_eventlist_dispatch(entry, entry->events, SP_EVENT_ON_EOS, &err);
+
+    return NULL;
+}
+
+static void stop_thread(AppSource *s)
+{
+    pthread_mutex_lock(&s->lock);
+    s->quit = 1;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+
+    pthread_join(s->thread, NULL);
+    s->thread = 0;
+}
+
+static int app_source_ctrl_cb(AVBufferRef *event_ref, void *callback_ctx, void *ctx,
+                              void *dep_ctx, void *data)
+{
+    SPCtrlTemplateCbCtx *event = callback_ctx;
+
+    IOSysEntry *entry = ctx;
+    AppSource *s = entry->io_priv;
+
+    if (event->ctrl & SP_EVENT_CTRL_START) {
+        s->epoch = atomic_load(event->epoch);
+        if (!s->thread)
+            pthread_create(&s->thread, NULL, app_source_thread, entry);
+        return 0;
+    } else if (event->ctrl & SP_EVENT_CTRL_STOP) {
+        if (s->thread)
+            stop_thread(s);
+        return 0;
+    } else {
+        return AVERROR(ENOTSUP);
+    }
+}
+
+static int app_source_ctrl(AVBufferRef *entry, SPEventType ctrl, void *arg)
+{
+    IOSysEntry *iosys_entry = (IOSysEntry *)entry->data;
+    return sp_ctrl_template(iosys_entry, iosys_entry->events, 0x0,
+                            app_source_ctrl_cb, ctrl, arg);
+}
+
+int sp_app_source_push(AVBufferRef *entry_ref, AVFrame *frame, int64_t timeout)
+{
+    int err = 0;
+    IOSysEntry *entry = (IOSysEntry *)entry_ref->data;
+    AppSource *s = entry->io_priv;
+
+    if (entry->ctrl != app_source_ctrl)
+        return AVERROR(EINVAL);
+
+    AVFrame *ref = NULL;
+    if (frame && !(ref = av_frame_clone(frame)))
+        return AVERROR(ENOMEM);
+
+    /* Condition variables wait on the wall clock */
+    struct timespec ts;
+    if (timeout > 0) {
+        int64_t deadline = av_gettime() + timeout;
+        ts.tv_sec  = deadline / 1000000;
+        ts.tv_nsec = (deadline % 1000000) * 1000;
+    }
+
+    pthread_mutex_lock(&s->lock);
+
+    while (!s->quit && !s->eos && (s->nb_queued == s->fifo_size)) {
+        if (!timeout) {
+            err = AVERROR(EAGAIN);
+            goto end;
+        } else if (timeout < 0) {
+            pthread_cond_wait(&s->cond, &s->lock);
+        } else if (pthread_cond_timedwait(&s->cond, &s->lock, &ts) == ETIMEDOUT) {
+            err = AVERROR(EAGAIN);
+            goto end;
+        }
+    }
+
+    if (s->quit || s->eos) {
+        err = AVERROR_EOF;
+        goto end;
+    }
+
+    if (ref) {
+        s->queue[(s->head + s->nb_queued) % s->fifo_size] = ref;
+        s->nb_queued++;
+        ref = NULL;
+    } else {
+        s->eos = 1;
+    }
+
+    pthread_cond_broadcast(&s->cond);
+
+end:
+    pthread_mutex_unlock(&s->lock);
+    av_frame_free(&ref);
+    return err;
+}
+
+static void destroy_source(void *opaque, uint8_t *data)
+{
+    IOSysEntry *entry = (IOSysEntry *)data;
+    AppSource *s = entry->io_priv;
+
+    if (s) {
+        if (s->thread)
+            stop_thread(s);
+
+        for (int i = 0; i < s->nb_queued; i++)
+            av_frame_free(&s->queue[(s->head + i) % s->fifo_size]);
+        av_free(s->queue);
+
+        pthread_cond_destroy(&s->cond);
+        pthread_mutex_destroy(&s->lock);
+        av_free(s);
+    }
+
+    av_buffer_unref(&entry->frames);
+    sp_bufferlist_free(&entry->events);
+
+    av_free(entry->desc);
+    sp_class_free(entry);
+    av_free(entry);
+}
+
+AVBufferRef *sp_app_source_create(void *log_ctx, const char *name,
+                                  enum AVMediaType type, AVRational time_base,
+                                  AVRational frame_rate, int fifo_size)
+{
+    if (type != AVMEDIA_TYPE_VIDEO && type != AVMEDIA_TYPE_AUDIO) {
+        sp_log(log_ctx, SP_LOG_ERROR, "Application sources only support video and audio!\n");
+        return NULL;
+    } else if (!time_base.num || !time_base.den) {
+        sp_log(log_ctx, SP_LOG_ERROR, "Invalid time base %i/%i!\n",
+               time_base.num, time_base.den);
+        return NULL;
+    }
+
+    IOSysEntry *entry = av_mallocz(sizeof(*entry));
+    if (!entry)
+        return NULL;
+
+    AVBufferRef *entry_ref = av_buffer_create((uint8_t *)entry, sizeof(*entry),
+                                              destroy_source, NULL, 0);
+    if (!entry_ref) {
+        av_free(entry);
+        return NULL;
+    }
+
+    int err = sp_class_alloc(entry, name ? name : "app_source",
+                             type == AVMEDIA_TYPE_VIDEO ? SP_TYPE_VIDEO_SOURCE :
+                                                          SP_TYPE_AUDIO_SOURCE,
+                             log_ctx);
+    if (err < 0)
+        goto fail;
+
+    AppSource *s = av_mallocz(sizeof(*s));
+    if (!s)
+        goto fail;
+
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    entry->io_priv = s;
+
+    s->time_base = time_base;
+    s->frame_rate = frame_rate;
+    s->fifo_size = fifo_size > 0 ? fifo_size : 8;
+    s->queue = av_calloc(s->fifo_size, sizeof(*s->queue));
+
+    entry->framerate = frame_rate;
+    entry->desc = av_strdup("Application source");
+    /* Only passes frames on, queueing happens before */
+    entry->frames = sp_frame_fifo_create(entry, 0, 0);
+    entry->events = sp_bufferlist_new();
+    entry->ctrl = app_source_ctrl;
+    if (!s->queue || !entry->desc || !entry->frames || !entry->events)
+        goto fail;
+
+    return entry_ref;
+
+fail:
+    av_buffer_unref(&entry_ref);
+    return NULL;
+}
@@ -0,0 +1,37 @@
+/*
+ * This file is part of txproto.
+ *
+ * txproto is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * txproto is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with txproto; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <libavutil/buffer.h>
+#include <libavutil/frame.h>
+#include <libavutil/rational.h>
+
+/* Creates an IOSys source entry which frames from the application can be
+ * pushed into. A thread of its own passes them on downstream, waiting for it
+ * to have room rather than dropping any, so pushing waits once fifo_size frames
+ * are queued and downstream is behind.
+ * frame_rate may be zero if unknown. */
+AVBufferRef *sp_app_source_create(void *log_ctx, const char *name,
+                                  enum AVMediaType type, AVRational time_base,
+                                  AVRational frame_rate, int fifo_size);
+
+/* Queues a new reference to the frame, or NULL to signal the end.
+ * Waits for up to timeout microseconds for space, or forever if negative.
+ * Returns AVERROR(EAGAIN) if there was none, AVERROR_EOF once stopped. */
+int sp_app_source_push(AVBufferRef *entry, AVFrame *frame, int64_t timeout);
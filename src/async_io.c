@@ -0,0 +1,859 @@
+/*
+ * This file is part of txproto.
+ *
+ * txproto is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * txproto is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with txproto; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <libavformat/version.h>
+#include <libavutil/mem.h>
+#include <libavutil/time.h>
+#include <libavutil/avstring.h>
+
+#include <libtxproto/utils.h>
+#include <libtxproto/log.h>
+#include "async_io.h"
+#include "os_compat.h"
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+/* Size of the buffer lavf itself reads from or writes into */
+#define AVIO_BUFFER_SIZE (64 << 10)
+
+enum BlockState {
+    /* Read: may be issued. Write: may be filled by the muxer. */
+    BLOCK_FREE = 0,
+    /* Read: has data for the demuxer. Write: waiting to be written. */
+    BLOCK_READY,
+    /* Owned by the I/O thread */
+    BLOCK_PENDING,
+};
+
+enum FsyncMode {
+    FSYNC_NONE = 0,
+    FSYNC_CLOSE,
+    FSYNC_INTERVAL,
+    FSYNC_ALWAYS,
+};
+
+enum Backend {
+    BACKEND_AUTO = 0,
+    BACKEND_URING,
+    BACKEND_THREAD,
+};
+
+typedef struct AsyncIOBlock {
+    uint8_t *data;
+    int64_t pos;      /* File offset of the first byte */
+    int size;         /* Read: valid bytes. Write: bytes to write. */
+    unsigned int gen; /* Read: seek generation the request was made in */
+} AsyncIOBlock;
+
+struct SPAsyncIO {
+    void *log_ctx;
+    AVIOContext *pb;
+    int fd;
+    int write;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond; /* Signalled on any block state change */
+    int quit;
+    int err;
+
+    AsyncIOBlock *blocks;
+    int *state;
+    int nb_blocks;
+    int block_size;
+
+    /* AVIO callbacks side */
+    int head;     /* Block being read from, or filled */
+    int head_off; /* Read only, offset within the head block */
+    int64_t pos;  /* Position lavf sees */
+    int64_t size; /* Write only, largest offset lavf wrote up to */
+
+    /* I/O thread side, blocks from next up to head are in flight or ready */
+    int next;
+    int64_t next_pos; /* Read only, file offset of the next request */
+    int in_flight;
+    unsigned int gen;
+    int eof;
+    int64_t eof_pos;
+
+    int fsync_mode;
+    int64_t fsync_interval;
+    int64_t last_sync;
+
+#ifdef HAVE_LIBURING
+    int use_uring;
+    struct io_uring ring;
+#endif
+};
+
+/* Transfers the remainder of a block synchronously, returns the new amount
+ * of bytes done, or an error */
+static int transfer_rest(SPAsyncIO *s, AsyncIOBlock *blk, int done)
+{
+    int target = s->write ? blk->size : s->block_size;
+
+    while (done < target) {
+        ssize_t ret;
+        if (s->write)
+            ret = pwrite(s->fd, blk->data + done, target - done, blk->pos + done);
+        else
+            ret = pread(s->fd, blk->data + done, target - done, blk->pos + done);
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return AVERROR(errno);
+        } else if (!ret) {
+            break;
+        }
+
+        done += ret;
+    }
+
+    return done;
+}
+
+static void set_state(SPAsyncIO *s, AsyncIOBlock *blk, int state)
+{
+    s->state[blk - s->blocks] = state;
+    pthread_cond_broadcast(&s->cond);
+}
+
+static int get_state(SPAsyncIO *s, int idx)
+{
+    return s->state[idx];
+}
+
+/* Called with the lock held */
+static void complete_read(SPAsyncIO *s, AsyncIOBlock *blk, int ret)
+{
+    if (blk->gen != s->gen) {
+        /* Seeked away while the request was in flight */
+        set_state(s, blk, BLOCK_FREE);
+        return;
+    } else if (ret < 0) {
+        sp_log(s->log_ctx, SP_LOG_ERROR, "Error reading at %" PRIi64 ": %s!\n",
+               blk->pos, av_err2str(ret));
+        s->err = ret;
+        set_state(s, blk, BLOCK_FREE);
+        return;
+    }
+
+    blk->size = ret;
+    if (ret < s->block_size) {
+        s->eof_pos = s->eof ? SPMIN(s->eof_pos, blk->pos + ret) : blk->pos + ret;
+        s->eof = 1;
+    }
+
+    set_state(s, blk, BLOCK_READY);
+}
+
+/* Called with the lock held */
+static void complete_write(SPAsyncIO *s, AsyncIOBlock *blk, int ret)
+{
+    if (ret < 0 && !s->err) {
+        sp_log(s->log_ctx, SP_LOG_ERROR, "Error writing at %" PRIi64 ": %s!\n",
+               blk->pos, av_err2str(ret));
+        s->err = ret;
+    }
+
+    blk->size = 0;
+    set_state(s, blk, BLOCK_FREE);
+}
+
+/* Called with the lock held, after a block has been written */
+static void sync_output(SPAsyncIO *s)
+{
+    int64_t now = av_gettime_relative();
+
+    if (!((s->fsync_mode == FSYNC_ALWAYS) ||
+          ((s->fsync_mode == FSYNC_INTERVAL) &&
+           ((now - s->last_sync) >= s->fsync_interval))))
+        return;
+
+    pthread_mutex_unlock(&s->lock);
+    int ret = fdatasync(s->fd);
+    pthread_mutex_lock(&s->lock);
+
+    if (ret < 0 && !s->err)
+        s->err = AVERROR(errno);
+
+    s->last_sync = now;
+}
+
+static int can_issue_read(SPAsyncIO *s)
+{
+    return !s->quit && !s->eof && !s->err &&
+           (get_state(s, s->next) == BLOCK_FREE);
+}
+
+/* Called with the lock held, takes the next block to read */
+static AsyncIOBlock *take_read_block(SPAsyncIO *s)
+{
+    AsyncIOBlock *blk = &s->blocks[s->next];
+
+    blk->pos = s->next_pos;
+    blk->size = 0;
+    blk->gen = s->gen;
+    s->state[s->next] = BLOCK_PENDING;
+
+    s->next = (s->next + 1) % s->nb_blocks;
+    s->next_pos += s->block_size;
+    s->in_flight++;
+
+    return blk;
+}
+
+static void thread_loop(SPAsyncIO *s)
+{
+    pthread_mutex_lock(&s->lock);
+
+    while (1) {
+        AsyncIOBlock *blk = NULL;
+
+        if (!s->write && can_issue_read(s))
+            blk = take_read_block(s);
+        else if (s->write && (get_state(s, s->next) == BLOCK_READY))
+            blk = &s->blocks[s->next];
+
+        if (!blk) {
+            if (s->quit)
+                break;
+            pthread_cond_wait(&s->cond, &s->lock);
+            continue;
+        }
+
+        if (s->write) {
+            s->state[s->next] = BLOCK_PENDING;
+            s->in_flight++;
+        }
+
+        pthread_mutex_unlock(&s->lock);
+        int ret = transfer_rest(s, blk, 0);
+        pthread_mutex_lock(&s->lock);
+
+        s->in_flight--;
+        if (s->write) {
+            complete_write(s, blk, ret);
+            s->next = (s->next + 1) % s->nb_blocks;
+            sync_output(s);
+        } else {
+            complete_read(s, blk, ret);
+        }
+    }
+
+    pthread_mutex_unlock(&s->lock);
+}
+
+#ifdef HAVE_LIBURING
+/* Called with the lock held. Reads have no ordering requirements, so as
+ * many as there are free blocks get issued at once. */
+static int uring_issue_reads(SPAsyncIO *s)
+{
+    int nb = 0;
+
+    while (can_issue_read(s)) {
+        struct io_uring_sqe *sqe = io_uring_get_sqe(&s->ring);
+        if (!sqe)
+            break;
+
+        AsyncIOBlock *blk = take_read_block(s);
+        io_uring_prep_read(sqe, s->fd, blk->data, s->block_size, blk->pos);
+        io_uring_sqe_set_data(sqe, blk);
+        nb++;
+    }
+
+    return nb;
+}
+
+/* Called with the lock held. Muxers rewrite headers, so writes must land in
+ * order: a batch is a single linked chain, and a new one is only issued
+ * once the previous one has completed. */
+static int uring_issue_writes(SPAsyncIO *s)
+{
+    int nb = 0;
+    struct io_uring_sqe *prev = NULL;
+
+    if (s->in_flight)
+        return 0;
+
+    for (int i = 0; i < s->nb_blocks; i++) {
+        int idx = (s->next + i) % s->nb_blocks;
+        if (get_state(s, idx) != BLOCK_READY)
+            break;
+
+        struct io_uring_sqe *sqe = io_uring_get_sqe(&s->ring);
+        if (!sqe)
+            break;
+
+        if (prev)
+            prev->flags |= IOSQE_IO_LINK;
+
+        AsyncIOBlock *blk = &s->blocks[idx];
+        io_uring_prep_write(sqe, s->fd, blk->data, blk->size, blk->pos);
+        io_uring_sqe_set_data(sqe, blk);
+        s->state[idx] = BLOCK_PENDING;
+        s->in_flight++;
+        prev = sqe;
+        nb++;
+    }
+
+    return nb;
+}
+
+/* Called with the lock held */
+static void uring_complete(SPAsyncIO *s, AsyncIOBlock *blk, int res)
+{
+    s->in_flight--;
+
+    if (s->write && (res == -ECANCELED)) {
+        /* An earlier write in the chain fell short, reissued next batch */
+        set_state(s, blk, BLOCK_READY);
+    } else if (res < 0) {
+        if (s->write)
+            complete_write(s, blk, AVERROR(-res));
+        else
+            complete_read(s, blk, AVERROR(-res));
+    } else {
+        /* Short transfers are rare on regular files, finish them here */
+        int target = s->write ? blk->size : s->block_size;
+        if (res && (res < target)) {
+            pthread_mutex_unlock(&s->lock);
+            res = transfer_rest(s, blk, res);
+            pthread_mutex_lock(&s->lock);
+        }
+        if (s->write)
+            complete_write(s, blk, res);
+        else
+            complete_read(s, blk, res);
+    }
+
+    if (s->write && !s->in_flight) {
+        while ((s->next != s->head) && (get_state(s, s->next) == BLOCK_FREE))
+            s->next = (s->next + 1) % s->nb_blocks;
+        sync_output(s);
+    }
+}
+
+static void uring_loop(SPAsyncIO *s)
+{
+    pthread_mutex_lock(&s->lock);
+
+    while (1) {
+        int nb = s->write ? uring_issue_writes(s) : uring_issue_reads(s);
+        if (nb) {
+            int ret = io_uring_submit(&s->ring);
+            if (ret < 0) {
+                sp_log(s->log_ctx, SP_LOG_ERROR, "Unable to submit I/O: %s!\n",
+                       av_err2str(AVERROR(-ret)));
+                s->err = AVERROR(-ret);
+                break;
+            }
+        }
+
+        if (!s->in_flight) {
+            if (s->quit || s->err)
+                break;
+            pthread_cond_wait(&s->cond, &s->lock);
+            continue;
+        }
+
+        pthread_mutex_unlock(&s->lock);
+
+        struct io_uring_cqe *cqe;
+        int ret = io_uring_wait_cqe(&s->ring, &cqe);
+
+        pthread_mutex_lock(&s->lock);
+
+        if (ret == -EINTR) {
+            continue;
+        } else if (ret < 0) {
+            s->err = AVERROR(-ret);
+            break;
+        }
+
+        AsyncIOBlock *blk = io_uring_cqe_get_data(cqe);
+        int res = cqe->res;
+        io_uring_cqe_seen(&s->ring, cqe);
+
+        uring_complete(s, blk, res);
+    }
+
+    /* Wake up anyone waiting on a block that will never arrive */
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+}
+#endif
+
+static void *async_io_thread(void *arg)
+{
+    SPAsyncIO *s = arg;
+
+    sp_set_thread_name_self(s->write ? "async_io:write" : "async_io:read");
+
+#ifdef HAVE_LIBURING
+    if (s->use_uring) {
+        uring_loop(s);
+        return NULL;
+    }
+#endif
+
+    thread_loop(s);
+
+    return NULL;
+}
+
+static int async_read(void *opaque, uint8_t *buf, int buf_size)
+{
+    SPAsyncIO *s = opaque;
+    int ret = 0;
+
+    pthread_mutex_lock(&s->lock);
+
+    while (ret < buf_size) {
+        AsyncIOBlock *blk = &s->blocks[s->head];
+
+        if (get_state(s, s->head) != BLOCK_READY) {
+            if (ret)
+                break; /* Return what we have rather than waiting */
+            if (s->err < 0) {
+                ret = s->err;
+                break;
+            }
+            if (s->eof && (s->pos >= s->eof_pos)) {
+                ret = AVERROR_EOF;
+                break;
+            }
+            pthread_cond_wait(&s->cond, &s->lock);
+            continue;
+        }
+
+        int len = SPMIN(blk->size - s->head_off, buf_size - ret);
+        memcpy(buf + ret, blk->data + s->head_off, len);
+        ret += len;
+        s->pos += len;
+        s->head_off += len;
+
+        if (s->head_off == blk->size) {
+            set_state(s, blk, BLOCK_FREE);
+            s->head = (s->head + 1) % s->nb_blocks;
+            s->head_off = 0;
+        }
+    }
+
+    pthread_mutex_unlock(&s->lock);
+
+    return ret;
+}
+
+/* Called with the lock held */
+static void queue_write_block(SPAsyncIO *s)
+{
+    set_state(s, &s->blocks[s->head], BLOCK_READY);
+    s->head = (s->head + 1) % s->nb_blocks;
+}
+
+#if LIBAVFORMAT_VERSION_MAJOR < 61
+static int async_write(void *opaque, uint8_t *buf, int buf_size)
+#else
+static int async_write(void *opaque, const uint8_t *buf, int buf_size)
+#endif
+{
+    SPAsyncIO *s = opaque;
+    int ret = 0;
+
+    pthread_mutex_lock(&s->lock);
+
+    while (ret < buf_size) {
+        if (s->err < 0) {
+            ret = s->err;
+            break;
+        }
+
+        AsyncIOBlock *blk = &s->blocks[s->head];
+        if (get_state(s, s->head) != BLOCK_FREE) {
+            /* Every block is queued, the disk can't keep up */
+            pthread_cond_wait(&s->cond, &s->lock);
+            continue;
+        }
+
+        if (!blk->size)
+            blk->pos = s->pos;
+
+        int len = SPMIN(s->block_size - blk->size, buf_size - ret);
+        memcpy(blk->data + blk->size, buf + ret, len);
+        blk->size += len;
+        ret += len;
+        s->pos += len;
+        s->size = SPMAX(s->size, s->pos);
+
+        if (blk->size == s->block_size)
+            queue_write_block(s);
+    }
+
+    pthread_mutex_unlock(&s->lock);
+
+    return ret;
+}
+
+/* Called with the lock held */
+static int64_t seek_read(SPAsyncIO *s, int64_t pos)
+{
+    /* Skip forward within what was read ahead */
+    while (get_state(s, s->head) == BLOCK_READY) {
+        AsyncIOBlock *blk = &s->blocks[s->head];
+        if ((pos >= blk->pos) && (pos < (blk->pos + blk->size))) {
+            s->head_off = pos - blk->pos;
+            s->pos = pos;
+            return pos;
+        } else if ((pos < blk->pos) || (blk->size < s->block_size)) {
+            break;
+        }
+
+        set_state(s, blk, BLOCK_FREE);
+        s->head = (s->head + 1) % s->nb_blocks;
+        s->head_off = 0;
+    }
+
+    /* Drop everything, requests in flight get discarded on completion */
+    s->gen++;
+    for (int i = 0; i < s->nb_blocks; i++)
+        if (get_state(s, i) == BLOCK_READY)
+            s->state[i] = BLOCK_FREE;
+
+    s->head = s->next;
+    s->head_off = 0;
+    s->next_pos = pos;
+    s->pos = pos;
+    s->eof = 0;
+
+    pthread_cond_broadcast(&s->cond);
+
+    return pos;
+}
+
+/* Called with the lock held */
+static int64_t seek_write(SPAsyncIO *s, int64_t pos)
+{
+    AsyncIOBlock *blk = &s->blocks[s->head];
+
+    /* Blocks carry their own offset, so only a discontinuity ends one */
+    if (blk->size && (pos != (blk->pos + blk->size)) &&
+        (get_state(s, s->head) == BLOCK_FREE))
+        queue_write_block(s);
+
+    s->pos = pos;
+
+    return pos;
+}
+
+/* Called with the lock held */
+static int64_t file_size(SPAsyncIO *s)
+{
+    struct stat st;
+    if (fstat(s->fd, &st) < 0)
+        return AVERROR(errno);
+
+    return s->write ? SPMAX(st.st_size, s->size) : st.st_size;
+}
+
+static int64_t async_seek(void *opaque, int64_t offset, int whence)
+{
+    SPAsyncIO *s = opaque;
+    int64_t ret;
+
+    pthread_mutex_lock(&s->lock);
+
+    if (whence & AVSEEK_SIZE) {
+        ret = file_size(s);
+        goto end;
+    }
+
+    switch (whence & ~AVSEEK_FORCE) {
+    case SEEK_SET:
+        ret = offset;
+        break;
+    case SEEK_CUR:
+        ret = s->pos + offset;
+        break;
+    case SEEK_END:
+        ret = file_size(s);
+        if (ret >= 0)
+            ret += offset;
+        break;
+    default:
+        ret = AVERROR(EINVAL);
+        break;
+    }
+
+    if (ret < 0)
+        goto end;
+
+    ret = s->write ? seek_write(s, ret) : seek_read(s, ret);
+
+end:
+    pthread_mutex_unlock(&s->lock);
+    return ret;
+}
+
+static void async_io_free(SPAsyncIO *s)
+{
+    if (s->pb) {
+        av_freep(&s->pb->buffer);
+        avio_context_free(&s->pb);
+    }
+
+#ifdef HAVE_LIBURING
+    if (s->use_uring)
+        io_uring_queue_exit(&s->ring);
+#endif
+
+    if (s->fd >= 0)
+        close(s->fd);
+
+    for (int i = 0; s->blocks && i < s->nb_blocks; i++)
+        av_free(s->blocks[i].data);
+    av_free(s->blocks);
+    av_free(s->state);
+
+    pthread_cond_destroy(&s->cond);
+    pthread_mutex_destroy(&s->lock);
+
+    av_free(s);
+}
+
+int sp_async_io_open(void *log_ctx, SPAsyncIO **s_ptr, AVIOContext **pb,
+                     const char *url, int flags, AVDictionary *opts)
+{
+    int err;
+    const char *tmp_val;
+
+    *s_ptr = NULL;
+
+    if (!(tmp_val = dict_get(opts, "async")) ||
+        !(!strcmp(tmp_val, "true") || strtol(tmp_val, NULL, 10) != 0))
+        return 0;
+
+    const char *proto = avio_find_protocol_name(url);
+    if (!proto || strcmp(proto, "file")) {
+        sp_log(log_ctx, SP_LOG_WARN, "Async I/O only supported for local files, "
+               "not \"%s\"!\n", url);
+        return AVERROR(ENOTSUP);
+    }
+    av_strstart(url, "file:", &url);
+
+    SPAsyncIO *s = av_mallocz(sizeof(*s));
+    if (!s)
+        return AVERROR(ENOMEM);
+
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    s->log_ctx = log_ctx;
+    s->fd = -1;
+    s->write = !!(flags & AVIO_FLAG_WRITE);
+    s->block_size = 512 << 10;
+    s->fsync_mode = FSYNC_CLOSE;
+    s->fsync_interval = 1000000;
+    s->last_sync = av_gettime_relative();
+
+    int64_t buffer_size = 8 << 20;
+    int backend = BACKEND_AUTO;
+
+    if ((tmp_val = dict_get(opts, "buffer_size"))) {
+        int64_t val = strtoll(tmp_val, NULL, 10);
+        if (val <= 0)
+            sp_log(log_ctx, SP_LOG_ERROR, "Invalid buffer size \"%s\"!\n", tmp_val);
+        else
+            buffer_size = val;
+    }
+    if ((tmp_val = dict_get(opts, "block_size"))) {
+        long val = strtol(tmp_val, NULL, 10);
+        if (val < 4096 || val > (INT_MAX >> 1))
+            sp_log(log_ctx, SP_LOG_ERROR, "Invalid block size \"%s\"!\n", tmp_val);
+        else
+            s->block_size = val;
+    }
+    if ((tmp_val = dict_get(opts, "backend"))) {
+        if (!strcmp(tmp_val, "auto"))
+            backend = BACKEND_AUTO;
+        else if (!strcmp(tmp_val, "io_uring"))
+            backend = BACKEND_URING;
+        else if (!strcmp(tmp_val, "thread"))
+            backend = BACKEND_THREAD;
+        else
+            sp_log(log_ctx, SP_LOG_ERROR, "Invalid backend \"%s\"!\n", tmp_val);
+    }
+    if ((tmp_val = dict_get(opts, "fsync"))) {
+        if (!strcmp(tmp_val, "none"))
+            s->fsync_mode = FSYNC_NONE;
+        else if (!strcmp(tmp_val, "close"))
+            s->fsync_mode = FSYNC_CLOSE;
+        else if (!strcmp(tmp_val, "interval"))
+            s->fsync_mode = FSYNC_INTERVAL;
+        else if (!strcmp(tmp_val, "always"))
+            s->fsync_mode = FSYNC_ALWAYS;
+        else
+            sp_log(log_ctx, SP_LOG_ERROR, "Invalid fsync mode \"%s\"!\n", tmp_val);
+    }
+    if ((tmp_val = dict_get(opts, "fsync_interval"))) {
+        long val = strtol(tmp_val, NULL, 10);
+        if (val <= 0)
+            sp_log(log_ctx, SP_LOG_ERROR, "Invalid fsync interval \"%s\"!\n", tmp_val);
+        else
+            s->fsync_interval = val * 1000;
+    }
+
+    s->nb_blocks = SPMAX(buffer_size / s->block_size, 2);
+    s->blocks = av_mallocz(s->nb_blocks * sizeof(*s->blocks));
+    s->state = av_mallocz(s->nb_blocks * sizeof(*s->state));
+    if (!s->blocks || !s->state) {
+        err = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    for (int i = 0; i < s->nb_blocks; i++) {
+        s->blocks[i].data = av_malloc(s->block_size);
+        if (!s->blocks[i].data) {
+            err = AVERROR(ENOMEM);
+            goto fail;
+        }
+    }
+
+    int oflags = s->write ? (O_WRONLY | O_CREAT | O_TRUNC) : O_RDONLY;
+#ifdef O_CLOEXEC
+    oflags |= O_CLOEXEC;
+#endif
+    s->fd = open(url, oflags, 0666);
+    if (s->fd < 0) {
+        err = AVERROR(errno);
+        sp_log(log_ctx, SP_LOG_ERROR, "Couldn't open %s: %s!\n", url, av_err2str(err));
+        goto fail;
+    }
+
+    if (!s->write)
+        posix_fadvise(s->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+#ifdef HAVE_LIBURING
+    if (backend != BACKEND_THREAD) {
+        err = io_uring_queue_init(s->nb_blocks, &s->ring, 0);
+        if (err < 0 && backend == BACKEND_URING) {
+            err = AVERROR(-err);
+            sp_log(log_ctx, SP_LOG_ERROR, "Unable to init io_uring: %s!\n",
+                   av_err2str(err));
+            goto fail;
+        } else if (err < 0) {
+            sp_log(log_ctx, SP_LOG_VERBOSE, "io_uring unavailable (%s), "
+                   "using a thread\n", av_err2str(AVERROR(-err)));
+        }
+        s->use_uring = err >= 0;
+    }
+#else
+    if (backend == BACKEND_URING)
+        sp_log(log_ctx, SP_LOG_WARN, "Built without io_uring, using a thread!\n");
+#endif
+
+    uint8_t *avio_buf = av_malloc(AVIO_BUFFER_SIZE);
+    if (!avio_buf) {
+        err = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    s->pb = avio_alloc_context(avio_buf, AVIO_BUFFER_SIZE, s->write, s,
+                               s->write ? NULL : async_read,
+                               s->write ? async_write : NULL,
+                               async_seek);
+    if (!s->pb) {
+        av_free(avio_buf);
+        err = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    err = pthread_create(&s->thread, NULL, async_io_thread, s);
+    if (err) {
+        err = AVERROR(err);
+        goto fail;
+    }
+
+    sp_log(log_ctx, SP_LOG_VERBOSE, "Async I/O for %s: %i blocks of %i KiB, via %s\n",
+           url, s->nb_blocks, s->block_size >> 10,
+#ifdef HAVE_LIBURING
+           s->use_uring ? "io_uring" :
+#endif
+           "a thread");
+
+    *pb = s->pb;
+    *s_ptr = s;
+
+    return 1;
+
+fail:
+    async_io_free(s);
+    return err;
+}
+
+int sp_async_io_close(SPAsyncIO **s_ptr)
+{
+    SPAsyncIO *s = *s_ptr;
+    if (!s)
+        return 0;
+
+    if (s->write)
+        avio_flush(s->pb);
+
+    pthread_mutex_lock(&s->lock);
+
+    if (s->write) {
+        if (s->blocks[s->head].size && (get_state(s, s->head) == BLOCK_FREE))
+            queue_write_block(s);
+
+        /* Wait for the write-behind to drain */
+        while (!s->err) {
+            int idle = 1;
+            for (int i = 0; i < s->nb_blocks; i++)
+                idle &= get_state(s, i) == BLOCK_FREE;
+            if (idle)
+                break;
+            pthread_cond_wait(&s->cond, &s->lock);
+        }
+    }
+
+    s->quit = 1;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+
+    pthread_join(s->thread, NULL);
+
+    int err = s->err;
+    if (s->write && (s->fsync_mode != FSYNC_NONE) &&
+        (fdatasync(s->fd) < 0) && !err)
+        err = AVERROR(errno);
+
+    async_io_free(s);
+    *s_ptr = NULL;
+
+    return err;
+}
@@ -0,0 +1,45 @@
+/*
+ * This file is part of txproto.
+ *
+ * txproto is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * txproto is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with txproto; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <libavformat/avio.h>
+#include <libavutil/dict.h>
+
+/* An AVIOContext backed by a ring of large blocks, filled (read-ahead) or
+ * drained (write-behind) by a dedicated I/O thread, so that stalls on the
+ * disk don't stall the thread demuxing or muxing. Only local files.
+ *
+ * Options:
+ *     async          - "true" or 1 to enable, otherwise nothing is opened
+ *     buffer_size    - total size of the ring, in bytes (default 8 MiB)
+ *     block_size     - size of a single I/O request, in bytes (default 512 KiB)
+ *     backend        - "auto", "io_uring" or "thread"
+ *     fsync          - "none", "close" (default), "interval" or "always"
+ *     fsync_interval - for "interval", in milliseconds (default 1000)
+ */
+typedef struct SPAsyncIO SPAsyncIO;
+
+/* Returns 0 and leaves *s NULL if the options don't enable async I/O,
+ * AVERROR(ENOTSUP) if the URL is not a local file, 1 if opened */
+int sp_async_io_open(void *log_ctx, SPAsyncIO **s, AVIOContext **pb,
+                     const char *url, int flags, AVDictionary *opts);
+
+/* Writes out everything pending, applies the fsync policy and frees the
+ * AVIOContext given on open */
+int sp_async_io_close(SPAsyncIO **s);
@@ -0,0 +1,379 @@
+/*
+ * This file is part of txproto.
+ *
+ * txproto is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * txproto is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with txproto; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <libtxproto/bsf.h>
+
+#include <pthread.h>
+#include <libavutil/avstring.h>
+#include <libavutil/opt.h>
+
+#include "utils.h"
+#include "ctrl_template.h"
+#include "os_compat.h"
+
+int sp_bsf_connect_demuxer(BSFContext *ctx, DemuxingContext *demux,
+                           int stream_id, const char *stream_desc)
+{
+    int err;
+
+    int idx = sp_demuxer_find_stream(demux, stream_id, stream_desc);
+    if (idx < 0)
+        return idx;
+
+    pthread_mutex_lock(&demux->lock);
+
+    AVStream *st = demux->avf->streams[idx];
+
+    err = avcodec_parameters_copy(ctx->bsf->par_in, st->codecpar);
+    if (err < 0) {
+        pthread_mutex_unlock(&demux->lock);
+        sp_log(ctx, SP_LOG_ERROR, "Cannot copy coder parameters: %s!\n", av_err2str(err));
+        return err;
+    }
+
+    ctx->bsf->time_base_in   = st->time_base;
+    ctx->avg_frame_rate      = st->avg_frame_rate;
+    ctx->sample_aspect_ratio = st->sample_aspect_ratio;
+    ctx->have_input = 1;
+
+    pthread_mutex_unlock(&demux->lock);
+
+    sp_log(ctx, SP_LOG_VERBOSE, "Linked to demuxer %s, stream %i (tb: %i/%i)\n",
+           sp_class_get_name(demux), idx,
+           ctx->bsf->time_base_in.num, ctx->bsf->time_base_in.den);
+
+    AVBufferRef *src_fifo = sp_demuxer_get_stream_fifo(demux, idx);
+    if (!src_fifo)
+        return AVERROR(ENOMEM);
+
+    return sp_packet_fifo_mirror(ctx->src_packets, src_fifo);
+}
+
+int sp_bsf_connect_encoder(BSFContext *ctx, EncodingContext *enc)
+{
+    int err;
+
+    err = avcodec_parameters_from_context(ctx->bsf->par_in, enc->avctx);
+    if (err < 0) {
+        sp_log(ctx, SP_LOG_ERROR, "Cannot copy coder parameters: %s!\n", av_err2str(err));
+        return err;
+    }
+
+    ctx->bsf->time_base_in = enc->avctx->time_base;
+    if (enc->avctx->codec_type == AVMEDIA_TYPE_VIDEO) {
+        ctx->avg_frame_rate      = enc->avctx->framerate;
+        ctx->sample_aspect_ratio = enc->avctx->sample_aspect_ratio;
+    }
+    ctx->have_input = 1;
+
+    sp_log(ctx, SP_LOG_VERBOSE, "Linked to encoder %s (tb: %i/%i)\n",
+           sp_class_get_name(enc),
+           enc->avctx->time_base.num, enc->avctx->time_base.den);
+
+    return sp_packet_fifo_mirror(ctx->src_packets, enc->dst_packets);
+}
+
+static void *bsf_thread(void *arg)
+{
+    BSFContext *ctx = arg;
+    int ret = 0, flush = 0;
+
+    sp_set_thread_name_self(sp_class_get_name(ctx));
+
+    sp_log(ctx, SP_LOG_VERBOSE, "Bitstream filter initialized!\n");
+
+    sp_eventlist_dispatch(ctx, ctx->events, SP_EVENT_ON_CONFIG | SP_EVENT_ON_INIT, NULL);
+
+    do {
+        pthread_mutex_lock(&ctx->lock);
+
+        AVPacket *packet = NULL;
+
+        if (!flush) {
+            packet = sp_packet_fifo_pop(ctx->src_packets);
+            flush = !packet;
+        }
+
+        if (atomic_exchange(&ctx->flush_pending, 0)) {
+            sp_log(ctx, SP_LOG_DEBUG, "Flushing filter state\n");
+            av_bsf_flush(ctx->bsf);
+        }
+
+        if (sp_packet_is_flush_marker(packet)) {
+            sp_log(ctx, SP_LOG_DEBUG, "Flushing filter state after a seek\n");
+            av_bsf_flush(ctx->bsf);
+            packet->opaque = (void *)(intptr_t)sp_class_get_id(ctx);
+            packet->time_base = ctx->bsf->time_base_out;
+            sp_packet_fifo_push(ctx->dst_packets, packet);
+            av_packet_free(&packet);
+            pthread_mutex_unlock(&ctx->lock);
+            continue;
+        }
+
+        /* Give packet, a NULL packet signals EOF */
+        ret = av_bsf_send_packet(ctx->bsf, packet);
+        av_packet_free(&packet);
+        if (ret < 0) {
+            sp_log(ctx, SP_LOG_ERROR, "Error filtering: %s!\n", av_err2str(ret));
+            pthread_mutex_unlock(&ctx->lock);
+            goto fail;
+        }
+
+        /* Return */
+        while (1) {
+            AVPacket *out_packet = av_packet_alloc();
+
+            ret = av_bsf_receive_packet(ctx->bsf, out_packet);
+            if (ret == AVERROR_EOF) {
+                pthread_mutex_unlock(&ctx->lock);
+                av_packet_free(&out_packet);
+                goto end;
+            } else if (ret == AVERROR(EAGAIN)) {
+                av_packet_free(&out_packet);
+                ret = 0;
+                break;
+            } else if (ret < 0) {
+                pthread_mutex_unlock(&ctx->lock);
+                sp_log(ctx, SP_LOG_ERROR, "Error filtering: %s!\n", av_err2str(ret));
+                av_packet_free(&out_packet);
+                goto fail;
+            }
+
+            out_packet->opaque = (void *)(intptr_t)sp_class_get_id(ctx);
+            out_packet->time_base = ctx->bsf->time_base_out;
+
+            sp_log(ctx, SP_LOG_TRACE, "Pushing packet to FIFO, pts = %f\n",
+                   av_q2d(out_packet->time_base) * out_packet->pts);
+
+            sp_packet_fifo_push(ctx->dst_packets, out_packet);
+
+            av_packet_free(&out_packet);
+        }
+
+        pthread_mutex_unlock(&ctx->lock);
+    } while (!ctx->err);
+
+end:
+    sp_log(ctx, SP_LOG_VERBOSE, "Stream flushed!\n");
+
+    sp_event_send_eos_packet(ctx, ctx->events, ctx->dst_packets, ret);
+
+    return NULL;
+
+fail:
+    ctx->err = ret;
+
+    sp_eventlist_dispatch(ctx, ctx->events, SP_EVENT_ON_ERROR, NULL);
+
+    sp_event_send_eos_packet(ctx, ctx->events, ctx->dst_packets, ret);
+
+    return NULL;
+}
+
+static int configure_bsf(BSFContext *ctx)
+{
+    int err;
+
+    /* Runs the link events, which set the input parameters */
+    err = sp_eventlist_dispatch(ctx, ctx->events, SP_EVENT_ON_CONFIG, NULL);
+    if (err < 0)
+        return err;
+
+    if (!ctx->have_input) {
+        sp_log(ctx, SP_LOG_ERROR, "No input linked!\n");
+        return AVERROR(EINVAL);
+    }
+
+    err = av_bsf_init(ctx->bsf);
+    if (err < 0) {
+        sp_log(ctx, SP_LOG_ERROR, "Unable to init bitstream filter: %s!\n",
+               av_err2str(err));
+        return err;
+    }
+
+    sp_log(ctx, SP_LOG_VERBOSE, "Bitstream filter configured (tb: %i/%i)!\n",
+           ctx->bsf->time_base_out.num, ctx->bsf->time_base_out.den);
+
+    return 0;
+}
+
+static int bsf_ioctx_ctrl_cb(AVBufferRef *event_ref, void *callback_ctx,
+                             void *_ctx, void *dep_ctx, void *data)
+{
+    SPCtrlTemplateCbCtx *event = callback_ctx;
+    BSFContext *ctx = _ctx;
+
+    if (event->ctrl & SP_EVENT_CTRL_START) {
+        if (!sp_eventlist_has_dispatched(ctx->events, SP_EVENT_ON_CONFIG)) {
+            int ret = configure_bsf(ctx);
+            if (ret < 0)
+                return ret;
+        }
+        ctx->epoch = atomic_load(event->epoch);
+        if (!ctx->bsf_thread)
+            pthread_create(&ctx->bsf_thread, NULL, bsf_thread, ctx);
+    } else if (event->ctrl & SP_EVENT_CTRL_OPTS) {
+        const char *tmp_val = NULL;
+        if ((tmp_val = dict_get(event->opts, "fifo_size"))) {
+            long int len = strtol(tmp_val, NULL, 10);
+            if (len < 0)
+                sp_log(ctx, SP_LOG_ERROR, "Invalid fifo size \"%s\"!\n", tmp_val);
+            else
+                sp_packet_fifo_set_max_queued(ctx->src_packets, len);
+        }
+    } else if (event->ctrl & SP_EVENT_CTRL_STOP) {
+        if (ctx->bsf_thread) {
+            sp_packet_fifo_push(ctx->src_packets, NULL);
+            pthread_join(ctx->bsf_thread, NULL);
+            ctx->bsf_thread = 0;
+        }
+    } else if (event->ctrl & SP_EVENT_CTRL_FLUSH) {
+        /* Applied by the thread, so it never races a packet being filtered */
+        if (ctx->bsf_thread)
+            atomic_store(&ctx->flush_pending, 1);
+        else if (ctx->bsf)
+            av_bsf_flush(ctx->bsf);
+    } else {
+        return AVERROR(ENOTSUP);
+    }
+
+    return 0;
+}
+
+int sp_bsf_ctrl(AVBufferRef *ctx_ref, SPEventType ctrl, void *arg)
+{
+    BSFContext *ctx = (BSFContext *)ctx_ref->data;
+    return sp_ctrl_template(ctx, ctx->events, 0x0,
+                            bsf_ioctx_ctrl_cb, ctrl, arg);
+}
+
+int sp_bsf_init(AVBufferRef *ctx_ref)
+{
+    int err;
+    BSFContext *ctx = (BSFContext *)ctx_ref->data;
+
+    if (!ctx->filters) {
+        sp_log(ctx, SP_LOG_ERROR, "No bitstream filters specified!\n");
+        return AVERROR(EINVAL);
+    }
+
+    err = av_bsf_list_parse_str(ctx->filters, &ctx->bsf);
+    if (err < 0) {
+        sp_log(ctx, SP_LOG_ERROR, "Unable to parse bitstream filters \"%s\": %s!\n",
+               ctx->filters, av_err2str(err));
+        return err;
+    }
+
+    if (ctx->bsf_opts) {
+        err = av_opt_set_dict2(ctx->bsf, &ctx->bsf_opts, AV_OPT_SEARCH_CHILDREN);
+        if (err < 0) {
+            sp_log(ctx, SP_LOG_ERROR, "Unable to set options: %s!\n", av_err2str(err));
+            goto fail;
+        }
+
+        const AVDictionaryEntry *e = NULL;
+        while ((e = av_dict_get(ctx->bsf_opts, "", e, AV_DICT_IGNORE_SUFFIX)))
+            sp_log(ctx, SP_LOG_WARN, "Option \"%s\" not found!\n", e->key);
+    }
+
+    char *new_name = NULL;
+    if (ctx->name) {
+        new_name = av_strdup(ctx->name);
+        if (!new_name) {
+            err = AVERROR(ENOMEM);
+            goto fail;
+        }
+    } else {
+        int len = strlen(sp_class_get_name(ctx)) + 1 + strlen(ctx->filters) + 1;
+        new_name = av_mallocz(len);
+        if (!new_name) {
+            err = AVERROR(ENOMEM);
+            goto fail;
+        }
+        av_strlcpy(new_name, sp_class_get_name(ctx), len);
+        av_strlcat(new_name, ":", len);
+        av_strlcat(new_name, ctx->filters, len);
+    }
+
+    sp_class_set_name(ctx, new_name);
+    av_free(new_name);
+    ctx->name = sp_class_get_name(ctx);
+
+    /* Not owned by us */
+    ctx->filters = NULL;
+
+    return 0;
+
+fail:
+    av_bsf_free(&ctx->bsf);
+    return err;
+}
+
+static void bsf_free(void *opaque, uint8_t *data)
+{
+    BSFContext *ctx = (BSFContext *)data;
+
+    sp_packet_fifo_unmirror_all(ctx->src_packets);
+    sp_packet_fifo_unmirror_all(ctx->dst_packets);
+
+    if (ctx->bsf_thread) {
+        sp_packet_fifo_push(ctx->src_packets, NULL);
+        pthread_join(ctx->bsf_thread, NULL);
+    }
+
+    av_buffer_unref(&ctx->src_packets);
+    av_buffer_unref(&ctx->dst_packets);
+
+    sp_eventlist_dispatch(ctx, ctx->events, SP_EVENT_ON_DESTROY, NULL);
+    sp_bufferlist_free(&ctx->events);
+
+    av_bsf_free(&ctx->bsf);
+    av_dict_free(&ctx->bsf_opts);
+
+    pthread_mutex_destroy(&ctx->lock);
+
+    sp_log(ctx, SP_LOG_VERBOSE, "Bitstream filter destroyed!\n");
+    sp_class_free(ctx);
+    av_free(ctx);
+}
+
+AVBufferRef *sp_bsf_alloc(void)
+{
+    BSFContext *ctx = av_mallocz(sizeof(BSFContext));
+    if (!ctx)
+        return NULL;
+
+    AVBufferRef *ctx_ref = av_buffer_create((uint8_t *)ctx, sizeof(*ctx),
+                                            bsf_free, NULL, 0);
+
+    int err = sp_class_alloc(ctx, "lavc", SP_TYPE_BSF, NULL);
+    if (err < 0) {
+        av_buffer_unref(&ctx_ref);
+        return NULL;
+    }
+
+    pthread_mutex_init(&ctx->lock, NULL);
+    ctx->events = sp_bufferlist_new();
+    ctx->flush_pending = ATOMIC_VAR_INIT(0);
+
+    ctx->src_packets = sp_packet_fifo_create(ctx, 64, PACKET_FIFO_BLOCK_MAX_OUTPUT |
+                                                      PACKET_FIFO_BLOCK_NO_INPUT);
+    ctx->dst_packets = sp_packet_fifo_create(ctx, 0, 0);
+
+    return ctx_ref;
+}
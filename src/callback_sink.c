@@ -0,0 +1,349 @@
+/*
+ * This file is part of txproto.
+ *
+ * txproto is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * txproto is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with txproto; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <libavutil/time.h>
+
+#include "iosys_common.h"
+#include <libtxproto/fifo_packet.h>
+#include <libtxproto/utils.h>
+#include <libtxproto/log.h>
+#include "ctrl_template.h"
+#include "os_compat.h"
+#include "utils.h"
+#include "callback_sink.h"
+
+enum SinkDropPolicy {
+    SINK_DROP_NEWEST = 0,
+    SINK_DROP_OLDEST,
+    SINK_DROP_NONE,
+};
+
+typedef struct CallbackSink {
+    int (*frame_cb)(AVFrame *frame, void *userdata);
+    int (*packet_cb)(AVPacket *pkt, void *userdata);
+    void *userdata;
+
+    int fifo_size;
+    enum SinkDropPolicy drop;
+
+    pthread_t thread;
+    int err; /* Once set, everything gets discarded */
+
+    /* Stats */
+    int64_t delivered;
+    int64_t dropped;
+    int64_t stats_start;
+    int64_t stats_delivered;
+    int64_t stats_cb_time;
+} CallbackSink;
+
+static void apply_fifo_opts(IOSysEntry *entry, CallbackSink *s)
+{
+    /* Dropping the newest is done by the FIFO refusing them. Dropping the
+     * oldest is done by the thread, so that much more is let in before. */
+    int block = s->drop == SINK_DROP_NONE;
+    int max = s->drop == SINK_DROP_OLDEST ? 2*s->fifo_size : s->fifo_size;
+
+    if (entry->frames) {
+        sp_frame_fifo_set_max_queued(entry->frames, max);
+        sp_frame_fifo_set_block_flags(entry->frames, FRAME_FIFO_BLOCK_NO_INPUT |
+                                      (block ? FRAME_FIFO_BLOCK_MAX_OUTPUT : 0));
+    } else {
+        sp_packet_fifo_set_max_queued(entry->packets, max);
+        sp_packet_fifo_set_block_flags(entry->packets, PACKET_FIFO_BLOCK_NO_INPUT |
+                                       (block ? PACKET_FIFO_BLOCK_MAX_OUTPUT : 0));
+    }
+}
+
+static int parse_opts(IOSysEntry *entry, CallbackSink *s, AVDictionary *opts)
+{
+    const char *tmp_val;
+
+    if ((tmp_val = dict_get(opts, "fifo_size"))) {
+        long int len = strtol(tmp_val, NULL, 10);
+        if (len <= 0) {
+            sp_log(entry, SP_LOG_ERROR, "Invalid fifo size \"%s\"!\n", tmp_val);
+            return AVERROR(EINVAL);
+        }
+        s->fifo_size = len;
+    }
+
+    if ((tmp_val = dict_get(opts, "drop"))) {
+        if (!strcmp(tmp_val, "newest")) {
+            s->drop = SINK_DROP_NEWEST;
+        } else if (!strcmp(tmp_val, "oldest")) {
+            s->drop = SINK_DROP_OLDEST;
+        } else if (!strcmp(tmp_val, "none")) {
+            s->drop = SINK_DROP_NONE;
+        } else {
+            sp_log(entry, SP_LOG_ERROR, "Invalid drop policy \"%s\"!\n", tmp_val);
+            return AVERROR(EINVAL);
+        }
+    }
+
+    apply_fifo_opts(entry, s);
+
+    return 0;
+}
+
+static void *fifo_pop(IOSysEntry *entry)
+{
+    return entry->frames ? (void *)sp_frame_fifo_pop(entry->frames) :
+                           (void *)sp_packet_fifo_pop(entry->packets);
+}
+
+static void fifo_drop(IOSysEntry *entry, void **in)
+{
+    if (entry->frames)
+        av_frame_free((AVFrame **)in);
+    else
+        av_packet_free((AVPacket **)in);
+}
+
+/* Pops the next frame or packet, dropping some if too many are queued */
+static void *pop_next(IOSysEntry *entry, CallbackSink *s)
+{
+    void *in;
+
+    while ((in = fifo_pop(entry))) {
+        if (!entry->frames && sp_packet_is_flush_marker(in)) {
+            fifo_drop(entry, &in);
+            continue;
+        }
+
+        int queued = entry->frames ? sp_frame_fifo_get_size(entry->frames) :
+                                     sp_packet_fifo_get_size(entry->packets);
+        if ((s->drop != SINK_DROP_OLDEST) || (queued < s->fifo_size))
+            break;
+
+        fifo_drop(entry, &in);
+        s->dropped++;
+    }
+
+    return in;
+}
+
+static void update_stats(IOSysEntry *entry, CallbackSink *s, int64_t cb_time)
+{
+    int64_t now = av_gettime_relative();
+
+    s->delivered++;
+    s->stats_delivered++;
+    s->stats_cb_time += cb_time;
+
+    if ((now - s->stats_start) < AV_TIME_BASE)
+        return;
+
+    double rate = s->stats_delivered * (double)AV_TIME_BASE / (now - s->stats_start);
+    int64_t cb_avg = s->stats_cb_time / s->stats_delivered;
+    int queued = entry->frames ? sp_frame_fifo_get_size(entry->frames) :
+                                 sp_packet_fifo_get_size(entry->packets);
+
+    /* Including whatever the FIFO refused for being full */
+    int64_t dropped = s->dropped +
+                      (entry->frames ? sp_frame_fifo_get_refused(entry->frames) :
+                                       sp_packet_fifo_get_refused(entry->packets));
+
+    SPGenericData entries[] = {
+        D_TYPE("rate", NULL, rate),
+        D_TYPE("callback_time", NULL, cb_avg),
+        D_TYPE("queued", NULL, queued),
+        D_TYPE("delivered", NULL, s->delivered),
+        D_TYPE("dropped", NULL, dropped),
+        { 0 },
+    };
+    sp_eventlist_dispatch(entry, entry->events, SP_EVENT_ON_STATS, entries);
+
+    s->stats_start = now;
+    s->stats_delivered = 0;
+    s->stats_cb_time = 0;
+}
+
+static void *callback_sink_thread(void *arg)
+{
+    IOSysEntry *entry = arg;
+    CallbackSink *s = entry->io_priv;
+
+    sp_set_thread_name_self(sp_class_get_name(entry));
+
+    sp_eventlist_dispatch(entry, entry->events, SP_EVENT_ON_INIT, NULL);
+
+    s->stats_start = av_gettime_relative();
+
+    while (1) {
+        void *in = pop_next(entry, s);
+
+        /* Keep draining after an error, so that upstream never stalls */
+        if (s->err) {
+            if (!in)
+                break;
+            fifo_drop(entry, &in);
+            continue;
+        }
+
+        int64_t start = av_gettime_relative();
+        int ret = entry->frames ? s->frame_cb(in, s->userdata) :
+                                  s->packet_cb(in, s->userdata);
+        if (!in)
+            break;
+
+        if (ret < 0) {
+            sp_log(entry, SP_LOG_ERROR, "Callback failed: %s!\n", av_err2str(ret));
+            s->err = ret;
+            continue;
+        }
+
+        update_stats(entry, s, av_gettime_relative() - start);
+    }
+
+    sp_eventlist_dispatch(entry, entry->events, SP_EVENT_ON_EOS, &s->err);
+
+    return NULL;
+}
+
+static int callback_sink_ctrl_cb(AVBufferRef *event_ref, void *callback_ctx, void *ctx,
+                                 void *dep_ctx, void *data)
+{
+    SPCtrlTemplateCbCtx *event = callback_ctx;
+
+    IOSysEntry *entry = ctx;
+    CallbackSink *s = entry->io_priv;
+
+    if (event->ctrl & SP_EVENT_CTRL_START) {
+        if (!sp_eventlist_has_dispatched(entry->events, SP_EVENT_ON_CONFIG)) {
+            int ret = sp_eventlist_dispatch(entry, entry->events, SP_EVENT_ON_CONFIG, NULL);
+            if (ret < 0)
+                return ret;
+        }
+        if (!s->thread) {
+            int err = pthread_create(&s->thread, NULL, callback_sink_thread, entry);
+            if (err) {
+                s->thread = 0;
+                sp_log(entry, SP_LOG_ERROR, "Unable to start thread: %s!\n",
+                       av_err2str(AVERROR(err)));
+                return AVERROR(err);
+            }
+        }
+    } else if (event->ctrl & SP_EVENT_CTRL_STOP) {
+        if (s->thread) {
+            if (entry->frames)
+                sp_frame_fifo_push(entry->frames, NULL);
+            else
+                sp_packet_fifo_push(entry->packets, NULL);
+            pthread_join(s->thread, NULL);
+            s->thread = 0;
+        }
+    } else if (event->ctrl & SP_EVENT_CTRL_OPTS) {
+        return parse_opts(entry, s, event->opts);
+    } else {
+        return AVERROR(ENOTSUP);
+    }
+
+    return 0;
+}
+
+static int callback_sink_ctrl(AVBufferRef *entry, SPEventType ctrl, void *arg)
+{
+    IOSysEntry *iosys_entry = (IOSysEntry *)entry->data;
+    return sp_ctrl_template(iosys_entry, iosys_entry->events, 0x0,
+                            callback_sink_ctrl_cb, ctrl, arg);
+}
+
+static void destroy_sink(void *opaque, uint8_t *data)
+{
+    IOSysEntry *entry = (IOSysEntry *)data;
+    CallbackSink *s = entry->io_priv;
+
+    if (s && s->thread) {
+        if (entry->frames)
+            sp_frame_fifo_push(entry->frames, NULL);
+        else
+            sp_packet_fifo_push(entry->packets, NULL);
+        pthread_join(s->thread, NULL);
+    }
+    av_free(s);
+
+    av_buffer_unref(&entry->frames);
+    av_buffer_unref(&entry->packets);
+    sp_bufferlist_free(&entry->events);
+
+    av_free(entry->desc);
+    sp_class_free(entry);
+    av_free(entry);
+}
+
+AVBufferRef *sp_callback_sink_create(void *log_ctx, enum AVMediaType type,
+                                     int (*frame_cb)(AVFrame *frame, void *userdata),
+                                     int (*packet_cb)(AVPacket *pkt, void *userdata),
+                                     void *userdata, AVDictionary *opts)
+{
+    if (type != AVMEDIA_TYPE_VIDEO && type != AVMEDIA_TYPE_AUDIO) {
+        sp_log(log_ctx, SP_LOG_ERROR, "Callback sinks only support video and audio!\n");
+        return NULL;
+    } else if (!frame_cb == !packet_cb) {
+        sp_log(log_ctx, SP_LOG_ERROR, "Exactly one callback must be given!\n");
+        return NULL;
+    }
+
+    IOSysEntry *entry = av_mallocz(sizeof(*entry));
+    if (!entry)
+        return NULL;
+
+    AVBufferRef *entry_ref = av_buffer_create((uint8_t *)entry, sizeof(*entry),
+                                              destroy_sink, NULL, 0);
+    if (!entry_ref) {
+        av_free(entry);
+        return NULL;
+    }
+
+    int err = sp_class_alloc(entry, frame_cb ? "frame_sink" : "packet_sink",
+                             type == AVMEDIA_TYPE_VIDEO ? SP_TYPE_VIDEO_SINK :
+                                                          SP_TYPE_AUDIO_SINK,
+                             log_ctx);
+    if (err < 0)
+        goto fail;
+
+    CallbackSink *s = av_mallocz(sizeof(*s));
+    if (!s)
+        goto fail;
+    entry->io_priv = s;
+
+    s->frame_cb = frame_cb;
+    s->packet_cb = packet_cb;
+    s->userdata = userdata;
+    s->fifo_size = 16;
+
+    if (frame_cb)
+        entry->frames = sp_frame_fifo_create(entry, 0, 0);
+    else
+        entry->packets = sp_packet_fifo_create(entry, 0, 0);
+    entry->desc = av_asprintf("Callback %s sink", frame_cb ? "frame" : "packet");
+    entry->events = sp_bufferlist_new();
+    entry->ctrl = callback_sink_ctrl;
+    if (!(entry->frames || entry->packets) || !entry->desc || !entry->events)
+        goto fail;
+
+    if (parse_opts(entry, s, opts) < 0)
+        goto fail;
+
+    return entry_ref;
+
+fail:
+    av_buffer_unref(&entry_ref);
+    return NULL;
+}
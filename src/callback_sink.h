@@ -0,0 +1,43 @@
+/*
+ * This file is part of txproto.
+ *
+ * txproto is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * txproto is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with txproto; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <libavcodec/packet.h>
+#include <libavutil/buffer.h>
+#include <libavutil/dict.h>
+#include <libavutil/frame.h>
+
+/* Creates an IOSys sink entry which hands every frame, or every packet, it
+ * receives to a callback, on a thread of its own. Exactly one of frame_cb and
+ * packet_cb must be set, which decides what the sink can be linked to.
+ * The callback owns the reference it gets, and is called once with NULL at
+ * the end of the stream. A negative return stops any further callbacks.
+ *
+ * Options:
+ *     fifo_size - maximum number of queued frames or packets (default 16)
+ *     drop      - what to do once the queue is full: "newest" (default) drops
+ *                 incoming ones, "oldest" skips to the most recent ones, with
+ *                 up to twice as many queued while the callback runs, and
+ *                 "none" makes upstream wait. Dropped ones are counted in
+ *                 the "dropped" stat.
+ */
+AVBufferRef *sp_callback_sink_create(void *log_ctx, enum AVMediaType type,
+                                     int (*frame_cb)(AVFrame *frame, void *userdata),
+                                     int (*packet_cb)(AVPacket *pkt, void *userdata),
+                                     void *userdata, AVDictionary *opts);
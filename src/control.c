@@ -25,6 +25,7 @@
 #include "iosys_common.h"
 
 #include <libtxproto/control.h>
+#include <libtxproto/bsf.h>
 #include <libtxproto/commit.h>
 #include <libtxproto/encode.h>
 #include <libtxproto/decode.h>
@@ -45,6 +46,8 @@ ctrl_fn sp_get_ctrl_fn(void *ctx)
         return sp_demuxer_ctrl;
     case SP_TYPE_FILTER:
         return sp_filter_ctrl;
+    case SP_TYPE_BSF:
+        return sp_bsf_ctrl;
 #ifdef HAVE_INTERFACE
     case SP_TYPE_INTERFACE:
         return sp_interface_ctrl;
@@ -22,76 +22,32 @@
 #include <libavutil/avstring.h>
 #include <libavutil/opt.h>
 #include <libavutil/pixdesc.h>
+#include <libavutil/time.h>
 
 #include "utils.h"
 #include "ctrl_template.h"
 #include "os_compat.h"
 
 int sp_decoding_connect(DecodingContext *dec, DemuxingContext *mux,
-                        int stream_id, char *stream_desc)
+                        int stream_id, const char *stream_desc)
 {
     int err;
-    int idx = -1;
-
-    if (stream_id >= 0) {
-has_stream_id:
-        idx = stream_id;
-        if (stream_id > (mux->avf->nb_streams - 1)) {
-            sp_log(dec, SP_LOG_ERROR, "Invalid stream ID %i, demuxer only has %i streams!\n",
-                   stream_id, mux->avf->nb_streams);
-            return AVERROR(EINVAL);
-        }
-    } else if (stream_desc) {
-#define FIND_STREAM(prefix_str, media_type)                                     \
-        if (!strncmp(stream_desc, prefix_str, strlen(prefix_str))) {            \
-            int cnt = 0;                                                        \
-            stream_id = strtol(stream_desc + strlen(prefix_str), NULL, 10);     \
-            for (int i = 0; i < mux->avf->nb_streams; i++) {                    \
-                if (mux->avf->streams[i]->codecpar->codec_type == media_type) { \
-                    if (stream_id == cnt) {                                     \
-                        stream_id = i;                                          \
-                        goto has_stream_id;                                     \
-                    }                                                           \
-                    cnt++;                                                      \
-                }                                                               \
-            }                                                                   \
-            goto has_stream_id;                                                 \
-        }
 
-        FIND_STREAM("video=", AVMEDIA_TYPE_VIDEO)
-        FIND_STREAM("vid=", AVMEDIA_TYPE_VIDEO)
-        FIND_STREAM("audio=", AVMEDIA_TYPE_VIDEO)
-        FIND_STREAM("aid=", AVMEDIA_TYPE_VIDEO)
-        FIND_STREAM("subtitle=", AVMEDIA_TYPE_VIDEO)
-        FIND_STREAM("sub=", AVMEDIA_TYPE_VIDEO)
+    int idx = sp_demuxer_find_stream(mux, stream_id, stream_desc);
+    if (idx < 0)
+        return idx;
 
-        for (int i = 0; i < mux->avf->nb_streams; i++) {
-            AVDictionaryEntry *d = av_dict_get(mux->avf->streams[i]->metadata, "title", NULL, 0);
-            if (!d)
-                continue;
-            if (!strcmp(d->value, stream_desc)) {
-                stream_id = i;
-                break;
-            }
-        }
-
-        sp_log(dec, SP_LOG_ERROR, "Unable to find stream with title \"%s\"\n",
-               stream_desc);
-        return AVERROR(EINVAL);
-    } else if (mux->avf->nb_streams == 1) {
-        idx = 0;
-    } else {
-        sp_log(dec, SP_LOG_ERROR, "No stream ID or description specified for searching!\n");
-        return AVERROR(EINVAL);
-    }
+    pthread_mutex_lock(&mux->lock);
 
     AVStream *st = mux->avf->streams[idx];
 
     if (st->codecpar->extradata_size) {
         dec->avctx->extradata = av_mallocz(st->codecpar->extradata_size +
                                             AV_INPUT_BUFFER_PADDING_SIZE);
-        if (!dec->avctx->extradata)
+        if (!dec->avctx->extradata) {
+            pthread_mutex_unlock(&mux->lock);
             return AVERROR(ENOMEM);
+        }
 
         memcpy(dec->avctx->extradata, st->codecpar->extradata,
                st->codecpar->extradata_size);
@@ -99,8 +55,11 @@ has_stream_id:
     }
 
     dec->avctx->time_base = mux->avf->streams[idx]->time_base;
+    AVRational st_tb = st->time_base;
+    int64_t item_start = mux->avf->start_time;
 
     err = avcodec_parameters_to_context(dec->avctx, st->codecpar);
+    pthread_mutex_unlock(&mux->lock);
     if (err < 0) {
     	sp_log(dec, SP_LOG_ERROR, "Cannot copy coder parameters: %s!\n", av_err2str(err));
         return err;
@@ -109,19 +68,75 @@ has_stream_id:
     if (dec->low_latency)
         dec->avctx->flags |= AV_CODEC_FLAG_LOW_DELAY;
 
+    /* Frame threading adds a frame of delay per thread, so unless asked
+     * otherwise, only use slice threading when latency matters */
+    dec->avctx->thread_count = dec->thread_count;
+    if (dec->thread_type)
+        dec->avctx->thread_type = dec->thread_type;
+    else
+        dec->avctx->thread_type = dec->low_latency ? FF_THREAD_SLICE : FF_THREAD_FRAME;
+
+    dec->avctx->skip_loop_filter = dec->skip_loop_filter;
+    dec->avctx->skip_idct = dec->skip_idct;
+    if (dec->keyframes_only)
+        dec->avctx->skip_frame = AVDISCARD_NONKEY;
+
+    if (dec->lowres > dec->codec->max_lowres) {
+        sp_log(dec, SP_LOG_WARN, "Decoder only supports lowres up to %i!\n",
+               dec->codec->max_lowres);
+        dec->lowres = dec->codec->max_lowres;
+    }
+    dec->avctx->lowres = dec->lowres;
+
     err = avcodec_open2(dec->avctx, dec->codec, NULL);
     if (err < 0) {
     	sp_log(dec, SP_LOG_ERROR, "Cannot open decoder: %s!\n", av_err2str(err));
     	return err;
     }
 
-    sp_log(dec, SP_LOG_VERBOSE, "Linked to demuxer %s (tb: %i/%i)\n",
+    sp_log(dec, SP_LOG_VERBOSE, "Linked to demuxer %s (tb: %i/%i, threads: %i, %s)\n",
            sp_class_get_name(dec),
-           dec->avctx->time_base.num, dec->avctx->time_base.den);
+           dec->avctx->time_base.num, dec->avctx->time_base.den,
+           dec->avctx->thread_count,
+           dec->avctx->active_thread_type == FF_THREAD_FRAME ? "frame" :
+           dec->avctx->active_thread_type == FF_THREAD_SLICE ? "slice" : "none");
+
+    /* Frames before the demuxer's start time are only decoded as references */
+    if (mux->start_time != AV_NOPTS_VALUE) {
+        int64_t trim = mux->start_time;
+        if (item_start != AV_NOPTS_VALUE)
+            trim += item_start;
+        dec->trim_pts = av_rescale_q(trim, AV_TIME_BASE_Q, st_tb);
+    }
 
-    dec->src_packets = av_buffer_ref(mux->dst_packets[idx]);
+    AVBufferRef *src_fifo = sp_demuxer_get_stream_fifo(mux, idx);
+    if (!src_fifo)
+        return AVERROR(ENOMEM);
 
-    return 0;
+    return sp_packet_fifo_mirror(dec->src_packets, src_fifo);
+}
+
+static void update_stats(DecodingContext *ctx)
+{
+    int64_t now = av_gettime_relative();
+
+    ctx->stats_frames++;
+    ctx->total_frames++;
+
+    if ((now - ctx->stats_start) < AV_TIME_BASE)
+        return;
+
+    double fps = ctx->stats_frames * (double)AV_TIME_BASE / (now - ctx->stats_start);
+
+    SPGenericData entries[] = {
+        D_TYPE("decode_fps", NULL, fps),
+        D_TYPE("frames", NULL, ctx->total_frames),
+        { 0 },
+    };
+    sp_eventlist_dispatch(ctx, ctx->events, SP_EVENT_ON_STATS, entries);
+
+    ctx->stats_start = now;
+    ctx->stats_frames = 0;
 }
 
 static void *decoding_thread(void *arg)
@@ -135,6 +150,8 @@ static void *decoding_thread(void *arg)
 
     sp_eventlist_dispatch(ctx, ctx->events, SP_EVENT_ON_CONFIG | SP_EVENT_ON_INIT, NULL);
 
+    ctx->stats_start = av_gettime_relative();
+
     do {
         pthread_mutex_lock(&ctx->lock);
 
@@ -145,6 +162,14 @@ static void *decoding_thread(void *arg)
             flush = !packet;
         }
 
+        if (sp_packet_is_flush_marker(packet)) {
+            sp_log(ctx, SP_LOG_DEBUG, "Flushing decoder after a seek\n");
+            avcodec_flush_buffers(ctx->avctx);
+            av_packet_free(&packet);
+            pthread_mutex_unlock(&ctx->lock);
+            continue;
+        }
+
         /* Give packet */
         ret = avcodec_send_packet(ctx->avctx, packet);
         av_packet_free(&packet);
@@ -174,6 +199,15 @@ static void *decoding_thread(void *arg)
                 goto fail;
             }
 
+            if ((out_frame->flags & AV_FRAME_FLAG_DISCARD) ||
+                ((ctx->trim_pts != AV_NOPTS_VALUE) && (out_frame->pts != AV_NOPTS_VALUE) &&
+                 (out_frame->pts < ctx->trim_pts))) {
+                sp_log(ctx, SP_LOG_TRACE, "Discarding frame, pts = %f\n",
+                       av_q2d(ctx->avctx->time_base) * out_frame->pts);
+                av_frame_free(&out_frame);
+                continue;
+            }
+
             if (!ctx->start_pts)
                 ctx->start_pts = out_frame->pts;
 
@@ -191,6 +225,8 @@ static void *decoding_thread(void *arg)
 
             sp_frame_fifo_push(ctx->dst_frames, out_frame);
 
+            update_stats(ctx);
+
             sp_eventlist_dispatch(ctx, ctx->events, SP_EVENT_ON_CONFIG | SP_EVENT_ON_INIT, NULL);
 
             av_frame_free(&out_frame);
@@ -215,6 +251,30 @@ fail:
     return NULL;
 }
 
+static const struct {
+    const char *name;
+    enum AVDiscard val;
+} discard_names[] = {
+    { "none",     AVDISCARD_NONE     },
+    { "default",  AVDISCARD_DEFAULT  },
+    { "nonref",   AVDISCARD_NONREF   },
+    { "bidir",    AVDISCARD_BIDIR    },
+    { "nonintra", AVDISCARD_NONINTRA },
+    { "nonkey",   AVDISCARD_NONKEY   },
+    { "all",      AVDISCARD_ALL      },
+};
+
+static int parse_discard(const char *str, enum AVDiscard *val)
+{
+    for (int i = 0; i < SP_ARRAY_ELEMS(discard_names); i++) {
+        if (!strcmp(str, discard_names[i].name)) {
+            *val = discard_names[i].val;
+            return 0;
+        }
+    }
+    return AVERROR(EINVAL);
+}
+
 static int decoder_ioctx_ctrl_cb(AVBufferRef *event_ref, void *callback_ctx,
                                  void *_ctx, void *dep_ctx, void *data)
 {
@@ -230,6 +290,43 @@ static int decoder_ioctx_ctrl_cb(AVBufferRef *event_ref, void *callback_ctx,
         if ((tmp_val = dict_get(event->opts, "low_latency")))
             if (!strcmp(tmp_val, "true") || strtol(tmp_val, NULL, 10) != 0)
                 ctx->low_latency = 1;
+        if ((tmp_val = dict_get(event->opts, "threads"))) {
+            if (!strcmp(tmp_val, "auto")) {
+                ctx->thread_count = 0;
+            } else {
+                long val = strtol(tmp_val, NULL, 10);
+                if (val < 0 || val > INT_MAX)
+                    sp_log(ctx, SP_LOG_ERROR, "Invalid thread count \"%s\"!\n", tmp_val);
+                else
+                    ctx->thread_count = val;
+            }
+        }
+        if ((tmp_val = dict_get(event->opts, "thread_type"))) {
+            if (!strcmp(tmp_val, "auto"))
+                ctx->thread_type = 0;
+            else if (!strcmp(tmp_val, "frame"))
+                ctx->thread_type = FF_THREAD_FRAME;
+            else if (!strcmp(tmp_val, "slice"))
+                ctx->thread_type = FF_THREAD_SLICE;
+            else
+                sp_log(ctx, SP_LOG_ERROR, "Invalid thread type \"%s\"!\n", tmp_val);
+        }
+        if ((tmp_val = dict_get(event->opts, "skip_loop_filter")))
+            if (parse_discard(tmp_val, &ctx->skip_loop_filter) < 0)
+                sp_log(ctx, SP_LOG_ERROR, "Invalid loop filter skip mode \"%s\"!\n", tmp_val);
+        if ((tmp_val = dict_get(event->opts, "skip_idct")))
+            if (parse_discard(tmp_val, &ctx->skip_idct) < 0)
+                sp_log(ctx, SP_LOG_ERROR, "Invalid IDCT skip mode \"%s\"!\n", tmp_val);
+        if ((tmp_val = dict_get(event->opts, "keyframes_only")))
+            if (!strcmp(tmp_val, "true") || strtol(tmp_val, NULL, 10) != 0)
+                ctx->keyframes_only = 1;
+        if ((tmp_val = dict_get(event->opts, "lowres"))) {
+            long val = strtol(tmp_val, NULL, 10);
+            if (val < 0 || val > 3)
+                sp_log(ctx, SP_LOG_ERROR, "Invalid lowres factor \"%s\"!\n", tmp_val);
+            else
+                ctx->lowres = val;
+        }
     } else if (event->ctrl & SP_EVENT_CTRL_STOP) {
         if (ctx->decoding_thread) {
             sp_packet_fifo_push(ctx->src_packets, NULL);
@@ -293,7 +390,7 @@ static void decoder_free(void *opaque, uint8_t *data)
 {
     DecodingContext *ctx = (DecodingContext *)data;
 
-    sp_frame_fifo_unmirror_all(ctx->src_packets);
+    sp_packet_fifo_unmirror_all(ctx->src_packets);
     sp_frame_fifo_unmirror_all(ctx->dst_frames);
 
     if (ctx->decoding_thread) {
@@ -334,7 +431,10 @@ AVBufferRef *sp_decoder_alloc(void)
     pthread_mutex_init(&ctx->lock, NULL);
     ctx->events = sp_bufferlist_new();
 
+    ctx->src_packets = sp_packet_fifo_create(ctx, 10, PACKET_FIFO_BLOCK_MAX_OUTPUT |
+                                                      PACKET_FIFO_BLOCK_NO_INPUT);
     ctx->dst_frames = sp_frame_fifo_create(ctx, 0, 0);
+    ctx->trim_pts = AV_NOPTS_VALUE;
 
     return ctx_ref;
 }
@@ -25,11 +25,522 @@
 #include "utils.h"
 #include "ctrl_template.h"
 #include "os_compat.h"
+#include "async_io.h"
+#include "mmap_io.h"
+#include "stream_info_cache.h"
+
+typedef struct DemuxStreamQueue {
+    AVBufferRef *pending; /* Read, but not yet taken by the consumers */
+    int64_t nb_packets;
+    int64_t bytes;
+    int64_t first_ts; /* Microseconds */
+    int64_t last_ts;
+    int64_t duration;
+    int ended; /* Reached the end time, or EOF */
+    int new_extradata; /* Playlist item changed the extradata */
+    char *name;
+} DemuxStreamQueue;
+
+AVBufferRef *sp_demuxer_get_stream_fifo(DemuxingContext *ctx, int idx)
+{
+    pthread_mutex_lock(&ctx->lock);
+
+    if (!ctx->dst_packets[idx]) {
+        ctx->dst_packets[idx] = sp_packet_fifo_create(ctx, 0, 0);
+        atomic_store(&ctx->discard_update, 1);
+    }
+
+    pthread_mutex_unlock(&ctx->lock);
+
+    return ctx->dst_packets[idx];
+}
+
+/* Streams nobody linked to are not read at all */
+static void update_discard(DemuxingContext *ctx)
+{
+    int nb_discarded = 0;
+
+    pthread_mutex_lock(&ctx->lock);
+
+    for (int i = 0; i < ctx->avf->nb_streams; i++) {
+        AVStream *st = ctx->avf->streams[i];
+        if (!ctx->dst_packets[i])
+            st->discard = AVDISCARD_ALL;
+        else if (ctx->keyframes_only && (st->codecpar->codec_type == AVMEDIA_TYPE_VIDEO))
+            st->discard = AVDISCARD_NONKEY; /* Lets some demuxers skip reading them */
+        else
+            st->discard = AVDISCARD_DEFAULT;
+        nb_discarded += !ctx->dst_packets[i];
+    }
+
+    pthread_mutex_unlock(&ctx->lock);
+
+    sp_log(ctx, SP_LOG_VERBOSE, "Discarding %i out of %i streams\n",
+           nb_discarded, ctx->avf->nb_streams);
+}
+
+/* Timestamp used to measure how much of a stream is queued */
+static int64_t queue_ts(DemuxingContext *ctx, AVPacket *pkt, int64_t fallback)
+{
+    int64_t ts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+    if (ts == AV_NOPTS_VALUE)
+        return fallback;
+    return av_rescale_q(ts, pkt->time_base, AV_TIME_BASE_Q);
+}
+
+static int queue_packet(DemuxingContext *ctx, AVPacket *pkt)
+{
+    DemuxStreamQueue *q = &ctx->queues[pkt->stream_index];
+
+    int err = sp_packet_fifo_push(q->pending, pkt);
+    if (err < 0)
+        return err;
+
+    q->last_ts = queue_ts(ctx, pkt, q->last_ts);
+    if (!q->nb_packets)
+        q->first_ts = q->last_ts;
+
+    q->nb_packets++;
+    q->bytes += pkt->size;
+    ctx->queued_bytes += pkt->size;
+
+    return 0;
+}
+
+/* Hands over queued packets to the stream's consumers, only blocking on the
+ * first one if asked to */
+static void deliver_packets(DemuxingContext *ctx, int idx, int block)
+{
+    DemuxStreamQueue *q = &ctx->queues[idx];
+
+    pthread_mutex_lock(&ctx->lock);
+    AVBufferRef *fifo = NULL;
+    if (ctx->dst_packets[idx])
+        fifo = av_buffer_ref(ctx->dst_packets[idx]);
+    pthread_mutex_unlock(&ctx->lock);
+
+    /* Nothing linked to it yet */
+    if (!fifo)
+        return;
+
+    while (q->nb_packets) {
+        if (!block && sp_packet_fifo_would_block(fifo))
+            break;
+
+        AVPacket *pkt = NULL;
+        sp_packet_fifo_pop_flags(q->pending, &pkt, PACKET_FIFO_PULL_NO_BLOCK);
+        if (!pkt)
+            break;
+
+        q->nb_packets--;
+        q->bytes -= pkt->size;
+        ctx->queued_bytes -= pkt->size;
+
+        AVPacket *next = sp_packet_fifo_peek(q->pending);
+        if (next) {
+            q->first_ts = queue_ts(ctx, next, q->first_ts);
+            av_packet_free(&next);
+        }
+
+        sp_log(ctx, SP_LOG_TRACE, "Sending packet from stream %i\n", idx);
+        sp_packet_fifo_push(fifo, pkt);
+        av_packet_free(&pkt);
+
+        block = 0;
+    }
+
+    av_buffer_unref(&fifo);
+}
+
+/* Sends out everything queued for a stream, followed by its EOS */
+static void end_stream(DemuxingContext *ctx, int idx)
+{
+    DemuxStreamQueue *q = &ctx->queues[idx];
+    if (q->ended)
+        return;
+
+    while (q->nb_packets)
+        deliver_packets(ctx, idx, 1);
+
+    pthread_mutex_lock(&ctx->lock);
+    AVBufferRef *fifo = NULL;
+    if (ctx->dst_packets[idx])
+        fifo = av_buffer_ref(ctx->dst_packets[idx]);
+    pthread_mutex_unlock(&ctx->lock);
+
+    sp_packet_fifo_push(fifo, NULL);
+    av_buffer_unref(&fifo);
+
+    q->ended = 1;
+}
+
+static int all_streams_ended(DemuxingContext *ctx)
+{
+    int ret = 1;
+
+    pthread_mutex_lock(&ctx->lock);
+    for (int i = 0; i < ctx->avf->nb_streams; i++)
+        if (ctx->dst_packets[i] && !ctx->queues[i].ended)
+            ret = 0;
+    pthread_mutex_unlock(&ctx->lock);
+
+    return ret;
+}
+
+/* Presentation time in microseconds, from the start of the input */
+static int64_t packet_time(DemuxingContext *ctx, AVPacket *pkt)
+{
+    int64_t ts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+    if (ts == AV_NOPTS_VALUE)
+        return AV_NOPTS_VALUE;
+
+    return av_rescale_q(ts, pkt->time_base, AV_TIME_BASE_Q) - ctx->timeline_start;
+}
+
+/* Seeks to the keyframe at or before the target, everything read up until
+ * the target will be flagged to be discarded after decoding */
+static int seek_to(DemuxingContext *ctx, int64_t target)
+{
+    int64_t ts = target;
+    if (ctx->avf->start_time != AV_NOPTS_VALUE)
+        ts += ctx->avf->start_time;
+
+    int err = avformat_seek_file(ctx->avf, -1, INT64_MIN, ts, ts, 0);
+    if (err < 0) {
+        sp_log(ctx, SP_LOG_ERROR, "Unable to seek to %f: %s!\n",
+               target / (double)AV_TIME_BASE, av_err2str(err));
+        return err;
+    }
+
+    /* Whatever was read ahead is now stale */
+    for (int i = 0; i < ctx->avf->nb_streams; i++) {
+        DemuxStreamQueue *q = &ctx->queues[i];
+        while (1) {
+            AVPacket *pkt = NULL;
+            sp_packet_fifo_pop_flags(q->pending, &pkt, PACKET_FIFO_PULL_NO_BLOCK);
+            if (!pkt)
+                break;
+            av_packet_free(&pkt);
+        }
+        q->nb_packets = 0;
+        q->bytes = 0;
+
+        /* Have consumers drop what they buffered, and revive streams which
+         * already ended */
+        pthread_mutex_lock(&ctx->lock);
+        AVBufferRef *fifo = NULL;
+        if (ctx->dst_packets[i])
+            fifo = av_buffer_ref(ctx->dst_packets[i]);
+        pthread_mutex_unlock(&ctx->lock);
+
+        if (fifo) {
+            AVPacket *marker = sp_packet_flush_marker();
+            if (marker) {
+                marker->opaque = (void *)(intptr_t)sp_class_get_id(ctx);
+                marker->stream_index = i;
+                marker->time_base = ctx->avf->streams[i]->time_base;
+                sp_packet_fifo_push(fifo, marker);
+                av_packet_free(&marker);
+            }
+            av_buffer_unref(&fifo);
+        }
+
+        q->ended = 0;
+    }
+    ctx->queued_bytes = 0;
+
+    ctx->trim_time = target + ctx->item_offset;
+    ctx->rt_start_ts = AV_NOPTS_VALUE;
+    ctx->next_sample = AV_NOPTS_VALUE;
+
+    sp_log(ctx, SP_LOG_VERBOSE, "Seeked to %f\n", target / (double)AV_TIME_BASE);
+
+    return 0;
+}
+
+/* In keyframes-only mode, returns whether a packet should be dropped, and
+ * seeks ahead to the next sample after each keyframe let through. Sampling
+ * only outputs video, so other streams are ended for their consumers. */
+static int sample_packet(DemuxingContext *ctx, AVPacket *pkt, int64_t pkt_time)
+{
+    AVStream *st = ctx->avf->streams[pkt->stream_index];
+    if (st->codecpar->codec_type != AVMEDIA_TYPE_VIDEO) {
+        if (!ctx->sample_interval)
+            return 0;
+        end_stream(ctx, pkt->stream_index);
+        return 1;
+    }
+
+    if (!(pkt->flags & AV_PKT_FLAG_KEY))
+        return 1;
+
+    if (!ctx->sample_interval || (pkt_time == AV_NOPTS_VALUE))
+        return 0;
+
+    /* Without a working seek, keyframes in between are simply skipped over */
+    if ((ctx->next_sample != AV_NOPTS_VALUE) && (pkt_time < ctx->next_sample))
+        return 1;
+
+    ctx->next_sample = pkt_time + ctx->sample_interval;
+
+    if (!ctx->sample_seek_failed && !ctx->playlist) {
+        int64_t ts = ctx->next_sample;
+        if (ctx->avf->start_time != AV_NOPTS_VALUE)
+            ts += ctx->avf->start_time;
+
+        /* Lands on the first keyframe at or after the next sample */
+        int err = avformat_seek_file(ctx->avf, -1, ts, ts, INT64_MAX, 0);
+        if (err < 0) {
+            sp_log(ctx, SP_LOG_WARN, "Unable to seek, reading linearly instead: %s\n",
+                   av_err2str(err));
+            ctx->sample_seek_failed = 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Finds the stream parameters, from the cache if possible */
+static int probe_streams(DemuxingContext *ctx, AVFormatContext *avf, const char *url)
+{
+    if (ctx->info_cache &&
+        sp_stream_info_cache_load(ctx, ctx->info_cache, url, avf) > 0)
+        return 0;
+
+    int64_t probe_start = av_gettime_relative();
+
+    int err = avformat_find_stream_info(avf, NULL);
+    if (err < 0) {
+        sp_log(ctx, SP_LOG_ERROR, "Couldn't find stream info: %s!\n", av_err2str(err));
+        return err;
+    }
+
+    sp_log(ctx, SP_LOG_VERBOSE, "Probed streams in %.3f s\n",
+           (av_gettime_relative() - probe_start) / (double)AV_TIME_BASE);
+
+    if (ctx->info_cache)
+        sp_stream_info_cache_store(ctx, ctx->info_cache, url, avf);
+
+    return 0;
+}
+
+static void *prefetch_thread(void *arg)
+{
+    DemuxingContext *ctx = arg;
+    AVDictionary *opts = NULL;
+    const char *url = ctx->playlist[ctx->next_idx];
+
+    sp_set_thread_name_self("demux:prefetch");
+
+    /* Only the first item can use mapped or asynchronous I/O */
+    av_strstart(url, SP_MMAP_IO_PREFIX, &url);
+
+    ctx->next_avf = avformat_alloc_context();
+    if (!ctx->next_avf) {
+        ctx->next_err = AVERROR(ENOMEM);
+        return NULL;
+    }
+
+    if (ctx->probesize)
+        ctx->next_avf->probesize = ctx->probesize;
+    if (ctx->analyzeduration)
+        ctx->next_avf->max_analyze_duration = ctx->analyzeduration;
+    if (ctx->fpsprobesize >= 0)
+        ctx->next_avf->fps_probe_size = ctx->fpsprobesize;
+
+    av_dict_copy(&opts, ctx->item_options, 0);
+    ctx->next_err = avformat_open_input(&ctx->next_avf, url, NULL, &opts);
+    av_dict_free(&opts);
+    if (ctx->next_err < 0) {
+        sp_log(ctx, SP_LOG_ERROR, "Couldn't open playlist item %s: %s!\n",
+               url, av_err2str(ctx->next_err));
+        return NULL;
+    }
+
+    ctx->next_err = probe_streams(ctx, ctx->next_avf, url);
+    if (ctx->next_err < 0)
+        avformat_close_input(&ctx->next_avf);
+
+    return NULL;
+}
+
+static void start_prefetch(DemuxingContext *ctx)
+{
+    int nb_items = 0;
+    while (ctx->playlist[nb_items])
+        nb_items++;
+
+    ctx->next_idx = ctx->playlist_idx + 1;
+    if (ctx->next_idx >= nb_items) {
+        if (!ctx->playlist_loop)
+            return;
+        ctx->next_idx = 0;
+    }
+
+    ctx->next_avf = NULL;
+    ctx->next_err = 0;
+    if (pthread_create(&ctx->prefetch_thread, NULL, prefetch_thread, ctx))
+        ctx->prefetch_thread = 0;
+}
+
+/* Items are switched without touching the consumers, so they must carry the
+ * same streams. Extradata may change, and gets sent along. */
+static int playlist_item_compatible(DemuxingContext *ctx, AVFormatContext *next)
+{
+    if (next->nb_streams != ctx->avf->nb_streams)
+        return 0;
+
+    for (int i = 0; i < next->nb_streams; i++) {
+        AVCodecParameters *a = ctx->avf->streams[i]->codecpar;
+        AVCodecParameters *b = next->streams[i]->codecpar;
+        if ((a->codec_type != b->codec_type) || (a->codec_id != b->codec_id))
+            return 0;
+        if ((a->codec_type == AVMEDIA_TYPE_VIDEO) &&
+            ((a->width != b->width) || (a->height != b->height)))
+            return 0;
+        if ((a->codec_type == AVMEDIA_TYPE_AUDIO) &&
+            (a->sample_rate != b->sample_rate))
+            return 0;
+    }
+
+    return 1;
+}
+
+/* Moves on to the next playable item, returns 0 once there are none left */
+static int playlist_next(DemuxingContext *ctx)
+{
+    int nb_items = 0;
+    while (ctx->playlist[nb_items])
+        nb_items++;
+
+    for (int skipped = 0; ctx->prefetch_thread && (skipped < nb_items); skipped++) {
+        pthread_join(ctx->prefetch_thread, NULL);
+        ctx->prefetch_thread = 0;
+
+        AVFormatContext *next = ctx->next_avf;
+        ctx->next_avf = NULL;
+        ctx->playlist_idx = ctx->next_idx;
+
+        if (ctx->next_err < 0 || !playlist_item_compatible(ctx, next)) {
+            if (ctx->next_err >= 0)
+                sp_log(ctx, SP_LOG_WARN, "Skipping playlist item %s: streams differ "
+                       "from the current item!\n", ctx->playlist[ctx->playlist_idx]);
+            avformat_close_input(&next);
+            start_prefetch(ctx);
+            continue;
+        }
+
+        for (int i = 0; i < next->nb_streams; i++) {
+            AVCodecParameters *a = ctx->avf->streams[i]->codecpar;
+            AVCodecParameters *b = next->streams[i]->codecpar;
+            ctx->queues[i].new_extradata = b->extradata_size &&
+                                           ((a->extradata_size != b->extradata_size) ||
+                                            memcmp(a->extradata, b->extradata, b->extradata_size));
+        }
+
+        pthread_mutex_lock(&ctx->lock);
+        AVFormatContext *old = ctx->avf;
+        ctx->avf = next;
+        ctx->in_url = ctx->avf->url;
+        pthread_mutex_unlock(&ctx->lock);
+
+        avformat_close_input(&old);
+        sp_async_io_close(&ctx->async_io);
+        sp_mmap_io_close(&ctx->mmap_io);
+
+        ctx->item_offset = ctx->item_end;
+        atomic_store(&ctx->discard_update, 1);
+
+        sp_log(ctx, SP_LOG_VERBOSE, "Playing item %i, %s, from %f\n",
+               ctx->playlist_idx, ctx->in_url, ctx->item_offset / (double)AV_TIME_BASE);
+
+        start_prefetch(ctx);
+
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Puts packets of every item on the timeline and time bases of the first */
+static void playlist_rebase(DemuxingContext *ctx, AVPacket *pkt)
+{
+    int idx = pkt->stream_index;
+    AVRational dst_tb = ctx->stream_tb[idx];
+
+    int64_t item_start = ctx->avf->start_time != AV_NOPTS_VALUE ? ctx->avf->start_time : 0;
+    int64_t offset = ctx->item_offset + ctx->timeline_start - item_start;
+    if (offset) {
+        offset = av_rescale_q(offset, AV_TIME_BASE_Q, pkt->time_base);
+        if (pkt->pts != AV_NOPTS_VALUE)
+            pkt->pts += offset;
+        if (pkt->dts != AV_NOPTS_VALUE)
+            pkt->dts += offset;
+    }
+
+    av_packet_rescale_ts(pkt, pkt->time_base, dst_tb);
+    pkt->time_base = dst_tb;
+
+    int64_t end = packet_time(ctx, pkt);
+    if (end != AV_NOPTS_VALUE)
+        ctx->item_end = SPMAX(ctx->item_end, end + av_rescale_q(pkt->duration, dst_tb,
+                                                                AV_TIME_BASE_Q));
+
+    if (ctx->queues[idx].new_extradata) {
+        AVCodecParameters *par = ctx->avf->streams[idx]->codecpar;
+        uint8_t *data = av_packet_new_side_data(pkt, AV_PKT_DATA_NEW_EXTRADATA,
+                                                par->extradata_size);
+        if (data)
+            memcpy(data, par->extradata, par->extradata_size);
+        ctx->queues[idx].new_extradata = 0;
+    }
+}
+
+static int over_budget(DemuxingContext *ctx)
+{
+    if (ctx->queue_max_bytes && (ctx->queued_bytes > ctx->queue_max_bytes))
+        return 1;
+
+    for (int i = 0; ctx->queue_max_duration && i < ctx->avf->nb_streams; i++)
+        if (ctx->queues[i].nb_packets &&
+            (ctx->queues[i].last_ts - ctx->queues[i].first_ts) > ctx->queue_max_duration)
+            return 1;
+
+    return 0;
+}
+
+/* Holds back packets until their time, relative to the epoch, has come */
+static void pace_packet(DemuxingContext *ctx, AVPacket *pkt, SlidingWinCtx *jitter_c)
+{
+    int64_t ts = queue_ts(ctx, pkt, AV_NOPTS_VALUE);
+    if (ts == AV_NOPTS_VALUE)
+        return;
+
+    if (ctx->rt_start_ts == AV_NOPTS_VALUE) {
+        ctx->rt_start_ts = ts;
+        ctx->rt_start_time = SPMAX(ctx->epoch, av_gettime_relative());
+    }
+
+    int64_t deadline = ctx->rt_start_time +
+                       (int64_t)((ts - ctx->rt_start_ts - ctx->realtime_burst) /
+                                 ctx->realtime_speed);
+    if (deadline <= av_gettime_relative())
+        return;
+
+    sp_sleep_until(deadline);
+
+    int64_t now = av_gettime_relative();
+    ctx->pacing_jitter = sp_sliding_win(jitter_c, now - deadline, now,
+                                        AV_TIME_BASE_Q, 1000000, 1);
+}
 
 static void *demuxing_thread(void *arg)
 {
     int err;
     DemuxingContext *ctx = arg;
+    SPGenericData *stat_entries = NULL;
+    unsigned int nb_stat_entries = 0;
+    SlidingWinCtx sctx_jitter = { 0 };
 
     sp_set_thread_name_self(sp_class_get_name(ctx));
 
@@ -37,13 +548,48 @@ static void *demuxing_thread(void *arg)
 
     sp_log(ctx, SP_LOG_VERBOSE, "Demuxer initialized!\n");
 
+    if (ctx->start_time != AV_NOPTS_VALUE)
+        seek_to(ctx, ctx->start_time);
+
+    if (ctx->playlist)
+        start_prefetch(ctx);
+
     while (1) {
+        if (atomic_exchange(&ctx->discard_update, 0))
+            update_discard(ctx);
+
+        int64_t seek = atomic_exchange(&ctx->seek_request, AV_NOPTS_VALUE);
+        if (seek != AV_NOPTS_VALUE)
+            seek_to(ctx, seek);
+
+        /* Only linked streams ever get packets queued */
+        for (int i = 0; i < ctx->avf->nb_streams; i++)
+            if (ctx->queues[i].nb_packets)
+                deliver_packets(ctx, i, 0);
+
+        /* No budget left to read ahead, so wait on the stream which is the
+         * furthest behind. Any single queue may use up the whole budget, as
+         * long as the others are empty. */
+        if (over_budget(ctx)) {
+            int oldest = -1;
+            for (int i = 0; i < ctx->avf->nb_streams; i++)
+                if (ctx->queues[i].nb_packets &&
+                    ((oldest < 0) || (ctx->queues[i].first_ts < ctx->queues[oldest].first_ts)))
+                    oldest = i;
+
+            deliver_packets(ctx, oldest, 1);
+            continue;
+        }
+
         AVPacket *out_packet = av_packet_alloc();
 
         err = av_read_frame(ctx->avf, out_packet);
-        if (err == AVERROR_EOF) {
+        if (err == AVERROR_EOF && ctx->playlist && playlist_next(ctx)) {
+            av_packet_free(&out_packet);
+            continue;
+        } else if (err == AVERROR_EOF) {
             for (int i = 0; i < ctx->avf->nb_streams; i++)
-                sp_packet_fifo_push(ctx->dst_packets[i], NULL);
+                end_stream(ctx, i);
 
             sp_log(ctx, SP_LOG_VERBOSE, "Stream EOF, FIFOs flushed!\n");
             err = 0;
@@ -55,12 +601,76 @@ static void *demuxing_thread(void *arg)
             goto fail;
         }
 
-        sp_log(ctx, SP_LOG_TRACE, "Sending packet from stream %i\n", out_packet->stream_index);
-        sp_packet_fifo_push(ctx->dst_packets[out_packet->stream_index], out_packet);
+        /* Identifies the source for stream copying */
+        out_packet->opaque = (void *)(intptr_t)sp_class_get_id(ctx);
+        out_packet->time_base = ctx->avf->streams[out_packet->stream_index]->time_base;
 
-        sp_eventlist_dispatch(ctx, ctx->events, SP_EVENT_ON_CONFIG | SP_EVENT_ON_INIT, NULL);
+        if (ctx->playlist)
+            playlist_rebase(ctx, out_packet);
+
+        int64_t pkt_time = packet_time(ctx, out_packet);
+        if (pkt_time != AV_NOPTS_VALUE) {
+            if ((ctx->trim_time != AV_NOPTS_VALUE) && (pkt_time < ctx->trim_time))
+                out_packet->flags |= AV_PKT_FLAG_DISCARD;
+
+            if ((ctx->end_time != AV_NOPTS_VALUE) && (pkt_time >= ctx->end_time)) {
+                end_stream(ctx, out_packet->stream_index);
+                av_packet_free(&out_packet);
+                if (all_streams_ended(ctx)) {
+                    sp_log(ctx, SP_LOG_VERBOSE, "End time reached, FIFOs flushed!\n");
+                    err = 0;
+                    break;
+                }
+                continue;
+            }
+        }
+
+        if (ctx->keyframes_only && sample_packet(ctx, out_packet, pkt_time)) {
+            av_packet_free(&out_packet);
+            continue;
+        }
+
+        if (ctx->realtime)
+            pace_packet(ctx, out_packet, &sctx_jitter);
+
+        /* May be created by a link at any time */
+        pthread_mutex_lock(&ctx->lock);
+        int linked = !!ctx->dst_packets[out_packet->stream_index];
+        pthread_mutex_unlock(&ctx->lock);
+
+        if (linked && !ctx->queues[out_packet->stream_index].ended) {
+            err = queue_packet(ctx, out_packet);
+            if (err < 0) {
+                sp_log(ctx, SP_LOG_ERROR, "Failed to queue packet: %s\n", av_err2str(err));
+                av_packet_free(&out_packet);
+                goto fail;
+            }
+        }
 
         av_packet_free(&out_packet);
+
+        sp_eventlist_dispatch(ctx, ctx->events, SP_EVENT_ON_CONFIG | SP_EVENT_ON_INIT, NULL);
+
+        int entries = 1 + 3*ctx->avf->nb_streams + !!ctx->realtime + 1;
+        stat_entries = av_fast_realloc(stat_entries, &nb_stat_entries, sizeof(*stat_entries) * entries);
+
+        int idx = 0;
+        stat_entries[idx++] = D_TYPE("queued_bytes", NULL, ctx->queued_bytes);
+
+        for (int i = 0; i < ctx->avf->nb_streams; i++) {
+            DemuxStreamQueue *q = &ctx->queues[i];
+            q->duration = q->nb_packets ? q->last_ts - q->first_ts : 0;
+            stat_entries[idx++] = D_TYPE("queued_packets", q->name, q->nb_packets);
+            stat_entries[idx++] = D_TYPE("queued_bytes", q->name, q->bytes);
+            stat_entries[idx++] = D_TYPE("queued_duration", q->name, q->duration);
+        }
+
+        if (ctx->realtime)
+            stat_entries[idx++] = D_TYPE("pacing_jitter", NULL, ctx->pacing_jitter);
+
+        stat_entries[idx] = (SPGenericData){ 0 };
+
+        sp_eventlist_dispatch(ctx, ctx->events, SP_EVENT_ON_STATS, stat_entries);
     }
 
     sp_event_send_eos_packets(ctx, ctx->events,
@@ -68,9 +678,23 @@ static void *demuxing_thread(void *arg)
                               err);
 
 fail:
+    av_free(stat_entries);
     return NULL;
 }
 
+/* Waits for an asynchronous init to finish, and returns its result */
+static int demuxer_wait_init(DemuxingContext *ctx)
+{
+    pthread_mutex_lock(&ctx->lock);
+    if (ctx->init_thread) {
+        pthread_join(ctx->init_thread, NULL);
+        ctx->init_thread = 0;
+    }
+    pthread_mutex_unlock(&ctx->lock);
+
+    return ctx->init_err;
+}
+
 static int demuxer_ioctx_ctrl_cb(AVBufferRef *event_ref, void *callback_ctx,
                                  void *_ctx, void *dep_ctx, void *data)
 {
@@ -78,15 +702,89 @@ static int demuxer_ioctx_ctrl_cb(AVBufferRef *event_ref, void *callback_ctx,
     DemuxingContext *ctx = _ctx;
 
     if (event->ctrl & SP_EVENT_CTRL_START) {
+        int err = demuxer_wait_init(ctx);
+        if (err < 0)
+            return err;
         ctx->epoch = atomic_load(event->epoch);
+        atomic_store(&ctx->discard_update, 1);
         if (!ctx->demuxing_thread)
             pthread_create(&ctx->demuxing_thread, NULL, demuxing_thread, ctx);
     } else if (event->ctrl & SP_EVENT_CTRL_STOP) {
         pthread_join(ctx->demuxing_thread, NULL);
     } else if (event->ctrl & SP_EVENT_CTRL_OPTS) {
-
+        const char *tmp_val = NULL;
+        if ((tmp_val = dict_get(event->opts, "queue_max_bytes"))) {
+            long int val = strtol(tmp_val, NULL, 10);
+            if (val < 0)
+                sp_log(ctx, SP_LOG_ERROR, "Invalid queue size \"%s\"!\n", tmp_val);
+            else
+                ctx->queue_max_bytes = val;
+        }
+        if ((tmp_val = dict_get(event->opts, "start_time"))) {
+            double val = strtod(tmp_val, NULL);
+            if (val < 0.0)
+                sp_log(ctx, SP_LOG_ERROR, "Invalid start time \"%s\"!\n", tmp_val);
+            else
+                ctx->start_time = val * AV_TIME_BASE;
+        }
+        if ((tmp_val = dict_get(event->opts, "end_time"))) {
+            double val = strtod(tmp_val, NULL);
+            if (val <= 0.0)
+                sp_log(ctx, SP_LOG_ERROR, "Invalid end time \"%s\"!\n", tmp_val);
+            else
+                ctx->end_time = val * AV_TIME_BASE;
+        }
+        if ((tmp_val = dict_get(event->opts, "realtime")))
+            if (!strcmp(tmp_val, "true") || strtol(tmp_val, NULL, 10) != 0)
+                ctx->realtime = 1;
+        if ((tmp_val = dict_get(event->opts, "realtime_speed"))) {
+            double val = strtod(tmp_val, NULL);
+            if (val <= 0.0)
+                sp_log(ctx, SP_LOG_ERROR, "Invalid speed \"%s\"!\n", tmp_val);
+            else
+                ctx->realtime_speed = val;
+        }
+        if ((tmp_val = dict_get(event->opts, "realtime_burst_ms"))) {
+            long int val = strtol(tmp_val, NULL, 10);
+            if (val < 0)
+                sp_log(ctx, SP_LOG_ERROR, "Invalid burst duration \"%s\"!\n", tmp_val);
+            else
+                ctx->realtime_burst = val * 1000;
+        }
+        if ((tmp_val = dict_get(event->opts, "keyframes_only")))
+            if (!strcmp(tmp_val, "true") || strtol(tmp_val, NULL, 10) != 0)
+                ctx->keyframes_only = 1;
+        if ((tmp_val = dict_get(event->opts, "sample_interval"))) {
+            double val = strtod(tmp_val, NULL);
+            if (val <= 0.0) {
+                sp_log(ctx, SP_LOG_ERROR, "Invalid sample interval \"%s\"!\n", tmp_val);
+            } else {
+                ctx->sample_interval = val * AV_TIME_BASE;
+                ctx->keyframes_only = 1;
+            }
+        }
+        if (ctx->keyframes_only)
+            atomic_store(&ctx->discard_update, 1);
+        if ((tmp_val = dict_get(event->opts, "queue_max_ms"))) {
+            long int val = strtol(tmp_val, NULL, 10);
+            if (val < 0)
+                sp_log(ctx, SP_LOG_ERROR, "Invalid queue duration \"%s\"!\n", tmp_val);
+            else
+                ctx->queue_max_duration = val * 1000;
+        }
+    } else if (event->ctrl & SP_EVENT_CTRL_COMMAND) {
+        const char *tmp_val = NULL;
+        if ((tmp_val = dict_get(event->cmd, "seek"))) {
+            double val = strtod(tmp_val, NULL);
+            if (val < 0.0)
+                sp_log(ctx, SP_LOG_ERROR, "Invalid seek position \"%s\"!\n", tmp_val);
+            else
+                atomic_store(&ctx->seek_request, (int64_t)(val * AV_TIME_BASE));
+        }
     } else if (event->ctrl & SP_EVENT_CTRL_FLUSH) {
         sp_log(ctx, SP_LOG_VERBOSE, "Flushing buffer\n");
+        if (demuxer_wait_init(ctx) < 0)
+            return 0;
         pthread_mutex_lock(&ctx->lock);
         avio_flush(ctx->avf->pb);
         pthread_mutex_unlock(&ctx->lock);
@@ -100,57 +798,186 @@ static int demuxer_ioctx_ctrl_cb(AVBufferRef *event_ref, void *callback_ctx,
 int sp_demuxer_ctrl(AVBufferRef *ctx_ref, SPEventType ctrl, void *arg)
 {
     DemuxingContext *ctx = (DemuxingContext *)ctx_ref->data;
-    return sp_ctrl_template(ctx, ctx->events, 0x0, demuxer_ioctx_ctrl_cb, ctrl, arg);
+    return sp_ctrl_template(ctx, ctx->events, SP_EVENT_CTRL_COMMAND,
+                            demuxer_ioctx_ctrl_cb, ctrl, arg);
 }
 
-int sp_demuxer_init(AVBufferRef *ctx_ref)
+static int find_stream(DemuxingContext *ctx, int stream_id, const char *stream_desc)
+{
+    static const struct {
+        const char *prefix;
+        enum AVMediaType type;
+    } stream_prefixes[] = {
+        { "video=",    AVMEDIA_TYPE_VIDEO    },
+        { "vid=",      AVMEDIA_TYPE_VIDEO    },
+        { "audio=",    AVMEDIA_TYPE_AUDIO    },
+        { "aid=",      AVMEDIA_TYPE_AUDIO    },
+        { "subtitle=", AVMEDIA_TYPE_SUBTITLE },
+        { "sub=",      AVMEDIA_TYPE_SUBTITLE },
+    };
+
+    if (stream_id >= 0) {
+        if (stream_id >= ctx->avf->nb_streams) {
+            sp_log(ctx, SP_LOG_ERROR, "Invalid stream ID %i, demuxer only has %i streams!\n",
+                   stream_id, ctx->avf->nb_streams);
+            return AVERROR(EINVAL);
+        }
+        return stream_id;
+    } else if (stream_desc) {
+        for (int i = 0; i < SP_ARRAY_ELEMS(stream_prefixes); i++) {
+            int len = strlen(stream_prefixes[i].prefix);
+            if (strncmp(stream_desc, stream_prefixes[i].prefix, len))
+                continue;
+
+            int cnt = 0, nb = strtol(stream_desc + len, NULL, 10);
+            for (int j = 0; j < ctx->avf->nb_streams; j++)
+                if (ctx->avf->streams[j]->codecpar->codec_type == stream_prefixes[i].type)
+                    if (cnt++ == nb)
+                        return j;
+
+            sp_log(ctx, SP_LOG_ERROR, "Unable to find stream \"%s\"!\n", stream_desc);
+            return AVERROR(EINVAL);
+        }
+
+        for (int i = 0; i < ctx->avf->nb_streams; i++) {
+            AVDictionaryEntry *d = av_dict_get(ctx->avf->streams[i]->metadata, "title", NULL, 0);
+            if (d && !strcmp(d->value, stream_desc))
+                return i;
+        }
+
+        sp_log(ctx, SP_LOG_ERROR, "Unable to find stream with title \"%s\"\n",
+               stream_desc);
+        return AVERROR(EINVAL);
+    } else if (ctx->avf->nb_streams == 1) {
+        return 0;
+    }
+
+    sp_log(ctx, SP_LOG_ERROR, "No stream ID or description specified for searching!\n");
+    return AVERROR(EINVAL);
+}
+
+int sp_demuxer_find_stream(DemuxingContext *ctx, int stream_id, const char *stream_desc)
+{
+    int err = demuxer_wait_init(ctx);
+    if (err < 0)
+        return err;
+
+    /* The playlist may switch the input context at any time */
+    pthread_mutex_lock(&ctx->lock);
+    err = find_stream(ctx, stream_id, stream_desc);
+    pthread_mutex_unlock(&ctx->lock);
+
+    return err;
+}
+
+/* Opens and probes the input, may run on its own thread */
+/* Suffixes the default name with the format's */
+static int name_by_format(DemuxingContext *ctx, const char *format)
+{
+    int len = strlen(sp_class_get_name(ctx)) + 1 + strlen(format) + 1;
+    char *new_name = av_mallocz(len);
+    if (!new_name)
+        return AVERROR(ENOMEM);
+
+    av_strlcpy(new_name, sp_class_get_name(ctx), len);
+    av_strlcat(new_name, ":", len);
+    av_strlcat(new_name, format, len);
+    int err = sp_class_set_name(ctx, new_name);
+    av_free(new_name);
+    if (err < 0)
+        return err;
+
+    ctx->name = sp_class_get_name(ctx);
+
+    return 0;
+}
+
+static int demuxer_open(DemuxingContext *ctx)
 {
     int err;
-    DemuxingContext *ctx = (DemuxingContext *)ctx_ref->data;
 
-    if (!ctx->in_format) {
-        if (!strncmp(ctx->in_url, "/dev/video", strlen("/dev/video")))
-            ctx->in_format = "v4l2";
-        if (!strncmp(ctx->in_url, "rtmp://", strlen("rtmp://")))
-            ctx->in_format = "flv";
-        if (!strncmp(ctx->in_url, "udp://", strlen("udp://")))
-            ctx->in_format = "mpegts";
-        if (!strncmp(ctx->in_url, "http://", strlen("http://")))
-            ctx->in_format = "dash";
+    ctx->avf = avformat_alloc_context();
+    if (!ctx->avf)
+        return AVERROR(ENOMEM);
+
+    if (ctx->probesize)
+        ctx->avf->probesize = ctx->probesize;
+    if (ctx->analyzeduration)
+        ctx->avf->max_analyze_duration = ctx->analyzeduration;
+    if (ctx->fpsprobesize >= 0)
+        ctx->avf->fps_probe_size = ctx->fpsprobesize;
+
+    const char *open_url = ctx->in_url;
+
+    err = sp_mmap_io_open(ctx, &ctx->mmap_io, &ctx->avf->pb, ctx->in_url,
+                          ctx->io_opts);
+    if (err > 0) {
+        av_strstart(open_url, SP_MMAP_IO_PREFIX, &open_url);
+        ctx->avf->flags |= AVFMT_FLAG_CUSTOM_IO;
+    } else if (err < 0) {
+        goto fail;
+    } else {
+        err = sp_async_io_open(ctx, &ctx->async_io, &ctx->avf->pb, ctx->in_url,
+                               AVIO_FLAG_READ, ctx->io_opts);
+        if (err > 0)
+            ctx->avf->flags |= AVFMT_FLAG_CUSTOM_IO;
+        else if (err < 0 && err != AVERROR(ENOTSUP))
+            goto fail;
     }
 
-    err = avformat_open_input(&ctx->avf, ctx->in_url, NULL, &ctx->start_options);
+    err = avformat_open_input(&ctx->avf, open_url, NULL, &ctx->start_options);
     if (err < 0) {
         sp_log(ctx, SP_LOG_ERROR, "Couldn't initialize demuxer: %s!\n", av_err2str(err));
         goto fail;
     }
 
-    if (!ctx->name) {
-        int len = strlen(sp_class_get_name(ctx)) + 1 + strlen(ctx->avf->iformat->name) + 1;
-        char *new_name = av_mallocz(len);
-        if (!new_name) {
+    /* Opening in the background names it before, as others may be logging
+     * through it by now */
+    if (!ctx->name && !ctx->async_init) {
+        err = name_by_format(ctx, ctx->avf->iformat->name);
+        if (err < 0)
+            goto fail;
+    }
+
+    err = probe_streams(ctx, ctx->avf, ctx->in_url);
+    if (err < 0)
+        goto fail;
+
+    ctx->timeline_start = ctx->avf->start_time != AV_NOPTS_VALUE ? ctx->avf->start_time : 0;
+
+    if (ctx->playlist) {
+        ctx->stream_tb = av_malloc(ctx->avf->nb_streams*sizeof(*ctx->stream_tb));
+        if (!ctx->stream_tb) {
             err = AVERROR(ENOMEM);
             goto fail;
         }
-        av_strlcpy(new_name, sp_class_get_name(ctx), len);
-        av_strlcat(new_name, ":", len);
-        av_strlcat(new_name, ctx->avf->iformat->name, len);
-        sp_class_set_name(ctx, new_name);
-        av_free(new_name);
-        ctx->name = sp_class_get_name(ctx);
-    } else {
-        sp_class_set_name(ctx, ctx->name);
+        for (int i = 0; i < ctx->avf->nb_streams; i++)
+            ctx->stream_tb[i] = ctx->avf->streams[i]->time_base;
     }
 
-    err = avformat_find_stream_info(ctx->avf, NULL);
-    if (err < 0) {
-        sp_log(ctx, SP_LOG_ERROR, "Couldn't find stream info: %s!\n", av_err2str(err));
+    /* Each consumer mirrors these, and blocks us via its own FIFO.
+     * Only created once a stream gets linked. */
+    ctx->dst_packets = av_mallocz(ctx->avf->nb_streams*sizeof(*ctx->dst_packets));
+    if (!ctx->dst_packets) {
+        err = AVERROR(ENOMEM);
         goto fail;
     }
 
-    ctx->dst_packets = av_mallocz(ctx->avf->nb_streams*sizeof(ctx->dst_packets));
-    for (int i = 0; i < ctx->avf->nb_streams; i++)
-        ctx->dst_packets[i] = sp_packet_fifo_create(ctx, 10, PACKET_FIFO_BLOCK_MAX_OUTPUT | PACKET_FIFO_BLOCK_NO_INPUT);
+    ctx->queues = av_mallocz(ctx->avf->nb_streams*sizeof(*ctx->queues));
+    if (!ctx->queues) {
+        err = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    for (int i = 0; i < ctx->avf->nb_streams; i++) {
+        DemuxStreamQueue *q = &ctx->queues[i];
+        q->pending = sp_packet_fifo_create(ctx, -1, 0);
+        q->name = av_asprintf("%s:%i", sp_class_get_name(ctx), i);
+        if (!q->pending || !q->name) {
+            err = AVERROR(ENOMEM);
+            goto fail;
+        }
+    }
 
     /* Both fields alive for the duration of the avf context */
     ctx->in_format = ctx->avf->iformat->name;
@@ -159,28 +986,146 @@ int sp_demuxer_init(AVBufferRef *ctx_ref)
     return 0;
 
 fail:
-    avformat_free_context(ctx->avf);
+    for (int i = 0; ctx->queues && i < ctx->avf->nb_streams; i++) {
+        av_buffer_unref(&ctx->queues[i].pending);
+        av_free(ctx->queues[i].name);
+    }
+    av_freep(&ctx->queues);
+    av_freep(&ctx->dst_packets);
+    avformat_close_input(&ctx->avf);
     return err;
 }
 
+static void *demuxer_init_thread(void *arg)
+{
+    DemuxingContext *ctx = arg;
+
+    sp_set_thread_name_self("demux:init");
+
+    ctx->init_err = demuxer_open(ctx);
+
+    return NULL;
+}
+
+int sp_demuxer_init(AVBufferRef *ctx_ref)
+{
+    int err;
+    DemuxingContext *ctx = (DemuxingContext *)ctx_ref->data;
+
+    /* An explicit URL plays ahead of the whole playlist */
+    if (ctx->playlist && !ctx->in_url)
+        ctx->in_url = ctx->playlist[0];
+    else if (ctx->playlist)
+        ctx->playlist_idx = -1;
+
+    if (!ctx->in_url) {
+        sp_log(ctx, SP_LOG_ERROR, "No input URL given!\n");
+        return AVERROR(EINVAL);
+    }
+
+    if (!ctx->in_format) {
+        if (!strncmp(ctx->in_url, "/dev/video", strlen("/dev/video")))
+            ctx->in_format = "v4l2";
+        if (!strncmp(ctx->in_url, "rtmp://", strlen("rtmp://")))
+            ctx->in_format = "flv";
+        if (!strncmp(ctx->in_url, "udp://", strlen("udp://")))
+            ctx->in_format = "mpegts";
+        if (!strncmp(ctx->in_url, "http://", strlen("http://")))
+            ctx->in_format = "dash";
+    }
+
+    /* Also accepted along with the lavf options, for tx_demuxer_create() */
+    static const char *own_opts[] = { "map_file", "info_cache", "async_init" };
+    for (int i = 0; i < FF_ARRAY_ELEMS(own_opts); i++) {
+        const char *val = dict_get(ctx->start_options, own_opts[i]);
+        if (!val)
+            continue;
+        if (!strcmp(own_opts[i], "map_file"))
+            av_dict_set(&ctx->io_opts, "map_file", val, 0);
+        else if (!strcmp(own_opts[i], "info_cache")) {
+            av_free(ctx->info_cache);
+            ctx->info_cache = av_strdup(val);
+        } else if (!strcmp(own_opts[i], "async_init"))
+            ctx->async_init = !strcmp(val, "true") || strtol(val, NULL, 10) != 0;
+        av_dict_set(&ctx->start_options, own_opts[i], NULL, 0);
+    }
+
+    /* Opening consumes the options, every playlist item needs them */
+    if (ctx->playlist) {
+        err = av_dict_copy(&ctx->item_options, ctx->start_options, 0);
+        if (err < 0)
+            return err;
+    }
+
+    if (ctx->name) {
+        sp_class_set_name(ctx, ctx->name);
+        ctx->name = sp_class_get_name(ctx);
+    }
+
+    if (!ctx->async_init)
+        return demuxer_open(ctx);
+
+    /* Only the format asked for is known at this point */
+    if (!ctx->name && ctx->in_format) {
+        err = name_by_format(ctx, ctx->in_format);
+        if (err < 0)
+            return err;
+    }
+
+    /* The caller's strings may not outlive this call */
+    ctx->in_url = ctx->in_url_copy = av_strdup(ctx->in_url);
+    if (!ctx->in_url_copy)
+        return AVERROR(ENOMEM);
+
+    err = pthread_create(&ctx->init_thread, NULL, demuxer_init_thread, ctx);
+    if (err) {
+        ctx->init_thread = 0;
+        return AVERROR(err);
+    }
+
+    return 0;
+}
+
 static void demuxer_free(void *opaque, uint8_t *data)
 {
     DemuxingContext *ctx = (DemuxingContext *)data;
 
+    demuxer_wait_init(ctx);
+
     if (ctx->demuxing_thread)
         pthread_join(ctx->demuxing_thread, NULL);
 
-    for (int i = 0; i < ctx->avf->nb_streams; i++)
+    if (ctx->prefetch_thread)
+        pthread_join(ctx->prefetch_thread, NULL);
+    avformat_close_input(&ctx->next_avf);
+
+    for (int i = 0; ctx->dst_packets && i < ctx->avf->nb_streams; i++)
         av_buffer_unref(&ctx->dst_packets[i]);
 
+    for (int i = 0; ctx->queues && i < ctx->avf->nb_streams; i++) {
+        av_buffer_unref(&ctx->queues[i].pending);
+        av_free(ctx->queues[i].name);
+    }
+
     sp_eventlist_dispatch(ctx, ctx->events, SP_EVENT_ON_DESTROY, NULL);
     sp_bufferlist_free(&ctx->events);
 
     avformat_close_input(&ctx->avf);
+    sp_async_io_close(&ctx->async_io);
+    sp_mmap_io_close(&ctx->mmap_io);
+    av_dict_free(&ctx->io_opts);
+    av_free(ctx->info_cache);
+    av_free(ctx->in_url_copy);
+    av_free(ctx->stream_tb);
+    av_dict_free(&ctx->item_options);
+    for (int i = 0; ctx->playlist && ctx->playlist[i]; i++)
+        av_free(ctx->playlist[i]);
+    av_free(ctx->playlist);
 
     pthread_mutex_destroy(&ctx->lock);
 
     av_free(ctx->dst_packets);
+    av_free(ctx->queues);
 
     sp_log(ctx, SP_LOG_VERBOSE, "Demuxer destroyed!\n");
     sp_class_free(ctx);
@@ -204,6 +1149,16 @@ AVBufferRef *sp_demuxer_alloc(void)
 
     pthread_mutex_init(&ctx->lock, NULL);
     ctx->events = sp_bufferlist_new();
+    ctx->queue_max_bytes = 32 << 20;
+    ctx->queue_max_duration = 5000000;
+    ctx->realtime_speed = 1.0;
+    ctx->rt_start_ts = AV_NOPTS_VALUE;
+    ctx->fpsprobesize = -1;
+    ctx->start_time = AV_NOPTS_VALUE;
+    ctx->end_time = AV_NOPTS_VALUE;
+    ctx->trim_time = AV_NOPTS_VALUE;
+    ctx->next_sample = AV_NOPTS_VALUE;
+    ctx->seek_request = ATOMIC_VAR_INIT(AV_NOPTS_VALUE);
 
     return ctx_ref;
 }
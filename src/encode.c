@@ -582,6 +582,45 @@ static int video_config_changed(const EncodingContext *ctx, const AVFrame *frame
            (ctx->rotation != fe->rotation);
 }
 
+static void apply_runtime_changes(EncodingContext *ctx, AVFrame *frame)
+{
+    if (atomic_exchange(&ctx->force_keyframe, 0)) {
+        sp_log(ctx, SP_LOG_VERBOSE, "Forcing keyframe\n");
+        frame->pict_type = AV_PICTURE_TYPE_I;
+    }
+
+    int64_t bit_rate = atomic_exchange(&ctx->pending_bitrate, 0);
+    int64_t max_rate = atomic_exchange(&ctx->pending_maxrate, 0);
+    int64_t buf_size = atomic_exchange(&ctx->pending_bufsize, 0);
+
+    if (bit_rate && (bit_rate != ctx->avctx->bit_rate)) {
+        /* Keep the VBV constraints proportional to the new target, unless given */
+        if (ctx->avctx->bit_rate) {
+            if (ctx->avctx->rc_max_rate && !max_rate)
+                ctx->avctx->rc_max_rate = av_rescale(ctx->avctx->rc_max_rate, bit_rate,
+                                                     ctx->avctx->bit_rate);
+            if (ctx->avctx->rc_buffer_size && !buf_size)
+                ctx->avctx->rc_buffer_size = av_rescale(ctx->avctx->rc_buffer_size, bit_rate,
+                                                        ctx->avctx->bit_rate);
+        }
+
+        sp_log(ctx, SP_LOG_VERBOSE, "Changing bitrate from %" PRIi64 " to %" PRIi64 "\n",
+               ctx->avctx->bit_rate, bit_rate);
+
+        ctx->avctx->bit_rate = bit_rate;
+    }
+
+    if (max_rate) {
+        sp_log(ctx, SP_LOG_VERBOSE, "Changing maxrate to %" PRIi64 "\n", max_rate);
+        ctx->avctx->rc_max_rate = max_rate;
+    }
+
+    if (buf_size) {
+        sp_log(ctx, SP_LOG_VERBOSE, "Changing bufsize to %" PRIi64 "\n", buf_size);
+        ctx->avctx->rc_buffer_size = buf_size;
+    }
+}
+
 static void *encoding_thread(void *arg)
 {
     EncodingContext *ctx = arg;
@@ -620,6 +659,32 @@ static void *encoding_thread(void *arg)
         } else if (!flush) {
             frame = sp_frame_fifo_pop(ctx->src_frames);
             flush = !frame;
+
+            if (frame && ctx->max_latency) {
+                ctx->lag = sp_frame_lag(frame, ctx->epoch);
+                if (ctx->lag > ctx->max_latency) {
+                    ctx->dropped_late++;
+                    sp_log(ctx, SP_LOG_TRACE, "Dropping late frame, lag = %f (%" PRIi64 " dropped)\n",
+                           ctx->lag / (double)AV_TIME_BASE, ctx->dropped_late);
+                    av_frame_free(&frame);
+                }
+
+                int64_t now = av_gettime_relative();
+                if ((now - ctx->stats_start) >= AV_TIME_BASE) {
+                    SPGenericData entries[] = {
+                        D_TYPE("dropped_late", NULL, ctx->dropped_late),
+                        D_TYPE("lag", NULL, ctx->lag),
+                        { 0 },
+                    };
+                    sp_eventlist_dispatch(ctx, ctx->events, SP_EVENT_ON_STATS, entries);
+                    ctx->stats_start = now;
+                }
+
+                if (!frame) {
+                    pthread_mutex_unlock(&ctx->lock);
+                    continue;
+                }
+            }
         }
 
         if (ctx->codec->type == AVMEDIA_TYPE_VIDEO) {
@@ -660,6 +725,9 @@ static void *encoding_thread(void *arg)
             if (!atomic_load(&ctx->soft_flush)) {
                 out_pkt = av_packet_alloc();
 
+                if (frame)
+                    apply_runtime_changes(ctx, frame);
+
                 /* Give frame */
                 ret = avcodec_send_frame(ctx->avctx, frame);
                 av_frame_free(&frame);
@@ -779,6 +847,13 @@ static int encoder_ioctx_ctrl_cb(AVBufferRef *event_ref, void *callback_ctx,
             else
                 sp_packet_fifo_set_max_queued(ctx->src_frames, len);
         }
+        if ((tmp_val = dict_get(event->opts, "max_latency_ms"))) {
+            long int val = strtol(tmp_val, NULL, 10);
+            if (val < 0)
+                sp_log(ctx, SP_LOG_ERROR, "Invalid maximum latency \"%s\"!\n", tmp_val);
+            else
+                ctx->max_latency = val * 1000;
+        }
         if ((tmp_val = dict_get(event->opts, "fifo_flags"))) {
             enum SPFrameFIFOFlags new_block_flags = 0;
             int res = sp_frame_fifo_string_to_block_flags(&new_block_flags, tmp_val);
@@ -789,6 +864,31 @@ static int encoder_ioctx_ctrl_cb(AVBufferRef *event_ref, void *callback_ctx,
                 sp_log(ctx, SP_LOG_TRACE, "Changed fifo flags to %s (%d)\n", tmp_val, new_block_flags);
             }
         }
+    } else if (event->ctrl & SP_EVENT_CTRL_COMMAND) {
+        const char *tmp_val = NULL;
+        if ((tmp_val = dict_get(event->cmd, "bitrate"))) {
+            int ret = sp_encoder_set_bitrate(ctx, strtol(tmp_val, NULL, 10));
+            if (ret < 0)
+                sp_log(ctx, SP_LOG_ERROR, "Unable to change bitrate to \"%s\": %s!\n",
+                       tmp_val, av_err2str(ret));
+        }
+        if ((tmp_val = dict_get(event->cmd, "maxrate"))) {
+            long int val = strtol(tmp_val, NULL, 10);
+            if (!ctx->rc_live || val <= 0)
+                sp_log(ctx, SP_LOG_ERROR, "Unable to change maxrate to \"%s\"!\n", tmp_val);
+            else
+                atomic_store(&ctx->pending_maxrate, val);
+        }
+        if ((tmp_val = dict_get(event->cmd, "bufsize"))) {
+            long int val = strtol(tmp_val, NULL, 10);
+            if (!ctx->rc_live || val <= 0 || val > INT_MAX)
+                sp_log(ctx, SP_LOG_ERROR, "Unable to change bufsize to \"%s\"!\n", tmp_val);
+            else
+                atomic_store(&ctx->pending_bufsize, val);
+        }
+        if ((tmp_val = dict_get(event->cmd, "force_keyframe")))
+            if (!strcmp(tmp_val, "true") || strtol(tmp_val, NULL, 10) != 0)
+                atomic_store(&ctx->force_keyframe, 1);
     } else if (event->ctrl & SP_EVENT_CTRL_FLUSH) {
         if (ctx->codec->capabilities & AV_CODEC_CAP_ENCODER_FLUSH) {
             atomic_store(&ctx->soft_flush, 1);
@@ -804,10 +904,22 @@ static int encoder_ioctx_ctrl_cb(AVBufferRef *event_ref, void *callback_ctx,
 int sp_encoder_ctrl(AVBufferRef *ctx_ref, SPEventType ctrl, void *arg)
 {
     EncodingContext *ctx = (EncodingContext *)ctx_ref->data;
-    return sp_ctrl_template(ctx, ctx->events, 0x0,
+    return sp_ctrl_template(ctx, ctx->events, SP_EVENT_CTRL_COMMAND,
                             encoder_ioctx_ctrl_cb, ctrl, arg);
 }
 
+int sp_encoder_set_bitrate(EncodingContext *ctx, int64_t bit_rate)
+{
+    if (!ctx->rc_live)
+        return AVERROR(ENOTSUP);
+    if (bit_rate <= 0)
+        return AVERROR(EINVAL);
+
+    atomic_store(&ctx->pending_bitrate, bit_rate);
+
+    return 0;
+}
+
 int sp_encoder_init(AVBufferRef *ctx_ref)
 {
     int err;
@@ -822,6 +934,8 @@ int sp_encoder_init(AVBufferRef *ctx_ref)
     if (!ctx->avctx)
         return AVERROR(ENOMEM);
 
+    ctx->rc_live = codec_supports_live_rc(ctx->codec);
+
     if (!ctx->name) {
         int len = strlen(sp_class_get_name(ctx)) + 1 + strlen(ctx->codec->name) + 1;
         char *new_name = av_mallocz(len);
@@ -902,6 +1016,10 @@ AVBufferRef *sp_encoder_alloc(void)
     ctx->events = sp_bufferlist_new();
     ctx->swr = swr_alloc();
     ctx->soft_flush = ATOMIC_VAR_INIT(0);
+    ctx->pending_bitrate = ATOMIC_VAR_INIT(0);
+    ctx->pending_maxrate = ATOMIC_VAR_INIT(0);
+    ctx->pending_bufsize = ATOMIC_VAR_INIT(0);
+    ctx->force_keyframe = ATOMIC_VAR_INIT(0);
 
     ctx->src_frames = sp_frame_fifo_create(ctx, 8, FRAME_FIFO_BLOCK_NO_INPUT);
     ctx->dst_packets = sp_packet_fifo_create(ctx, 0, 0);
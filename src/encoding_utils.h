@@ -32,6 +32,22 @@ static const AVCodecHWConfig *get_codec_hw_config(EncodingContext *ctx)
     return NULL;
 }
 
+/* Encoders which pick up bit_rate/rc_max_rate/rc_buffer_size changes on
+ * the next frame without being reinitialized */
+static int codec_supports_live_rc(const AVCodec *codec)
+{
+    static const char *live_rc_codecs[] = {
+        "libx264", "libx264rgb",
+        "h264_nvenc", "hevc_nvenc", "av1_nvenc",
+    };
+
+    for (int i = 0; i < SP_ARRAY_ELEMS(live_rc_codecs); i++)
+        if (!strcmp(codec->name, live_rc_codecs[i]))
+            return 1;
+
+    return 0;
+}
+
 static enum AVSampleFormat pick_codec_sample_fmt(const AVCodec *codec,
                                                  enum AVSampleFormat ifmt,
                                                  int ibps)
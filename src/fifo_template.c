@@ -16,6 +16,9 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include <errno.h>
+#include <time.h>
+
 #include <libtxproto/utils.h>
 
 typedef struct SNAME {
@@ -23,6 +26,7 @@ typedef struct SNAME {
     int num_queued;
     int max_queued;
     FNAME block_flags;
+    int64_t nb_refused; /* Pushes which failed with ENOBUFS */
     unsigned int queued_alloc_size;
     pthread_mutex_t lock;
     pthread_cond_t cond_in;
@@ -166,6 +170,53 @@ int RENAME(fifo_is_full)(AVBufferRef *src)
     return ret;
 }
 
+int RENAME(fifo_would_block)(AVBufferRef *dst)
+{
+    if (!dst)
+        return 0;
+
+    AVBufferRef *dist = NULL;
+    SNAME *ctx = (SNAME *)dst->data;
+    pthread_mutex_lock(&ctx->lock);
+
+    int ret = (ctx->max_queued > 0) &&
+              (ctx->block_flags & FRENAME(BLOCK_MAX_OUTPUT)) &&
+              (ctx->num_queued > (ctx->max_queued + 1));
+
+    while (!ret && (dist = sp_bufferlist_iter_ref(ctx->dests))) {
+        ret = RENAME(fifo_would_block)(dist);
+        av_buffer_unref(&dist);
+        if (ret)
+            sp_bufferlist_iter_halt(ctx->dests);
+    }
+
+    pthread_mutex_unlock(&ctx->lock);
+    return ret;
+}
+
+int RENAME(fifo_would_overflow)(AVBufferRef *dst)
+{
+    if (!dst)
+        return 0;
+
+    AVBufferRef *dist = NULL;
+    SNAME *ctx = (SNAME *)dst->data;
+    pthread_mutex_lock(&ctx->lock);
+
+    int ret = (ctx->max_queued > 0) &&
+              (ctx->num_queued > (ctx->max_queued + 1));
+
+    while (!ret && (dist = sp_bufferlist_iter_ref(ctx->dests))) {
+        ret = RENAME(fifo_would_overflow)(dist);
+        av_buffer_unref(&dist);
+        if (ret)
+            sp_bufferlist_iter_halt(ctx->dests);
+    }
+
+    pthread_mutex_unlock(&ctx->lock);
+    return ret;
+}
+
 int RENAME(fifo_get_size)(AVBufferRef *src)
 {
     if (!src)
@@ -190,6 +241,18 @@ int RENAME(fifo_get_max_size)(AVBufferRef *src)
     return ret;
 }
 
+int64_t RENAME(fifo_get_refused)(AVBufferRef *src)
+{
+    if (!src)
+        return 0;
+
+    SNAME *ctx = (SNAME *)src->data;
+    pthread_mutex_lock(&ctx->lock);
+    int64_t ret = ctx->nb_refused;
+    pthread_mutex_unlock(&ctx->lock);
+    return ret;
+}
+
 void RENAME(fifo_set_max_queued)(AVBufferRef *dst, int max_queued)
 {
     SNAME *ctx = (SNAME *)dst->data;
@@ -250,6 +313,7 @@ int RENAME(fifo_push)(AVBufferRef *dst, TYPE *in)
     if (in && (ctx->max_queued != -1) &&
         (ctx->num_queued > (ctx->max_queued + 1))) {
         if (!(ctx->block_flags & FRENAME(BLOCK_MAX_OUTPUT))) {
+            ctx->nb_refused++;
             err = AVERROR(ENOBUFS);
             goto unlock;
         }
@@ -330,6 +394,49 @@ unlock:
     return ret;
 }
 
+int RENAME(fifo_pop_timed)(AVBufferRef *src, TYPE **dst, int64_t deadline)
+{
+    int ret = 0;
+
+    if (!src) {
+        *dst = NULL;
+        return 0;
+    }
+
+    TYPE *out = NULL;
+    SNAME *ctx = (SNAME *)src->data;
+    pthread_mutex_lock(&ctx->lock);
+
+    struct timespec ts = {
+        .tv_sec  = deadline / 1000000,
+        .tv_nsec = (deadline % 1000000) * 1000,
+    };
+
+    while (!ctx->num_queued) {
+        if (!(ctx->block_flags & FRENAME(BLOCK_NO_INPUT)) ||
+            (pthread_cond_timedwait(&ctx->cond_in, &ctx->lock, &ts) == ETIMEDOUT)) {
+            ret = AVERROR(EAGAIN);
+            goto unlock;
+        }
+    }
+
+    out = ctx->queued[0];
+    ctx->num_queued--;
+    assert(ctx->num_queued >= 0);
+
+    memmove(&ctx->queued[0], &ctx->queued[1], ctx->num_queued*sizeof(TYPE *));
+
+    if (ctx->max_queued > 0)
+        pthread_cond_signal(&ctx->cond_out);
+
+unlock:
+    pthread_mutex_unlock(&ctx->lock);
+
+    *dst = out;
+
+    return ret;
+}
+
 TYPE *RENAME(fifo_pop)(AVBufferRef *src)
 {
     TYPE *ret;
@@ -27,6 +27,7 @@
 #include <libtxproto/fifo_frame.h>
 #include "os_compat.h"
 #include <libtxproto/utils.h>
+#include "utils.h"
 #include "ctrl_template.h"
 
 FN_CREATING(FilterContext, FilterPad, in_pad, in_pads, num_in_pads)
@@ -532,6 +533,23 @@ static int push_input_pads(FilterContext *ctx, int *flush, int opportunistically
                 j = nb_req;
             } else {
                 FormatExtraData *fe = (FormatExtraData *)in_frame->opaque_ref->data;
+
+                if (ctx->max_latency) {
+                    ctx->lag = sp_frame_lag(in_frame, ctx->epoch);
+                    if (ctx->lag > ctx->max_latency) {
+                        ctx->dropped_late++;
+                        sp_log(ctx, SP_LOG_TRACE, "Dropping late frame on input pad \"%s\", "
+                               "lag = %f (%" PRIi64 " dropped)\n", in_pad->name,
+                               ctx->lag / (double)AV_TIME_BASE, ctx->dropped_late);
+                        av_frame_free(&in_frame);
+
+                        /* We still want the requested number of frames */
+                        if (!opportunistically)
+                            j--;
+                        continue;
+                    }
+                }
+
                 sp_log(ctx, SP_LOG_TRACE, "Giving frame to input pad \"%s\", pts = %f\n",
                        in_pad->name, av_q2d(fe->time_base) * in_frame->pts);
             }
@@ -660,6 +678,17 @@ static void *filtering_thread(void *data)
         if (err < 0)
             goto fail;
 
+        int64_t now = av_gettime_relative();
+        if (ctx->max_latency && ((now - ctx->stats_start) >= AV_TIME_BASE)) {
+            SPGenericData entries[] = {
+                D_TYPE("dropped_late", NULL, ctx->dropped_late),
+                D_TYPE("lag", NULL, ctx->lag),
+                { 0 },
+            };
+            sp_eventlist_dispatch(ctx, ctx->events, SP_EVENT_ON_STATS, entries);
+            ctx->stats_start = now;
+        }
+
         pthread_mutex_unlock(&ctx->lock);
         pthread_mutex_lock(&ctx->lock);
 
@@ -814,6 +843,13 @@ static int filter_ioctx_ctrl_cb(AVBufferRef *event_ref, void *callback_ctx,
                     sp_frame_fifo_set_max_queued(ctx->in_pads[i]->fifo, len);
             }
         }
+        if ((tmp_val = dict_get(event->opts, "max_latency_ms"))) {
+            long int val = strtol(tmp_val, NULL, 10);
+            if (val < 0)
+                sp_log(ctx, SP_LOG_ERROR, "Invalid maximum latency \"%s\"!\n", tmp_val);
+            else
+                ctx->max_latency = val * 1000;
+        }
         pthread_mutex_unlock(&ctx->lock);
     } else if (event->ctrl & SP_EVENT_CTRL_COMMAND) {
         char result[4096];
@@ -0,0 +1,70 @@
+/*
+ * This file is part of txproto.
+ *
+ * txproto is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * txproto is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with txproto; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <stdatomic.h>
+#include <libavcodec/bsf.h>
+
+#include <libtxproto/fifo_packet.h>
+#include <libtxproto/utils.h>
+#include <libtxproto/log.h>
+#include <libtxproto/demux.h>
+#include <libtxproto/encode.h>
+
+/* Bitstream filter - packets in, packets out */
+typedef struct BSFContext {
+    SPClass *class;
+
+    const char *name;
+    pthread_mutex_t lock;
+
+    int64_t epoch;
+
+    /* Needed to init */
+    const char *filters; /* Same syntax as ffmpeg's -bsf option */
+    AVDictionary *bsf_opts;
+
+    /* Needed to start */
+    AVBufferRef *src_packets;
+    AVBufferRef *dst_packets;
+
+    /* Events */
+    SPBufferList *events;
+
+    /* Internals below */
+    pthread_t bsf_thread;
+    AVBSFContext *bsf;
+    int have_input; /* Input parameters were set by a link */
+    atomic_int flush_pending; /* Drop the filter state before the next packet */
+
+    /* Taken from the input stream, when known */
+    AVRational avg_frame_rate;
+    AVRational sample_aspect_ratio;
+
+    int err;
+} BSFContext;
+
+AVBufferRef *sp_bsf_alloc(void);
+int sp_bsf_init(AVBufferRef *ctx_ref);
+int sp_bsf_ctrl(AVBufferRef *ctx_ref, SPEventType ctrl, void *arg);
+
+/* Set the input parameters from a demuxer stream or an encoder */
+int sp_bsf_connect_demuxer(BSFContext *ctx, DemuxingContext *demux,
+                           int stream_id, const char *stream_desc);
+int sp_bsf_connect_encoder(BSFContext *ctx, EncodingContext *enc);
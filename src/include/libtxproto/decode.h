@@ -36,10 +36,19 @@ typedef struct DecodingContext {
     pthread_mutex_t lock;
 
     int64_t start_pts;
+    int64_t trim_pts; /* Frames before this are dropped after decoding */
     int64_t epoch;
 
     /* Options */
     int low_latency;
+    int thread_count;   /* 0 means one per core */
+    int thread_type;    /* FF_THREAD_FRAME/SLICE, 0 picks based on low_latency */
+    enum AVDiscard skip_loop_filter;
+
+    /* Previews, trading quality for speed */
+    int keyframes_only;
+    int lowres; /* Downscale by 2^lowres, for codecs supporting it */
+    enum AVDiscard skip_idct;
 
     /* Needed to start */
     AVBufferRef *src_packets;
@@ -61,11 +70,16 @@ typedef struct DecodingContext {
     /* Video */
     AVBufferRef *dec_frames_ref;
 
+    /* Stats */
+    int64_t stats_start;
+    int64_t stats_frames;
+    int64_t total_frames;
+
     int err;
 } DecodingContext;
 
 AVBufferRef *sp_decoder_alloc(void);
 int sp_decoder_init(AVBufferRef *ctx_ref);
 int sp_decoding_connect(DecodingContext *dec, DemuxingContext *mux,
-                        int stream_id, char *stream_desc);
+                        int stream_id, const char *stream_desc);
 int sp_decoder_ctrl(AVBufferRef *ctx_ref, enum SPEventType ctrl, void *arg);
@@ -42,7 +42,65 @@ typedef struct DemuxingContext {
     const char *in_format;
     AVDictionary *start_options;
 
-    AVBufferRef **dst_packets; // One per output stream
+    /* Probing, 0 (-1 for fpsprobesize) means lavf's default */
+    int64_t probesize;       /* In bytes */
+    int64_t analyzeduration; /* In microseconds */
+    int fpsprobesize;        /* In frames */
+    char *info_cache;        /* Directory to cache stream info in, for local files */
+    int async_init;          /* Open and probe on a separate thread */
+    pthread_t init_thread;
+    int init_err;
+    char *in_url_copy;
+
+    /* Playlist, played back to back on a single timeline. Each item is opened
+     * and probed in the background while the previous one is playing. */
+    char **playlist; /* NULL-terminated, in_url defaults to the first item */
+    int playlist_loop;
+    int playlist_idx;
+    AVDictionary *item_options; /* start_options, before the first open */
+    pthread_t prefetch_thread;
+    AVFormatContext *next_avf;
+    int next_idx;
+    int next_err;
+    AVRational *stream_tb;  /* Of the first item, everything is rescaled to these */
+    int64_t timeline_start; /* Start time of the first item */
+    int64_t item_offset;    /* Where the current item starts on the timeline */
+    int64_t item_end;       /* Furthest point reached on the timeline */
+    AVDictionary *io_opts; /* Async or mapped I/O, for local files */
+    struct SPAsyncIO *async_io;
+    struct SPMmapIO *mmap_io;
+
+    AVBufferRef **dst_packets; // One per output stream, only distributes to linked FIFOs
+                               // NULL until linked, unlinked streams are discarded
+    atomic_int discard_update;
+
+    /* Read-ahead budget, shared by all streams, 0 means no limit */
+    int64_t queue_max_bytes;
+    int64_t queue_max_duration; /* In microseconds */
+    struct DemuxStreamQueue *queues;
+    int64_t queued_bytes;
+
+    /* Release packets at the rate they'd arrive at if live */
+    int realtime;
+    double realtime_speed;
+    int64_t realtime_burst; /* Read without pacing at the start, in microseconds */
+    int64_t rt_start_ts;
+    int64_t rt_start_time;
+    int64_t pacing_jitter;
+
+    /* Range limiting, in microseconds from the start of the input */
+    int64_t start_time;
+    int64_t end_time;
+    int64_t trim_time; /* Packets before this get AV_PKT_FLAG_DISCARD */
+    atomic_int_fast64_t seek_request;
+
+    /* Thumbnailing, only keyframes of video streams are output. With an
+     * interval set, seeks to the next keyframe after it instead of reading
+     * everything in between. */
+    int keyframes_only;
+    int64_t sample_interval; /* In microseconds */
+    int64_t next_sample;
+    int sample_seek_failed;
     AVCodecParameters par;
 
     int err;
@@ -51,3 +109,13 @@ typedef struct DemuxingContext {
 AVBufferRef *sp_demuxer_alloc(void);
 int  sp_demuxer_init(AVBufferRef *ctx_ref);
 int  sp_demuxer_ctrl(AVBufferRef *ctx_ref, SPEventType ctrl, void *arg);
+
+/* Returns the index of a stream given either its ID or a description
+ * ("video=N", "audio=N", "subtitle=N" or a title), or a negative error.
+ * Anyone reading avf->streams afterwards must hold ctx->lock, since a
+ * playlist may switch avf at any time. */
+int  sp_demuxer_find_stream(DemuxingContext *ctx, int stream_id, const char *stream_desc);
+
+/* Returns the FIFO of a stream, creating it and enabling reading the stream
+ * if this is its first user */
+AVBufferRef *sp_demuxer_get_stream_fifo(DemuxingContext *ctx, int idx);
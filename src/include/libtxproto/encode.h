@@ -81,9 +81,26 @@ typedef struct EncodingContext {
     int waiting_eof;
     int attach_sidedata;
 
+    /* Runtime changes, may be set from any thread, applied on the next frame */
+    atomic_int_fast64_t pending_bitrate;
+    atomic_int_fast64_t pending_maxrate;
+    atomic_int_fast64_t pending_bufsize;
+    atomic_int force_keyframe;
+    int rc_live; /* Codec reconfigures its rate control in-place */
+
+    /* Late frame dropping */
+    int64_t max_latency; /* In microseconds, 0 to disable */
+    int64_t dropped_late;
+    int64_t lag;
+    int64_t stats_start;
+
     int err;
 } EncodingContext;
 
 AVBufferRef *sp_encoder_alloc(void);
 int sp_encoder_init(AVBufferRef *ctx_ref);
 int sp_encoder_ctrl(AVBufferRef *ctx_ref, SPEventType ctrl, void *arg);
+
+/* Request a new target bitrate, returns AVERROR(ENOTSUP) if the codec
+ * cannot change it without being reinitialized */
+int sp_encoder_set_bitrate(EncodingContext *ctx, int64_t bit_rate);
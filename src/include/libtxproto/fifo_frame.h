@@ -38,8 +38,11 @@ AVBufferRef *RENAME(fifo_ref)(AVBufferRef *src, int max_queued, FNAME block_flag
 
 /* Query */
 int RENAME(fifo_is_full)(AVBufferRef *src);
+int RENAME(fifo_would_block)(AVBufferRef *dst); /* Pushing, including to mirrors */
+int RENAME(fifo_would_overflow)(AVBufferRef *dst); /* Same, but also if it would be refused */
 int RENAME(fifo_get_size)(AVBufferRef *src);
 int RENAME(fifo_get_max_size)(AVBufferRef *src);
+int64_t RENAME(fifo_get_refused)(AVBufferRef *src); /* Pushes refused for being full */
 
 /* Modify */
 void RENAME(fifo_set_max_queued)(AVBufferRef *dst, int max_queued);
@@ -55,6 +58,7 @@ int RENAME(fifo_unmirror_all)(AVBufferRef *dst);
 int   RENAME(fifo_push)(AVBufferRef *dst, TYPE *in);
 TYPE *RENAME(fifo_pop)(AVBufferRef *src);
 int   RENAME(fifo_pop_flags)(AVBufferRef *src, TYPE **ret, FNAME flags);
+int   RENAME(fifo_pop_timed)(AVBufferRef *src, TYPE **ret, int64_t deadline); /* av_gettime(), AVERROR(EAGAIN) once past */
 TYPE *RENAME(fifo_peek)(AVBufferRef *src);
 
 #undef TYPE
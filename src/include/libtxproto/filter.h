@@ -59,6 +59,12 @@ typedef struct FilterContext {
     int dump_graph;
     int fifo_size;
 
+    /* Late frame dropping */
+    int64_t max_latency; /* In microseconds, 0 to disable */
+    int64_t dropped_late;
+    int64_t lag;
+    int64_t stats_start;
+
     /* Derived from input device reference */
     enum AVHWDeviceType device_type;
     AVBufferRef *hw_device_ref;
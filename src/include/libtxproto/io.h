@@ -69,6 +69,9 @@ typedef struct IOSysEntry {
     /* Input/output FIFO */
     AVBufferRef *frames;
 
+    /* Input packet FIFO, for sinks which take packets rather than frames */
+    AVBufferRef *packets;
+
     /* Command interface */
     int (*ctrl)(AVBufferRef *entry, SPEventType ctrl, void *arg);
     SPBufferList *events;
@@ -24,11 +24,25 @@
 #include "encode.h"
 #include "log.h"
 
+/* Statistics of a single output stream, over the last second unless noted */
+typedef struct SPMuxerStreamStats {
+    char *name;          /* Of its source, owned by the copied out stats */
+    int stream_index;
+    int64_t bitrate;     /* In bits per second */
+    int64_t packet_rate; /* In packets per second */
+    int64_t latency_avg; /* From capture to being written, in microseconds */
+    int64_t latency_max;
+    int64_t queue_time;  /* Average time spent in the muxer, in microseconds */
+    int64_t bytes;       /* Total written */
+    int64_t packets;     /* Total written */
+} SPMuxerStreamStats;
+
 typedef struct MuxingContext {
     SPClass *class;
 
     const char *name;
     pthread_mutex_t lock;
+    pthread_mutex_t stats_lock; /* For the published stream stats only */
 
     AVFormatContext *avf;
     pthread_t muxing_thread;
@@ -39,9 +53,45 @@ typedef struct MuxingContext {
     int64_t epoch;
     const char *out_url;
     const char *out_format;
-    int low_latency;
+    AVDictionary *io_opts; /* Async I/O for local files, or paced network output */
+    struct SPAsyncIO *async_io;
+    struct SPPacedIO *paced_io;
+    int low_latency; /* Packets are written as they come, without interleaving */
+    int64_t max_interleave_delta; /* In microseconds, 0 to wait for all streams */
     int dump_info;
     char *dump_sdp_file;
+    char *copy_bsf[AVMEDIA_TYPE_NB]; /* Bitstream filters for copied streams */
+
+    /* Adaptive bitrate, driven by the output rate and input queue depth */
+    int abr;
+    int64_t abr_min_bitrate; /* 0 means 1/10th of the initial bitrate */
+    int64_t abr_max_bitrate; /* 0 means the initial bitrate */
+    int64_t abr_reaction_time;
+
+    /* Replay buffer, keeps the last packets in memory instead of writing
+     * them out, until a dump into a new file is requested */
+    int64_t replay_duration; /* In microseconds, 0 disables */
+    int64_t replay_max_bytes;
+    struct SPReplayRing *replay;
+    pthread_t replay_dump_thread;
+    atomic_int replay_dumping;
+
+    /* Segmented output, out_url is then a template with a %d for the segment
+     * number. New segments start on keyframes once either limit is reached. */
+    int64_t segment_duration; /* In microseconds, 0 for no limit */
+    int64_t segment_size;     /* In bytes, 0 for no limit */
+    int segment_idx;          /* Of the current segment, the first one if set before init */
+    struct MuxSegmenter *segmenter;
+
+    /* Reconnect on output errors, holding back packets in the meantime */
+    int reconnect;
+    int reconnect_max_attempts;     /* 0 means forever */
+    int64_t reconnect_delay_max;    /* In microseconds */
+    int64_t reconnect_buffer;       /* In microseconds */
+    int64_t reconnect_buffer_bytes;
+
+    /* Streams and options before the header, to open the output again */
+    AVFormatContext *avf_template;
 
     AVBufferRef *src_packets;
 
@@ -57,5 +107,12 @@ typedef struct MuxingContext {
 
 AVBufferRef *sp_muxer_alloc(void);
 int  sp_muxer_init(AVBufferRef *ctx_ref);
-int  sp_muxer_add_stream(MuxingContext *ctx, EncodingContext *enc);
+/* Source may be an encoder, a bitstream filter, or a demuxer with src_stream
+ * being the stream index to copy */
+int  sp_muxer_add_stream(MuxingContext *ctx, AVBufferRef *src_ref, int src_stream);
 int  sp_muxer_ctrl(AVBufferRef *ctx_ref, SPEventType ctrl, void *arg);
+
+/* Copies out the latest stats of all streams, without waiting on muxing.
+ * The array must be freed with sp_muxer_stream_stats_free(). */
+int  sp_muxer_stream_stats(MuxingContext *ctx, SPMuxerStreamStats **stats, int *nb_stats);
+void sp_muxer_stream_stats_free(SPMuxerStreamStats **stats, int nb_stats);
@@ -18,8 +18,10 @@
 
 #pragma once
 
+#include <libavcodec/packet.h>
 #include <libavutil/buffer.h>
 #include <libavutil/dict.h>
+#include <libavutil/frame.h>
 #include <libavutil/hwcontext.h>
 
 typedef struct TXMainContext TXMainContext;
@@ -59,6 +61,14 @@ AVBufferRef *tx_encoder_create(
     AVDictionary *init_opts
 );
 
+AVBufferRef *tx_bsf_create(
+    TXMainContext *ctx,
+    const char *filters,
+    const char *name,
+    AVDictionary *options,
+    AVDictionary *init_opts
+);
+
 AVBufferRef *tx_muxer_create(
     TXMainContext *ctx,
     const char *out_url,
@@ -67,6 +77,64 @@ AVBufferRef *tx_muxer_create(
     AVDictionary *init_opts
 );
 
+AVBufferRef *tx_rawcap_sink_create(
+    TXMainContext *ctx,
+    const char *path,
+    enum AVMediaType type,
+    AVDictionary *options
+);
+
+/* Creates a sink which hands every frame, or with packet_cb set instead of
+ * frame_cb, every packet, to a callback running on a thread of its own.
+ * The callback owns the reference it gets, and gets NULL at the end.
+ * The "fifo_size" option sets the queue depth, and "drop" what to do once
+ * it's full: "newest", "oldest" or "none" to make upstream wait. */
+AVBufferRef *tx_sink_create(
+    TXMainContext *ctx,
+    enum AVMediaType type,
+    int (*frame_cb)(AVFrame *frame, void *userdata),
+    int (*packet_cb)(AVPacket *pkt, void *userdata),
+    void *userdata,
+    AVDictionary *options
+);
+
+AVBufferRef *tx_shm_sink_create(
+    TXMainContext *ctx,
+    const char *name,
+    enum AVMediaType type,
+    AVDictionary *options
+);
+
+typedef struct TXSourceParams {
+    const char *name;
+    enum AVMediaType type;
+    AVRational time_base;  /* Of the pushed frames */
+    AVRational frame_rate; /* Optional */
+    int fifo_size;         /* Frames queued before pushing waits, 0 for the default */
+} TXSourceParams;
+
+/* Creates a source which the application pushes frames into, which can be
+ * linked to filters and encoders. */
+AVBufferRef *tx_source_create(
+    TXMainContext *ctx,
+    const TXSourceParams *params
+);
+
+/* Pushes a new reference to the frame, or NULL to end the stream. Waits for
+ * space for up to timeout microseconds, or forever if negative, and returns
+ * AVERROR(EAGAIN) if there was none. Frames without a pts are timestamped. */
+int tx_source_push(
+    AVBufferRef *source,
+    AVFrame *frame,
+    int64_t timeout
+);
+
+/* Same as tx_source_push(), but never waits */
+int tx_source_try_push(
+    AVBufferRef *source,
+    AVFrame *frame
+);
+
 AVBufferRef *tx_filtergraph_create(
     TXMainContext *ctx,
     const char *graph,
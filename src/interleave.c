@@ -0,0 +1,204 @@
+/*
+ * This file is part of txproto.
+ *
+ * txproto is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * txproto is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with txproto; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <libavutil/mem.h>
+#include <libavutil/mathematics.h>
+#include <libavutil/time.h>
+
+#include <libtxproto/utils.h>
+#include "interleave.h"
+
+typedef struct InterleaveEntry {
+    AVPacket *pkt;
+    int64_t ts;      /* In AV_TIME_BASE */
+    int64_t arrival; /* Wall clock time it was pushed */
+    uint64_t seq;    /* Keeps packets with identical timestamps in order */
+} InterleaveEntry;
+
+struct SPInterleaver {
+    InterleaveEntry *heap;
+    int nb;
+    int size;
+    uint64_t seq;
+
+    int64_t *last_ts; /* Latest timestamp seen, per stream */
+    int nb_streams;
+    int64_t max_ts;
+
+    int64_t max_delta;
+};
+
+static int entry_before(const InterleaveEntry *a, const InterleaveEntry *b)
+{
+    if (a->ts != b->ts)
+        return a->ts < b->ts;
+    return a->seq < b->seq;
+}
+
+static void sift_up(SPInterleaver *s, int i)
+{
+    InterleaveEntry e = s->heap[i];
+
+    while (i) {
+        int parent = (i - 1) >> 1;
+        if (!entry_before(&e, &s->heap[parent]))
+            break;
+        s->heap[i] = s->heap[parent];
+        i = parent;
+    }
+
+    s->heap[i] = e;
+}
+
+static void sift_down(SPInterleaver *s, int i)
+{
+    InterleaveEntry e = s->heap[i];
+
+    while (1) {
+        int child = (i << 1) + 1;
+        if (child >= s->nb)
+            break;
+        if ((child + 1 < s->nb) && entry_before(&s->heap[child + 1], &s->heap[child]))
+            child++;
+        if (!entry_before(&s->heap[child], &e))
+            break;
+        s->heap[i] = s->heap[child];
+        i = child;
+    }
+
+    s->heap[i] = e;
+}
+
+SPInterleaver *sp_interleaver_alloc(int nb_streams, int64_t max_delta)
+{
+    SPInterleaver *s = av_mallocz(sizeof(*s));
+    if (!s)
+        return NULL;
+
+    s->last_ts = av_malloc_array(nb_streams, sizeof(*s->last_ts));
+    if (!s->last_ts) {
+        av_free(s);
+        return NULL;
+    }
+
+    for (int i = 0; i < nb_streams; i++)
+        s->last_ts[i] = AV_NOPTS_VALUE;
+
+    s->nb_streams = nb_streams;
+    s->max_ts = AV_NOPTS_VALUE;
+    s->max_delta = max_delta;
+
+    return s;
+}
+
+int sp_interleaver_push(SPInterleaver *s, AVPacket *pkt)
+{
+    if (s->nb == s->size) {
+        int new_size = s->size ? s->size << 1 : 64;
+        InterleaveEntry *heap = av_realloc_array(s->heap, new_size, sizeof(*heap));
+        if (!heap)
+            return AVERROR(ENOMEM);
+        s->heap = heap;
+        s->size = new_size;
+    }
+
+    int64_t ts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+    if (ts != AV_NOPTS_VALUE)
+        ts = av_rescale_q(ts, pkt->time_base, AV_TIME_BASE_Q);
+    else /* Nothing to order it by, keep it where it arrived */
+        ts = s->max_ts != AV_NOPTS_VALUE ? s->max_ts : 0;
+
+    if ((pkt->stream_index >= 0) && (pkt->stream_index < s->nb_streams))
+        s->last_ts[pkt->stream_index] = ts;
+    if ((s->max_ts == AV_NOPTS_VALUE) || (ts > s->max_ts))
+        s->max_ts = ts;
+
+    s->heap[s->nb] = (InterleaveEntry){
+        .pkt = pkt,
+        .ts = ts,
+        .arrival = av_gettime_relative(),
+        .seq = s->seq++,
+    };
+    sift_up(s, s->nb++);
+
+    return 0;
+}
+
+AVPacket *sp_interleaver_pop(SPInterleaver *s, int flush, int64_t *arrival)
+{
+    if (!s->nb)
+        return NULL;
+
+    InterleaveEntry *top = &s->heap[0];
+
+    int ready = 1;
+    for (int i = 0; i < s->nb_streams; i++) {
+        if ((s->last_ts[i] == AV_NOPTS_VALUE) || (s->last_ts[i] < top->ts)) {
+            ready = 0;
+            break;
+        }
+    }
+
+    if (!ready && s->max_delta)
+        ready = ((s->max_ts - top->ts) > s->max_delta) ||
+                ((av_gettime_relative() - top->arrival) > s->max_delta);
+
+    if (!ready && !flush)
+        return NULL;
+
+    AVPacket *pkt = top->pkt;
+    *arrival = top->arrival;
+    s->heap[0] = s->heap[--s->nb];
+    if (s->nb)
+        sift_down(s, 0);
+
+    return pkt;
+}
+
+int64_t sp_interleaver_timeout(SPInterleaver *s)
+{
+    if (!s->nb || !s->max_delta)
+        return -1;
+
+    int64_t left = s->heap[0].arrival + s->max_delta - av_gettime_relative();
+    return SPMAX(left, 0) + 1;
+}
+
+int sp_interleaver_queued(SPInterleaver *s)
+{
+    return s->nb;
+}
+
+int64_t sp_interleaver_delay(SPInterleaver *s)
+{
+    return s->nb ? s->max_ts - s->heap[0].ts : 0;
+}
+
+void sp_interleaver_free(SPInterleaver **s_ptr)
+{
+    SPInterleaver *s = *s_ptr;
+    if (!s)
+        return;
+
+    for (int i = 0; i < s->nb; i++)
+        av_packet_free(&s->heap[i].pkt);
+
+    av_free(s->heap);
+    av_free(s->last_ts);
+    av_freep(s_ptr);
+}
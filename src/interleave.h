@@ -0,0 +1,49 @@
+/*
+ * This file is part of txproto.
+ *
+ * txproto is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * txproto is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with txproto; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <libavcodec/packet.h>
+
+/* Orders packets from all streams of an output by their decoding timestamp,
+ * using a min-heap. A packet is released once every stream has had a packet
+ * at least as late, or once it has waited for longer than the latency budget,
+ * either in timestamps or in real time, so a late or sparse stream can never
+ * hold back the others indefinitely. Not thread-safe. */
+typedef struct SPInterleaver SPInterleaver;
+
+/* max_delta is the latency budget, in microseconds, 0 to wait indefinitely */
+SPInterleaver *sp_interleaver_alloc(int nb_streams, int64_t max_delta);
+
+/* Takes ownership of the packet, which must have a time base set */
+int sp_interleaver_push(SPInterleaver *s, AVPacket *pkt);
+
+/* Returns the next packet to write, or NULL if none is ready yet. When
+ * flushing, every queued packet is returned. arrival is set to the time the
+ * packet was pushed. */
+AVPacket *sp_interleaver_pop(SPInterleaver *s, int flush, int64_t *arrival);
+
+/* Time left, in microseconds, until the next packet gets released regardless
+ * of the other streams, or -1 if never */
+int64_t sp_interleaver_timeout(SPInterleaver *s);
+
+/* Number of queued packets, and the span of their timestamps */
+int sp_interleaver_queued(SPInterleaver *s);
+int64_t sp_interleaver_delay(SPInterleaver *s);
+
+void sp_interleaver_free(SPInterleaver **s);
@@ -63,6 +63,8 @@ const char *sp_iosys_entry_type_string(enum IOType type)
     return io_type_map[type];
 }
 
+extern const IOSysAPI src_rawcap;
+
 #ifdef HAVE_LAVD
 extern const IOSysAPI src_lavd;
 #endif
@@ -79,6 +81,10 @@ extern const IOSysAPI src_xcb;
 extern const IOSysAPI src_wayland;
 #endif
 
+#ifdef HAVE_SHM_RING
+extern const IOSysAPI src_shm;
+#endif
+
 const IOSysAPI *sp_compiled_apis[] = {
 #ifdef HAVE_LAVD
     &src_lavd,
@@ -92,6 +98,10 @@ const IOSysAPI *sp_compiled_apis[] = {
 #ifdef HAVE_XCB
     &src_xcb,
 #endif
+#ifdef HAVE_SHM_RING
+    &src_shm,
+#endif
+    &src_rawcap,
 };
 
 const int sp_compiled_apis_len = SP_ARRAY_ELEMS(sp_compiled_apis);
@@ -0,0 +1,1171 @@
+/*
+ * This file is part of txproto.
+ *
+ * txproto is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * txproto is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with txproto; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <libavutil/avstring.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/crc.h>
+#include <libavutil/hwcontext.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/time.h>
+
+#include "iosys_common.h"
+#include <libtxproto/utils.h>
+#include <libtxproto/log.h>
+#include "ctrl_template.h"
+#include "os_compat.h"
+#include "rawcap.h"
+
+const IOSysAPI src_rawcap;
+
+/* Files are looked for in this directory */
+#define RAWCAP_DIR_ENV "TXPROTO_RAWCAP_DIR"
+
+/* Size of the mapped window frames get written through */
+#define MAP_WINDOW (64 << 20)
+
+static int64_t frame_bytes(const RawCapHeader *hdr, int nb_samples)
+{
+    if (hdr->media_type == AVMEDIA_TYPE_VIDEO)
+        return av_image_get_buffer_size(av_get_pix_fmt(hdr->format),
+                                        hdr->width, hdr->height, RAWCAP_LINE_ALIGN);
+    return av_samples_get_buffer_size(NULL, hdr->channels, nb_samples,
+                                      av_get_sample_fmt(hdr->format), RAWCAP_LINE_ALIGN);
+}
+
+/* Sink */
+typedef struct RawCapSink {
+    char *path;
+    int fd;
+    int direct;
+
+    int64_t prealloc;
+    int64_t allocated; /* Size of the file */
+    int64_t pos;       /* Where the next frame goes */
+
+    uint8_t *map;
+    int64_t map_start;
+    int64_t map_size;
+
+    uint8_t *bounce; /* Aligned, for O_DIRECT */
+    int64_t bounce_size;
+
+    RawCapHeader hdr;
+    int have_format;
+    uint8_t **planes;
+
+    RawCapIndexEntry *index;
+    int nb_index;
+    int index_alloc;
+
+    pthread_t thread;
+
+    /* Stats */
+    int64_t bytes;
+    int64_t stats_start;
+    int64_t stats_bytes;
+} RawCapSink;
+
+static int sink_reserve(RawCapSink *s, int64_t end)
+{
+    if (end <= s->allocated)
+        return 0;
+
+    int64_t new_size = s->allocated + SPMAX(s->prealloc, end - s->allocated);
+    new_size = FFALIGN(new_size, RAWCAP_ALIGN);
+
+    int err = posix_fallocate(s->fd, s->allocated, new_size - s->allocated);
+    if (err)
+        return AVERROR(err);
+
+    s->allocated = new_size;
+
+    return 0;
+}
+
+/* Returns where a block at off can be written to, either the mapping or the
+ * bounce buffer */
+static uint8_t *sink_get_dst(RawCapSink *s, int64_t off, int64_t size)
+{
+    if (s->direct) {
+        if (size > s->bounce_size) {
+            free(s->bounce);
+            s->bounce = NULL;
+            s->bounce_size = 0;
+            if (posix_memalign((void **)&s->bounce, RAWCAP_ALIGN, size))
+                return NULL;
+            s->bounce_size = size;
+        }
+        return s->bounce;
+    }
+
+    if (s->map && (off >= s->map_start) &&
+        ((off + size) <= (s->map_start + s->map_size)))
+        return s->map + (off - s->map_start);
+
+    if (s->map)
+        munmap(s->map, s->map_size);
+    s->map = NULL;
+
+    int64_t page = sysconf(_SC_PAGESIZE);
+    int64_t start = off & ~(page - 1);
+    int64_t map_size = SPMIN(SPMAX(MAP_WINDOW, off + size - start), s->allocated - start);
+
+    uint8_t *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, start);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    s->map = map;
+    s->map_start = start;
+    s->map_size = map_size;
+
+    return s->map + (off - s->map_start);
+}
+
+static int sink_put(RawCapSink *s, int64_t off, int64_t size)
+{
+    if (!s->direct)
+        return 0;
+
+    int64_t done = 0;
+    while (done < size) {
+        ssize_t ret = pwrite(s->fd, s->bounce + done, size - done, off + done);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        else if (ret < 0)
+            return AVERROR(errno);
+        done += ret;
+    }
+
+    return 0;
+}
+
+/* Writes a block outside of the frame area */
+static int sink_write_block(RawCapSink *s, int64_t off, const void *data, int64_t size)
+{
+    int64_t slot = FFALIGN(size, RAWCAP_ALIGN);
+
+    int err = sink_reserve(s, off + slot);
+    if (err < 0)
+        return err;
+
+    uint8_t *dst = sink_get_dst(s, off, slot);
+    if (!dst)
+        return AVERROR(errno ? errno : ENOMEM);
+
+    memcpy(dst, data, size);
+    memset(dst + size, 0, slot - size);
+
+    return sink_put(s, off, slot);
+}
+
+static int sink_set_format(IOSysEntry *entry, RawCapSink *s, AVFrame *f)
+{
+    RawCapHeader *hdr = &s->hdr;
+    FormatExtraData *fe = f->opaque_ref ? (FormatExtraData *)f->opaque_ref->data : NULL;
+
+    memcpy(hdr->magic, RAWCAP_MAGIC, sizeof(hdr->magic));
+    hdr->version = RAWCAP_VERSION;
+
+    AVRational tb = fe ? fe->time_base : f->time_base;
+    if (!tb.num || !tb.den)
+        tb = AV_TIME_BASE_Q;
+    hdr->tb_num = tb.num;
+    hdr->tb_den = tb.den;
+    if (fe) {
+        hdr->fr_num = fe->avg_frame_rate.num;
+        hdr->fr_den = fe->avg_frame_rate.den;
+    }
+
+    if (hdr->media_type == AVMEDIA_TYPE_VIDEO) {
+        av_strlcpy(hdr->format, av_get_pix_fmt_name(f->format), sizeof(hdr->format));
+        hdr->width = f->width;
+        hdr->height = f->height;
+        sp_log(entry, SP_LOG_VERBOSE, "Capturing %ix%i %s frames to %s\n",
+               f->width, f->height, hdr->format, s->path);
+    } else {
+        av_strlcpy(hdr->format, av_get_sample_fmt_name(f->format), sizeof(hdr->format));
+        hdr->sample_rate = f->sample_rate;
+        hdr->channels = f->ch_layout.nb_channels;
+        av_channel_layout_describe(&f->ch_layout, hdr->ch_layout, sizeof(hdr->ch_layout));
+
+        s->planes = av_calloc(hdr->channels, sizeof(*s->planes));
+        if (!s->planes)
+            return AVERROR(ENOMEM);
+
+        sp_log(entry, SP_LOG_VERBOSE, "Capturing %i Hz %s %s audio to %s\n",
+               f->sample_rate, hdr->ch_layout, hdr->format, s->path);
+    }
+
+    s->have_format = 1;
+
+    /* Until finished, the file is marked as such by a zero index offset */
+    int err = sink_write_block(s, 0, hdr, sizeof(*hdr));
+    if (err < 0)
+        return err;
+
+    s->pos = RAWCAP_ALIGN;
+
+    return 0;
+}
+
+static int sink_format_changed(RawCapSink *s, AVFrame *f)
+{
+    RawCapHeader *hdr = &s->hdr;
+
+    if (hdr->media_type == AVMEDIA_TYPE_VIDEO)
+        return (f->width != hdr->width) || (f->height != hdr->height) ||
+               (f->format != av_get_pix_fmt(hdr->format));
+
+    return (f->sample_rate != hdr->sample_rate) ||
+           (f->ch_layout.nb_channels != hdr->channels) ||
+           (f->format != av_get_sample_fmt(hdr->format));
+}
+
+static int sink_write_frame(IOSysEntry *entry, RawCapSink *s, AVFrame *f)
+{
+    int err;
+    AVFrame *sw = NULL;
+
+    if (f->hw_frames_ctx) {
+        sw = av_frame_alloc();
+        if (!sw)
+            return AVERROR(ENOMEM);
+
+        err = av_hwframe_transfer_data(sw, f, 0);
+        if (err < 0) {
+            sp_log(entry, SP_LOG_ERROR, "Unable to download frame: %s!\n", av_err2str(err));
+            av_frame_free(&sw);
+            return err;
+        }
+
+        av_frame_copy_props(sw, f);
+        f = sw;
+    }
+
+    if (!s->have_format) {
+        err = sink_set_format(entry, s, f);
+        if (err < 0)
+            goto end;
+    } else if (sink_format_changed(s, f)) {
+        sp_log(entry, SP_LOG_WARN, "Frame format changed, dropping frame!\n");
+        err = 0;
+        goto end;
+    }
+
+    if (s->nb_index == s->index_alloc) {
+        int new_alloc = s->index_alloc ? s->index_alloc << 1 : 1024;
+        RawCapIndexEntry *index = av_realloc_array(s->index, new_alloc, sizeof(*index));
+        if (!index) {
+            err = AVERROR(ENOMEM);
+            goto end;
+        }
+        s->index = index;
+        s->index_alloc = new_alloc;
+    }
+
+    int64_t size = frame_bytes(&s->hdr, f->nb_samples);
+    if (size < 0) {
+        err = size;
+        goto end;
+    }
+    int64_t slot = FFALIGN(size, RAWCAP_ALIGN);
+
+    err = sink_reserve(s, s->pos + slot);
+    if (err < 0) {
+        sp_log(entry, SP_LOG_ERROR, "Unable to preallocate %s: %s!\n", s->path, av_err2str(err));
+        goto end;
+    }
+
+    uint8_t *dst = sink_get_dst(s, s->pos, slot);
+    if (!dst) {
+        err = AVERROR(errno ? errno : ENOMEM);
+        goto end;
+    }
+
+    if (s->hdr.media_type == AVMEDIA_TYPE_VIDEO) {
+        err = av_image_copy_to_buffer(dst, size, (const uint8_t * const *)f->data,
+                                      f->linesize, f->format, f->width, f->height,
+                                      RAWCAP_LINE_ALIGN);
+    } else {
+        err = av_samples_fill_arrays(s->planes, NULL, dst, s->hdr.channels, f->nb_samples,
+                                     f->format, RAWCAP_LINE_ALIGN);
+        if (err >= 0)
+            err = av_samples_copy(s->planes, f->extended_data, 0, 0, f->nb_samples,
+                                  s->hdr.channels, f->format);
+    }
+    if (err < 0)
+        goto end;
+
+    err = sink_put(s, s->pos, slot);
+    if (err < 0) {
+        sp_log(entry, SP_LOG_ERROR, "Unable to write to %s: %s!\n", s->path, av_err2str(err));
+        goto end;
+    }
+
+    s->index[s->nb_index++] = (RawCapIndexEntry){
+        .pts = f->pts,
+        .offset = s->pos,
+        .size = size,
+        .nb_samples = s->hdr.media_type == AVMEDIA_TYPE_AUDIO ? f->nb_samples : 0,
+    };
+
+    s->pos += slot;
+    s->bytes += size;
+    s->stats_bytes += size;
+    err = 0;
+
+end:
+    av_frame_free(&sw);
+    return err;
+}
+
+/* Writes out the index and the final header */
+static int sink_finish(IOSysEntry *entry, RawCapSink *s)
+{
+    int err;
+
+    if (s->map)
+        munmap(s->map, s->map_size);
+    s->map = NULL;
+
+    if (!s->have_format) {
+        sp_log(entry, SP_LOG_WARN, "Nothing was captured to %s!\n", s->path);
+        return ftruncate(s->fd, 0) ? AVERROR(errno) : 0;
+    }
+
+    s->hdr.nb_frames = s->nb_index;
+    s->hdr.index_offset = s->pos;
+
+    err = sink_write_block(s, s->pos, s->index, s->nb_index * sizeof(*s->index));
+    if (err < 0)
+        goto fail;
+
+    int64_t end = s->pos + FFALIGN(s->nb_index * sizeof(*s->index), RAWCAP_ALIGN);
+
+    err = sink_write_block(s, 0, &s->hdr, sizeof(s->hdr));
+    if (err < 0)
+        goto fail;
+
+    if (s->map)
+        munmap(s->map, s->map_size);
+    s->map = NULL;
+
+    /* Drop what's left of the preallocation */
+    if (ftruncate(s->fd, end) || fdatasync(s->fd)) {
+        err = AVERROR(errno);
+        goto fail;
+    }
+
+    sp_log(entry, SP_LOG_VERBOSE, "Finished %s, %i frames, %" PRIi64 " bytes\n",
+           s->path, s->nb_index, end);
+
+    return 0;
+
+fail:
+    sp_log(entry, SP_LOG_ERROR, "Unable to finish %s: %s!\n", s->path, av_err2str(err));
+    return err;
+}
+
+static void *rawcap_sink_thread(void *arg)
+{
+    int err = 0;
+    IOSysEntry *entry = arg;
+    RawCapSink *s = entry->io_priv;
+
+    sp_set_thread_name_self(sp_class_get_name(entry));
+
+    sp_eventlist_dispatch(entry, entry->events, SP_EVENT_ON_INIT, NULL);
+
+    s->stats_start = av_gettime_relative();
+
+    while (1) {
+        AVFrame *f = sp_frame_fifo_pop(entry->frames);
+        if (!f)
+            break;
+
+        err = sink_write_frame(entry, s, f);
+        av_frame_free(&f);
+        if (err < 0)
+            break;
+
+        int64_t now = av_gettime_relative();
+        if ((now - s->stats_start) >= AV_TIME_BASE) {
+            int64_t rate = av_rescale(s->stats_bytes, AV_TIME_BASE, now - s->stats_start);
+            int64_t frames = s->nb_index;
+            SPGenericData entries[] = {
+                D_TYPE("write_rate", NULL, rate),
+                D_TYPE("bytes", NULL, s->bytes),
+                D_TYPE("frames", NULL, frames),
+                { 0 },
+            };
+            sp_eventlist_dispatch(entry, entry->events, SP_EVENT_ON_STATS, entries);
+            s->stats_start = now;
+            s->stats_bytes = 0;
+        }
+    }
+
+    int ret = sink_finish(entry, s);
+    if (!err)
+        err = ret;
+
+    sp_eventlist_dispatch(entry, entry->events, SP_EVENT_ON_EOS, &err);
+
+    return NULL;
+}
+
+static int rawcap_sink_ctrl_cb(AVBufferRef *event_ref, void *callback_ctx, void *ctx,
+                               void *dep_ctx, void *data)
+{
+    SPCtrlTemplateCbCtx *event = callback_ctx;
+
+    IOSysEntry *entry = ctx;
+    RawCapSink *s = entry->io_priv;
+
+    if (event->ctrl & SP_EVENT_CTRL_START) {
+        if (!sp_eventlist_has_dispatched(entry->events, SP_EVENT_ON_CONFIG)) {
+            int ret = sp_eventlist_dispatch(entry, entry->events, SP_EVENT_ON_CONFIG, NULL);
+            if (ret < 0)
+                return ret;
+        }
+        if (!s->thread)
+            pthread_create(&s->thread, NULL, rawcap_sink_thread, entry);
+    } else if (event->ctrl & SP_EVENT_CTRL_STOP) {
+        if (s->thread) {
+            sp_frame_fifo_push(entry->frames, NULL);
+            pthread_join(s->thread, NULL);
+            s->thread = 0;
+        }
+    } else if (event->ctrl & SP_EVENT_CTRL_OPTS) {
+        const char *tmp_val = NULL;
+        if ((tmp_val = dict_get(event->opts, "fifo_size"))) {
+            long int len = strtol(tmp_val, NULL, 10);
+            if (len < 0)
+                sp_log(entry, SP_LOG_ERROR, "Invalid fifo size \"%s\"!\n", tmp_val);
+            else
+                sp_frame_fifo_set_max_queued(entry->frames, len);
+        }
+    } else {
+        return AVERROR(ENOTSUP);
+    }
+
+    return 0;
+}
+
+static int rawcap_sink_ctrl(AVBufferRef *entry, SPEventType ctrl, void *arg)
+{
+    IOSysEntry *iosys_entry = (IOSysEntry *)entry->data;
+    return sp_ctrl_template(iosys_entry, iosys_entry->events, 0x0,
+                            rawcap_sink_ctrl_cb, ctrl, arg);
+}
+
+static void destroy_sink(void *opaque, uint8_t *data)
+{
+    IOSysEntry *entry = (IOSysEntry *)data;
+    RawCapSink *s = entry->io_priv;
+
+    if (s) {
+        if (s->thread) {
+            sp_frame_fifo_push(entry->frames, NULL);
+            pthread_join(s->thread, NULL);
+        }
+        if (s->map)
+            munmap(s->map, s->map_size);
+        if (s->fd >= 0)
+            close(s->fd);
+        free(s->bounce);
+        av_free(s->planes);
+        av_free(s->index);
+        av_free(s->path);
+        av_free(s);
+    }
+
+    av_buffer_unref(&entry->frames);
+    sp_bufferlist_free(&entry->events);
+
+    av_free(entry->desc);
+    sp_class_free(entry);
+    av_free(entry);
+}
+
+AVBufferRef *sp_rawcap_sink_create(void *log_ctx, const char *path,
+                                   enum AVMediaType type, AVDictionary *opts)
+{
+    int err;
+    const char *tmp_val;
+
+    if (type != AVMEDIA_TYPE_VIDEO && type != AVMEDIA_TYPE_AUDIO) {
+        sp_log(log_ctx, SP_LOG_ERROR, "Raw capture only supports video and audio!\n");
+        return NULL;
+    }
+
+    IOSysEntry *entry = av_mallocz(sizeof(*entry));
+    if (!entry)
+        return NULL;
+
+    AVBufferRef *entry_ref = av_buffer_create((uint8_t *)entry, sizeof(*entry),
+                                              destroy_sink, NULL, 0);
+    if (!entry_ref) {
+        av_free(entry);
+        return NULL;
+    }
+
+    err = sp_class_alloc(entry, "rawcap",
+                         type == AVMEDIA_TYPE_VIDEO ? SP_TYPE_VIDEO_SINK : SP_TYPE_AUDIO_SINK,
+                         log_ctx);
+    if (err < 0)
+        goto fail;
+
+    RawCapSink *s = av_mallocz(sizeof(*s));
+    if (!s)
+        goto fail;
+    entry->io_priv = s;
+
+    s->fd = -1;
+    s->hdr.media_type = type;
+    s->prealloc = 1LL << 30;
+
+    if ((tmp_val = dict_get(opts, "prealloc"))) {
+        int64_t val = strtoll(tmp_val, NULL, 10);
+        if (val <= 0)
+            sp_log(entry, SP_LOG_ERROR, "Invalid preallocation size \"%s\"!\n", tmp_val);
+        else
+            s->prealloc = val;
+    }
+
+    if ((tmp_val = dict_get(opts, "io"))) {
+        if (!strcmp(tmp_val, "direct")) {
+#ifdef O_DIRECT
+            s->direct = 1;
+#else
+            sp_log(entry, SP_LOG_WARN, "O_DIRECT not available, writing through a mapping!\n");
+#endif
+        } else if (strcmp(tmp_val, "mmap")) {
+            sp_log(entry, SP_LOG_ERROR, "Invalid I/O mode \"%s\"!\n", tmp_val);
+            goto fail;
+        }
+    }
+
+    s->path = av_strdup(path);
+    entry->desc = av_asprintf("Raw capture to %s", path);
+    entry->frames = sp_frame_fifo_create(entry, 64, FRAME_FIFO_BLOCK_NO_INPUT);
+    entry->events = sp_bufferlist_new();
+    entry->ctrl = rawcap_sink_ctrl;
+    if (!s->path || !entry->desc || !entry->frames || !entry->events)
+        goto fail;
+
+    int flags = O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC;
+#ifdef O_DIRECT
+    if (s->direct)
+        flags |= O_DIRECT;
+#endif
+
+    s->fd = open(path, flags, 0644);
+    if (s->fd < 0) {
+        sp_log(entry, SP_LOG_ERROR, "Unable to open %s: %s!\n", path,
+               av_err2str(AVERROR(errno)));
+        goto fail;
+    }
+
+    err = sink_reserve(s, s->prealloc);
+    if (err < 0) {
+        sp_log(entry, SP_LOG_ERROR, "Unable to preallocate %s: %s!\n", path,
+               av_err2str(err));
+        goto fail;
+    }
+
+    if ((tmp_val = dict_get(opts, "fifo_size"))) {
+        long int len = strtol(tmp_val, NULL, 10);
+        if (len < 0)
+            sp_log(entry, SP_LOG_ERROR, "Invalid fifo size \"%s\"!\n", tmp_val);
+        else
+            sp_frame_fifo_set_max_queued(entry->frames, len);
+    }
+
+    return entry_ref;
+
+fail:
+    av_buffer_unref(&entry_ref);
+    return NULL;
+}
+
+/* Reader */
+typedef struct RawCapReader {
+    char *path;
+    RawCapHeader hdr;
+
+    AVBufferRef *map_ref; /* The whole file, frames reference it */
+    const RawCapIndexEntry *index;
+
+    int realtime;
+    int loop;
+
+    int64_t epoch;
+    atomic_int quit;
+    pthread_t thread;
+    int dropped_frames;
+} RawCapReader;
+
+typedef struct RawCapCtx {
+    SPClass *class;
+
+    SPBufferList *events;
+    SPBufferList *entries;
+    char *dir;
+} RawCapCtx;
+
+static int read_header(const char *path, RawCapHeader *hdr)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return AVERROR(errno);
+
+    ssize_t len = pread(fd, hdr, sizeof(*hdr), 0);
+    close(fd);
+
+    if ((len != sizeof(*hdr)) || memcmp(hdr->magic, RAWCAP_MAGIC, sizeof(hdr->magic)) ||
+        (hdr->version != RAWCAP_VERSION))
+        return AVERROR_INVALIDDATA;
+
+    /* Straight from the file */
+    hdr->format[sizeof(hdr->format) - 1] = '\0';
+    hdr->ch_layout[sizeof(hdr->ch_layout) - 1] = '\0';
+
+    /* Unfinished */
+    if (!hdr->index_offset || !hdr->nb_frames)
+        return AVERROR(EAGAIN);
+
+    return 0;
+}
+
+static void unmap_file(void *opaque, uint8_t *data)
+{
+    munmap(data, (size_t)(uintptr_t)opaque);
+}
+
+static void unref_map(void *opaque, uint8_t *data)
+{
+    AVBufferRef *map_ref = opaque;
+    av_buffer_unref(&map_ref);
+}
+
+/* Wraps a stored frame, without copying it */
+static AVFrame *reader_get_frame(RawCapReader *r, const RawCapIndexEntry *e)
+{
+    const RawCapHeader *hdr = &r->hdr;
+    uint8_t *src = r->map_ref->data + e->offset;
+
+    AVFrame *f = av_frame_alloc();
+    if (!f)
+        return NULL;
+
+    AVBufferRef *map_ref = av_buffer_ref(r->map_ref);
+    if (!map_ref)
+        goto fail;
+
+    f->buf[0] = av_buffer_create(src, e->size, unref_map, map_ref, AV_BUFFER_FLAG_READONLY);
+    if (!f->buf[0]) {
+        av_buffer_unref(&map_ref);
+        goto fail;
+    }
+
+    if (hdr->media_type == AVMEDIA_TYPE_VIDEO) {
+        f->format = av_get_pix_fmt(hdr->format);
+        f->width = hdr->width;
+        f->height = hdr->height;
+        if (av_image_fill_arrays(f->data, f->linesize, src, f->format,
+                                 f->width, f->height, RAWCAP_LINE_ALIGN) < 0)
+            goto fail;
+    } else {
+        f->format = av_get_sample_fmt(hdr->format);
+        f->sample_rate = hdr->sample_rate;
+        f->nb_samples = e->nb_samples;
+        if (av_channel_layout_from_string(&f->ch_layout, hdr->ch_layout) < 0)
+            av_channel_layout_default(&f->ch_layout, hdr->channels);
+
+        int planes = av_sample_fmt_is_planar(f->format) ? hdr->channels : 1;
+        if (planes > AV_NUM_DATA_POINTERS) {
+            f->extended_data = av_calloc(planes, sizeof(*f->extended_data));
+            if (!f->extended_data)
+                goto fail;
+        }
+
+        if (av_samples_fill_arrays(f->extended_data, f->linesize, src, hdr->channels,
+                                   f->nb_samples, f->format, RAWCAP_LINE_ALIGN) < 0)
+            goto fail;
+
+        if (f->extended_data != f->data)
+            memcpy(f->data, f->extended_data, sizeof(f->data));
+    }
+
+    return f;
+
+fail:
+    av_frame_free(&f);
+    return NULL;
+}
+
+static void *rawcap_reader_thread(void *arg)
+{
+    int err = 0;
+    IOSysEntry *entry = arg;
+    RawCapReader *r = entry->io_priv;
+    AVRational tb = av_make_q(r->hdr.tb_num, r->hdr.tb_den);
+    int nb = r->hdr.nb_frames;
+
+    sp_set_thread_name_self(sp_class_get_name(entry));
+
+    sp_eventlist_dispatch(entry, entry->events, SP_EVENT_ON_INIT | SP_EVENT_ON_CONFIG, NULL);
+
+    /* One loop is as long as the span of the timestamps, plus a frame */
+    int64_t first_pts = r->index[0].pts;
+    int64_t span = r->index[nb - 1].pts - first_pts;
+    int64_t loop_duration = span + (nb > 1 ? span / (nb - 1) : 1);
+
+    int64_t start = av_gettime_relative();
+    int64_t offset = av_rescale_q(start - r->epoch, AV_TIME_BASE_Q, tb);
+
+    for (int i = 0; !atomic_load(&r->quit); i++) {
+        if (i == nb) {
+            if (!r->loop)
+                break;
+            i = 0;
+            offset += loop_duration;
+        }
+
+        const RawCapIndexEntry *e = &r->index[i];
+        int64_t pts = e->pts - first_pts + offset;
+
+        if (r->realtime)
+            sp_sleep_until(r->epoch + av_rescale_q(pts, tb, AV_TIME_BASE_Q));
+
+        AVFrame *f = reader_get_frame(r, e);
+        if (!f) {
+            err = AVERROR(ENOMEM);
+            break;
+        }
+
+        f->pts = pts;
+        f->opaque_ref = av_buffer_allocz(sizeof(FormatExtraData));
+        if (!f->opaque_ref) {
+            av_frame_free(&f);
+            err = AVERROR(ENOMEM);
+            break;
+        }
+
+        FormatExtraData *fe = (FormatExtraData *)f->opaque_ref->data;
+        fe->time_base = tb;
+        fe->avg_frame_rate = av_make_q(r->hdr.fr_num, r->hdr.fr_den);
+
+        err = sp_frame_fifo_push(entry->frames, f);
+        av_frame_free(&f);
+        if (err == AVERROR(ENOBUFS)) {
+            r->dropped_frames++;
+            sp_log(entry, SP_LOG_WARN, "Dropping frame (%i dropped so far)!\n",
+                   r->dropped_frames);
+
+            SPGenericData entries[] = {
+                D_TYPE("dropped_frames", NULL, r->dropped_frames),
+                { 0 },
+            };
+            sp_eventlist_dispatch(entry, entry->events, SP_EVENT_ON_STATS, entries);
+            err = 0;
+        } else if (err) {
+            sp_log(entry, SP_LOG_ERROR, "Unable to push frame to FIFO: %s!\n",
+                   av_err2str(err));
+            break;
+        }
+    }
+
+    /* EOS */
+    sp_frame_fifo_push(entry->frames, NULL);
+    sp_eventlist_dispatch(entry, entry->events, SP_EVENT_ON_EOS, &err);
+
+    return NULL;
+}
+
+static int rawcap_reader_ctrl_cb(AVBufferRef *event_ref, void *callback_ctx, void *ctx,
+                                 void *dep_ctx, void *data)
+{
+    SPCtrlTemplateCbCtx *event = callback_ctx;
+
+    IOSysEntry *entry = ctx;
+    RawCapReader *r = entry->io_priv;
+
+    if (event->ctrl & SP_EVENT_CTRL_START) {
+        r->epoch = atomic_load(event->epoch);
+        if (!r->thread)
+            pthread_create(&r->thread, NULL, rawcap_reader_thread, entry);
+        return 0;
+    } else if (event->ctrl & SP_EVENT_CTRL_STOP) {
+        if (r->thread) {
+            atomic_store(&r->quit, 1);
+            pthread_join(r->thread, NULL);
+            r->thread = 0;
+        }
+        return 0;
+    } else {
+        return AVERROR(ENOTSUP);
+    }
+}
+
+static int rawcap_reader_ctrl(AVBufferRef *entry, SPEventType ctrl, void *arg)
+{
+    IOSysEntry *iosys_entry = (IOSysEntry *)entry->data;
+    return sp_ctrl_template(iosys_entry, iosys_entry->events, 0x0,
+                            rawcap_reader_ctrl_cb, ctrl, arg);
+}
+
+static int rawcap_init_io(AVBufferRef *ctx_ref, AVBufferRef *entry,
+                          AVDictionary *opts)
+{
+    int err;
+    const char *tmp_val;
+    IOSysEntry *iosys_entry = (IOSysEntry *)entry->data;
+
+    RawCapReader *r = av_mallocz(sizeof(*r));
+    if (!r)
+        return AVERROR(ENOMEM);
+
+    r->path = av_strdup(iosys_entry->api_priv);
+    r->realtime = 1;
+    r->quit = ATOMIC_VAR_INIT(0);
+    if (!r->path) {
+        err = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    if ((tmp_val = dict_get(opts, "realtime")))
+        r->realtime = !strcmp(tmp_val, "true") || strtol(tmp_val, NULL, 10) != 0;
+    if ((tmp_val = dict_get(opts, "loop")))
+        r->loop = !strcmp(tmp_val, "true") || strtol(tmp_val, NULL, 10) != 0;
+
+    int fd = open(r->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        err = AVERROR(errno);
+        goto fail;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st)) {
+        err = AVERROR(errno);
+        close(fd);
+        goto fail;
+    } else if (st.st_size < RAWCAP_ALIGN) {
+        err = AVERROR_INVALIDDATA;
+        close(fd);
+        goto fail;
+    }
+
+    uint8_t *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        err = AVERROR(errno);
+        goto fail;
+    }
+
+    r->map_ref = av_buffer_create(map, st.st_size, unmap_file,
+                                  (void *)(uintptr_t)st.st_size, AV_BUFFER_FLAG_READONLY);
+    if (!r->map_ref) {
+        munmap(map, st.st_size);
+        err = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    memcpy(&r->hdr, map, sizeof(r->hdr));
+    r->hdr.format[sizeof(r->hdr.format) - 1] = '\0';
+    r->hdr.ch_layout[sizeof(r->hdr.ch_layout) - 1] = '\0';
+
+    /* Everything the header and index point to has to be in the file.
+     * Checked by subtracting and dividing, as none of it can be trusted not
+     * to overflow when added up or multiplied. */
+    uint64_t file_size = st.st_size;
+    uint64_t index_offset = r->hdr.index_offset;
+    if (!r->hdr.nb_frames || (r->hdr.nb_frames > INT_MAX) ||
+        (index_offset < RAWCAP_ALIGN) || (index_offset > file_size) || (index_offset & (RAWCAP_ALIGN - 1)) ||
+        (r->hdr.nb_frames > (file_size - index_offset) / sizeof(*r->index))) {
+        err = AVERROR_INVALIDDATA;
+        goto fail;
+    }
+
+    r->index = (const RawCapIndexEntry *)(map + index_offset);
+    for (uint64_t i = 0; i < r->hdr.nb_frames; i++) {
+        const RawCapIndexEntry *e = &r->index[i];
+        int64_t min_size = frame_bytes(&r->hdr, e->nb_samples);
+        if ((e->offset < RAWCAP_ALIGN) || (e->offset > index_offset) ||
+            (e->size > index_offset - e->offset) ||
+            (min_size < 0) || (e->size < min_size)) {
+            err = AVERROR_INVALIDDATA;
+            goto fail;
+        }
+    }
+
+    posix_madvise(map, st.st_size, POSIX_MADV_SEQUENTIAL);
+
+    iosys_entry->io_priv = r;
+    iosys_entry->frames = sp_frame_fifo_create(iosys_entry, 8, FRAME_FIFO_BLOCK_MAX_OUTPUT);
+    iosys_entry->ctrl = rawcap_reader_ctrl;
+    if (!iosys_entry->frames) {
+        iosys_entry->io_priv = NULL;
+        err = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    sp_log(iosys_entry, SP_LOG_ERROR, "Unable to open %s: %s!\n",
+           (char *)iosys_entry->api_priv, av_err2str(err));
+    av_buffer_unref(&r->map_ref);
+    av_free(r->path);
+    av_free(r);
+    return err;
+}
+
+static void destroy_entry(void *opaque, uint8_t *data)
+{
+    IOSysEntry *entry = (IOSysEntry *)data;
+
+    if (entry->io_priv) {
+        RawCapReader *r = entry->io_priv;
+
+        if (r->thread) {
+            atomic_store(&r->quit, 1);
+            pthread_join(r->thread, NULL);
+        }
+
+        av_buffer_unref(&r->map_ref);
+        av_free(r->path);
+        av_free(r);
+    }
+
+    av_buffer_unref(&entry->frames);
+    sp_bufferlist_free(&entry->events);
+
+    av_free(entry->api_priv);
+    av_free(entry->desc);
+    sp_class_free(entry);
+    av_free(entry);
+}
+
+static void add_file(RawCapCtx *ctx, const char *path)
+{
+    RawCapHeader hdr;
+    if (read_header(path, &hdr) < 0)
+        return;
+
+    const AVCRC *crc_tab = av_crc_get_table(AV_CRC_32_IEEE);
+    uint32_t path_crc = av_crc(crc_tab, UINT32_MAX, path, strlen(path));
+    uint32_t idx = sp_iosys_gen_identifier(ctx, path_crc, hdr.media_type);
+
+    AVBufferRef *entry_ref = sp_bufferlist_ref(ctx->entries,
+                                               sp_bufferlist_iosysentry_by_id,
+                                               &idx);
+    if (entry_ref) {
+        av_buffer_unref(&entry_ref);
+        return;
+    }
+
+    IOSysEntry *entry = av_mallocz(sizeof(*entry));
+    if (!entry)
+        return;
+
+    entry_ref = av_buffer_create((uint8_t *)entry, sizeof(*entry),
+                                 destroy_entry, ctx, 0);
+    if (!entry_ref) {
+        av_free(entry);
+        return;
+    }
+
+    const char *name = av_basename(path);
+    int video = hdr.media_type == AVMEDIA_TYPE_VIDEO;
+    if (sp_class_alloc(entry, name, video ? SP_TYPE_VIDEO_SOURCE : SP_TYPE_AUDIO_SOURCE,
+                       ctx) < 0) {
+        av_buffer_unref(&entry_ref);
+        return;
+    }
+
+    entry->api_priv = av_strdup(path);
+    entry->desc = av_asprintf("Raw capture, %" PRIu64 " %s frames", hdr.nb_frames, hdr.format);
+    entry->events = sp_bufferlist_new();
+    if (!entry->api_priv || !entry->desc || !entry->events) {
+        av_buffer_unref(&entry_ref);
+        return;
+    }
+
+    entry->identifier = idx;
+    entry->api_id = path_crc;
+    if (video) {
+        entry->width = hdr.width;
+        entry->height = hdr.height;
+        entry->scale = 1;
+        entry->framerate = av_make_q(hdr.fr_num, hdr.fr_den);
+    } else {
+        entry->sample_rate = hdr.sample_rate;
+        entry->sample_fmt = av_get_sample_fmt(hdr.format);
+        entry->channels = hdr.channels;
+        if (av_channel_layout_from_string(&entry->ch_layout, hdr.ch_layout) < 0)
+            av_channel_layout_default(&entry->ch_layout, hdr.channels);
+    }
+
+    sp_eventlist_dispatch(entry, ctx->events, SP_EVENT_ON_CHANGE | SP_EVENT_TYPE_SOURCE, entry);
+
+    sp_bufferlist_append_noref(ctx->entries, entry_ref);
+}
+
+static void update_entries(RawCapCtx *ctx)
+{
+    DIR *dir = opendir(ctx->dir);
+    if (!dir) {
+        sp_log(ctx, SP_LOG_WARN, "Unable to open %s: %s!\n", ctx->dir,
+               av_err2str(AVERROR(errno)));
+        return;
+    }
+
+    struct dirent *d;
+    while ((d = readdir(dir))) {
+        if (d->d_name[0] == '.')
+            continue;
+
+        char *path = av_asprintf("%s/%s", ctx->dir, d->d_name);
+        if (!path)
+            break;
+
+        add_file(ctx, path);
+        av_free(path);
+    }
+
+    closedir(dir);
+}
+
+static int rawcap_ctrl(AVBufferRef *ctx_ref, SPEventType ctrl, void *arg)
+{
+    int err = 0;
+    RawCapCtx *ctx = (RawCapCtx *)ctx_ref->data;
+
+    if (ctrl & SP_EVENT_CTRL_NEW_EVENT) {
+        AVBufferRef *event = arg;
+        char *fstr = sp_event_flags_to_str_buf(event);
+        sp_log(ctx, SP_LOG_DEBUG, "Registering new event (%s)!\n", fstr);
+        av_free(fstr);
+
+        if (ctrl & SP_EVENT_FLAG_IMMEDIATE) {
+            /* Bring up the new event to speed with current affairs */
+            SPBufferList *tmp_event = sp_bufferlist_new();
+            sp_eventlist_add(ctx, tmp_event, event, 1);
+
+            update_entries(ctx);
+
+            AVBufferRef *obj = NULL;
+            while ((obj = sp_bufferlist_iter_ref(ctx->entries))) {
+                sp_eventlist_dispatch(obj->data, tmp_event,
+                                      SP_EVENT_ON_CHANGE | SP_EVENT_TYPE_SOURCE, obj->data);
+                av_buffer_unref(&obj);
+            }
+
+            sp_bufferlist_free(&tmp_event);
+        }
+
+        /* Add it to the list now to receive events dynamically */
+        err = sp_eventlist_add(ctx, ctx->events, event, 1);
+        if (err < 0)
+            return err;
+    }
+
+    return 0;
+}
+
+static AVBufferRef *rawcap_ref_entry(AVBufferRef *ctx_ref, uint32_t identifier)
+{
+    RawCapCtx *ctx = (RawCapCtx *)ctx_ref->data;
+    return sp_bufferlist_pop(ctx->entries, sp_bufferlist_iosysentry_by_id, &identifier);
+}
+
+static void rawcap_uninit(void *opaque, uint8_t *data)
+{
+    RawCapCtx *ctx = (RawCapCtx *)data;
+
+    sp_eventlist_dispatch(ctx, ctx->events, SP_EVENT_ON_DESTROY, ctx);
+    sp_bufferlist_free(&ctx->events);
+
+    sp_bufferlist_free(&ctx->entries);
+
+    av_free(ctx->dir);
+    sp_class_free(ctx);
+    av_free(ctx);
+}
+
+static int rawcap_init(AVBufferRef **s)
+{
+    int err = 0;
+
+    /* Nothing to replay from unless pointed to a directory */
+    const char *dir = getenv(RAWCAP_DIR_ENV);
+    if (!dir || !strlen(dir))
+        return AVERROR(ENOSYS);
+
+    RawCapCtx *ctx = av_mallocz(sizeof(*ctx));
+    if (!ctx)
+        return AVERROR(ENOMEM);
+
+    AVBufferRef *ctx_ref = av_buffer_create((uint8_t *)ctx, sizeof(*ctx),
+                                            rawcap_uninit, NULL, 0);
+    if (!ctx_ref) {
+        av_free(ctx);
+        return AVERROR(ENOMEM);
+    }
+
+    ctx->dir = av_strdup(dir);
+    ctx->entries = sp_bufferlist_new();
+    ctx->events = sp_bufferlist_new();
+    if (!ctx->dir || !ctx->entries || !ctx->events) {
+        err = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    err = sp_class_alloc(ctx, src_rawcap.name, SP_TYPE_CONTEXT, NULL);
+    if (err < 0)
+        goto fail;
+
+    *s = ctx_ref;
+
+    return 0;
+
+fail:
+    av_buffer_unref(&ctx_ref);
+
+    return err;
+}
+
+const IOSysAPI src_rawcap = {
+    .name      = "rawcap",
+    .ctrl      = rawcap_ctrl,
+    .init_sys  = rawcap_init,
+    .ref_entry = rawcap_ref_entry,
+    .init_io   = rawcap_init_io,
+};
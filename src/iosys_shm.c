@@ -0,0 +1,1085 @@
+/*
+ * This file is part of txproto.
+ *
+ * txproto is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * txproto is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with txproto; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include <libavutil/avstring.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/crc.h>
+#include <libavutil/hwcontext.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/time.h>
+
+#include "iosys_common.h"
+#include <libtxproto/utils.h>
+#include <libtxproto/log.h>
+#include "ctrl_template.h"
+#include "os_compat.h"
+#include "shm_ring.h"
+
+const IOSysAPI src_shm;
+
+/* Readers wake up at least this often to check if they should quit */
+#define READ_POLL_INTERVAL 100000
+
+/* Not FUTEX_PRIVATE, the word is shared between processes */
+static void futex_wake(atomic_uint *addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static void futex_wait(atomic_uint *addr, uint32_t val, int64_t timeout)
+{
+    struct timespec ts = {
+        .tv_sec  = timeout / 1000000,
+        .tv_nsec = (timeout % 1000000) * 1000,
+    };
+    syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+static int64_t slot_bytes(enum AVMediaType type, const ShmRingSlot *slot)
+{
+    if (type == AVMEDIA_TYPE_VIDEO)
+        return av_image_get_buffer_size(av_get_pix_fmt(slot->format),
+                                        slot->width, slot->height, SHM_RING_LINE_ALIGN);
+    return av_samples_get_buffer_size(NULL, slot->channels, slot->nb_samples,
+                                      av_get_sample_fmt(slot->format), SHM_RING_LINE_ALIGN);
+}
+
+/* Sink */
+typedef struct ShmSink {
+    char *name;
+    int fd;
+    enum AVMediaType type;
+
+    int nb_slots;
+    int64_t slot_size;
+
+    ShmRingHeader *hdr;
+    uint8_t *data;
+    int64_t data_size;
+    uint8_t **planes;
+    int nb_planes;
+
+    uint32_t seq;
+    pthread_t thread;
+
+    /* Stats */
+    int64_t published;
+    int64_t dropped;     /* Slot still held by the reader */
+    int64_t overwritten; /* Never read */
+    int64_t stats_start;
+} ShmSink;
+
+static int sink_setup_ring(IOSysEntry *entry, ShmSink *s, int64_t size)
+{
+    ShmRingHeader *hdr = s->hdr;
+
+    if (!s->slot_size)
+        s->slot_size = s->type == AVMEDIA_TYPE_AUDIO ? 2*size : size;
+    s->slot_size = FFALIGN(s->slot_size, SHM_RING_ALIGN);
+
+    int64_t data_offset = FFALIGN(sizeof(*hdr), SHM_RING_ALIGN);
+    s->data_size = s->nb_slots * s->slot_size;
+
+    if (ftruncate(s->fd, data_offset + s->data_size))
+        return AVERROR(errno);
+
+    uint8_t *data = mmap(NULL, s->data_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         s->fd, data_offset);
+    if (data == MAP_FAILED)
+        return AVERROR(errno);
+    s->data = data;
+
+    hdr->nb_slots = s->nb_slots;
+    hdr->slot_size = s->slot_size;
+    hdr->data_offset = data_offset;
+    atomic_store(&hdr->ready, 1);
+    futex_wake(&hdr->write_seq);
+
+    sp_log(entry, SP_LOG_VERBOSE, "Ring %s set up, %i slots of %" PRIi64 " bytes\n",
+           s->name, s->nb_slots, s->slot_size);
+
+    return 0;
+}
+
+static int sink_publish(IOSysEntry *entry, ShmSink *s, AVFrame *f)
+{
+    int err;
+    ShmRingHeader *hdr = s->hdr;
+    FormatExtraData *fe = f->opaque_ref ? (FormatExtraData *)f->opaque_ref->data : NULL;
+
+    ShmRingSlot desc = { 0 };
+    if (s->type == AVMEDIA_TYPE_VIDEO) {
+        av_strlcpy(desc.format, av_get_pix_fmt_name(f->format), sizeof(desc.format));
+        desc.width = f->width;
+        desc.height = f->height;
+    } else {
+        av_strlcpy(desc.format, av_get_sample_fmt_name(f->format), sizeof(desc.format));
+        desc.sample_rate = f->sample_rate;
+        desc.channels = f->ch_layout.nb_channels;
+        desc.nb_samples = f->nb_samples;
+        av_channel_layout_describe(&f->ch_layout, desc.ch_layout, sizeof(desc.ch_layout));
+    }
+
+    AVRational tb = fe ? fe->time_base : f->time_base;
+    desc.pts = f->pts;
+    desc.tb_num = tb.num;
+    desc.tb_den = tb.den;
+    if (fe) {
+        desc.fr_num = fe->avg_frame_rate.num;
+        desc.fr_den = fe->avg_frame_rate.den;
+    }
+
+    int64_t size = slot_bytes(s->type, &desc);
+    if (size < 0)
+        return size;
+    desc.size = size;
+
+    if (!atomic_load(&hdr->ready) && ((err = sink_setup_ring(entry, s, size)) < 0)) {
+        sp_log(entry, SP_LOG_ERROR, "Unable to set up ring: %s!\n", av_err2str(err));
+        return err;
+    }
+
+    if (size > s->slot_size) {
+        sp_log(entry, SP_LOG_WARN, "Frame of %" PRIi64 " bytes doesn't fit in a slot, "
+               "dropping!\n", size);
+        s->dropped++;
+        return 0;
+    }
+
+    int idx = s->seq % s->nb_slots;
+    ShmRingSlot *slot = &hdr->slots[idx];
+
+    unsigned int state = SHM_SLOT_FREE;
+    if (!atomic_compare_exchange_strong(&slot->state, &state, SHM_SLOT_WRITING)) {
+        state = SHM_SLOT_READY;
+        if (!atomic_compare_exchange_strong(&slot->state, &state, SHM_SLOT_WRITING)) {
+            s->dropped++;
+            return 0;
+        }
+        s->overwritten++;
+    }
+
+    uint8_t *dst = s->data + idx*s->slot_size;
+    if (s->type == AVMEDIA_TYPE_VIDEO) {
+        err = av_image_copy_to_buffer(dst, size, (const uint8_t * const *)f->data,
+                                      f->linesize, f->format, f->width, f->height,
+                                      SHM_RING_LINE_ALIGN);
+    } else {
+        if (desc.channels > s->nb_planes) {
+            av_freep(&s->planes);
+            s->nb_planes = 0;
+            s->planes = av_calloc(desc.channels, sizeof(*s->planes));
+            if (!s->planes) {
+                atomic_store(&slot->state, SHM_SLOT_FREE);
+                return AVERROR(ENOMEM);
+            }
+            s->nb_planes = desc.channels;
+        }
+        err = av_samples_fill_arrays(s->planes, NULL, dst, desc.channels, f->nb_samples,
+                                     f->format, SHM_RING_LINE_ALIGN);
+        if (err >= 0)
+            err = av_samples_copy(s->planes, f->extended_data, 0, 0, f->nb_samples,
+                                  desc.channels, f->format);
+    }
+    if (err < 0) {
+        atomic_store(&slot->state, SHM_SLOT_FREE);
+        return err;
+    }
+
+    /* Everything but the state, which is what publishes it */
+    desc.seq = s->seq;
+    memcpy((uint8_t *)slot + offsetof(ShmRingSlot, seq),
+           (uint8_t *)&desc + offsetof(ShmRingSlot, seq),
+           sizeof(desc) - offsetof(ShmRingSlot, seq));
+    atomic_store(&slot->state, SHM_SLOT_READY);
+
+    s->seq++;
+    s->published++;
+    atomic_store(&hdr->write_seq, s->seq);
+    futex_wake(&hdr->write_seq);
+
+    return 0;
+}
+
+static void *shm_sink_thread(void *arg)
+{
+    int err = 0;
+    IOSysEntry *entry = arg;
+    ShmSink *s = entry->io_priv;
+
+    sp_set_thread_name_self(sp_class_get_name(entry));
+
+    sp_eventlist_dispatch(entry, entry->events, SP_EVENT_ON_INIT, NULL);
+
+    s->stats_start = av_gettime_relative();
+
+    while (1) {
+        AVFrame *f = sp_frame_fifo_pop(entry->frames);
+        if (!f)
+            break;
+
+        if (f->hw_frames_ctx) {
+            AVFrame *sw = av_frame_alloc();
+            if (!sw) {
+                av_frame_free(&f);
+                err = AVERROR(ENOMEM);
+                break;
+            }
+
+            err = av_hwframe_transfer_data(sw, f, 0);
+            av_frame_copy_props(sw, f);
+            av_frame_free(&f);
+            f = sw;
+            if (err < 0) {
+                sp_log(entry, SP_LOG_ERROR, "Unable to download frame: %s!\n", av_err2str(err));
+                av_frame_free(&f);
+                break;
+            }
+        }
+
+        err = sink_publish(entry, s, f);
+        av_frame_free(&f);
+        if (err < 0)
+            break;
+
+        int64_t now = av_gettime_relative();
+        if ((now - s->stats_start) >= AV_TIME_BASE) {
+            SPGenericData entries[] = {
+                D_TYPE("frames", NULL, s->published),
+                D_TYPE("dropped_frames", NULL, s->dropped),
+                D_TYPE("overwritten_frames", NULL, s->overwritten),
+                { 0 },
+            };
+            sp_eventlist_dispatch(entry, entry->events, SP_EVENT_ON_STATS, entries);
+            s->stats_start = now;
+        }
+    }
+
+    atomic_store(&s->hdr->eos, 1);
+    futex_wake(&s->hdr->write_seq);
+
+    sp_eventlist_dispatch(entry, entry->events, SP_EVENT_ON_EOS, &err);
+
+    return NULL;
+}
+
+static int shm_sink_ctrl_cb(AVBufferRef *event_ref, void *callback_ctx, void *ctx,
+                            void *dep_ctx, void *data)
+{
+    SPCtrlTemplateCbCtx *event = callback_ctx;
+
+    IOSysEntry *entry = ctx;
+    ShmSink *s = entry->io_priv;
+
+    if (event->ctrl & SP_EVENT_CTRL_START) {
+        if (!sp_eventlist_has_dispatched(entry->events, SP_EVENT_ON_CONFIG)) {
+            int ret = sp_eventlist_dispatch(entry, entry->events, SP_EVENT_ON_CONFIG, NULL);
+            if (ret < 0)
+                return ret;
+        }
+        if (!s->thread)
+            pthread_create(&s->thread, NULL, shm_sink_thread, entry);
+    } else if (event->ctrl & SP_EVENT_CTRL_STOP) {
+        if (s->thread) {
+            sp_frame_fifo_push(entry->frames, NULL);
+            pthread_join(s->thread, NULL);
+            s->thread = 0;
+        }
+    } else if (event->ctrl & SP_EVENT_CTRL_OPTS) {
+        const char *tmp_val = NULL;
+        if ((tmp_val = dict_get(event->opts, "fifo_size"))) {
+            long int len = strtol(tmp_val, NULL, 10);
+            if (len < 0)
+                sp_log(entry, SP_LOG_ERROR, "Invalid fifo size \"%s\"!\n", tmp_val);
+            else
+                sp_frame_fifo_set_max_queued(entry->frames, len);
+        }
+    } else {
+        return AVERROR(ENOTSUP);
+    }
+
+    return 0;
+}
+
+static int shm_sink_ctrl(AVBufferRef *entry, SPEventType ctrl, void *arg)
+{
+    IOSysEntry *iosys_entry = (IOSysEntry *)entry->data;
+    return sp_ctrl_template(iosys_entry, iosys_entry->events, 0x0,
+                            shm_sink_ctrl_cb, ctrl, arg);
+}
+
+static void destroy_sink(void *opaque, uint8_t *data)
+{
+    IOSysEntry *entry = (IOSysEntry *)data;
+    ShmSink *s = entry->io_priv;
+
+    if (s) {
+        if (s->thread) {
+            sp_frame_fifo_push(entry->frames, NULL);
+            pthread_join(s->thread, NULL);
+        }
+        if (s->data)
+            munmap(s->data, s->data_size);
+        if (s->hdr) {
+            /* In case it was never started */
+            atomic_store(&s->hdr->eos, 1);
+            futex_wake(&s->hdr->write_seq);
+            munmap(s->hdr, sizeof(*s->hdr));
+        }
+        if (s->fd >= 0) {
+            close(s->fd);
+            /* Readers keep their mappings */
+            shm_unlink(s->name);
+        }
+        av_free(s->planes);
+        av_free(s->name);
+        av_free(s);
+    }
+
+    av_buffer_unref(&entry->frames);
+    sp_bufferlist_free(&entry->events);
+
+    av_free(entry->desc);
+    sp_class_free(entry);
+    av_free(entry);
+}
+
+AVBufferRef *sp_shm_sink_create(void *log_ctx, const char *name,
+                                enum AVMediaType type, AVDictionary *opts)
+{
+    int err;
+    const char *tmp_val;
+
+    if (type != AVMEDIA_TYPE_VIDEO && type != AVMEDIA_TYPE_AUDIO) {
+        sp_log(log_ctx, SP_LOG_ERROR, "Shared memory rings only support video and audio!\n");
+        return NULL;
+    } else if (!name || !strlen(name) || strchr(name, '/')) {
+        sp_log(log_ctx, SP_LOG_ERROR, "Invalid ring name \"%s\"!\n", name ? name : "");
+        return NULL;
+    }
+
+    IOSysEntry *entry = av_mallocz(sizeof(*entry));
+    if (!entry)
+        return NULL;
+
+    AVBufferRef *entry_ref = av_buffer_create((uint8_t *)entry, sizeof(*entry),
+                                              destroy_sink, NULL, 0);
+    if (!entry_ref) {
+        av_free(entry);
+        return NULL;
+    }
+
+    err = sp_class_alloc(entry, name,
+                         type == AVMEDIA_TYPE_VIDEO ? SP_TYPE_VIDEO_SINK : SP_TYPE_AUDIO_SINK,
+                         log_ctx);
+    if (err < 0)
+        goto fail;
+
+    ShmSink *s = av_mallocz(sizeof(*s));
+    if (!s)
+        goto fail;
+    entry->io_priv = s;
+
+    s->fd = -1;
+    s->type = type;
+    s->nb_slots = 4;
+
+    if ((tmp_val = dict_get(opts, "slots"))) {
+        long int val = strtol(tmp_val, NULL, 10);
+        if (val < 2 || val > SHM_RING_MAX_SLOTS)
+            sp_log(entry, SP_LOG_ERROR, "Invalid number of slots \"%s\", must be between "
+                   "2 and %i!\n", tmp_val, SHM_RING_MAX_SLOTS);
+        else
+            s->nb_slots = val;
+    }
+    if ((tmp_val = dict_get(opts, "slot_size"))) {
+        int64_t val = strtoll(tmp_val, NULL, 10);
+        if (val <= 0)
+            sp_log(entry, SP_LOG_ERROR, "Invalid slot size \"%s\"!\n", tmp_val);
+        else
+            s->slot_size = val;
+    }
+
+    s->name = av_asprintf("/" SHM_RING_PREFIX "%s", name);
+    entry->desc = av_asprintf("Shared memory ring %s", s->name);
+    entry->frames = sp_frame_fifo_create(entry, 8, FRAME_FIFO_BLOCK_NO_INPUT);
+    entry->events = sp_bufferlist_new();
+    entry->ctrl = shm_sink_ctrl;
+    if (!s->name || !entry->desc || !entry->frames || !entry->events)
+        goto fail;
+
+    s->fd = shm_open(s->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (s->fd < 0) {
+        sp_log(entry, SP_LOG_ERROR, "Unable to create %s: %s!\n", s->name,
+               av_err2str(AVERROR(errno)));
+        goto fail;
+    }
+
+    if (ftruncate(s->fd, FFALIGN(sizeof(*s->hdr), SHM_RING_ALIGN))) {
+        sp_log(entry, SP_LOG_ERROR, "Unable to resize %s: %s!\n", s->name,
+               av_err2str(AVERROR(errno)));
+        goto fail;
+    }
+
+    ShmRingHeader *hdr = mmap(NULL, sizeof(*hdr), PROT_READ | PROT_WRITE, MAP_SHARED,
+                              s->fd, 0);
+    if (hdr == MAP_FAILED)
+        goto fail;
+    s->hdr = hdr;
+
+    /* The object starts zeroed, so every slot is free */
+    memcpy(hdr->magic, SHM_RING_MAGIC, sizeof(hdr->magic));
+    hdr->version = SHM_RING_VERSION;
+    hdr->media_type = type;
+    hdr->pid = getpid();
+
+    if ((tmp_val = dict_get(opts, "fifo_size"))) {
+        long int len = strtol(tmp_val, NULL, 10);
+        if (len < 0)
+            sp_log(entry, SP_LOG_ERROR, "Invalid fifo size \"%s\"!\n", tmp_val);
+        else
+            sp_frame_fifo_set_max_queued(entry->frames, len);
+    }
+
+    return entry_ref;
+
+fail:
+    av_buffer_unref(&entry_ref);
+    return NULL;
+}
+
+/* Reader */
+typedef struct ShmReader {
+    char *name;
+    int fd;
+
+    ShmRingHeader *hdr;
+    AVBufferRef *hdr_ref; /* Frames reference it too, to free their slots */
+    AVBufferRef *map_ref; /* The slots, frames reference it */
+    uint32_t nb_slots;    /* Validated copies of the header's */
+    uint64_t slot_size;
+
+    atomic_int quit;
+    pthread_t thread;
+    int dropped_frames;
+} ShmReader;
+
+typedef struct ShmSlotRef {
+    AVBufferRef *hdr_ref;
+    AVBufferRef *map_ref;
+    ShmRingSlot *slot;
+} ShmSlotRef;
+
+typedef struct ShmCtx {
+    SPClass *class;
+
+    SPBufferList *events;
+    SPBufferList *entries;
+} ShmCtx;
+
+static void unmap_ring(void *opaque, uint8_t *data)
+{
+    munmap(data, (size_t)(uintptr_t)opaque);
+}
+
+/* Called once the last reference to a frame in a slot is gone */
+static void release_slot(void *opaque, uint8_t *data)
+{
+    ShmSlotRef *ref = opaque;
+    atomic_store(&ref->slot->state, SHM_SLOT_FREE);
+    av_buffer_unref(&ref->map_ref);
+    av_buffer_unref(&ref->hdr_ref);
+    av_free(ref);
+}
+
+static AVFrame *reader_get_frame(IOSysEntry *entry, ShmReader *r, int idx)
+{
+    ShmRingHeader *hdr = r->hdr;
+    ShmRingSlot *slot = &hdr->slots[idx];
+    uint8_t *src = r->map_ref->data + idx*r->slot_size;
+
+    AVFrame *f = av_frame_alloc();
+    ShmSlotRef *ref = av_mallocz(sizeof(*ref));
+    if (!f || !ref)
+        goto fail;
+
+    ref->slot = slot;
+    ref->hdr_ref = av_buffer_ref(r->hdr_ref);
+    ref->map_ref = av_buffer_ref(r->map_ref);
+    if (!ref->hdr_ref || !ref->map_ref)
+        goto fail;
+
+    f->buf[0] = av_buffer_create(src, slot->size, release_slot, ref, AV_BUFFER_FLAG_READONLY);
+    if (!f->buf[0]) {
+        av_buffer_unref(&ref->map_ref);
+        av_buffer_unref(&ref->hdr_ref);
+        goto fail;
+    }
+
+    if (hdr->media_type == AVMEDIA_TYPE_VIDEO) {
+        f->format = av_get_pix_fmt(slot->format);
+        f->width = slot->width;
+        f->height = slot->height;
+        if (av_image_fill_arrays(f->data, f->linesize, src, f->format,
+                                 f->width, f->height, SHM_RING_LINE_ALIGN) < 0)
+            goto fail;
+    } else {
+        f->format = av_get_sample_fmt(slot->format);
+        f->sample_rate = slot->sample_rate;
+        f->nb_samples = slot->nb_samples;
+        if (av_channel_layout_from_string(&f->ch_layout, slot->ch_layout) < 0)
+            av_channel_layout_default(&f->ch_layout, slot->channels);
+
+        int planes = av_sample_fmt_is_planar(f->format) ? slot->channels : 1;
+        if (planes > AV_NUM_DATA_POINTERS) {
+            f->extended_data = av_calloc(planes, sizeof(*f->extended_data));
+            if (!f->extended_data)
+                goto fail;
+        }
+
+        if (av_samples_fill_arrays(f->extended_data, f->linesize, src, slot->channels,
+                                   f->nb_samples, f->format, SHM_RING_LINE_ALIGN) < 0)
+            goto fail;
+
+        if (f->extended_data != f->data)
+            memcpy(f->data, f->extended_data, sizeof(f->data));
+    }
+
+    f->pts = slot->pts;
+    f->opaque_ref = av_buffer_allocz(sizeof(FormatExtraData));
+    if (!f->opaque_ref)
+        goto fail;
+
+    FormatExtraData *fe = (FormatExtraData *)f->opaque_ref->data;
+    fe->time_base = av_make_q(slot->tb_num, slot->tb_den);
+    fe->avg_frame_rate = av_make_q(slot->fr_num, slot->fr_den);
+
+    return f;
+
+fail:
+    /* Without a frame buffer, the slot has to be released here */
+    if (!f || !f->buf[0]) {
+        atomic_store(&slot->state, SHM_SLOT_FREE);
+        if (ref) {
+            av_buffer_unref(&ref->map_ref);
+            av_buffer_unref(&ref->hdr_ref);
+        }
+        av_free(ref);
+    }
+    av_frame_free(&f);
+    return NULL;
+}
+
+/* Waits until the writer has set up the slots, and maps them */
+static int reader_map_slots(IOSysEntry *entry, ShmReader *r)
+{
+    ShmRingHeader *hdr = r->hdr;
+
+    while (!atomic_load(&hdr->ready)) {
+        if (atomic_load(&r->quit) || atomic_load(&hdr->eos))
+            return AVERROR_EOF;
+        futex_wait(&hdr->write_seq, atomic_load(&hdr->write_seq), READ_POLL_INTERVAL);
+    }
+
+    /* The writer could be anything, so its sizes must fit the object */
+    struct stat st;
+    if (fstat(r->fd, &st))
+        return AVERROR(errno);
+
+    uint64_t obj_size = st.st_size;
+    uint32_t nb_slots = hdr->nb_slots;
+    uint64_t slot_size = hdr->slot_size;
+    uint64_t data_offset = hdr->data_offset;
+    if ((nb_slots < 2) || (nb_slots > SHM_RING_MAX_SLOTS) || !slot_size ||
+        (data_offset < sizeof(*hdr)) || (data_offset > obj_size) ||
+        (slot_size > (obj_size - data_offset) / nb_slots))
+        return AVERROR_INVALIDDATA;
+
+    size_t size = nb_slots * slot_size;
+    uint8_t *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                        r->fd, data_offset);
+    if (map == MAP_FAILED)
+        return AVERROR(errno);
+
+    av_buffer_unref(&r->map_ref);
+    r->map_ref = av_buffer_create(map, size, unmap_ring, (void *)(uintptr_t)size, 0);
+    if (!r->map_ref) {
+        munmap(map, size);
+        return AVERROR(ENOMEM);
+    }
+    r->nb_slots = nb_slots;
+    r->slot_size = slot_size;
+
+    /* Slots left as READING are only taken back once whoever read them is
+     * gone, a live reader will still free them */
+    int32_t self = getpid();
+    int32_t prev = atomic_exchange(&hdr->reader_pid, self);
+    if (prev && (prev != self) && !(kill(prev, 0) && (errno == ESRCH))) {
+        /* Stays the one whose slots get waited on */
+        atomic_compare_exchange_strong(&hdr->reader_pid, &self, prev);
+        sp_log(entry, SP_LOG_WARN, "Process %i is also reading %s!\n", prev, r->name);
+    } else if (prev && (prev != self)) {
+        for (int i = 0; i < nb_slots; i++) {
+            unsigned int state = SHM_SLOT_READING;
+            atomic_compare_exchange_strong(&hdr->slots[i].state, &state, SHM_SLOT_FREE);
+        }
+    }
+
+    return 0;
+}
+
+static void *shm_reader_thread(void *arg)
+{
+    int err = 0;
+    IOSysEntry *entry = arg;
+    ShmReader *r = entry->io_priv;
+    ShmRingHeader *hdr = r->hdr;
+
+    sp_set_thread_name_self(sp_class_get_name(entry));
+
+    sp_eventlist_dispatch(entry, entry->events, SP_EVENT_ON_INIT | SP_EVENT_ON_CONFIG, NULL);
+
+    err = reader_map_slots(entry, r);
+    if (err < 0) {
+        if (err != AVERROR_EOF)
+            sp_log(entry, SP_LOG_ERROR, "Unable to map %s: %s!\n", r->name, av_err2str(err));
+        goto end;
+    }
+
+    uint32_t nb_slots = r->nb_slots;
+
+    /* Start with whatever hasn't been overwritten yet */
+    uint32_t seq = atomic_load(&hdr->write_seq);
+    seq = seq > nb_slots ? seq - nb_slots : 0;
+
+    while (!atomic_load(&r->quit)) {
+        uint32_t cur = atomic_load(&hdr->write_seq);
+        if (seq == cur) {
+            if (atomic_load(&hdr->eos))
+                break;
+            futex_wait(&hdr->write_seq, cur, READ_POLL_INTERVAL);
+            continue;
+        }
+
+        /* Fell behind by more than the ring */
+        if ((uint32_t)(cur - seq) > nb_slots)
+            seq = cur - nb_slots;
+
+        int idx = seq % nb_slots;
+        ShmRingSlot *slot = &hdr->slots[idx];
+        unsigned int state = SHM_SLOT_READY;
+        if (!atomic_compare_exchange_strong(&slot->state, &state, SHM_SLOT_READING)) {
+            seq++; /* Being rewritten, or dropped by the writer */
+            continue;
+        }
+
+        /* Already holds a later frame, get to it on the next round */
+        if (slot->seq != seq) {
+            atomic_store(&slot->state, SHM_SLOT_READY);
+            seq++;
+            continue;
+        }
+        seq++;
+
+        /* Ours while reading, never trust the writer to terminate them */
+        slot->format[sizeof(slot->format) - 1] = '\0';
+        slot->ch_layout[sizeof(slot->ch_layout) - 1] = '\0';
+
+        if ((slot->size > r->slot_size) ||
+            (slot->size < slot_bytes(hdr->media_type, slot))) {
+            atomic_store(&slot->state, SHM_SLOT_FREE);
+            continue;
+        }
+
+        AVFrame *f = reader_get_frame(entry, r, idx);
+        if (!f) {
+            err = AVERROR(ENOMEM);
+            break;
+        }
+
+        err = sp_frame_fifo_push(entry->frames, f);
+        av_frame_free(&f);
+        if (err == AVERROR(ENOBUFS)) {
+            r->dropped_frames++;
+            sp_log(entry, SP_LOG_WARN, "Dropping frame (%i dropped so far)!\n",
+                   r->dropped_frames);
+
+            SPGenericData entries[] = {
+                D_TYPE("dropped_frames", NULL, r->dropped_frames),
+                { 0 },
+            };
+            sp_eventlist_dispatch(entry, entry->events, SP_EVENT_ON_STATS, entries);
+            err = 0;
+        } else if (err) {
+            sp_log(entry, SP_LOG_ERROR, "Unable to push frame to FIFO: %s!\n",
+                   av_err2str(err));
+            break;
+        }
+    }
+
+end:
+    /* EOS */
+    sp_frame_fifo_push(entry->frames, NULL);
+    sp_eventlist_dispatch(entry, entry->events, SP_EVENT_ON_EOS, &err);
+
+    return NULL;
+}
+
+static int shm_reader_ctrl_cb(AVBufferRef *event_ref, void *callback_ctx, void *ctx,
+                              void *dep_ctx, void *data)
+{
+    SPCtrlTemplateCbCtx *event = callback_ctx;
+
+    IOSysEntry *entry = ctx;
+    ShmReader *r = entry->io_priv;
+
+    if (event->ctrl & SP_EVENT_CTRL_START) {
+        if (!r->thread)
+            pthread_create(&r->thread, NULL, shm_reader_thread, entry);
+        return 0;
+    } else if (event->ctrl & SP_EVENT_CTRL_STOP) {
+        if (r->thread) {
+            atomic_store(&r->quit, 1);
+            pthread_join(r->thread, NULL);
+            r->thread = 0;
+        }
+        return 0;
+    } else {
+        return AVERROR(ENOTSUP);
+    }
+}
+
+static int shm_reader_ctrl(AVBufferRef *entry, SPEventType ctrl, void *arg)
+{
+    IOSysEntry *iosys_entry = (IOSysEntry *)entry->data;
+    return sp_ctrl_template(iosys_entry, iosys_entry->events, 0x0,
+                            shm_reader_ctrl_cb, ctrl, arg);
+}
+
+static void reader_free(ShmReader *r)
+{
+    /* Without frames still out, and holding slots, there's nothing left
+     * for another reader to wait on */
+    if (r->map_ref && (av_buffer_get_ref_count(r->map_ref) == 1)) {
+        int32_t self = getpid();
+        atomic_compare_exchange_strong(&r->hdr->reader_pid, &self, 0);
+    }
+
+    /* Frames still out keep the slots and the header mapped */
+    av_buffer_unref(&r->map_ref);
+    av_buffer_unref(&r->hdr_ref);
+    if (r->fd >= 0)
+        close(r->fd);
+    av_free(r->name);
+    av_free(r);
+}
+
+static int shm_init_io(AVBufferRef *ctx_ref, AVBufferRef *entry,
+                       AVDictionary *opts)
+{
+    int err;
+    IOSysEntry *iosys_entry = (IOSysEntry *)entry->data;
+
+    ShmReader *r = av_mallocz(sizeof(*r));
+    if (!r)
+        return AVERROR(ENOMEM);
+
+    r->fd = -1;
+    r->quit = ATOMIC_VAR_INIT(0);
+    r->name = av_strdup(iosys_entry->api_priv);
+    if (!r->name) {
+        err = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    r->fd = shm_open(r->name, O_RDWR, 0);
+    if (r->fd < 0) {
+        err = AVERROR(errno);
+        goto fail;
+    }
+
+    ShmRingHeader *hdr = mmap(NULL, sizeof(*hdr), PROT_READ | PROT_WRITE, MAP_SHARED,
+                              r->fd, 0);
+    if (hdr == MAP_FAILED) {
+        err = AVERROR(errno);
+        goto fail;
+    }
+    r->hdr_ref = av_buffer_create((uint8_t *)hdr, sizeof(*hdr), unmap_ring,
+                                  (void *)(uintptr_t)sizeof(*hdr), 0);
+    if (!r->hdr_ref) {
+        munmap(hdr, sizeof(*hdr));
+        err = AVERROR(ENOMEM);
+        goto fail;
+    }
+    r->hdr = hdr;
+
+    if (memcmp(hdr->magic, SHM_RING_MAGIC, sizeof(hdr->magic)) ||
+        (hdr->version != SHM_RING_VERSION)) {
+        err = AVERROR_INVALIDDATA;
+        goto fail;
+    }
+
+    iosys_entry->io_priv = r;
+    iosys_entry->frames = sp_frame_fifo_create(iosys_entry, 8, 0);
+    iosys_entry->ctrl = shm_reader_ctrl;
+    if (!iosys_entry->frames) {
+        iosys_entry->io_priv = NULL;
+        err = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    sp_log(iosys_entry, SP_LOG_ERROR, "Unable to open %s: %s!\n",
+           (char *)iosys_entry->api_priv, av_err2str(err));
+    reader_free(r);
+    return err;
+}
+
+static void destroy_entry(void *opaque, uint8_t *data)
+{
+    IOSysEntry *entry = (IOSysEntry *)data;
+
+    if (entry->io_priv) {
+        ShmReader *r = entry->io_priv;
+
+        if (r->thread) {
+            atomic_store(&r->quit, 1);
+            pthread_join(r->thread, NULL);
+        }
+
+        reader_free(r);
+    }
+
+    av_buffer_unref(&entry->frames);
+    sp_bufferlist_free(&entry->events);
+
+    av_free(entry->api_priv);
+    av_free(entry->desc);
+    sp_class_free(entry);
+    av_free(entry);
+}
+
+static int read_header(const char *name, ShmRingHeader *hdr)
+{
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+        return AVERROR(errno);
+
+    ssize_t len = pread(fd, hdr, sizeof(*hdr), 0);
+    close(fd);
+
+    if ((len != sizeof(*hdr)) || memcmp(hdr->magic, SHM_RING_MAGIC, sizeof(hdr->magic)) ||
+        (hdr->version != SHM_RING_VERSION))
+        return AVERROR_INVALIDDATA;
+
+    /* Left over from a writer which didn't exit cleanly */
+    if (kill(hdr->pid, 0) && (errno == ESRCH))
+        return AVERROR(ESRCH);
+
+    return 0;
+}
+
+static void add_ring(ShmCtx *ctx, const char *file)
+{
+    ShmRingHeader hdr;
+    char *name = av_asprintf("/%s", file);
+    if (!name || (read_header(name, &hdr) < 0)) {
+        av_free(name);
+        return;
+    }
+
+    const AVCRC *crc_tab = av_crc_get_table(AV_CRC_32_IEEE);
+    uint32_t name_crc = av_crc(crc_tab, UINT32_MAX, name, strlen(name));
+    uint32_t idx = sp_iosys_gen_identifier(ctx, name_crc, hdr.media_type);
+
+    AVBufferRef *entry_ref = sp_bufferlist_ref(ctx->entries,
+                                               sp_bufferlist_iosysentry_by_id,
+                                               &idx);
+    if (entry_ref) {
+        av_buffer_unref(&entry_ref);
+        av_free(name);
+        return;
+    }
+
+    IOSysEntry *entry = av_mallocz(sizeof(*entry));
+    if (!entry) {
+        av_free(name);
+        return;
+    }
+    entry->api_priv = name;
+
+    entry_ref = av_buffer_create((uint8_t *)entry, sizeof(*entry),
+                                 destroy_entry, ctx, 0);
+    if (!entry_ref) {
+        av_free(name);
+        av_free(entry);
+        return;
+    }
+
+    int video = hdr.media_type == AVMEDIA_TYPE_VIDEO;
+    if (sp_class_alloc(entry, file + strlen(SHM_RING_PREFIX),
+                       video ? SP_TYPE_VIDEO_SOURCE : SP_TYPE_AUDIO_SOURCE, ctx) < 0) {
+        av_buffer_unref(&entry_ref);
+        return;
+    }
+
+    entry->desc = av_asprintf("Shared memory ring from process %i", hdr.pid);
+    entry->events = sp_bufferlist_new();
+    if (!entry->desc || !entry->events) {
+        av_buffer_unref(&entry_ref);
+        return;
+    }
+
+    entry->identifier = idx;
+    entry->api_id = name_crc;
+
+    sp_eventlist_dispatch(entry, ctx->events, SP_EVENT_ON_CHANGE | SP_EVENT_TYPE_SOURCE, entry);
+
+    sp_bufferlist_append_noref(ctx->entries, entry_ref);
+}
+
+static void update_entries(ShmCtx *ctx)
+{
+    DIR *dir = opendir("/dev/shm");
+    if (!dir)
+        return;
+
+    struct dirent *d;
+    while ((d = readdir(dir)))
+        if (!strncmp(d->d_name, SHM_RING_PREFIX, strlen(SHM_RING_PREFIX)))
+            add_ring(ctx, d->d_name);
+
+    closedir(dir);
+}
+
+static int shm_ctrl(AVBufferRef *ctx_ref, SPEventType ctrl, void *arg)
+{
+    int err = 0;
+    ShmCtx *ctx = (ShmCtx *)ctx_ref->data;
+
+    if (ctrl & SP_EVENT_CTRL_NEW_EVENT) {
+        AVBufferRef *event = arg;
+        char *fstr = sp_event_flags_to_str_buf(event);
+        sp_log(ctx, SP_LOG_DEBUG, "Registering new event (%s)!\n", fstr);
+        av_free(fstr);
+
+        if (ctrl & SP_EVENT_FLAG_IMMEDIATE) {
+            /* Bring up the new event to speed with current affairs */
+            SPBufferList *tmp_event = sp_bufferlist_new();
+            sp_eventlist_add(ctx, tmp_event, event, 1);
+
+            update_entries(ctx);
+
+            AVBufferRef *obj = NULL;
+            while ((obj = sp_bufferlist_iter_ref(ctx->entries))) {
+                sp_eventlist_dispatch(obj->data, tmp_event,
+                                      SP_EVENT_ON_CHANGE | SP_EVENT_TYPE_SOURCE, obj->data);
+                av_buffer_unref(&obj);
+            }
+
+            sp_bufferlist_free(&tmp_event);
+        }
+
+        /* Add it to the list now to receive events dynamically */
+        err = sp_eventlist_add(ctx, ctx->events, event, 1);
+        if (err < 0)
+            return err;
+    }
+
+    return 0;
+}
+
+static AVBufferRef *shm_ref_entry(AVBufferRef *ctx_ref, uint32_t identifier)
+{
+    ShmCtx *ctx = (ShmCtx *)ctx_ref->data;
+    return sp_bufferlist_pop(ctx->entries, sp_bufferlist_iosysentry_by_id, &identifier);
+}
+
+static void shm_uninit(void *opaque, uint8_t *data)
+{
+    ShmCtx *ctx = (ShmCtx *)data;
+
+    sp_eventlist_dispatch(ctx, ctx->events, SP_EVENT_ON_DESTROY, ctx);
+    sp_bufferlist_free(&ctx->events);
+
+    sp_bufferlist_free(&ctx->entries);
+
+    sp_class_free(ctx);
+    av_free(ctx);
+}
+
+static int shm_init(AVBufferRef **s)
+{
+    int err = 0;
+
+    ShmCtx *ctx = av_mallocz(sizeof(*ctx));
+    if (!ctx)
+        return AVERROR(ENOMEM);
+
+    AVBufferRef *ctx_ref = av_buffer_create((uint8_t *)ctx, sizeof(*ctx),
+                                            shm_uninit, NULL, 0);
+    if (!ctx_ref) {
+        av_free(ctx);
+        return AVERROR(ENOMEM);
+    }
+
+    ctx->entries = sp_bufferlist_new();
+    ctx->events = sp_bufferlist_new();
+    if (!ctx->entries || !ctx->events) {
+        err = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    err = sp_class_alloc(ctx, src_shm.name, SP_TYPE_CONTEXT, NULL);
+    if (err < 0)
+        goto fail;
+
+    *s = ctx_ref;
+
+    return 0;
+
+fail:
+    av_buffer_unref(&ctx_ref);
+
+    return err;
+}
+
+const IOSysAPI src_shm = {
+    .name      = "shm",
+    .ctrl      = shm_ctrl,
+    .init_sys  = shm_init,
+    .ref_entry = shm_ref_entry,
+    .init_io   = shm_init_io,
+};
@@ -16,6 +16,7 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include <libtxproto/bsf.h>
 #include <libtxproto/commit.h>
 #include <libtxproto/control.h>
 #include <libtxproto/decode.h>
@@ -98,6 +99,8 @@ static SPBufferList *sp_ctx_get_events_list(void *ctx)
         return ((DecodingContext *)ctx)->events;
     case SP_TYPE_DEMUXER:
         return ((DemuxingContext *)ctx)->events;
+    case SP_TYPE_BSF:
+        return ((BSFContext *)ctx)->events;
     default:
         break;
     }
@@ -142,6 +145,11 @@ static AVBufferRef *sp_ctx_get_fifo(void *ctx, int out)
             return ((DecodingContext *)ctx)->src_packets;
     case SP_TYPE_DEMUXER:
         return NULL;
+    case SP_TYPE_BSF:
+        if (out)
+            return ((BSFContext *)ctx)->dst_packets;
+        else
+            return ((BSFContext *)ctx)->src_packets;
     default:
         sp_assert(0); /* Should never happen */
         return NULL;
@@ -193,16 +201,46 @@ static int link_fn(AVBufferRef *event_ref, void *callback_ctx, void *dst_ctx,
         return sp_map_fifo_to_pad((FilterContext *)dst_ctx, src_fifo,
                                   cb_ctx->dst_filt_pad, 0);
     } else if ((s_type == SP_TYPE_ENCODER) && (d_type == SP_TYPE_MUXER)) {
-        EncodingContext *src_enc_ctx  = src_ctx;
-        MuxingContext   *dst_mux_ctx  = dst_ctx;
+        MuxingContext *dst_mux_ctx = dst_ctx;
 
         sp_assert(dst_fifo && src_fifo);
 
-        int err = sp_muxer_add_stream(dst_mux_ctx, src_enc_ctx);
+        int err = sp_muxer_add_stream(dst_mux_ctx, cb_ctx->src_ref, -1);
+        if (err < 0)
+            return err;
+
+        return sp_packet_fifo_mirror(dst_fifo, src_fifo);
+    } else if ((s_type == SP_TYPE_DEMUXER) && (d_type == SP_TYPE_MUXER)) {
+        DemuxingContext *src_mux_ctx = src_ctx;
+        MuxingContext   *dst_mux_ctx = dst_ctx;
+
+        int idx = sp_demuxer_find_stream(src_mux_ctx, cb_ctx->src_stream_id,
+                                         cb_ctx->src_stream_desc);
+        if (idx < 0)
+            return idx;
+
+        int err = sp_muxer_add_stream(dst_mux_ctx, cb_ctx->src_ref, idx);
+        if (err < 0)
+            return err;
+
+        src_fifo = sp_demuxer_get_stream_fifo(src_mux_ctx, idx);
+        if (!src_fifo)
+            return AVERROR(ENOMEM);
+
+        return sp_packet_fifo_mirror(dst_fifo, src_fifo);
+    } else if ((s_type == SP_TYPE_BSF) && (d_type == SP_TYPE_MUXER)) {
+        sp_assert(dst_fifo && src_fifo);
+
+        int err = sp_muxer_add_stream((MuxingContext *)dst_ctx, cb_ctx->src_ref, -1);
         if (err < 0)
             return err;
 
         return sp_packet_fifo_mirror(dst_fifo, src_fifo);
+    } else if ((s_type == SP_TYPE_DEMUXER) && (d_type == SP_TYPE_BSF)) {
+        return sp_bsf_connect_demuxer((BSFContext *)dst_ctx, (DemuxingContext *)src_ctx,
+                                      cb_ctx->src_stream_id, cb_ctx->src_stream_desc);
+    } else if ((s_type == SP_TYPE_ENCODER) && (d_type == SP_TYPE_BSF)) {
+        return sp_bsf_connect_encoder((BSFContext *)dst_ctx, (EncodingContext *)src_ctx);
     } else if ((s_type == SP_TYPE_DEMUXER) && (d_type == SP_TYPE_DECODER)) {
         DemuxingContext *src_mux_ctx = src_ctx;
         DecodingContext *dst_dec_ctx = dst_ctx;
@@ -244,6 +282,44 @@ static int link_fn(AVBufferRef *event_ref, void *callback_ctx, void *dst_ctx,
         }
 
         return sp_frame_fifo_mirror(dst_fifo, src_fifo);
+    } else if ((s_type == SP_TYPE_FILTER) && (d_type & SP_TYPE_SINK)) {
+        if (!dst_fifo) {
+            sp_log(dst_ctx, SP_LOG_ERROR, "Sink doesn't take frames!\n");
+            return AVERROR(EINVAL);
+        }
+
+        return sp_map_fifo_to_pad((FilterContext *)src_ctx, dst_fifo,
+                                  cb_ctx->src_filt_pad, 1);
+    } else if (((s_type == SP_TYPE_DECODER) || (s_type & SP_TYPE_SOURCE)) &&
+               (d_type & SP_TYPE_SINK)) {
+        if (!dst_fifo) {
+            sp_log(dst_ctx, SP_LOG_ERROR, "Sink doesn't take frames!\n");
+            return AVERROR(EINVAL);
+        }
+
+        return sp_frame_fifo_mirror(dst_fifo, src_fifo);
+    } else if (((s_type == SP_TYPE_ENCODER) || (s_type == SP_TYPE_BSF) ||
+                (s_type == SP_TYPE_DEMUXER)) && (d_type & SP_TYPE_SINK)) {
+        dst_fifo = ((IOSysEntry *)dst_ctx)->packets;
+        if (!dst_fifo) {
+            sp_log(dst_ctx, SP_LOG_ERROR, "Sink doesn't take packets!\n");
+            return AVERROR(EINVAL);
+        }
+
+        if (s_type == SP_TYPE_DEMUXER) {
+            DemuxingContext *src_mux_ctx = src_ctx;
+
+            int idx = sp_demuxer_find_stream(src_mux_ctx, cb_ctx->src_stream_id,
+                                             cb_ctx->src_stream_desc);
+            if (idx < 0)
+                return idx;
+
+            src_fifo = sp_demuxer_get_stream_fifo(src_mux_ctx, idx);
+            if (!src_fifo)
+                return AVERROR(ENOMEM);
+        }
+
+        return sp_packet_fifo_mirror(dst_fifo, src_fifo);
     } else {
         sp_assert(1); /* Should never happen */
     }
@@ -363,6 +439,30 @@ int sp_generic_link(TXMainContext *ctx,
         dst_ref = PICK_REF(obj1, obj2, SP_TYPE_ENCODER);
         src_ctrl_fn = sp_decoder_ctrl;
         dst_ctrl_fn = sp_encoder_ctrl;
+    } else if (EITHER(obj1, obj2, SP_TYPE_DEMUXER, SP_TYPE_MUXER)) {
+        src_ref = PICK_REF(obj1, obj2, SP_TYPE_DEMUXER);
+        dst_ref = PICK_REF(obj1, obj2, SP_TYPE_MUXER);
+        stream_id = src_stream_id;
+        stream_desc = av_strdup(src_stream_desc);
+        src_ctrl_fn = sp_demuxer_ctrl;
+        dst_ctrl_fn = sp_muxer_ctrl;
+    } else if (EITHER(obj1, obj2, SP_TYPE_BSF, SP_TYPE_MUXER)) {
+        src_ref = PICK_REF(obj1, obj2, SP_TYPE_BSF);
+        dst_ref = PICK_REF(obj1, obj2, SP_TYPE_MUXER);
+        src_ctrl_fn = sp_bsf_ctrl;
+        dst_ctrl_fn = sp_muxer_ctrl;
+    } else if (EITHER(obj1, obj2, SP_TYPE_DEMUXER, SP_TYPE_BSF)) {
+        src_ref = PICK_REF(obj1, obj2, SP_TYPE_DEMUXER);
+        dst_ref = PICK_REF(obj1, obj2, SP_TYPE_BSF);
+        stream_id = src_stream_id;
+        stream_desc = av_strdup(src_stream_desc);
+        src_ctrl_fn = sp_demuxer_ctrl;
+        dst_ctrl_fn = sp_bsf_ctrl;
+    } else if (EITHER(obj1, obj2, SP_TYPE_ENCODER, SP_TYPE_BSF)) {
+        src_ref = PICK_REF(obj1, obj2, SP_TYPE_ENCODER);
+        dst_ref = PICK_REF(obj1, obj2, SP_TYPE_BSF);
+        src_ctrl_fn = sp_encoder_ctrl;
+        dst_ctrl_fn = sp_bsf_ctrl;
     } else if (EITHER(obj1, obj2, SP_TYPE_DEMUXER, SP_TYPE_DECODER)) {
         src_ref = PICK_REF(obj1, obj2, SP_TYPE_DEMUXER);
         dst_ref = PICK_REF(obj1, obj2, SP_TYPE_DECODER);
@@ -370,6 +470,46 @@ int sp_generic_link(TXMainContext *ctx,
         stream_desc = av_strdup(src_stream_desc);
         src_ctrl_fn = sp_demuxer_ctrl;
         dst_ctrl_fn = sp_decoder_ctrl;
+    } else if (EITHER(obj1, obj2, SP_TYPE_FILTER, SP_TYPE_VIDEO_SINK) ||
+               EITHER(obj1, obj2, SP_TYPE_FILTER, SP_TYPE_AUDIO_SINK)) {
+        src_ref = PICK_REF(obj1, obj2, SP_TYPE_FILTER);
+        dst_ref = PICK_REF_INV(obj1, obj2, SP_TYPE_FILTER);
+        src_filt_pad = av_strdup(src_pad_name);
+        src_ctrl_fn = sp_filter_ctrl;
+        dst_ctrl_fn = ((IOSysEntry *)dst_ref->data)->ctrl;
+    } else if (EITHER(obj1, obj2, SP_TYPE_DECODER, SP_TYPE_VIDEO_SINK) ||
+               EITHER(obj1, obj2, SP_TYPE_DECODER, SP_TYPE_AUDIO_SINK)) {
+        src_ref = PICK_REF(obj1, obj2, SP_TYPE_DECODER);
+        dst_ref = PICK_REF_INV(obj1, obj2, SP_TYPE_DECODER);
+        src_ctrl_fn = sp_decoder_ctrl;
+        dst_ctrl_fn = ((IOSysEntry *)dst_ref->data)->ctrl;
+    } else if (EITHER(obj1, obj2, SP_TYPE_ENCODER, SP_TYPE_VIDEO_SINK) ||
+               EITHER(obj1, obj2, SP_TYPE_ENCODER, SP_TYPE_AUDIO_SINK)) {
+        src_ref = PICK_REF(obj1, obj2, SP_TYPE_ENCODER);
+        dst_ref = PICK_REF_INV(obj1, obj2, SP_TYPE_ENCODER);
+        src_ctrl_fn = sp_encoder_ctrl;
+        dst_ctrl_fn = ((IOSysEntry *)dst_ref->data)->ctrl;
+    } else if (EITHER(obj1, obj2, SP_TYPE_BSF, SP_TYPE_VIDEO_SINK) ||
+               EITHER(obj1, obj2, SP_TYPE_BSF, SP_TYPE_AUDIO_SINK)) {
+        src_ref = PICK_REF(obj1, obj2, SP_TYPE_BSF);
+        dst_ref = PICK_REF_INV(obj1, obj2, SP_TYPE_BSF);
+        src_ctrl_fn = sp_bsf_ctrl;
+        dst_ctrl_fn = ((IOSysEntry *)dst_ref->data)->ctrl;
+    } else if (EITHER(obj1, obj2, SP_TYPE_DEMUXER, SP_TYPE_VIDEO_SINK) ||
+               EITHER(obj1, obj2, SP_TYPE_DEMUXER, SP_TYPE_AUDIO_SINK)) {
+        src_ref = PICK_REF(obj1, obj2, SP_TYPE_DEMUXER);
+        dst_ref = PICK_REF_INV(obj1, obj2, SP_TYPE_DEMUXER);
+        stream_id = src_stream_id;
+        stream_desc = av_strdup(src_stream_desc);
+        src_ctrl_fn = sp_demuxer_ctrl;
+        dst_ctrl_fn = ((IOSysEntry *)dst_ref->data)->ctrl;
+    } else if (EITHER(obj1, obj2, SP_TYPE_VIDEO_SOURCE, SP_TYPE_VIDEO_SINK) ||
+               EITHER(obj1, obj2, SP_TYPE_AUDIO_SOURCE, SP_TYPE_AUDIO_SINK)) {
+        int first_src = sp_class_get_type(obj1->data) & SP_TYPE_SOURCE;
+        src_ref = av_buffer_ref(first_src ? obj1 : obj2);
+        dst_ref = av_buffer_ref(first_src ? obj2 : obj1);
+        src_ctrl_fn = ((IOSysEntry *)src_ref->data)->ctrl;
+        dst_ctrl_fn = ((IOSysEntry *)dst_ref->data)->ctrl;
     } else {
         sp_log(ctx, SP_LOG_ERROR, "Unable to link \"%s\" (%s) to \"%s\" (%s)!\n",
                sp_class_get_name(obj1->data), sp_class_type_string(obj1->data),
@@ -377,6 +517,19 @@ int sp_generic_link(TXMainContext *ctx,
         return AVERROR(EINVAL);
     }
 
+    /* Tell the demuxer which streams are used now, so that it can discard
+     * all others once started */
+    if (sp_class_get_type(src_ref->data) == SP_TYPE_DEMUXER) {
+        DemuxingContext *src_mux_ctx = (DemuxingContext *)src_ref->data;
+        int idx = sp_demuxer_find_stream(src_mux_ctx, stream_id, stream_desc);
+        if (idx < 0 || !sp_demuxer_get_stream_fifo(src_mux_ctx, idx)) {
+            av_free(stream_desc);
+            av_buffer_unref(&src_ref);
+            av_buffer_unref(&dst_ref);
+            return idx < 0 ? idx : AVERROR(ENOMEM);
+        }
+    }
+
     sp_log(ctx, SP_LOG_VERBOSE, "Linking \"%s\" (%s) to \"%s\" (%s)\n",
            sp_class_get_name(obj1->data), sp_class_type_string(obj1->data),
            sp_class_get_name(obj2->data), sp_class_type_string(obj2->data));
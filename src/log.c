@@ -689,12 +689,12 @@ int sp_class_set_name(void *ctx, const char *name)
     if (!class)
         return AVERROR(EINVAL);
 
-    pthread_mutex_lock(&class->lock);
-
     char *dup = av_strdup(name);
     if (!dup)
         return AVERROR(ENOMEM);
 
+    pthread_mutex_lock(&class->lock);
+
     av_free(class->name);
     class->name = dup;
 
@@ -26,6 +26,7 @@
 
 #include "cli.h"
 #include "iosys_common.h"
+#include "rawcap.h"
 
 #include <libtxproto/commit.h>
 #include <libtxproto/epoch.h>
@@ -33,6 +34,7 @@
 #include <libtxproto/demux.h>
 #include <libtxproto/encode.h>
 #include <libtxproto/decode.h>
+#include <libtxproto/bsf.h>
 #include <libtxproto/filter.h>
 #include <libtxproto/io.h>
 
@@ -40,6 +42,10 @@
 #include "interface_common.h"
 #endif
 
+#ifdef HAVE_SHM_RING
+#include "shm_ring.h"
+#endif
+
 #include "lua_generic_api.h"
 #include "lua_api_utils.h"
 
@@ -357,6 +363,9 @@ static int lua_generic_schedule(lua_State *L)
     case SP_TYPE_FILTER:
         fn = sp_filter_ctrl;
         break;
+    case SP_TYPE_BSF:
+        fn = sp_bsf_ctrl;
+        break;
     case SP_TYPE_AUDIO_SOURCE:
     case SP_TYPE_AUDIO_SINK:
     case SP_TYPE_AUDIO_BIDIR:
@@ -511,6 +520,67 @@ static int lua_create_interface(lua_State *L)
 }
 #endif
 
+static int lua_command_template(lua_State *L, ctrl_fn ctrl, int is_graph)
+{
+    int err = 0;
+    TXMainContext *ctx = lua_touserdata(L, lua_upvalueindex(1));
+    AVBufferRef *obj_ref = lua_touserdata(L, lua_upvalueindex(2));
+
+    LUA_CLEANUP_FN_DEFS(sp_class_get_name(obj_ref->data), "command")
+
+    /* (graph only) target, commands[] = values[], (optional) flags */
+    int args = lua_gettop(L);
+    if (args != (is_graph + 1) && args != (is_graph + 2))
+        LUA_ERROR("Invalid number of arguments, expected %i or %i, got %i!",
+                  is_graph + 1, is_graph + 2, args);
+    if (args == (is_graph + 2) && !lua_isstring(L, -1) && !lua_istable(L, -1))
+        LUA_ERROR("Invalid argument, expected \"string\" or \"table\" (flags), got \"%s\"!",
+                  lua_typename(L, lua_type(L, -1)));
+    if (!lua_istable(L, is_graph - args))
+        LUA_ERROR("Invalid argument, expected \"table\" (commands), got \"%s\"!",
+                  lua_typename(L, lua_type(L, is_graph - args)));
+    if (is_graph && !lua_isstring(L, -args))
+        LUA_ERROR("Invalid argument, expected \"string\" (target), got \"%s\"!",
+                  lua_typename(L, lua_type(L, -args)));
+
+    uint64_t flags = 0x0;
+    if (args == (is_graph + 2)) {
+        if (lua_isstring(L, -1))
+            err = sp_event_string_to_flags(ctx, &flags, lua_tostring(L, -1));
+        else
+            err = sp_lua_table_to_event_flags(ctx, L, &flags);
+        if (err < 0)
+            LUA_ERROR("Unable to parse given flags: %s", av_err2str(err));
+        lua_pop(L, 1);
+    }
+
+    flags |= SP_EVENT_CTRL_COMMAND;
+
+    AVDictionary *cmdlist = NULL;
+    err = sp_lua_parse_table_to_avdict(L, &cmdlist);
+    if (err < 0)
+        LUA_ERROR("Unable to parse command list: %s", av_err2str(err));
+
+    if (is_graph)
+        av_dict_set(&cmdlist, "sp_filter_target", lua_tostring(L, -2), 0);
+
+    err = ctrl(obj_ref, flags, cmdlist);
+    if (err < 0)
+         LUA_ERROR("Unable to process command: %s", av_err2str(err));
+
+    if (!(flags & SP_EVENT_FLAG_IMMEDIATE))
+        sp_add_commit_fn_to_list(ctx, ctrl, obj_ref);
+
+    av_dict_free(&cmdlist);
+
+    return 0;
+}
+
+static int lua_muxer_command(lua_State *L)
+{
+    return lua_command_template(L, sp_muxer_ctrl, 0);
+}
+
 static int lua_create_muxer(lua_State *L)
 {
     int err;
@@ -527,6 +597,18 @@ static int lua_create_muxer(lua_State *L)
     GET_OPT_STR(mctx->name, "name");
     GET_OPT_STR(mctx->out_url, "out_url");
     GET_OPT_STR(mctx->out_format, "out_format");
+    GET_OPTS_DICT(mctx->io_opts, "io_options");
+    GET_OPT_NUM(mctx->replay_max_bytes, "replay_max_bytes");
+
+    double replay = 0.0;
+    GET_OPT_NUM(replay, "replay");
+    mctx->replay_duration = replay * AV_TIME_BASE;
+
+    double segment_duration = 0.0;
+    GET_OPT_NUM(segment_duration, "segment_duration");
+    mctx->segment_duration = segment_duration * AV_TIME_BASE;
+    GET_OPT_NUM(mctx->segment_size, "segment_size");
+    GET_OPT_NUM(mctx->segment_idx, "segment_start_number");
 
     err = sp_muxer_init(mctx_ref);
     if (err < 0)
@@ -550,6 +632,7 @@ static int lua_create_muxer(lua_State *L)
         { "ctrl", sp_lua_generic_ctrl },
         { "schedule", lua_generic_schedule },
         { "link", sp_lua_generic_link },
+        { "command", lua_muxer_command },
         { "destroy", lua_generic_destroy },
         { NULL, NULL },
     };
@@ -559,6 +642,11 @@ static int lua_create_muxer(lua_State *L)
     return 1;
 }
 
+static int lua_demuxer_command(lua_State *L)
+{
+    return lua_command_template(L, sp_demuxer_ctrl, 0);
+}
+
 static int lua_create_demuxer(lua_State *L)
 {
     int err;
@@ -576,12 +664,29 @@ static int lua_create_demuxer(lua_State *L)
     GET_OPT_STR(mctx->in_url, "in_url");
     GET_OPT_STR(mctx->in_format, "in_format");
     GET_OPTS_DICT(mctx->start_options, "options");
+    GET_OPTS_DICT(mctx->io_opts, "io_options");
+    GET_OPTS_LIST(mctx->playlist, "playlist");
+    GET_OPT_BOOL(mctx->playlist_loop, "loop");
+    GET_OPT_NUM(mctx->probesize, "probesize");
+    GET_OPT_NUM(mctx->fpsprobesize, "fpsprobesize");
+    GET_OPT_BOOL(mctx->async_init, "async_init");
+
+    double analyzeduration = 0.0;
+    GET_OPT_NUM(analyzeduration, "analyzeduration");
+    mctx->analyzeduration = analyzeduration * AV_TIME_BASE;
+
+    const char *info_cache = NULL;
+    GET_OPT_STR(info_cache, "info_cache");
+    if (info_cache && !(mctx->info_cache = av_strdup(info_cache)))
+        LUA_ERROR("Unable to init demuxer: %s!", av_err2str(AVERROR(ENOMEM)));
 
     err = sp_demuxer_init(mctx_ref);
     if (err < 0)
         LUA_ERROR("Unable to init demuxer: %s!", av_err2str(err));
 
-    GET_OPTS_CLASS(mctx->avf, "options");
+    /* Already given on open, and the context may still be probing */
+    if (!mctx->async_init)
+        GET_OPTS_CLASS(mctx->avf, "options");
 
     AVDictionary *init_opts = NULL;
     GET_OPTS_DICT(init_opts, "priv_options");
@@ -599,6 +704,7 @@ static int lua_create_demuxer(lua_State *L)
         { "ctrl", sp_lua_generic_ctrl },
         { "schedule", lua_generic_schedule },
         { "link", sp_lua_generic_link },
+        { "command", lua_demuxer_command },
         { "destroy", lua_generic_destroy },
         { NULL, NULL },
     };
@@ -608,6 +714,11 @@ static int lua_create_demuxer(lua_State *L)
     return 1;
 }
 
+static int lua_encoder_command(lua_State *L)
+{
+    return lua_command_template(L, sp_encoder_ctrl, 0);
+}
+
 static int lua_create_encoder(lua_State *L)
 {
     int err;
@@ -690,6 +801,7 @@ static int lua_create_encoder(lua_State *L)
         { "ctrl", sp_lua_generic_ctrl },
         { "schedule", lua_generic_schedule },
         { "link", sp_lua_generic_link },
+        { "command", lua_encoder_command },
         { "destroy", lua_generic_destroy },
         { NULL, NULL },
     };
@@ -750,6 +862,57 @@ static int lua_create_decoder(lua_State *L)
     return 1;
 }
 
+static int lua_create_bsf(lua_State *L)
+{
+    int err;
+    TXMainContext *ctx = lua_touserdata(L, lua_upvalueindex(1));
+
+    LUA_CLEANUP_FN_DEFS(sp_class_get_name(ctx), "create_bsf")
+    LUA_INTERFACE_BOILERPLATE();
+
+    AVBufferRef *bctx_ref = sp_bsf_alloc();
+    BSFContext *bctx = (BSFContext *)bctx_ref->data;
+
+    LUA_SET_CLEANUP(bctx_ref);
+
+    GET_OPT_STR(bctx->filters, "filters");
+    if (!bctx->filters)
+        LUA_ERROR("No bitstream filters specified!");
+
+    GET_OPTS_DICT(bctx->bsf_opts, "options");
+
+    GET_OPT_STR(bctx->name, "name");
+    err = sp_bsf_init(bctx_ref);
+    if (err < 0)
+        LUA_ERROR("Unable to init bitstream filter: %s!", av_err2str(err));
+
+    SET_OPT_STR(sp_class_get_name(bctx), "name");
+
+    AVDictionary *init_opts = NULL;
+    GET_OPTS_DICT(init_opts, "priv_options");
+    if (init_opts) {
+        err = sp_bsf_ctrl(bctx_ref, SP_EVENT_CTRL_OPTS | SP_EVENT_FLAG_IMMEDIATE, init_opts);
+        if (err < 0)
+            LUA_ERROR("Unable to set options: %s!", av_err2str(err));
+    }
+    av_dict_free(&init_opts);
+
+    sp_bufferlist_append_noref(ctx->ext_buf_refs, bctx_ref);
+
+    void *contexts[] = { ctx, bctx_ref };
+    static const struct luaL_Reg lua_fns[] = {
+        { "ctrl", sp_lua_generic_ctrl },
+        { "schedule", lua_generic_schedule },
+        { "link", sp_lua_generic_link },
+        { "destroy", lua_generic_destroy },
+        { NULL, NULL },
+    };
+
+    LUA_PUSH_CONTEXTED_INTERFACE(L, lua_fns, contexts);
+
+    return 1;
+}
+
 static int lua_create_io(lua_State *L)
 {
     TXMainContext *ctx = lua_touserdata(L, lua_upvalueindex(1));
@@ -793,65 +956,107 @@ static int lua_create_io(lua_State *L)
     return 1;
 }
 
-static int lua_filter_command_template(lua_State *L, int is_graph)
+static int lua_create_rawcap(lua_State *L)
 {
-    int err = 0;
+    int err;
     TXMainContext *ctx = lua_touserdata(L, lua_upvalueindex(1));
-    AVBufferRef *obj_ref = lua_touserdata(L, lua_upvalueindex(2));
 
-    LUA_CLEANUP_FN_DEFS(sp_class_get_name(obj_ref->data), "command")
+    LUA_CLEANUP_FN_DEFS(sp_class_get_name(ctx), "create_rawcap")
+    LUA_INTERFACE_BOILERPLATE();
 
-    /* (graph only) target, commands[] = values[], (optional) flags */
-    int args = lua_gettop(L);
-    if (args != (is_graph + 1) && args != (is_graph + 2))
-        LUA_ERROR("Invalid number of arguments, expected %i or %i, got %i!",
-                  is_graph + 1, is_graph + 2, args);
-    if (args == (is_graph + 2) && !lua_isstring(L, -1) && !lua_istable(L, -1))
-        LUA_ERROR("Invalid argument, expected \"string\" or \"table\" (flags), got \"%s\"!",
-                  lua_typename(L, lua_type(L, -1)));
-    if (!lua_istable(L, is_graph - args))
-        LUA_ERROR("Invalid argument, expected \"table\" (commands), got \"%s\"!",
-                  lua_typename(L, lua_type(L, is_graph - args)));
-    if (is_graph && !lua_isstring(L, -args))
-        LUA_ERROR("Invalid argument, expected \"string\" (target), got \"%s\"!",
-                  lua_typename(L, lua_type(L, -args)));
+    const char *path = NULL;
+    GET_OPT_STR(path, "path");
+    if (!path)
+        LUA_ERROR("Missing option \"%s\"!", "path");
 
-    uint64_t flags = 0x0;
-    if (args == (is_graph + 2)) {
-        if (lua_isstring(L, -1))
-            err = sp_event_string_to_flags(ctx, &flags, lua_tostring(L, -1));
-        else
-            err = sp_lua_table_to_event_flags(ctx, L, &flags);
-        if (err < 0)
-            LUA_ERROR("Unable to parse given flags: %s", av_err2str(err));
-        lua_pop(L, 1);
-    }
+    const char *type_str = "video";
+    GET_OPT_STR(type_str, "type");
 
-    flags |= SP_EVENT_CTRL_COMMAND;
+    enum AVMediaType type;
+    if (!strcmp(type_str, "video"))
+        type = AVMEDIA_TYPE_VIDEO;
+    else if (!strcmp(type_str, "audio"))
+        type = AVMEDIA_TYPE_AUDIO;
+    else
+        LUA_ERROR("Invalid type \"%s\"!", type_str);
 
-    AVDictionary *cmdlist = NULL;
-    err = sp_lua_parse_table_to_avdict(L, &cmdlist);
-    if (err < 0)
-        LUA_ERROR("Unable to parse command list: %s", av_err2str(err));
+    AVDictionary *opts = NULL;
+    GET_OPTS_DICT(opts, "options");
 
-    if (is_graph)
-        av_dict_set(&cmdlist, "sp_filter_target", lua_tostring(L, -2), 0);
+    AVBufferRef *entry = sp_rawcap_sink_create(ctx, path, type, opts);
+    av_dict_free(&opts);
+    if (!entry)
+        LUA_ERROR("Unable to create raw capture sink for \"%s\"!", path);
 
-    err = sp_filter_ctrl(obj_ref, flags, cmdlist);
-    if (err < 0)
-         LUA_ERROR("Unable to process command: %s", av_err2str(err));
+    sp_bufferlist_append_noref(ctx->ext_buf_refs, entry);
 
-    if (!(flags & SP_EVENT_FLAG_IMMEDIATE))
-        sp_add_commit_fn_to_list(ctx, sp_filter_ctrl, obj_ref);
+    void *contexts[] = { ctx, entry };
+    static const struct luaL_Reg lua_fns[] = {
+        { "ctrl", sp_lua_generic_ctrl },
+        { "schedule", lua_generic_schedule },
+        { "link", sp_lua_generic_link },
+        { "destroy", lua_generic_destroy },
+        { NULL, NULL },
+    };
 
-    av_dict_free(&cmdlist);
+    LUA_PUSH_CONTEXTED_INTERFACE(L, lua_fns, contexts);
 
-    return 0;
+    return 1;
+}
+
+#ifdef HAVE_SHM_RING
+static int lua_create_shm_sink(lua_State *L)
+{
+    int err;
+    TXMainContext *ctx = lua_touserdata(L, lua_upvalueindex(1));
+
+    LUA_CLEANUP_FN_DEFS(sp_class_get_name(ctx), "create_shm_sink")
+    LUA_INTERFACE_BOILERPLATE();
+
+    const char *name = NULL;
+    GET_OPT_STR(name, "name");
+    if (!name)
+        LUA_ERROR("Missing option \"%s\"!", "name");
+
+    const char *type_str = "video";
+    GET_OPT_STR(type_str, "type");
+
+    enum AVMediaType type;
+    if (!strcmp(type_str, "video"))
+        type = AVMEDIA_TYPE_VIDEO;
+    else if (!strcmp(type_str, "audio"))
+        type = AVMEDIA_TYPE_AUDIO;
+    else
+        LUA_ERROR("Invalid type \"%s\"!", type_str);
+
+    AVDictionary *opts = NULL;
+    GET_OPTS_DICT(opts, "options");
+
+    AVBufferRef *entry = sp_shm_sink_create(ctx, name, type, opts);
+    av_dict_free(&opts);
+    if (!entry)
+        LUA_ERROR("Unable to create shared memory sink \"%s\"!", name);
+
+    sp_bufferlist_append_noref(ctx->ext_buf_refs, entry);
+
+    void *contexts[] = { ctx, entry };
+    static const struct luaL_Reg lua_fns[] = {
+        { "ctrl", sp_lua_generic_ctrl },
+        { "schedule", lua_generic_schedule },
+        { "link", sp_lua_generic_link },
+        { "destroy", lua_generic_destroy },
+        { NULL, NULL },
+    };
+
+    LUA_PUSH_CONTEXTED_INTERFACE(L, lua_fns, contexts);
+
+    return 1;
 }
+#endif
 
 static int lua_filter_command(lua_State *L)
 {
-    return lua_filter_command_template(L, 0);
+    return lua_command_template(L, sp_filter_ctrl, 0);
 }
 
 static int lua_create_filter(lua_State *L)
@@ -932,7 +1137,7 @@ static int lua_create_filter(lua_State *L)
 
 static int lua_filtergraph_command(lua_State *L)
 {
-    return lua_filter_command_template(L, 1);
+    return lua_command_template(L, sp_filter_ctrl, 1);
 }
 
 static int lua_create_filtergraph(lua_State *L)
@@ -1546,6 +1751,11 @@ const struct luaL_Reg sp_lua_lib_fns[] = {
     { "create_demuxer", lua_create_demuxer },
     { "create_encoder", lua_create_encoder },
     { "create_decoder", lua_create_decoder },
+    { "create_bsf", lua_create_bsf },
+    { "create_rawcap", lua_create_rawcap },
+#ifdef HAVE_SHM_RING
+    { "create_shm_sink", lua_create_shm_sink },
+#endif
     { "create_filter", lua_create_filter },
     { "create_filtergraph", lua_create_filtergraph },
 #ifdef HAVE_INTERFACE
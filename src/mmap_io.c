@@ -0,0 +1,220 @@
+/*
+ * This file is part of txproto.
+ *
+ * txproto is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * txproto is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with txproto; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <libavutil/mem.h>
+#include <libavutil/avstring.h>
+
+#include <libtxproto/utils.h>
+#include <libtxproto/log.h>
+#include "mmap_io.h"
+
+/* Only used for probing and small reads, packets bypass it */
+#define AVIO_BUFFER_SIZE (32 << 10)
+
+struct SPMmapIO {
+    void *log_ctx;
+    AVIOContext *pb;
+
+    uint8_t *map;
+    int64_t size;
+    int64_t pos;
+
+    /* The kernel gets told about the next window once we're halfway in */
+    int64_t readahead;
+    int64_t advised_end;
+};
+
+static void advise_window(SPMmapIO *s, int64_t from)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    int64_t start = from & ~((int64_t)page - 1);
+    int64_t end = SPMIN(from + s->readahead, s->size);
+
+    if (start >= end)
+        return;
+
+    posix_madvise(s->map + start, end - start, POSIX_MADV_WILLNEED);
+    s->advised_end = end;
+}
+
+static int mmap_read(void *opaque, uint8_t *buf, int buf_size)
+{
+    SPMmapIO *s = opaque;
+
+    if (s->pos >= s->size)
+        return AVERROR_EOF;
+
+    int len = SPMIN(buf_size, s->size - s->pos);
+    memcpy(buf, s->map + s->pos, len);
+    s->pos += len;
+
+    if ((s->advised_end < s->size) &&
+        (s->pos > (s->advised_end - (s->readahead >> 1))))
+        advise_window(s, s->advised_end);
+
+    return len;
+}
+
+static int64_t mmap_seek(void *opaque, int64_t offset, int whence)
+{
+    SPMmapIO *s = opaque;
+    int64_t pos;
+
+    if (whence & AVSEEK_SIZE)
+        return s->size;
+
+    switch (whence & ~AVSEEK_FORCE) {
+    case SEEK_SET: pos = offset;          break;
+    case SEEK_CUR: pos = s->pos + offset; break;
+    case SEEK_END: pos = s->size + offset; break;
+    default:       return AVERROR(EINVAL);
+    }
+
+    if (pos < 0)
+        return AVERROR(EINVAL);
+
+    /* Jumped outside of what the kernel's already reading */
+    if ((pos < s->pos) || (pos > s->advised_end))
+        advise_window(s, SPMIN(pos, s->size));
+
+    s->pos = pos;
+
+    return pos;
+}
+
+int sp_mmap_io_open(void *log_ctx, SPMmapIO **s_ptr, AVIOContext **pb,
+                    const char *url, AVDictionary *opts)
+{
+    int err;
+    const char *tmp_val;
+
+    *s_ptr = NULL;
+
+    int enabled = av_strstart(url, SP_MMAP_IO_PREFIX, &url);
+    if ((tmp_val = dict_get(opts, "map_file")))
+        enabled |= !strcmp(tmp_val, "true") || strtol(tmp_val, NULL, 10) != 0;
+    if (!enabled)
+        return 0;
+
+    av_strstart(url, "file:", &url);
+
+    SPMmapIO *s = av_mallocz(sizeof(*s));
+    if (!s)
+        return AVERROR(ENOMEM);
+
+    s->log_ctx = log_ctx;
+    s->map = MAP_FAILED;
+    s->readahead = 16 << 20;
+
+    if ((tmp_val = dict_get(opts, "map_readahead"))) {
+        int64_t val = strtoll(tmp_val, NULL, 10);
+        if (val <= 0)
+            sp_log(log_ctx, SP_LOG_ERROR, "Invalid read-ahead \"%s\"!\n", tmp_val);
+        else
+            s->readahead = val;
+    }
+
+    int oflags = O_RDONLY;
+#ifdef O_CLOEXEC
+    oflags |= O_CLOEXEC;
+#endif
+    int fd = open(url, oflags);
+    if (fd < 0) {
+        err = AVERROR(errno);
+        sp_log(log_ctx, SP_LOG_ERROR, "Couldn't open %s: %s!\n", url, av_err2str(err));
+        goto fail;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        err = AVERROR(errno);
+        close(fd);
+        goto fail;
+    } else if (!S_ISREG(st.st_mode) || !st.st_size) {
+        sp_log(log_ctx, SP_LOG_ERROR, "Unable to map %s: not a regular, "
+               "non-empty file!\n", url);
+        close(fd);
+        err = AVERROR(EINVAL);
+        goto fail;
+    }
+
+    s->size = st.st_size;
+    s->map = mmap(NULL, s->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    err = AVERROR(errno);
+    close(fd); /* The mapping holds its own reference */
+    if (s->map == MAP_FAILED) {
+        sp_log(log_ctx, SP_LOG_ERROR, "Unable to map %s: %s!\n", url, av_err2str(err));
+        goto fail;
+    }
+
+    posix_madvise(s->map, s->size, POSIX_MADV_SEQUENTIAL);
+    advise_window(s, 0);
+
+    uint8_t *avio_buf = av_malloc(AVIO_BUFFER_SIZE);
+    if (!avio_buf) {
+        err = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    s->pb = avio_alloc_context(avio_buf, AVIO_BUFFER_SIZE, 0, s,
+                               mmap_read, NULL, mmap_seek);
+    if (!s->pb) {
+        av_free(avio_buf);
+        err = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    /* Reads and seeks are free, so let lavf read packets straight from the
+     * mapping into their own memory instead of through the AVIO buffer */
+    s->pb->direct = 1;
+
+    sp_log(log_ctx, SP_LOG_VERBOSE, "Mapped %s, %" PRIi64 " bytes\n", url, s->size);
+
+    *pb = s->pb;
+    *s_ptr = s;
+
+    return 1;
+
+fail:
+    sp_mmap_io_close(&s);
+    return err;
+}
+
+void sp_mmap_io_close(SPMmapIO **s_ptr)
+{
+    SPMmapIO *s = *s_ptr;
+    if (!s)
+        return;
+
+    if (s->pb) {
+        av_freep(&s->pb->buffer);
+        avio_context_free(&s->pb);
+    }
+
+    if (s->map != MAP_FAILED)
+        munmap(s->map, s->size);
+
+    av_freep(s_ptr);
+}
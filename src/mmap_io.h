@@ -0,0 +1,41 @@
+/*
+ * This file is part of txproto.
+ *
+ * txproto is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * txproto is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with txproto; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <libavformat/avio.h>
+#include <libavutil/dict.h>
+
+/* A read-only AVIOContext over a memory-mapped local file. Reads go
+ * straight from the mapping into the caller's memory without syscalls,
+ * while the kernel is asked to read ahead of the current position.
+ *
+ * Used for "mmap://" URLs, or when the options contain:
+ *     map_file        - "true" or 1
+ *     map_readahead   - size of the read-ahead window, in bytes (default 16 MiB)
+ */
+typedef struct SPMmapIO SPMmapIO;
+
+#define SP_MMAP_IO_PREFIX "mmap://"
+
+/* Returns 0 and leaves *s NULL if neither the URL nor the options ask for
+ * mapping, 1 if mapped */
+int sp_mmap_io_open(void *log_ctx, SPMmapIO **s, AVIOContext **pb,
+                    const char *url, AVDictionary *opts);
+
+void sp_mmap_io_close(SPMmapIO **s);
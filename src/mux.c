@@ -16,227 +16,1680 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include <time.h>
+#include <unistd.h>
 #include <libavutil/time.h>
 #include <libavutil/avstring.h>
+#include <libavutil/opt.h>
+#include <libavcodec/bsf.h>
 
 #include <libtxproto/mux.h>
+#include <libtxproto/demux.h>
+#include <libtxproto/bsf.h>
 
 #include <libtxproto/utils.h>
 #include "utils.h"
 #include "ctrl_template.h"
 #include "os_compat.h"
+#include "async_io.h"
+#include "paced_io.h"
+#include "replay_ring.h"
+#include "interleave.h"
 
 typedef struct MuxEncoderMap {
     intptr_t encoder_id;
+    int src_stream; /* Demuxer stream index when copying, -1 for encoders */
     int stream_index;
     char *name;
+
+    /* Stream copy */
+    AVBSFContext *bsf;
+    int bsf_eof;
+
+    /* Adaptive bitrate */
+    AVBufferRef *enc_ref;
+    int64_t abr_initial_bitrate;
+    int64_t abr_bitrate;
+
+    /* Stats of the current window, only touched by the muxing thread */
+    int64_t win_start;
+    int64_t win_bytes;
+    int64_t win_packets;
+    int64_t win_latency;
+    int64_t win_latency_max;
+    int64_t win_queue_time;
+    int64_t total_bytes;
+    int64_t total_packets;
+
+    /* Published once per window, under stats_lock */
+    SPMuxerStreamStats stats;
 } MuxEncoderMap;
 
-static MuxEncoderMap *enc_id_lookup(MuxingContext *ctx, intptr_t enc_id)
-{
-    for (int i = 0; i < ctx->enc_map_size; i++)
-        if (ctx->enc_map[i].encoder_id == enc_id)
-            return &ctx->enc_map[i];
+typedef struct MuxABRState {
+    int64_t last_update;
+    int last_fifo_size;
+    int fifo_size;
+    int decision; /* -1 lowered, 0 held, 1 raised */
+    int64_t nb_lowered;
+    int64_t nb_raised;
+} MuxABRState;
+
+/* Used when the input FIFO has no upper bound */
+#define ABR_NOMINAL_FIFO_SIZE 64
+
+/* Stream stats are accumulated over this, then published */
+#define STATS_WINDOW 1000000
+
+static MuxEncoderMap *src_lookup(MuxingContext *ctx, AVPacket *pkt)
+{
+    for (int i = 0; i < ctx->enc_map_size; i++)
+        if ((ctx->enc_map[i].encoder_id == (intptr_t)pkt->opaque) &&
+            ((ctx->enc_map[i].src_stream < 0) ||
+             (ctx->enc_map[i].src_stream == pkt->stream_index)))
+            return &ctx->enc_map[i];
+    return NULL;
+}
+
+static MuxEncoderMap *stream_lookup(MuxingContext *ctx, int stream_index)
+{
+    for (int i = 0; i < ctx->enc_map_size; i++)
+        if (ctx->enc_map[i].stream_index == stream_index)
+            return &ctx->enc_map[i];
+    return NULL;
+}
+
+/* Accounts for a written packet. The window is published once it's over,
+ * which is the only time the stats lock is taken. */
+static void stream_stats_update(MuxingContext *ctx, MuxEncoderMap *m,
+                                AVPacket *pkt, int64_t arrival)
+{
+    int64_t now = av_gettime_relative();
+
+    int64_t latency = 0;
+    if (pkt->pts != AV_NOPTS_VALUE)
+        latency = now - ctx->epoch - av_rescale_q(pkt->pts, pkt->time_base, AV_TIME_BASE_Q);
+
+    if (!m->win_packets) {
+        m->win_latency_max = latency;
+        if (!m->win_start)
+            m->win_start = now;
+    }
+
+    m->win_bytes += pkt->size;
+    m->win_packets++;
+    m->win_latency += latency;
+    m->win_latency_max = SPMAX(m->win_latency_max, latency);
+    m->win_queue_time += now - arrival;
+    m->total_bytes += pkt->size;
+    m->total_packets++;
+
+    int64_t duration = now - m->win_start;
+    if (duration < STATS_WINDOW)
+        return;
+
+    pthread_mutex_lock(&ctx->stats_lock);
+    m->stats.bitrate = av_rescale(m->win_bytes << 3, AV_TIME_BASE, duration);
+    m->stats.packet_rate = av_rescale(m->win_packets, AV_TIME_BASE, duration);
+    m->stats.latency_avg = m->win_latency / m->win_packets;
+    m->stats.latency_max = m->win_latency_max;
+    m->stats.queue_time = m->win_queue_time / m->win_packets;
+    m->stats.bytes = m->total_bytes;
+    m->stats.packets = m->total_packets;
+    pthread_mutex_unlock(&ctx->stats_lock);
+
+    m->win_start = now;
+    m->win_bytes = 0;
+    m->win_packets = 0;
+    m->win_latency = 0;
+    m->win_queue_time = 0;
+}
+
+/* Pops the next packet to mux, running it through its stream's bitstream
+ * filter if it has one. *draining is the index of the map entry whose filter
+ * may still have output left, or -1. Once the input ends, all filters are
+ * flushed and drained before NULL is returned. */
+/* Waits for up to timeout microseconds for a packet if not negative, and sets
+ * timed_out if none came */
+static AVPacket *pop_packet(MuxingContext *ctx, int *draining, int *src_eof,
+                            int64_t timeout, int *timed_out)
+{
+    int err;
+    AVPacket *pkt;
+
+    while (1) {
+        if (*draining >= 0) {
+            MuxEncoderMap *m = &ctx->enc_map[*draining];
+
+            pkt = av_packet_alloc();
+            if (!pkt)
+                return NULL;
+
+            err = av_bsf_receive_packet(m->bsf, pkt);
+            if (!err) {
+                pkt->opaque = (void *)m->encoder_id;
+                pkt->stream_index = m->src_stream;
+                pkt->time_base = m->bsf->time_base_out;
+                return pkt;
+            } else if (err != AVERROR(EAGAIN) && err != AVERROR_EOF) {
+                sp_log(ctx, SP_LOG_ERROR, "Error filtering packet from \"%s\": %s!\n",
+                       m->name, av_err2str(err));
+            }
+
+            av_packet_free(&pkt);
+            *draining = -1;
+        }
+
+        if (*src_eof) {
+            MuxEncoderMap *m = NULL;
+            for (int i = 0; i < ctx->enc_map_size; i++) {
+                if (ctx->enc_map[i].bsf && !ctx->enc_map[i].bsf_eof) {
+                    m = &ctx->enc_map[i];
+                    break;
+                }
+            }
+            if (!m)
+                return NULL;
+
+            err = av_bsf_send_packet(m->bsf, NULL);
+            if (err < 0)
+                sp_log(ctx, SP_LOG_ERROR, "Error flushing filter of \"%s\": %s!\n",
+                       m->name, av_err2str(err));
+
+            m->bsf_eof = 1;
+            *draining = m - ctx->enc_map;
+            continue;
+        }
+
+        if (timeout >= 0) {
+            err = sp_packet_fifo_pop_timed(ctx->src_packets, &pkt, av_gettime() + timeout);
+            if (err == AVERROR(EAGAIN)) {
+                *timed_out = 1;
+                return NULL;
+            }
+        } else {
+            pkt = sp_packet_fifo_pop(ctx->src_packets);
+        }
+        if (!pkt) {
+            *src_eof = 1;
+            continue;
+        }
+
+        MuxEncoderMap *m = src_lookup(ctx, pkt);
+        if (sp_packet_is_flush_marker(pkt)) {
+            /* The source seeked, nothing to write */
+            if (m && m->bsf)
+                av_bsf_flush(m->bsf);
+            av_packet_free(&pkt);
+            continue;
+        }
+        if (!m || !m->bsf)
+            return pkt;
+
+        err = av_bsf_send_packet(m->bsf, pkt);
+        av_packet_free(&pkt);
+        if (err < 0)
+            sp_log(ctx, SP_LOG_ERROR, "Error filtering packet from \"%s\": %s!\n",
+                   m->name, av_err2str(err));
+
+        *draining = m - ctx->enc_map;
+    }
+}
+
+/* Lower the bitrate of all linked encoders as soon as the input queue starts
+ * building up, and slowly raise it back while the queue stays drained. */
+static void abr_update(MuxingContext *ctx, MuxABRState *s, int64_t mux_rate)
+{
+    int64_t now = av_gettime_relative();
+    if ((now - s->last_update) < ctx->abr_reaction_time)
+        return;
+
+    s->last_update = now;
+    s->decision = 0;
+
+    int fifo_max = sp_packet_fifo_get_max_size(ctx->src_packets);
+    if (fifo_max <= 0)
+        fifo_max = ABR_NOMINAL_FIFO_SIZE;
+
+    s->fifo_size = sp_packet_fifo_get_size(ctx->src_packets);
+    int growing = s->fifo_size > s->last_fifo_size;
+    int congested = (s->fifo_size > (fifo_max >> 1)) ||
+                    ((s->fifo_size > (fifo_max >> 3)) && growing);
+    int drained = (s->fifo_size <= (fifo_max >> 4)) && !growing;
+    s->last_fifo_size = s->fifo_size;
+
+    if (!congested && !drained)
+        return;
+
+    int64_t total = 0;
+    for (int i = 0; i < ctx->enc_map_size; i++)
+        total += ctx->enc_map[i].abr_bitrate;
+
+    for (int i = 0; i < ctx->enc_map_size; i++) {
+        MuxEncoderMap *m = &ctx->enc_map[i];
+        if (!m->enc_ref || !m->abr_bitrate)
+            continue;
+
+        int64_t max_rate = ctx->abr_max_bitrate ? ctx->abr_max_bitrate : m->abr_initial_bitrate;
+        int64_t min_rate = ctx->abr_min_bitrate ? ctx->abr_min_bitrate : max_rate / 10;
+        int64_t target;
+
+        if (congested) {
+            target = m->abr_bitrate - (m->abr_bitrate >> 2);
+            /* Never ask for more than what the output actually managed */
+            if (mux_rate > 0 && total > 0)
+                target = SPMIN(target, av_rescale(m->abr_bitrate, mux_rate - mux_rate / 10, total));
+        } else {
+            target = m->abr_bitrate + m->abr_bitrate / 10;
+        }
+
+        target = av_clip64(target, min_rate, SPMAX(min_rate, max_rate));
+        if (target == m->abr_bitrate)
+            continue;
+
+        int err = sp_encoder_set_bitrate((EncodingContext *)m->enc_ref->data, target);
+        if (err < 0) {
+            sp_log(ctx, SP_LOG_WARN, "Unable to change bitrate of \"%s\": %s, "
+                   "disabling adaptive bitrate for it!\n", m->name, av_err2str(err));
+            av_buffer_unref(&m->enc_ref);
+            continue;
+        }
+
+        sp_log(ctx, SP_LOG_VERBOSE, "%s bitrate of \"%s\" to %" PRIi64 " (queued: %i/%i, "
+               "output: %" PRIi64 ")\n",
+               congested ? "Lowering" : "Raising", m->name, target,
+               s->fifo_size, fifo_max, mux_rate);
+
+        m->abr_bitrate = target;
+        s->decision = congested ? -1 : 1;
+    }
+
+    if (s->decision < 0)
+        s->nb_lowered++;
+    else if (s->decision > 0)
+        s->nb_raised++;
+}
+
+/* Gives a new output context the same streams as another one */
+static int copy_streams(AVFormatContext *dst, AVFormatContext *src)
+{
+    for (int i = 0; i < src->nb_streams; i++) {
+        AVStream *ist = src->streams[i];
+        AVStream *st = avformat_new_stream(dst, NULL);
+        if (!st)
+            return AVERROR(ENOMEM);
+
+        int err = avcodec_parameters_copy(st->codecpar, ist->codecpar);
+        if (err < 0)
+            return err;
+
+        st->time_base           = ist->time_base;
+        st->avg_frame_rate      = ist->avg_frame_rate;
+        st->sample_aspect_ratio = ist->sample_aspect_ratio;
+        st->disposition         = ist->disposition;
+        av_dict_copy(&st->metadata, ist->metadata, 0);
+    }
+
+    return 0;
+}
+
+typedef struct MuxSegment {
+    AVFormatContext *avf;
+    SPAsyncIO *async_io;
+    SPPacedIO *paced_io;
+} MuxSegment;
+
+static int open_output(MuxingContext *ctx, MuxSegment *out)
+{
+    int err = 0;
+    AVFormatContext *avf = out->avf;
+
+    if (!(avf->oformat->flags & AVFMT_NOFILE)) {
+        err = sp_paced_io_open(ctx, &out->paced_io, &avf->pb, avf->url, ctx->io_opts);
+        if (!err)
+            err = sp_async_io_open(ctx, &out->async_io, &avf->pb, avf->url,
+                                   AVIO_FLAG_WRITE, ctx->io_opts);
+    }
+    if (!err || err == AVERROR(ENOTSUP))
+        err = avio_open(&avf->pb, avf->url, AVIO_FLAG_WRITE);
+    if (err < 0) {
+        sp_log(ctx, SP_LOG_ERROR, "Couldn't open %s: %s!\n", avf->url,
+               av_err2str(err));
+        return err;
+    }
+
+    return 0;
+}
+
+static void close_io(MuxingContext *ctx, AVIOContext **pb,
+                     SPAsyncIO **async_io, SPPacedIO **paced_io)
+{
+    int err = 0;
+
+    if (*paced_io) {
+        err = sp_paced_io_close(paced_io);
+        *pb = NULL;
+    } else if (*async_io) {
+        err = sp_async_io_close(async_io);
+        *pb = NULL;
+    } else {
+        avio_closep(pb);
+    }
+
+    if (err < 0)
+        sp_log(ctx, SP_LOG_ERROR, "Error closing output: %s!\n",
+               av_err2str(err));
+}
+
+static void close_output(MuxingContext *ctx, MuxSegment *out)
+{
+    close_io(ctx, &out->avf->pb, &out->async_io, &out->paced_io);
+}
+
+/* Closes the output the muxer is writing to */
+static void close_current_output(MuxingContext *ctx)
+{
+    MuxSegment cur = { ctx->avf, ctx->async_io, ctx->paced_io };
+    close_output(ctx, &cur);
+    ctx->async_io = NULL;
+    ctx->paced_io = NULL;
+}
+
+/* Segmented output. The next segment is opened and has its header written
+ * ahead of time, and finished segments get their trailer written and are
+ * closed, all on a separate thread, so that switching over is only a swap. */
+typedef struct MuxSegmenter {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int quit;
+
+    char *url_template;
+    int anchor_stream;     /* Segments start on its keyframes, or any if -1 */
+    int64_t start_ts;      /* Of the current segment, in microseconds */
+    int warned;
+
+    int prepare_idx; /* Next segment to open, or -1 */
+    int preparing;
+    MuxSegment next;
+    int next_idx;
+
+    MuxSegment *done;
+    int nb_done;
+} MuxSegmenter;
+
+static int segment_url(MuxSegmenter *s, int idx, char *buf, int size)
+{
+    if (av_get_frame_filename2(buf, size, s->url_template, idx, 0) < 0)
+        return AVERROR(EINVAL);
+    return 0;
+}
+
+/* Creates a new output from the template, with its header written */
+static int output_reopen(MuxingContext *ctx, const char *url, MuxSegment *out)
+{
+    int err;
+    AVFormatContext *tmpl = ctx->avf_template;
+    AVFormatContext *avf = NULL;
+    MuxSegment o = { 0 };
+
+    err = avformat_alloc_output_context2(&avf, tmpl->oformat, NULL, url);
+    if (err < 0)
+        return err;
+
+    err = copy_streams(avf, tmpl);
+    if (err < 0)
+        goto fail;
+
+    if (tmpl->priv_data && avf->priv_data) {
+        err = av_opt_copy(avf->priv_data, tmpl->priv_data);
+        if (err < 0)
+            goto fail;
+    }
+
+    avf->flags = tmpl->flags;
+    avf->avoid_negative_ts = tmpl->avoid_negative_ts;
+    avf->strict_std_compliance = tmpl->strict_std_compliance;
+
+    o.avf = avf;
+    err = open_output(ctx, &o);
+    if (err < 0)
+        goto fail;
+
+    if (ctx->low_latency && avf->pb)
+        avf->pb->min_packet_size = 0;
+
+    err = avformat_write_header(avf, NULL);
+    if (err < 0) {
+        sp_log(ctx, SP_LOG_ERROR, "Could not write header of %s: %s!\n",
+               url, av_err2str(err));
+        close_output(ctx, &o);
+        goto fail;
+    }
+
+    *out = o;
+
+    return 0;
+
+fail:
+    avformat_free_context(avf);
+    return err;
+}
+
+/* Keeps what's needed to open the output again, called before the header
+ * is written */
+static int output_template_init(MuxingContext *ctx)
+{
+    int err;
+
+    err = avformat_alloc_output_context2(&ctx->avf_template, ctx->avf->oformat, NULL, NULL);
+    if (err < 0)
+        return err;
+
+    err = copy_streams(ctx->avf_template, ctx->avf);
+    if (err < 0)
+        return err;
+
+    if (ctx->avf->priv_data && ctx->avf_template->priv_data) {
+        err = av_opt_copy(ctx->avf_template->priv_data, ctx->avf->priv_data);
+        if (err < 0)
+            return err;
+    }
+
+    ctx->avf_template->flags = ctx->avf->flags;
+    ctx->avf_template->avoid_negative_ts = ctx->avf->avoid_negative_ts;
+    ctx->avf_template->strict_std_compliance = ctx->avf->strict_std_compliance;
+
+    return 0;
+}
+
+static int segment_open(MuxingContext *ctx, int idx, MuxSegment *seg)
+{
+    char url[4096];
+
+    int err = segment_url(ctx->segmenter, idx, url, sizeof(url));
+    if (err < 0)
+        return err;
+
+    return output_reopen(ctx, url, seg);
+}
+
+static void segment_finish(MuxingContext *ctx, MuxSegment *seg)
+{
+    int err = av_write_trailer(seg->avf);
+    if (err < 0)
+        sp_log(ctx, SP_LOG_ERROR, "Error writing trailer of %s: %s!\n",
+               seg->avf->url, av_err2str(err));
+
+    close_output(ctx, seg);
+
+    sp_log(ctx, SP_LOG_VERBOSE, "Segment %s finished\n", seg->avf->url);
+
+    avformat_free_context(seg->avf);
+    seg->avf = NULL;
+}
+
+static void *segment_thread(void *arg)
+{
+    MuxingContext *ctx = arg;
+    MuxSegmenter *s = ctx->segmenter;
+
+    sp_set_thread_name_self("segmenter");
+
+    pthread_mutex_lock(&s->lock);
+
+    while (1) {
+        while (!s->quit && (s->prepare_idx < 0) && !s->nb_done)
+            pthread_cond_wait(&s->cond, &s->lock);
+
+        /* Opening the next one comes first, the muxer may be waiting on it */
+        if (s->prepare_idx >= 0) {
+            int idx = s->prepare_idx;
+            MuxSegment seg = { 0 };
+
+            s->prepare_idx = -1;
+            s->preparing = 1;
+            pthread_mutex_unlock(&s->lock);
+
+            int err = segment_open(ctx, idx, &seg);
+
+            pthread_mutex_lock(&s->lock);
+            s->preparing = 0;
+            if (err < 0) {
+                sp_log(ctx, SP_LOG_ERROR, "Unable to open segment %i: %s!\n",
+                       idx, av_err2str(err));
+            } else {
+                s->next = seg;
+                s->next_idx = idx;
+            }
+        } else if (s->nb_done) {
+            MuxSegment seg = s->done[0];
+            memmove(&s->done[0], &s->done[1], (s->nb_done - 1) * sizeof(*s->done));
+            s->nb_done--;
+
+            pthread_mutex_unlock(&s->lock);
+            segment_finish(ctx, &seg);
+            pthread_mutex_lock(&s->lock);
+        } else {
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&s->lock);
+
+    return NULL;
+}
+
+/* Called before the first header is written, after the template is made */
+static int segmenter_start(MuxingContext *ctx)
+{
+    MuxSegmenter *s = ctx->segmenter;
+
+    s->anchor_stream = av_find_best_stream(ctx->avf, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (s->anchor_stream < 0)
+        s->anchor_stream = -1;
+
+    s->prepare_idx = ctx->segment_idx + 1;
+    int err = pthread_create(&s->thread, NULL, segment_thread, ctx);
+    if (err) {
+        s->thread = 0;
+        return AVERROR(err);
+    }
+
+    return 0;
+}
+
+/* Switches over to the next segment if it's time, and it's ready. Returns 1
+ * if it did. Never waits on the segment thread. */
+static int segment_check(MuxingContext *ctx, AVPacket *pkt)
+{
+    MuxSegmenter *s = ctx->segmenter;
+
+    if (!(pkt->flags & AV_PKT_FLAG_KEY) ||
+        ((s->anchor_stream >= 0) && (pkt->stream_index != s->anchor_stream)))
+        return 0;
+
+    int64_t ts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+    if (ts != AV_NOPTS_VALUE)
+        ts = av_rescale_q(ts, pkt->time_base, AV_TIME_BASE_Q);
+
+    if (s->start_ts == AV_NOPTS_VALUE)
+        s->start_ts = ts;
+
+    int due = (ctx->segment_duration && (ts != AV_NOPTS_VALUE) &&
+               (s->start_ts != AV_NOPTS_VALUE) &&
+               ((ts - s->start_ts) >= ctx->segment_duration)) ||
+              (ctx->segment_size && ctx->avf->pb &&
+               (avio_tell(ctx->avf->pb) >= ctx->segment_size));
+    if (!due)
+        return 0;
+
+    pthread_mutex_lock(&s->lock);
+
+    if (!s->next.avf) {
+        /* Opening it failed, try again */
+        if (!s->preparing && (s->prepare_idx < 0)) {
+            s->prepare_idx = ctx->segment_idx + 1;
+            pthread_cond_signal(&s->cond);
+        }
+        if (!s->warned)
+            sp_log(ctx, SP_LOG_WARN, "Next segment not ready, extending the current one!\n");
+        s->warned = 1;
+        pthread_mutex_unlock(&s->lock);
+        return 0;
+    }
+
+    MuxSegment *done = av_realloc_array(s->done, s->nb_done + 1, sizeof(*done));
+    if (!done) {
+        pthread_mutex_unlock(&s->lock);
+        return 0;
+    }
+    s->done = done;
+    s->done[s->nb_done++] = (MuxSegment){ ctx->avf, ctx->async_io, ctx->paced_io };
+
+    ctx->avf = s->next.avf;
+    ctx->async_io = s->next.async_io;
+    ctx->paced_io = s->next.paced_io;
+    ctx->out_url = ctx->avf->url;
+    ctx->segment_idx = s->next_idx;
+
+    s->next = (MuxSegment){ 0 };
+    s->prepare_idx = ctx->segment_idx + 1;
+    s->start_ts = ts;
+    s->warned = 0;
+
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+
+    sp_log(ctx, SP_LOG_VERBOSE, "Switched to segment %s\n", ctx->out_url);
+
+    return 1;
+}
+
+static void segmenter_free(MuxingContext *ctx)
+{
+    MuxSegmenter *s = ctx->segmenter;
+    if (!s)
+        return;
+
+    if (s->thread) {
+        pthread_mutex_lock(&s->lock);
+        s->quit = 1;
+        s->prepare_idx = -1;
+        pthread_cond_signal(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+        pthread_join(s->thread, NULL);
+    }
+
+    /* Opened ahead, but never used */
+    if (s->next.avf) {
+        char *url = av_strdup(s->next.avf->url);
+        close_output(ctx, &s->next);
+        avformat_free_context(s->next.avf);
+        if (url) {
+            const char *path = url;
+            if (!strstr(path, "://") || av_strstart(path, "file:", &path))
+                unlink(path);
+            av_free(url);
+        }
+    }
+
+    av_free(s->done);
+    av_free(s->url_template);
+    pthread_cond_destroy(&s->cond);
+    pthread_mutex_destroy(&s->lock);
+    av_freep(&ctx->segmenter);
+}
+
+/* While the output is down, packets are held back in a ring starting at a
+ * keyframe, which is written out as soon as the output is reopened. The
+ * old output is closed and a new one opened on a separate thread, so that
+ * the muxing thread keeps taking in packets. */
+typedef struct MuxReconnectState {
+    MuxingContext *ctx;
+    int active;
+    char *url;
+    SPReplayRing *ring;
+    int64_t nb_reconnects;
+
+    /* Shared with the reconnect thread */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int quit;
+    int done;   /* Thread finished, with either an output or an error */
+    int err;
+    MuxSegment out;
+    int out_idx; /* Segment number of the new output */
+
+    /* Output which went down, closed by the thread */
+    AVIOContext *old_pb;
+    SPAsyncIO *old_async_io;
+    SPPacedIO *old_paced_io;
+} MuxReconnectState;
+
+#define RECONNECT_INITIAL_DELAY 250000
+
+/* Segments are never reopened, as that would truncate them. The next one is
+ * used instead, which may have already been prepared. */
+static int reconnect_open(MuxingContext *ctx, MuxReconnectState *rc)
+{
+    MuxSegmenter *s = ctx->segmenter;
+    if (!s)
+        return output_reopen(ctx, rc->url, &rc->out);
+
+    pthread_mutex_lock(&s->lock);
+
+    if (s->preparing || (s->prepare_idx >= 0)) {
+        pthread_mutex_unlock(&s->lock);
+        return AVERROR(EAGAIN);
+    } else if (s->next.avf) {
+        rc->out = s->next;
+        rc->out_idx = s->next_idx;
+        s->next = (MuxSegment){ 0 };
+        pthread_mutex_unlock(&s->lock);
+        return 0;
+    }
+
+    /* Only changes when switching segments, which is off while reconnecting */
+    rc->out_idx = ctx->segment_idx + 1;
+
+    pthread_mutex_unlock(&s->lock);
+
+    return segment_open(ctx, rc->out_idx, &rc->out);
+}
+
+static void *reconnect_thread(void *arg)
+{
+    MuxReconnectState *rc = arg;
+    MuxingContext *ctx = rc->ctx;
+    int err, attempts = 0;
+    int64_t delay = RECONNECT_INITIAL_DELAY;
+
+    sp_set_thread_name_self("reconnect");
+
+    /* Nothing more can be written to it, may block until it times out */
+    close_io(ctx, &rc->old_pb, &rc->old_async_io, &rc->old_paced_io);
+
+    pthread_mutex_lock(&rc->lock);
+
+    while (!rc->quit) {
+        pthread_mutex_unlock(&rc->lock);
+        err = reconnect_open(ctx, rc);
+        pthread_mutex_lock(&rc->lock);
+
+        if (err >= 0) {
+            break;
+        } else if (err != AVERROR(EAGAIN)) {
+            attempts++;
+            if (ctx->reconnect_max_attempts && (attempts >= ctx->reconnect_max_attempts)) {
+                sp_log(ctx, SP_LOG_ERROR, "Giving up reconnecting after %i attempts!\n",
+                       attempts);
+                rc->err = err;
+                break;
+            }
+
+            sp_log(ctx, SP_LOG_WARN, "Reconnect attempt %i failed: %s, retrying in %f s\n",
+                   attempts, av_err2str(err), delay / (double)AV_TIME_BASE);
+        }
+
+        int64_t deadline = av_gettime() + (err == AVERROR(EAGAIN) ? RECONNECT_INITIAL_DELAY : delay);
+        struct timespec ts = {
+            .tv_sec = deadline / AV_TIME_BASE,
+            .tv_nsec = (deadline % AV_TIME_BASE) * 1000,
+        };
+        while (!rc->quit &&
+               (pthread_cond_timedwait(&rc->cond, &rc->lock, &ts) != ETIMEDOUT))
+            ;
+
+        if (err != AVERROR(EAGAIN))
+            delay = SPMIN(delay << 1, ctx->reconnect_delay_max);
+    }
+
+    rc->done = 1;
+    pthread_mutex_unlock(&rc->lock);
+
+    return NULL;
+}
+
+/* Stops the reconnect thread, waiting for any attempt in progress, and
+ * drops an output it might have opened */
+static void reconnect_stop(MuxingContext *ctx, MuxReconnectState *rc)
+{
+    if (rc->thread) {
+        pthread_mutex_lock(&rc->lock);
+        rc->quit = 1;
+        pthread_cond_signal(&rc->cond);
+        pthread_mutex_unlock(&rc->lock);
+        pthread_join(rc->thread, NULL);
+        rc->thread = 0;
+    }
+
+    if (rc->out.avf) {
+        close_output(ctx, &rc->out);
+        avformat_free_context(rc->out.avf);
+        rc->out = (MuxSegment){ 0 };
+    }
+
+    sp_replay_ring_free(&rc->ring);
+    rc->active = 0;
+}
+
+/* Starts reconnecting, holding back the packets which couldn't be written */
+static int reconnect_begin(MuxingContext *ctx, MuxReconnectState *rc, int err,
+                           AVPacket **held, int nb_held)
+{
+    sp_log(ctx, SP_LOG_WARN, "Error muxing: %s, reconnecting!\n", av_err2str(err));
+
+    reconnect_stop(ctx, rc);
+
+    int anchor = av_find_best_stream(ctx->avf, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    rc->ring = sp_replay_ring_alloc(ctx->reconnect_buffer, ctx->reconnect_buffer_bytes,
+                                    anchor >= 0 ? anchor : -1);
+    av_free(rc->url);
+    rc->url = av_strdup(ctx->avf->url);
+    if (!rc->ring || !rc->url) {
+        sp_replay_ring_free(&rc->ring);
+        return AVERROR(ENOMEM);
+    }
+
+    /* The context stays, its streams' time bases remain in use until it's
+     * replaced, but its I/O is handed over to be closed */
+    rc->ctx = ctx;
+    rc->old_pb = ctx->avf->pb;
+    rc->old_async_io = ctx->async_io;
+    rc->old_paced_io = ctx->paced_io;
+    ctx->avf->pb = NULL;
+    ctx->async_io = NULL;
+    ctx->paced_io = NULL;
+
+    rc->quit = 0;
+    rc->done = 0;
+    rc->err = 0;
+
+    err = pthread_create(&rc->thread, NULL, reconnect_thread, rc);
+    if (err) {
+        rc->thread = 0;
+        close_io(ctx, &rc->old_pb, &rc->old_async_io, &rc->old_paced_io);
+        sp_replay_ring_free(&rc->ring);
+        return AVERROR(err);
+    }
+
+    rc->active = 1;
+
+    for (int i = 0; i < nb_held; i++) {
+        err = sp_replay_ring_push(rc->ring, held[i]);
+        if (err < 0)
+            return err;
+    }
+
+    return 0;
+}
+
+/* Buffers a packet, and switches over to the new output once the thread has
+ * opened it. Returns 1 once reconnected, a negative error when giving up.
+ * Never waits on the thread. */
+static int reconnect_step(MuxingContext *ctx, MuxReconnectState *rc, AVPacket *pkt)
+{
+    int err = sp_replay_ring_push(rc->ring, pkt);
+    if (err < 0)
+        return err;
+
+    pthread_mutex_lock(&rc->lock);
+    int done = rc->done;
+    pthread_mutex_unlock(&rc->lock);
+    if (!done)
+        return 0;
+
+    pthread_join(rc->thread, NULL);
+    rc->thread = 0;
+
+    if (rc->err < 0)
+        return rc->err;
+
+    AVPacket **pkts;
+    int nb_pkts;
+    err = sp_replay_ring_snapshot(rc->ring, &pkts, &nb_pkts);
+    sp_replay_ring_free(&rc->ring);
+    if (err < 0) {
+        reconnect_stop(ctx, rc);
+        return err;
+    }
+
+    avformat_free_context(ctx->avf);
+    ctx->avf = rc->out.avf;
+    ctx->async_io = rc->out.async_io;
+    ctx->paced_io = rc->out.paced_io;
+    ctx->out_url = ctx->avf->url;
+    rc->out = (MuxSegment){ 0 };
+    rc->active = 0;
+    rc->nb_reconnects++;
+
+    if (ctx->segmenter) {
+        MuxSegmenter *s = ctx->segmenter;
+        pthread_mutex_lock(&s->lock);
+        ctx->segment_idx = rc->out_idx;
+        s->prepare_idx = ctx->segment_idx + 1;
+        s->start_ts = AV_NOPTS_VALUE;
+        s->warned = 0;
+        pthread_cond_signal(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    sp_log(ctx, SP_LOG_INFO, "Reconnected to %s, sending %i held back packets\n",
+           ctx->out_url, nb_pkts);
+
+    int written;
+    for (written = 0; written < nb_pkts; written++) {
+        AVPacket *held = pkts[written];
+        AVRational dst_tb = ctx->avf->streams[held->stream_index]->time_base;
+        av_packet_rescale_ts(held, held->time_base, dst_tb);
+        held->time_base = dst_tb;
+        err = av_write_frame(ctx->avf, held);
+        if (err < 0)
+            break;
+    }
+
+    /* Went down again already, hold back whatever's left */
+    int down = err < 0;
+    if (down)
+        err = reconnect_begin(ctx, rc, err, pkts + written, nb_pkts - written);
+
+    for (int i = 0; i < nb_pkts; i++)
+        av_packet_free(&pkts[i]);
+    av_free(pkts);
+
+    if (down)
+        return err < 0 ? err : 0;
+
+    return 1;
+}
+
+/* Writes out a packet, in its source time base, or holds it back while the
+ * output is down. Returns 1 if the output was replaced. */
+static int write_packet(MuxingContext *ctx, MuxReconnectState *rc, AVPacket *pkt,
+                        int64_t arrival)
+{
+    int err, new_output = 0;
+
+    /* Output is down, hold back packets until it's back */
+    if (rc->active) {
+        err = reconnect_step(ctx, rc, pkt);
+        return err < 0 ? err : err > 0;
+    }
+
+    if (ctx->segmenter)
+        new_output = segment_check(ctx, pkt);
+
+    AVRational dst_tb = ctx->avf->streams[pkt->stream_index]->time_base;
+    av_packet_rescale_ts(pkt, pkt->time_base, dst_tb);
+    pkt->time_base = dst_tb;
+
+    /* Written out or not, the muxer is done with it */
+    MuxEncoderMap *m = stream_lookup(ctx, pkt->stream_index);
+    if (m)
+        stream_stats_update(ctx, m, pkt, arrival);
+
+    /* Already interleaved, or low latency */
+    err = av_write_frame(ctx->avf, pkt);
+    if (err == AVERROR(ETIMEDOUT)) {
+        sp_log(ctx, SP_LOG_ERROR, "Error muxing, operation timed out!\n");
+    } else if (err < 0 && ctx->reconnect) {
+        return reconnect_begin(ctx, rc, err, &pkt, 1);
+    } else if (err < 0) {
+        sp_log(ctx, SP_LOG_ERROR, "Error muxing: %s!\n", av_err2str(err));
+        return err;
+    }
+
+    return new_output;
+}
+
+static void *muxing_thread(void *arg)
+{
+    int err = 0;
+    MuxingContext *ctx = arg;
+    SPGenericData *stat_entries = NULL;
+    int nb_stat_entries = 0;
+    int64_t last_stats = av_gettime_relative();
+
+    sp_set_thread_name_self(sp_class_get_name(ctx));
+
+    if (ctx->dump_sdp_file) {
+        char sdp_data[16384];
+        err = av_sdp_create(&ctx->avf, 1, sdp_data, sizeof(sdp_data));
+        if (err < 0) {
+            sp_log(ctx, SP_LOG_WARN, "Unable to create an SDP: %s!\n", av_err2str(err));
+        } else {
+            FILE *sdp_file = fopen(ctx->dump_sdp_file, "w");
+            if (!sdp_file) {
+                sp_log(ctx, SP_LOG_WARN, "Unable to open SDP file for writing: %s!\n",
+                av_err2str(AVERROR(errno)));
+            } else {
+                size_t sdp_len = strlen(sdp_data) + 1;
+                fwrite(sdp_data, sdp_len, 1, sdp_file);
+                fclose(sdp_file);
+                sp_log(ctx, SP_LOG_INFO, "SDP file written to %s (%lu bytes)\n",
+                       ctx->dump_sdp_file, sdp_len);
+            }
+        }
+    }
+
+    if (ctx->dump_info)
+        av_dump_format(ctx->avf, 0, ctx->out_url, 1);
+
+    int flush = 0;
+    int fmt_can_flush = ctx->avf->oformat->flags & AVFMT_ALLOW_FLUSH;
+
+    /* Mux stats */
+    SlidingWinCtx sctx_mux = { 0 };
+    int64_t last_pos_update = av_gettime_relative();
+    int64_t mux_rate = 0;
+    int64_t last_pos = ctx->avf->pb->pos;
+    int64_t buf_bytes = 0;
+
+    MuxABRState abr = { .last_update = av_gettime_relative() };
+    int bsf_draining = -1, src_eof = 0;
+    MuxReconnectState rc = { .ctx = ctx };
+    int64_t pace_rate = 0, pace_delay = 0;
+    int64_t arrival = 0;
+
+    pthread_mutex_init(&rc.lock, NULL);
+    pthread_cond_init(&rc.cond, NULL);
+
+    SPInterleaver *il = NULL;
+    if (!ctx->low_latency) {
+        il = sp_interleaver_alloc(ctx->avf->nb_streams, ctx->max_interleave_delta);
+        if (!il) {
+            err = AVERROR(ENOMEM);
+            pthread_mutex_lock(&ctx->lock);
+            goto fail;
+        }
+    }
+
+    sp_log(ctx, SP_LOG_VERBOSE, "Muxer initialized!\n");
+
+    sp_eventlist_dispatch(ctx, ctx->events, SP_EVENT_ON_CONFIG | SP_EVENT_ON_INIT, NULL);
+
+    while (1) {
+        AVPacket *in_pkt = NULL;
+        pthread_mutex_lock(&ctx->lock);
+
+        sp_eventlist_dispatch(ctx, ctx->events, SP_EVENT_ON_CONFIG | SP_EVENT_ON_INIT, NULL);
+
+        if (!flush) {
+            /* Queued packets must go out once their time is up, even if no
+             * new ones come in */
+            int timed_out = 0;
+            int64_t timeout = il ? sp_interleaver_timeout(il) : -1;
+            in_pkt = pop_packet(ctx, &bsf_draining, &src_eof, timeout, &timed_out);
+            if (timed_out)
+                goto send;
+            flush = !in_pkt;
+        }
+
+        if (flush && rc.active) {
+            sp_log(ctx, SP_LOG_WARN, "Output still down, dropping held back packets!\n");
+            pthread_mutex_unlock(&ctx->lock);
+            break;
+        } else if (flush) {
+            goto send;
+        }
+
+        AVRational src_tb = in_pkt->time_base;
+        arrival = av_gettime_relative();
+
+        MuxEncoderMap *src_enc = src_lookup(ctx, in_pkt);
+        if (!src_enc) {
+            sp_log(ctx, SP_LOG_WARN, "Dropping packet from an unknown source!\n");
+            av_packet_free(&in_pkt);
+            pthread_mutex_unlock(&ctx->lock);
+            continue;
+        }
+
+        int sidx = src_enc->stream_index;
+
+        in_pkt->stream_index = sidx;
+
+        sp_log(ctx, SP_LOG_TRACE, "Got packet from \"%s\", sidx = %i, pts = %f, dts = %f\n",
+               src_enc->name,
+               sidx,
+               av_q2d(src_tb) * in_pkt->pts,
+               av_q2d(src_tb) * in_pkt->dts);
+
+        if (ctx->avf->pb) {
+            buf_bytes = ctx->avf->pb->buf_ptr - ctx->avf->pb->buffer;
+            if (last_pos != ctx->avf->pb->pos) {
+                int64_t t_delta, cur_time = av_gettime_relative();
+                mux_rate = (ctx->avf->pb->pos - last_pos) << 3;
+                t_delta = cur_time - last_pos_update;
+                mux_rate = av_rescale(mux_rate, 1000000, t_delta);
+                last_pos_update = cur_time;
+                last_pos = ctx->avf->pb->pos;
+                mux_rate = sp_sliding_win(&sctx_mux, mux_rate, cur_time, av_make_q(1, 1000000),
+                                          10000000, 1);
+            }
+        }
+
+        if (ctx->abr)
+            abr_update(ctx, &abr, mux_rate);
+
+send:
+        /* Write out everything which is ready, or everything left on EOS */
+        if (il && in_pkt) {
+            err = sp_interleaver_push(il, in_pkt);
+            if (err < 0) {
+                av_packet_free(&in_pkt);
+                goto fail;
+            }
+            in_pkt = sp_interleaver_pop(il, 0, &arrival);
+        } else if (il) {
+            in_pkt = sp_interleaver_pop(il, flush, &arrival);
+        }
+
+        while (in_pkt) {
+            err = write_packet(ctx, &rc, in_pkt, arrival);
+            av_packet_free(&in_pkt);
+            if (err < 0) {
+                goto fail;
+            } else if (err > 0) {
+                last_pos = ctx->avf->pb ? ctx->avf->pb->pos : 0;
+                last_pos_update = av_gettime_relative();
+            }
+            err = 0;
+
+            /* Held back packets can't be flushed anywhere */
+            if (flush && rc.active) {
+                sp_log(ctx, SP_LOG_WARN, "Output down, dropping held back packets!\n");
+                goto fail;
+            }
+
+            if (il)
+                in_pkt = sp_interleaver_pop(il, flush, &arrival);
+        }
+
+        if (flush) {
+            if (fmt_can_flush && !rc.active) {
+                err = av_write_frame(ctx->avf, NULL);
+                if (err < 0)
+                    sp_log(ctx, SP_LOG_ERROR, "Error flushing muxer: %s!\n", av_err2str(err));
+                err = 0;
+            }
+            pthread_mutex_unlock(&ctx->lock);
+            break;
+        }
+
+        /* Stream stats only change once per window */
+        int64_t now = av_gettime_relative();
+        if ((now - last_stats) < STATS_WINDOW) {
+            pthread_mutex_unlock(&ctx->lock);
+            continue;
+        }
+        last_stats = now;
+
+        int entries = 2 + 7*ctx->enc_map_size + 1;
+        if (ctx->abr)
+            entries += 4 + ctx->enc_map_size;
+        if (ctx->reconnect)
+            entries += 2;
+        if (ctx->paced_io)
+            entries += 2;
+        if (il)
+            entries += 2;
+        stat_entries = av_fast_realloc(stat_entries, &nb_stat_entries, sizeof(*stat_entries) * entries);
+
+        stat_entries[0] = D_TYPE("bitrate", NULL, mux_rate);
+        stat_entries[1] = D_TYPE("cached", NULL, buf_bytes);
+
+        int idx = 2;
+        for (int i = 0; i < ctx->enc_map_size; i++) {
+            MuxEncoderMap *m = &ctx->enc_map[i];
+            stat_entries[idx++] = D_TYPE("bitrate", m->name, m->stats.bitrate);
+            stat_entries[idx++] = D_TYPE("packet_rate", m->name, m->stats.packet_rate);
+            stat_entries[idx++] = D_TYPE("latency", m->name, m->stats.latency_avg);
+            stat_entries[idx++] = D_TYPE("latency_max", m->name, m->stats.latency_max);
+            stat_entries[idx++] = D_TYPE("queue_time", m->name, m->stats.queue_time);
+            stat_entries[idx++] = D_TYPE("bytes", m->name, m->stats.bytes);
+            stat_entries[idx++] = D_TYPE("packets", m->name, m->stats.packets);
+        }
+
+        if (ctx->abr) {
+            stat_entries[idx++] = D_TYPE("abr_decision", NULL, abr.decision);
+            stat_entries[idx++] = D_TYPE("abr_queued", NULL, abr.fifo_size);
+            stat_entries[idx++] = D_TYPE("abr_lowered", NULL, abr.nb_lowered);
+            stat_entries[idx++] = D_TYPE("abr_raised", NULL, abr.nb_raised);
+            for (int i = 0; i < ctx->enc_map_size; i++)
+                stat_entries[idx++] = D_TYPE("abr_bitrate", ctx->enc_map[i].name,
+                                             ctx->enc_map[i].abr_bitrate);
+        }
+
+        if (ctx->reconnect) {
+            stat_entries[idx++] = D_TYPE("reconnects", NULL, rc.nb_reconnects);
+            stat_entries[idx++] = D_TYPE("reconnecting", NULL, rc.active);
+        }
+
+        if (ctx->paced_io) {
+            sp_paced_io_stats(ctx->paced_io, &pace_rate, &pace_delay);
+            stat_entries[idx++] = D_TYPE("pace_rate", NULL, pace_rate);
+            stat_entries[idx++] = D_TYPE("pace_delay", NULL, pace_delay);
+        }
+
+        if (il) {
+            int64_t il_queued = sp_interleaver_queued(il);
+            int64_t il_delay = sp_interleaver_delay(il);
+            stat_entries[idx++] = D_TYPE("interleave_queued", NULL, il_queued);
+            stat_entries[idx++] = D_TYPE("interleave_delay", NULL, il_delay);
+        }
+
+        stat_entries[idx] = (SPGenericData){ 0 };
+
+        sp_eventlist_dispatch(ctx, ctx->events, SP_EVENT_ON_STATS, stat_entries);
+
+        pthread_mutex_unlock(&ctx->lock);
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+
+fail:
+    sp_interleaver_free(&il);
+    av_free(stat_entries);
+
+    pthread_mutex_unlock(&ctx->lock);
+
+    /* May wait on a reconnect attempt in progress to time out */
+    reconnect_stop(ctx, &rc);
+    av_free(rc.url);
+    pthread_cond_destroy(&rc.cond);
+    pthread_mutex_destroy(&rc.lock);
+
+    ctx->err = err;
+
+    sp_eventlist_dispatch(ctx, ctx->events, SP_EVENT_ON_EOS, &err);
+
     return NULL;
 }
 
-static void *muxing_thread(void *arg)
+/* Fills the replay buffer instead of writing packets out */
+static void *replay_thread(void *arg)
 {
     int err = 0;
     MuxingContext *ctx = arg;
-    SPGenericData *stat_entries = NULL;
-    int nb_stat_entries = 0;
-
-    /* Stream stats */
-    SlidingWinCtx *sctx_rate = av_mallocz(ctx->avf->nb_streams * sizeof(*sctx_rate));
-    SlidingWinCtx *sctx_latency = av_mallocz(ctx->avf->nb_streams * sizeof(*sctx_latency));
-    int64_t *rate = av_mallocz(ctx->avf->nb_streams * sizeof(*rate));
-    int64_t *latency = av_mallocz(ctx->avf->nb_streams * sizeof(*latency));
+    int bsf_draining = -1, src_eof = 0;
+    int64_t last_stats = 0;
 
     sp_set_thread_name_self(sp_class_get_name(ctx));
 
-    if (ctx->dump_sdp_file) {
-        char sdp_data[16384];
-        err = av_sdp_create(&ctx->avf, 1, sdp_data, sizeof(sdp_data));
-        if (err < 0) {
-            sp_log(ctx, SP_LOG_WARN, "Unable to create an SDP: %s!\n", av_err2str(err));
-        } else {
-            FILE *sdp_file = fopen(ctx->dump_sdp_file, "w");
-            if (!sdp_file) {
-                sp_log(ctx, SP_LOG_WARN, "Unable to open SDP file for writing: %s!\n",
-                av_err2str(AVERROR(errno)));
-            } else {
-                size_t sdp_len = strlen(sdp_data) + 1;
-                fwrite(sdp_data, sdp_len, 1, sdp_file);
-                fclose(sdp_file);
-                sp_log(ctx, SP_LOG_INFO, "SDP file written to %s (%lu bytes)\n",
-                       ctx->dump_sdp_file, sdp_len);
-            }
+    if (!ctx->replay) {
+        int anchor = av_find_best_stream(ctx->avf, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+        ctx->replay = sp_replay_ring_alloc(ctx->replay_duration, ctx->replay_max_bytes,
+                                           anchor >= 0 ? anchor : -1);
+        if (!ctx->replay) {
+            err = AVERROR(ENOMEM);
+            goto end;
         }
     }
 
-    if (ctx->dump_info)
-        av_dump_format(ctx->avf, 0, ctx->out_url, 1);
-
-    int flush = 0;
-    int fmt_can_flush = ctx->avf->oformat->flags & AVFMT_ALLOW_FLUSH;
-
-    /* Mux stats */
-    SlidingWinCtx sctx_mux = { 0 };
-    int64_t last_pos_update = av_gettime_relative();
-    int64_t mux_rate = 0;
-    int64_t last_pos = ctx->avf->pb->pos;
-    int64_t buf_bytes = 0;
-
-    sp_log(ctx, SP_LOG_VERBOSE, "Muxer initialized!\n");
+    sp_log(ctx, SP_LOG_VERBOSE, "Replay buffer initialized!\n");
 
     sp_eventlist_dispatch(ctx, ctx->events, SP_EVENT_ON_CONFIG | SP_EVENT_ON_INIT, NULL);
 
     while (1) {
-        AVPacket *in_pkt = NULL;
+        /* Streams are fixed once started, the lock only guards the buffer,
+         * so that dumps never wait on the next packet */
+        AVPacket *in_pkt = pop_packet(ctx, &bsf_draining, &src_eof);
+        if (!in_pkt)
+            break;
+
         pthread_mutex_lock(&ctx->lock);
 
-        sp_eventlist_dispatch(ctx, ctx->events, SP_EVENT_ON_CONFIG | SP_EVENT_ON_INIT, NULL);
+        MuxEncoderMap *src_enc = src_lookup(ctx, in_pkt);
+        if (!src_enc) {
+            sp_log(ctx, SP_LOG_WARN, "Dropping packet from an unknown source!\n");
+            av_packet_free(&in_pkt);
+            pthread_mutex_unlock(&ctx->lock);
+            continue;
+        }
 
-        if (!flush) {
-            in_pkt = sp_packet_fifo_pop(ctx->src_packets);
-            flush = !in_pkt;
+        in_pkt->stream_index = src_enc->stream_index;
 
-            /* Format can't flush, so just exit */
-            if (flush && !fmt_can_flush) {
-                pthread_mutex_unlock(&ctx->lock);
-                break;
-            }
+        err = sp_replay_ring_push(ctx->replay, in_pkt);
+        av_packet_free(&in_pkt);
+        if (err < 0) {
+            sp_log(ctx, SP_LOG_ERROR, "Error buffering packet: %s!\n", av_err2str(err));
+            pthread_mutex_unlock(&ctx->lock);
+            goto end;
         }
 
-        if (flush)
-            goto send;
+        /* Same as the muxing thread, stats only go out once per window */
+        int64_t now = av_gettime_relative();
+        if ((now - last_stats) >= STATS_WINDOW) {
+            int64_t duration = sp_replay_ring_duration(ctx->replay);
+            int64_t bytes = sp_replay_ring_bytes(ctx->replay);
+
+            SPGenericData entries[] = {
+                D_TYPE("replay_duration", NULL, duration),
+                D_TYPE("replay_bytes", NULL, bytes),
+                { 0 },
+            };
+            sp_eventlist_dispatch(ctx, ctx->events, SP_EVENT_ON_STATS, entries);
+            last_stats = now;
+        }
 
-        AVRational src_tb = in_pkt->time_base;
+        pthread_mutex_unlock(&ctx->lock);
+    }
 
-        MuxEncoderMap *src_enc = enc_id_lookup(ctx, (intptr_t)in_pkt->opaque);
-        int sidx = src_enc->stream_index;
+end:
+    ctx->err = err;
 
-        in_pkt->stream_index = sidx;
+    sp_eventlist_dispatch(ctx, ctx->events, SP_EVENT_ON_EOS, &err);
+
+    return NULL;
+}
 
-        AVRational dst_tb = ctx->avf->streams[sidx]->time_base;
-        SlidingWinCtx *rate_c = &sctx_rate[sidx];
-        SlidingWinCtx *latency_c = &sctx_latency[sidx];
+typedef struct ReplayDump {
+    MuxingContext *ctx;
+    char *url;
+    AVPacket **pkts;
+    int nb_pkts;
+} ReplayDump;
 
-        rate[sidx] = sp_sliding_win(rate_c, in_pkt->size, in_pkt->pts, src_tb, src_tb.den, 0) << 3;
+static void replay_dump_free(ReplayDump *d)
+{
+    for (int i = 0; i < d->nb_pkts; i++)
+        av_packet_free(&d->pkts[i]);
+    av_free(d->pkts);
+    av_free(d->url);
+    av_free(d);
+}
 
-        latency[sidx]  = av_gettime_relative() - ctx->epoch;
-        latency[sidx] -= av_rescale_q(in_pkt->pts, src_tb, av_make_q(1, 1000000));
-        latency[sidx]  = sp_sliding_win(latency_c, latency[sidx], in_pkt->pts, src_tb, src_tb.den, 1);
+/* Writes a snapshot of the replay buffer into a new file, with the streams
+ * of the muxer, without touching the muxer itself */
+static void *replay_dump_thread(void *arg)
+{
+    int err;
+    ReplayDump *d = arg;
+    MuxingContext *ctx = d->ctx;
+    AVFormatContext *avf = NULL;
 
-        /* Rescale timestamps */
-        in_pkt->pts = av_rescale_q(in_pkt->pts, src_tb, dst_tb);
-        in_pkt->dts = av_rescale_q(in_pkt->dts, src_tb, dst_tb);
-        in_pkt->duration = av_rescale_q(in_pkt->duration, src_tb, dst_tb);
+    sp_set_thread_name_self("replay_dump");
 
-        sp_log(ctx, SP_LOG_TRACE, "Got packet from \"%s\", sidx = %i, out pts = %f, out_dts = %f\n",
-               src_enc->name,
-               sidx,
-               av_q2d(dst_tb) * in_pkt->pts,
-               av_q2d(dst_tb) * in_pkt->dts);
+    err = avformat_alloc_output_context2(&avf, ctx->avf->oformat, NULL, d->url);
+    if (err < 0)
+        goto end;
 
-        buf_bytes = ctx->avf->pb->buf_ptr - ctx->avf->pb->buffer;
-        if (last_pos != ctx->avf->pb->pos) {
-            int64_t t_delta, cur_time = av_gettime_relative();
-            mux_rate = (ctx->avf->pb->pos - last_pos) << 3;
-            t_delta = cur_time - last_pos_update;
-            mux_rate = av_rescale(mux_rate, 1000000, t_delta);
-            last_pos_update = cur_time;
-            last_pos = ctx->avf->pb->pos;
-            mux_rate = sp_sliding_win(&sctx_mux, mux_rate, cur_time, av_make_q(1, 1000000),
-                                      10000000, 1);
-        }
+    err = copy_streams(avf, ctx->avf);
+    if (err < 0)
+        goto end;
 
-send:
-        err = av_interleaved_write_frame(ctx->avf, in_pkt);
-        av_packet_free(&in_pkt);
+    /* The buffer starts wherever it was cut off */
+    avf->avoid_negative_ts = AVFMT_AVOID_NEG_TS_MAKE_ZERO;
+    avf->flags |= AVFMT_FLAG_AUTO_BSF;
 
-        if (err == AVERROR(ETIMEDOUT)) {
-            sp_log(ctx, SP_LOG_ERROR, "Error muxing, operation timed out!\n");
-            pthread_mutex_unlock(&ctx->lock);
-            continue;
-        } else if (err < 0) {
-            sp_log(ctx, SP_LOG_ERROR, "Error muxing: %s!\n", av_err2str(err));
-            pthread_mutex_unlock(&ctx->lock);
-	    	goto fail;
+    if (!(avf->oformat->flags & AVFMT_NOFILE)) {
+        err = avio_open(&avf->pb, d->url, AVIO_FLAG_WRITE);
+        if (err < 0)
+            goto end;
+    }
+
+    err = avformat_write_header(avf, NULL);
+    if (err < 0)
+        goto end;
+
+    int64_t first_ts = AV_NOPTS_VALUE, last_ts = AV_NOPTS_VALUE;
+    for (int i = 0; i < d->nb_pkts; i++) {
+        AVPacket *pkt = d->pkts[i];
+        AVRational dst_tb = avf->streams[pkt->stream_index]->time_base;
+
+        if (pkt->dts != AV_NOPTS_VALUE) {
+            last_ts = av_rescale_q(pkt->dts, pkt->time_base, AV_TIME_BASE_Q);
+            if (first_ts == AV_NOPTS_VALUE)
+                first_ts = last_ts;
         }
 
-        if (flush) {
-            pthread_mutex_unlock(&ctx->lock);
-            break;
+        av_packet_rescale_ts(pkt, pkt->time_base, dst_tb);
+        pkt->time_base = dst_tb;
+
+        err = av_interleaved_write_frame(avf, pkt);
+        if (err < 0)
+            goto end;
+    }
+
+    err = av_write_trailer(avf);
+    if (err < 0)
+        goto end;
+
+    sp_log(ctx, SP_LOG_INFO, "Replay of %f seconds written to %s\n",
+           first_ts == AV_NOPTS_VALUE ? 0.0 : (last_ts - first_ts) / (double)AV_TIME_BASE,
+           d->url);
+
+end:
+    if (err < 0)
+        sp_log(ctx, SP_LOG_ERROR, "Error writing replay to %s: %s!\n",
+               d->url, av_err2str(err));
+
+    if (avf && !(avf->oformat->flags & AVFMT_NOFILE))
+        avio_closep(&avf->pb);
+    avformat_free_context(avf);
+
+    replay_dump_free(d);
+
+    atomic_store(&ctx->replay_dumping, 0);
+
+    return NULL;
+}
+
+/* The output URL is used as a strftime() template for dumps */
+static char *replay_url(MuxingContext *ctx)
+{
+    char buf[4096];
+    struct tm tm;
+    time_t now = time(NULL);
+
+    localtime_r(&now, &tm);
+    if (!strftime(buf, sizeof(buf), ctx->out_url, &tm))
+        return av_strdup(ctx->out_url);
+
+    return av_strdup(buf);
+}
+
+static int replay_dump(MuxingContext *ctx, const char *url)
+{
+    int err;
+
+    if (!ctx->replay_duration) {
+        sp_log(ctx, SP_LOG_ERROR, "Muxer has no replay buffer!\n");
+        return AVERROR(EINVAL);
+    } else if (atomic_load(&ctx->replay_dumping)) {
+        sp_log(ctx, SP_LOG_WARN, "Replay still being written, ignoring!\n");
+        return AVERROR(EBUSY);
+    }
+
+    if (ctx->replay_dump_thread) {
+        pthread_join(ctx->replay_dump_thread, NULL);
+        ctx->replay_dump_thread = 0;
+    }
+
+    ReplayDump *d = av_mallocz(sizeof(*d));
+    if (!d)
+        return AVERROR(ENOMEM);
+
+    d->ctx = ctx;
+    d->url = url ? av_strdup(url) : replay_url(ctx);
+    if (!d->url) {
+        av_free(d);
+        return AVERROR(ENOMEM);
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    err = ctx->replay ? sp_replay_ring_snapshot(ctx->replay, &d->pkts, &d->nb_pkts) : 0;
+    int keyless = ctx->replay && !sp_replay_ring_starts_at_key(ctx->replay);
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (!err && d->nb_pkts && keyless)
+        sp_log(ctx, SP_LOG_WARN, "Replay buffer doesn't start at a keyframe, "
+               "the start of the dump may not decode!\n");
+
+    if (err < 0 || !d->nb_pkts) {
+        if (!err)
+            sp_log(ctx, SP_LOG_WARN, "Replay buffer is empty, nothing to write!\n");
+        av_free(d->url);
+        av_free(d);
+        return err;
+    }
+
+    atomic_store(&ctx->replay_dumping, 1);
+    err = pthread_create(&ctx->replay_dump_thread, NULL, replay_dump_thread, d);
+    if (err) {
+        sp_log(ctx, SP_LOG_ERROR, "Unable to start writing the replay: %s!\n",
+               av_err2str(AVERROR(err)));
+        ctx->replay_dump_thread = 0;
+        replay_dump_free(d);
+        atomic_store(&ctx->replay_dumping, 0);
+        return AVERROR(err);
+    }
+
+    return 0;
+}
+
+static int add_copy_stream(MuxingContext *ctx, MuxEncoderMap *enc_map_entry,
+                           void *src, int src_stream)
+{
+    int err;
+    AVStream *ist = NULL;
+    AVCodecParameters *par;
+    AVRational time_base;
+    char *name;
+
+    if (sp_class_get_type(src) == SP_TYPE_BSF) {
+        BSFContext *bsf = src;
+        par = bsf->bsf->par_out;
+        time_base = bsf->bsf->time_base_out;
+    } else {
+        ist = ((DemuxingContext *)src)->avf->streams[src_stream];
+        par = ist->codecpar;
+        time_base = ist->time_base;
+    }
+
+    AVStream *st = avformat_new_stream(ctx->avf, NULL);
+    if (!st) {
+        sp_log(ctx, SP_LOG_ERROR, "Unable to allocate stream!\n");
+        return AVERROR(ENOMEM);
+    }
+
+    const char *bsf_str = NULL;
+    if (par->codec_type >= 0 && par->codec_type < AVMEDIA_TYPE_NB)
+        bsf_str = ctx->copy_bsf[par->codec_type];
+
+    if (bsf_str) {
+        err = av_bsf_list_parse_str(bsf_str, &enc_map_entry->bsf);
+        if (err < 0) {
+            sp_log(ctx, SP_LOG_ERROR, "Unable to parse bitstream filters \"%s\": %s!\n",
+                   bsf_str, av_err2str(err));
+            return err;
         }
 
-        int entries = 2 + 2*ctx->avf->nb_streams;
-        stat_entries = av_fast_realloc(stat_entries, &nb_stat_entries, sizeof(*stat_entries) * entries);
+        err = avcodec_parameters_copy(enc_map_entry->bsf->par_in, par);
+        if (err < 0)
+            return err;
 
-        stat_entries[0] = D_TYPE("bitrate", NULL, mux_rate);
-        stat_entries[1] = D_TYPE("cached", NULL, buf_bytes);
+        enc_map_entry->bsf->time_base_in = time_base;
 
-        for (int i = 0; i < ctx->avf->nb_streams; i++) {
-            stat_entries[2 + 2*i + 0] = D_TYPE("bitrate", src_enc->name, rate[i]);
-            stat_entries[2 + 2*i + 1] = D_TYPE("latency", src_enc->name, latency[i]);
+        err = av_bsf_init(enc_map_entry->bsf);
+        if (err < 0) {
+            sp_log(ctx, SP_LOG_ERROR, "Unable to init bitstream filters \"%s\": %s!\n",
+                   bsf_str, av_err2str(err));
+            return err;
         }
 
-        stat_entries[2 + 2*ctx->avf->nb_streams] = (SPGenericData){ 0 };
+        par = enc_map_entry->bsf->par_out;
+        time_base = enc_map_entry->bsf->time_base_out;
+    }
 
-        sp_eventlist_dispatch(ctx, ctx->events, SP_EVENT_ON_STATS, stat_entries);
+    err = avcodec_parameters_copy(st->codecpar, par);
+    if (err < 0) {
+        sp_log(ctx, SP_LOG_ERROR, "Could not copy codec params: %s!\n", av_err2str(err));
+        return err;
+    }
 
-        pthread_mutex_unlock(&ctx->lock);
+    /* Only keep the codec tag if the output format maps it to the same codec */
+    unsigned int codec_tag;
+    const struct AVCodecTag * const *tags = ctx->avf->oformat->codec_tag;
+    if (!tags || (av_codec_get_id(tags, st->codecpar->codec_tag) != st->codecpar->codec_id) ||
+        !av_codec_get_tag2(tags, st->codecpar->codec_id, &codec_tag))
+        st->codecpar->codec_tag = 0;
+
+    st->time_base = time_base;
+
+    if (ist) {
+        st->avg_frame_rate      = ist->avg_frame_rate;
+        st->sample_aspect_ratio = ist->sample_aspect_ratio;
+        st->disposition         = ist->disposition;
+        av_dict_copy(&st->metadata, ist->metadata, 0);
+
+        int name_len = strlen(sp_class_get_name(src)) + 1 + 11 + 1;
+        name = av_mallocz(name_len);
+        if (name)
+            snprintf(name, name_len, "%s:%i", sp_class_get_name(src), src_stream);
+    } else {
+        BSFContext *bsf = src;
+        st->avg_frame_rate      = bsf->avg_frame_rate;
+        st->sample_aspect_ratio = bsf->sample_aspect_ratio;
+
+        name = av_strdup(sp_class_get_name(src));
     }
 
-    pthread_mutex_lock(&ctx->lock);
+    if (!name)
+        return AVERROR(ENOMEM);
 
-fail:
-    av_free(sctx_rate);
-    av_free(sctx_latency);
-    av_free(rate);
-    av_free(latency);
-    av_free(stat_entries);
+    pthread_mutex_lock(&ctx->stats_lock);
+    enc_map_entry->name = name;
+    pthread_mutex_unlock(&ctx->stats_lock);
 
-    pthread_mutex_unlock(&ctx->lock);
+    enc_map_entry->stream_index = st->index;
 
-    ctx->err = err;
+    ctx->stream_has_link[st->index] = 1;
+    ctx->stream_codec_id[st->index] = st->codecpar->codec_id;
 
-    sp_eventlist_dispatch(ctx, ctx->events, SP_EVENT_ON_EOS, &err);
+    /* Copied packets arrive as fast as they're read and can't be dropped */
+    sp_packet_fifo_set_block_flags(ctx->src_packets, PACKET_FIFO_BLOCK_NO_INPUT |
+                                                     PACKET_FIFO_BLOCK_MAX_OUTPUT);
 
-    return NULL;
+    sp_log(ctx, SP_LOG_VERBOSE, "Stream \"%s\" registered for copying, stream index %i!\n",
+           enc_map_entry->name, st->index);
+
+    return 0;
 }
 
-int sp_muxer_add_stream(MuxingContext *ctx, EncodingContext *enc)
+int sp_muxer_add_stream(MuxingContext *ctx, AVBufferRef *src_ref, int src_stream)
 {
     int err = 0;
+    void *src = src_ref->data;
+    int is_copy = sp_class_get_type(src) == SP_TYPE_DEMUXER ||
+                  sp_class_get_type(src) == SP_TYPE_BSF;
+
+    if (sp_class_get_type(src) != SP_TYPE_DEMUXER)
+        src_stream = -1;
 
     pthread_mutex_lock(&ctx->lock);
 
     MuxEncoderMap *enc_map_entry = NULL;
     for (int i = 0; i < ctx->enc_map_size; i++) {
-        if (ctx->enc_map[i].encoder_id == sp_class_get_id(enc)) {
+        if (ctx->enc_map[i].encoder_id == sp_class_get_id(src) &&
+            ctx->enc_map[i].src_stream == src_stream) {
             enc_map_entry = &ctx->enc_map[i];
             break;
         }
     }
 
     if (!enc_map_entry) {
+        pthread_mutex_lock(&ctx->stats_lock);
         MuxEncoderMap *enc_map = av_realloc(ctx->enc_map, sizeof(*enc_map) * (ctx->enc_map_size + 1));
-        if (!enc_map)
-            return AVERROR(ENOMEM);
+        if (!enc_map) {
+            pthread_mutex_unlock(&ctx->stats_lock);
+            err = AVERROR(ENOMEM);
+            goto end;
+        }
         ctx->enc_map = enc_map;
         enc_map_entry = &ctx->enc_map[ctx->enc_map_size];
+        memset(enc_map_entry, 0, sizeof(*enc_map_entry));
         ctx->enc_map_size++;
+        pthread_mutex_unlock(&ctx->stats_lock);
     }
 
-    enc_map_entry->encoder_id = (intptr_t)sp_class_get_id(enc);
-
-    if (0) {
+    enc_map_entry->encoder_id = (intptr_t)sp_class_get_id(src);
+    enc_map_entry->src_stream = src_stream;
+    /* Stats may be reading it */
+    pthread_mutex_lock(&ctx->stats_lock);
+    av_freep(&enc_map_entry->name);
+    pthread_mutex_unlock(&ctx->stats_lock);
+    av_bsf_free(&enc_map_entry->bsf);
+
+    ctx->stream_has_link = av_realloc(ctx->stream_has_link, sizeof(*ctx->stream_has_link) * (ctx->avf->nb_streams + 1));
+    ctx->stream_codec_id = av_realloc(ctx->stream_codec_id, sizeof(*ctx->stream_codec_id) * (ctx->avf->nb_streams + 1));
+    if (!ctx->stream_has_link || !ctx->stream_codec_id) {
+        err = AVERROR(ENOMEM);
+        goto end;
+    }
 
+    if (is_copy) {
+        /* A demuxer playlist may switch its streams at any time */
+        DemuxingContext *demux = NULL;
+        if (sp_class_get_type(src) == SP_TYPE_DEMUXER)
+            demux = src;
+
+        if (demux)
+            pthread_mutex_lock(&demux->lock);
+        err = add_copy_stream(ctx, enc_map_entry, src, src_stream);
+        if (demux)
+            pthread_mutex_unlock(&demux->lock);
     } else {
-        ctx->stream_has_link = av_realloc(ctx->stream_has_link, sizeof(*ctx->stream_has_link) * (ctx->avf->nb_streams + 1));
-        ctx->stream_codec_id = av_realloc(ctx->stream_codec_id, sizeof(*ctx->stream_codec_id) * (ctx->avf->nb_streams + 1));
+        EncodingContext *enc = src;
+
+        /* Only encoders able to change their rate on the fly get controlled */
+        av_buffer_unref(&enc_map_entry->enc_ref);
+        if (enc->rc_live && enc->avctx->bit_rate) {
+            enc_map_entry->enc_ref = av_buffer_ref(src_ref);
+            enc_map_entry->abr_initial_bitrate = enc->avctx->bit_rate;
+            enc_map_entry->abr_bitrate = enc->avctx->bit_rate;
+        }
 
         AVStream *st = avformat_new_stream(ctx->avf, enc->codec);
         if (!st) {
@@ -254,10 +1707,12 @@ int sp_muxer_add_stream(MuxingContext *ctx, EncodingContext *enc)
         st->time_base = enc->avctx->time_base;
 
         enc_map_entry->stream_index = ctx->avf->nb_streams - 1;
+        pthread_mutex_lock(&ctx->stats_lock);
         enc_map_entry->name = av_strdup(enc->name);
+        pthread_mutex_unlock(&ctx->stats_lock);
 
-        ctx->stream_has_link[st->id] = 1;
-        ctx->stream_codec_id[st->id] = enc->avctx->codec_id;
+        ctx->stream_has_link[st->index] = 1;
+        ctx->stream_codec_id[st->index] = enc->avctx->codec_id;
 
         /* Set stream metadata */
         int enc_str_len = sizeof(LIBAVCODEC_IDENT) + 1 + strlen(enc->avctx->codec->name) + 1;
@@ -273,7 +1728,7 @@ int sp_muxer_add_stream(MuxingContext *ctx, EncodingContext *enc)
         }
 
         sp_log(ctx, SP_LOG_VERBOSE, "Encoder \"%s\" registered, stream index %i!\n",
-               enc_map_entry->name, st->id);
+               enc_map_entry->name, st->index);
     }
 
 end:
@@ -282,6 +1737,53 @@ end:
     return err;
 }
 
+void sp_muxer_stream_stats_free(SPMuxerStreamStats **stats, int nb_stats)
+{
+    if (!*stats)
+        return;
+
+    for (int i = 0; i < nb_stats; i++)
+        av_free((*stats)[i].name);
+    av_freep(stats);
+}
+
+int sp_muxer_stream_stats(MuxingContext *ctx, SPMuxerStreamStats **stats, int *nb_stats)
+{
+    int err = 0;
+
+    pthread_mutex_lock(&ctx->stats_lock);
+
+    *stats = NULL;
+    *nb_stats = 0;
+    if (!ctx->enc_map_size)
+        goto end;
+
+    *stats = av_malloc_array(ctx->enc_map_size, sizeof(**stats));
+    if (!*stats) {
+        err = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    /* Names get replaced when streams are added again */
+    for (int i = 0; i < ctx->enc_map_size; i++) {
+        MuxEncoderMap *m = &ctx->enc_map[i];
+        (*stats)[i] = m->stats;
+        (*stats)[i].name = av_strdup(m->name);
+        (*stats)[i].stream_index = m->stream_index;
+        if (m->name && !(*stats)[i].name) {
+            sp_muxer_stream_stats_free(stats, i);
+            err = AVERROR(ENOMEM);
+            goto end;
+        }
+    }
+    *nb_stats = ctx->enc_map_size;
+
+end:
+    pthread_mutex_unlock(&ctx->stats_lock);
+
+    return err;
+}
+
 static int configure_muxer(MuxingContext *ctx)
 {
     int ret;
@@ -290,6 +1792,10 @@ static int configure_muxer(MuxingContext *ctx)
     if (ret < 0)
         return ret;
 
+    /* Nothing is written until a dump */
+    if (ctx->replay_duration)
+        return 0;
+
     ctx->avf->flags |= AVFMT_FLAG_AUTO_BSF;
 
     if (ctx->low_latency) {
@@ -297,6 +1803,26 @@ static int configure_muxer(MuxingContext *ctx)
         ctx->avf->pb->min_packet_size = 0;
     }
 
+    /* Every segment starts at 0 */
+    if (ctx->segmenter)
+        ctx->avf->avoid_negative_ts = AVFMT_AVOID_NEG_TS_MAKE_ZERO;
+
+    if (ctx->segmenter || ctx->reconnect) {
+        ret = output_template_init(ctx);
+        if (ret < 0) {
+            sp_log(ctx, SP_LOG_ERROR, "Unable to init output template: %s!\n", av_err2str(ret));
+            return ret;
+        }
+    }
+
+    if (ctx->segmenter) {
+        ret = segmenter_start(ctx);
+        if (ret < 0) {
+            sp_log(ctx, SP_LOG_ERROR, "Unable to start segmenting: %s!\n", av_err2str(ret));
+            return ret;
+        }
+    }
+
     ret = avformat_write_header(ctx->avf, NULL);
     if (ret) {
         sp_log(ctx, SP_LOG_ERROR, "Could not write header: %s!\n", av_err2str(ret));
@@ -322,7 +1848,8 @@ static int muxer_ioctx_ctrl_cb(AVBufferRef *event_ref, void *callback_ctx,
         }
         ctx->epoch = atomic_load(event->epoch);
         if (!ctx->muxing_thread)
-            pthread_create(&ctx->muxing_thread, NULL, muxing_thread, ctx);
+            pthread_create(&ctx->muxing_thread, NULL,
+                           ctx->replay_duration ? replay_thread : muxing_thread, ctx);
     } else if (event->ctrl & SP_EVENT_CTRL_STOP) {
         if (ctx->muxing_thread) {
             sp_packet_fifo_push(ctx->src_packets, NULL);
@@ -340,6 +1867,74 @@ static int muxer_ioctx_ctrl_cb(AVBufferRef *event_ref, void *callback_ctx,
                 ctx->dump_info = 1;
         if ((tmp_val = dict_get(event->opts, "sdp_file")))
             ctx->dump_sdp_file = av_strdup(tmp_val);
+        if ((tmp_val = dict_get(event->opts, "video_bsf")))
+            ctx->copy_bsf[AVMEDIA_TYPE_VIDEO] = av_strdup(tmp_val);
+        if ((tmp_val = dict_get(event->opts, "audio_bsf")))
+            ctx->copy_bsf[AVMEDIA_TYPE_AUDIO] = av_strdup(tmp_val);
+        if ((tmp_val = dict_get(event->opts, "subtitle_bsf")))
+            ctx->copy_bsf[AVMEDIA_TYPE_SUBTITLE] = av_strdup(tmp_val);
+        if ((tmp_val = dict_get(event->opts, "abr")))
+            if (!strcmp(tmp_val, "true") || strtol(tmp_val, NULL, 10) != 0)
+                ctx->abr = 1;
+        if ((tmp_val = dict_get(event->opts, "abr_min_bitrate"))) {
+            long int val = strtol(tmp_val, NULL, 10);
+            if (val < 0)
+                sp_log(ctx, SP_LOG_ERROR, "Invalid minimum bitrate \"%s\"!\n", tmp_val);
+            else
+                ctx->abr_min_bitrate = val;
+        }
+        if ((tmp_val = dict_get(event->opts, "abr_max_bitrate"))) {
+            long int val = strtol(tmp_val, NULL, 10);
+            if (val < 0)
+                sp_log(ctx, SP_LOG_ERROR, "Invalid maximum bitrate \"%s\"!\n", tmp_val);
+            else
+                ctx->abr_max_bitrate = val;
+        }
+        if ((tmp_val = dict_get(event->opts, "abr_reaction_ms"))) {
+            long int val = strtol(tmp_val, NULL, 10);
+            if (val <= 0)
+                sp_log(ctx, SP_LOG_ERROR, "Invalid reaction time \"%s\"!\n", tmp_val);
+            else
+                ctx->abr_reaction_time = val * 1000;
+        }
+        if ((tmp_val = dict_get(event->opts, "reconnect")))
+            if (!strcmp(tmp_val, "true") || strtol(tmp_val, NULL, 10) != 0)
+                ctx->reconnect = 1;
+        if ((tmp_val = dict_get(event->opts, "reconnect_attempts"))) {
+            long int val = strtol(tmp_val, NULL, 10);
+            if (val < 0 || val > INT_MAX)
+                sp_log(ctx, SP_LOG_ERROR, "Invalid number of attempts \"%s\"!\n", tmp_val);
+            else
+                ctx->reconnect_max_attempts = val;
+        }
+        if ((tmp_val = dict_get(event->opts, "reconnect_delay_max_ms"))) {
+            long int val = strtol(tmp_val, NULL, 10);
+            if (val <= 0)
+                sp_log(ctx, SP_LOG_ERROR, "Invalid maximum delay \"%s\"!\n", tmp_val);
+            else
+                ctx->reconnect_delay_max = val * 1000;
+        }
+        if ((tmp_val = dict_get(event->opts, "reconnect_buffer_ms"))) {
+            long int val = strtol(tmp_val, NULL, 10);
+            if (val < 0)
+                sp_log(ctx, SP_LOG_ERROR, "Invalid buffer duration \"%s\"!\n", tmp_val);
+            else
+                ctx->reconnect_buffer = val * 1000;
+        }
+        if ((tmp_val = dict_get(event->opts, "reconnect_buffer_bytes"))) {
+            long int val = strtol(tmp_val, NULL, 10);
+            if (val < 0)
+                sp_log(ctx, SP_LOG_ERROR, "Invalid buffer size \"%s\"!\n", tmp_val);
+            else
+                ctx->reconnect_buffer_bytes = val;
+        }
+        if ((tmp_val = dict_get(event->opts, "max_interleave_delta_ms"))) {
+            long int val = strtol(tmp_val, NULL, 10);
+            if (val < 0)
+                sp_log(ctx, SP_LOG_ERROR, "Invalid interleaving delta \"%s\"!\n", tmp_val);
+            else
+                ctx->max_interleave_delta = val * 1000;
+        }
         if ((tmp_val = dict_get(event->opts, "fifo_size"))) {
             long int len = strtol(tmp_val, NULL, 10);
             if (len < 0)
@@ -358,10 +1953,17 @@ static int muxer_ioctx_ctrl_cb(AVBufferRef *event_ref, void *callback_ctx,
             }
         }
         pthread_mutex_unlock(&ctx->lock);
+    } else if (event->ctrl & SP_EVENT_CTRL_COMMAND) {
+        const char *tmp_val = NULL;
+        if ((tmp_val = dict_get(event->cmd, "dump"))) {
+            int use_template = !strcmp(tmp_val, "true") || !strcmp(tmp_val, "1");
+            return replay_dump(ctx, use_template ? NULL : tmp_val);
+        }
     } else if (event->ctrl & SP_EVENT_CTRL_FLUSH) {
         sp_log(ctx, SP_LOG_VERBOSE, "Flushing buffer\n");
         pthread_mutex_lock(&ctx->lock);
-        avio_flush(ctx->avf->pb);
+        if (ctx->avf->pb)
+            avio_flush(ctx->avf->pb);
         pthread_mutex_unlock(&ctx->lock);
     } else {
         return AVERROR(ENOTSUP);
@@ -373,7 +1975,8 @@ static int muxer_ioctx_ctrl_cb(AVBufferRef *event_ref, void *callback_ctx,
 int sp_muxer_ctrl(AVBufferRef *ctx_ref, SPEventType ctrl, void *arg)
 {
     MuxingContext *ctx = (MuxingContext *)ctx_ref->data;
-    return sp_ctrl_template(ctx, ctx->events, 0x0, muxer_ioctx_ctrl_cb, ctrl, arg);
+    return sp_ctrl_template(ctx, ctx->events, SP_EVENT_CTRL_COMMAND,
+                            muxer_ioctx_ctrl_cb, ctrl, arg);
 }
 
 int sp_muxer_init(AVBufferRef *ctx_ref)
@@ -392,8 +1995,33 @@ int sp_muxer_init(AVBufferRef *ctx_ref)
             ctx->out_format = "dash";
     }
 
+    /* The URL is a template, with a %d for the segment number */
+    const char *first_url = ctx->out_url;
+    char seg_url[4096];
+    if (ctx->segment_duration || ctx->segment_size) {
+        MuxSegmenter *seg = av_mallocz(sizeof(*seg));
+        if (!seg)
+            return AVERROR(ENOMEM);
+
+        ctx->segmenter = seg;
+        pthread_mutex_init(&seg->lock, NULL);
+        pthread_cond_init(&seg->cond, NULL);
+        seg->prepare_idx = -1;
+        seg->start_ts = AV_NOPTS_VALUE;
+        seg->url_template = av_strdup(ctx->out_url);
+        if (!seg->url_template)
+            return AVERROR(ENOMEM);
+
+        if (segment_url(seg, ctx->segment_idx, seg_url, sizeof(seg_url)) < 0) {
+            sp_log(ctx, SP_LOG_ERROR, "Segmented output URL \"%s\" must contain a %%d!\n",
+                   ctx->out_url);
+            return AVERROR(EINVAL);
+        }
+        first_url = seg_url;
+    }
+
     err = avformat_alloc_output_context2(&ctx->avf, NULL, ctx->out_format,
-	                                 ctx->out_url);
+	                                 first_url);
     if (err) {
         sp_log(ctx, SP_LOG_ERROR, "Unable to init lavf context!\n");
         return err;
@@ -418,12 +2046,14 @@ int sp_muxer_init(AVBufferRef *ctx_ref)
 
     ctx->avf->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
 
-    /* Open for writing */
-    err = avio_open(&ctx->avf->pb, ctx->out_url, AVIO_FLAG_WRITE);
-    if (err) {
-        sp_log(ctx, SP_LOG_ERROR, "Couldn't open %s: %s!\n", ctx->out_url,
-               av_err2str(err));
-        goto fail;
+    /* Open for writing, the replay buffer opens a new file on each dump */
+    if (!ctx->replay_duration) {
+        MuxSegment cur = { .avf = ctx->avf };
+        err = open_output(ctx, &cur);
+        if (err < 0)
+            goto fail;
+        ctx->async_io = cur.async_io;
+        ctx->paced_io = cur.paced_io;
     }
 
     /* Both fields alive for the duration of the avf context */
@@ -434,6 +2064,7 @@ int sp_muxer_init(AVBufferRef *ctx_ref)
 
 fail:
     avformat_free_context(ctx->avf);
+    ctx->avf = NULL;
     return err;
 }
 
@@ -448,16 +2079,31 @@ static void muxer_free(void *opaque, uint8_t *data)
         pthread_join(ctx->muxing_thread, NULL);
     }
 
-    for (int i = 0; i < ctx->enc_map_size; i++)
+    for (int i = 0; i < ctx->enc_map_size; i++) {
         av_free(ctx->enc_map[i].name);
+        av_buffer_unref(&ctx->enc_map[i].enc_ref);
+        av_bsf_free(&ctx->enc_map[i].bsf);
+    }
     av_free(ctx->enc_map);
 
     av_buffer_unref(&ctx->src_packets);
     av_free(ctx->stream_has_link);
     av_free(ctx->stream_codec_id);
     av_free(ctx->dump_sdp_file);
+    for (int i = 0; i < AVMEDIA_TYPE_NB; i++)
+        av_free(ctx->copy_bsf[i]);
+
+    segmenter_free(ctx);
+
+    if (ctx->replay_dump_thread)
+        pthread_join(ctx->replay_dump_thread, NULL);
+    sp_replay_ring_free(&ctx->replay);
+
+    /* Unless the output went down and never came back */
+    int output_up = ctx->avf && (ctx->avf->pb || (ctx->avf->oformat->flags & AVFMT_NOFILE));
 
-    if (sp_eventlist_has_dispatched(ctx->events, SP_EVENT_ON_INIT)) {
+    if (!ctx->replay_duration && output_up &&
+        sp_eventlist_has_dispatched(ctx->events, SP_EVENT_ON_INIT)) {
         int err = av_write_trailer(ctx->avf);
         if (err < 0)
             sp_log(ctx, SP_LOG_ERROR, "Error writing trailer: %s!\n",
@@ -474,11 +2120,14 @@ static void muxer_free(void *opaque, uint8_t *data)
     sp_bufferlist_free(&ctx->events);
 
     if (ctx->avf)
-        avio_closep(&ctx->avf->pb);
+        close_current_output(ctx);
+    av_dict_free(&ctx->io_opts);
 
     avformat_free_context(ctx->avf);
+    avformat_free_context(ctx->avf_template);
 
     pthread_mutex_destroy(&ctx->lock);
+    pthread_mutex_destroy(&ctx->stats_lock);
 
     sp_log(ctx, SP_LOG_VERBOSE, "Muxer destroyed!\n");
     sp_class_free(ctx);
@@ -501,8 +2150,15 @@ AVBufferRef *sp_muxer_alloc(void)
     }
 
     pthread_mutex_init(&ctx->lock, NULL);
+    pthread_mutex_init(&ctx->stats_lock, NULL);
     ctx->events = sp_bufferlist_new();
     ctx->src_packets = sp_packet_fifo_create(ctx, 256, PACKET_FIFO_BLOCK_NO_INPUT);
+    ctx->abr_reaction_time = 1000000;
+    ctx->reconnect_delay_max = 30000000;
+    ctx->reconnect_buffer = 10000000;
+    ctx->reconnect_buffer_bytes = 64 << 20;
+    ctx->max_interleave_delta = 1000000;
+    ctx->replay_dumping = ATOMIC_VAR_INIT(0);
 
     return ctx_ref;
 }
@@ -49,6 +49,29 @@ void sp_set_thread_name_self(const char *name)
 }
 #endif
 
+#if defined(HAVE_CLOCK_NANOSLEEP)
+#include <time.h>
+#include <errno.h>
+/* av_gettime_relative() uses CLOCK_MONOTONIC wherever this is available */
+void sp_sleep_until(int64_t deadline)
+{
+    struct timespec ts = {
+        .tv_sec  = deadline / 1000000,
+        .tv_nsec = (deadline % 1000000) * 1000,
+    };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+#else
+#include <libavutil/time.h>
+void sp_sleep_until(int64_t deadline)
+{
+    int64_t left = deadline - av_gettime_relative();
+    if (left > 0)
+        av_usleep(left);
+}
+#endif
+
 /* ================================================ */
 /* WAKEUP PIPE SECTION                              */
 /* ================================================ */
@@ -27,6 +27,9 @@
 /* Sets the thread name, if on an implementation where it's available */
 void sp_set_thread_name_self(const char *name);
 
+/* Sleeps until av_gettime_relative() reaches the given deadline */
+void sp_sleep_until(int64_t deadline);
+
 #if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
 #define noreturn _Noreturn
 #elif defined(__GNUC__)
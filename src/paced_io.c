@@ -0,0 +1,335 @@
+/*
+ * This file is part of txproto.
+ *
+ * txproto is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * txproto is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with txproto; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <pthread.h>
+#include <string.h>
+
+#include <libavformat/version.h>
+#include <libavutil/mem.h>
+#include <libavutil/time.h>
+
+#include <libtxproto/utils.h>
+#include <libtxproto/log.h>
+#include "paced_io.h"
+#include "os_compat.h"
+
+/* Used when the protocol doesn't have a packet size, e.g. TCP */
+#define DEFAULT_PACKET_SIZE 4096
+
+typedef struct PacedChunk {
+    struct PacedChunk *next;
+    int64_t queued; /* Time it was written by the muxer */
+    int size;
+    uint8_t data[];
+} PacedChunk;
+
+struct SPPacedIO {
+    void *log_ctx;
+    AVIOContext *pb;    /* Given to the muxer */
+    AVIOContext *inner; /* The actual output */
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond; /* Signalled on any queue change */
+    int quit;
+    int err;
+
+    PacedChunk *head;
+    PacedChunk *tail;
+    int64_t queued_bytes;
+    int64_t max_queued;
+
+    /* Token bucket, in bytes */
+    double rate; /* Per second */
+    double burst;
+    double tokens;
+    int64_t last_fill;
+
+    /* Stats, over the last second */
+    int64_t period_start;
+    int64_t period_bytes;
+    int64_t period_delay;
+    int64_t period_chunks;
+    int64_t achieved_rate;
+    int64_t avg_delay;
+};
+
+static void fill_bucket(SPPacedIO *s, int64_t now)
+{
+    s->tokens += (now - s->last_fill) * s->rate / AV_TIME_BASE;
+    s->tokens = SPMIN(s->tokens, s->burst);
+    s->last_fill = now;
+}
+
+static void update_stats(SPPacedIO *s, PacedChunk *c, int64_t now)
+{
+    s->period_bytes += c->size;
+    s->period_delay += now - c->queued;
+    s->period_chunks++;
+
+    if ((now - s->period_start) < AV_TIME_BASE)
+        return;
+
+    s->achieved_rate = av_rescale(s->period_bytes << 3, AV_TIME_BASE, now - s->period_start);
+    s->avg_delay = s->period_delay / s->period_chunks;
+    s->period_start = now;
+    s->period_bytes = 0;
+    s->period_delay = 0;
+    s->period_chunks = 0;
+}
+
+static void *paced_io_thread(void *arg)
+{
+    SPPacedIO *s = arg;
+
+    sp_set_thread_name_self("paced_io");
+
+    pthread_mutex_lock(&s->lock);
+
+    while (1) {
+        while (!s->head && !s->quit)
+            pthread_cond_wait(&s->cond, &s->lock);
+        if (!s->head)
+            break;
+
+        PacedChunk *c = s->head;
+        s->head = c->next;
+        if (!s->head)
+            s->tail = NULL;
+
+        pthread_mutex_unlock(&s->lock);
+
+        /* Wait until the bucket has enough for the whole packet */
+        int64_t now = av_gettime_relative();
+        fill_bucket(s, now);
+        if (s->tokens < c->size) {
+            sp_sleep_until(now + (int64_t)((c->size - s->tokens) * AV_TIME_BASE / s->rate));
+            now = av_gettime_relative();
+            fill_bucket(s, now);
+        }
+        s->tokens -= c->size;
+
+        avio_write(s->inner, c->data, c->size);
+        avio_flush(s->inner);
+
+        pthread_mutex_lock(&s->lock);
+
+        if (s->inner->error < 0 && !s->err) {
+            s->err = s->inner->error;
+            sp_log(s->log_ctx, SP_LOG_ERROR, "Error writing paced output: %s!\n",
+                   av_err2str(s->err));
+        }
+
+        update_stats(s, c, now);
+        s->queued_bytes -= c->size;
+        av_free(c);
+
+        pthread_cond_broadcast(&s->cond);
+    }
+
+    pthread_mutex_unlock(&s->lock);
+
+    return NULL;
+}
+
+#if LIBAVFORMAT_VERSION_MAJOR < 61
+static int paced_write(void *opaque, uint8_t *buf, int buf_size)
+#else
+static int paced_write(void *opaque, const uint8_t *buf, int buf_size)
+#endif
+{
+    SPPacedIO *s = opaque;
+
+    PacedChunk *c = av_malloc(sizeof(*c) + buf_size);
+    if (!c)
+        return AVERROR(ENOMEM);
+
+    c->next = NULL;
+    c->size = buf_size;
+    memcpy(c->data, buf, buf_size);
+
+    pthread_mutex_lock(&s->lock);
+
+    /* Only the muxer waits, and only once it's far ahead of the rate */
+    while (!s->err && s->queued_bytes && ((s->queued_bytes + buf_size) > s->max_queued))
+        pthread_cond_wait(&s->cond, &s->lock);
+
+    if (s->err) {
+        int err = s->err;
+        pthread_mutex_unlock(&s->lock);
+        av_free(c);
+        return err;
+    }
+
+    c->queued = av_gettime_relative();
+    if (s->tail)
+        s->tail->next = c;
+    else
+        s->head = c;
+    s->tail = c;
+    s->queued_bytes += buf_size;
+
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+
+    return buf_size;
+}
+
+static void paced_io_free(SPPacedIO *s)
+{
+    if (s->pb) {
+        av_freep(&s->pb->buffer);
+        avio_context_free(&s->pb);
+    }
+
+    while (s->head) {
+        PacedChunk *c = s->head;
+        s->head = c->next;
+        av_free(c);
+    }
+
+    avio_closep(&s->inner);
+
+    pthread_cond_destroy(&s->cond);
+    pthread_mutex_destroy(&s->lock);
+
+    av_free(s);
+}
+
+int sp_paced_io_open(void *log_ctx, SPPacedIO **s_ptr, AVIOContext **pb,
+                     const char *url, AVDictionary *opts)
+{
+    int err;
+    const char *tmp_val;
+
+    *s_ptr = NULL;
+
+    if (!(tmp_val = dict_get(opts, "pace_rate")))
+        return 0;
+
+    int64_t rate = strtoll(tmp_val, NULL, 10);
+    if (rate <= 0) {
+        sp_log(log_ctx, SP_LOG_ERROR, "Invalid pacing rate \"%s\"!\n", tmp_val);
+        return AVERROR(EINVAL);
+    }
+
+    SPPacedIO *s = av_mallocz(sizeof(*s));
+    if (!s)
+        return AVERROR(ENOMEM);
+
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    s->log_ctx = log_ctx;
+    s->rate = rate / 8.0;
+    s->max_queued = 4 << 20;
+
+    err = avio_open(&s->inner, url, AVIO_FLAG_WRITE);
+    if (err < 0) {
+        sp_log(log_ctx, SP_LOG_ERROR, "Couldn't open %s: %s!\n", url, av_err2str(err));
+        goto fail;
+    }
+
+    /* Each write from the muxer's side is a single network packet */
+    int packet_size = s->inner->max_packet_size ? s->inner->max_packet_size :
+                                                  DEFAULT_PACKET_SIZE;
+
+    s->burst = 4 * packet_size;
+    if ((tmp_val = dict_get(opts, "pace_burst"))) {
+        int64_t val = strtoll(tmp_val, NULL, 10);
+        if (val < packet_size)
+            sp_log(log_ctx, SP_LOG_ERROR, "Invalid burst size \"%s\", must be at "
+                   "least one packet (%i bytes)!\n", tmp_val, packet_size);
+        else
+            s->burst = val;
+    }
+    if ((tmp_val = dict_get(opts, "pace_queue"))) {
+        int64_t val = strtoll(tmp_val, NULL, 10);
+        if (val < packet_size)
+            sp_log(log_ctx, SP_LOG_ERROR, "Invalid queue size \"%s\"!\n", tmp_val);
+        else
+            s->max_queued = val;
+    }
+
+    s->tokens = s->burst;
+    s->last_fill = av_gettime_relative();
+    s->period_start = s->last_fill;
+
+    uint8_t *avio_buf = av_malloc(packet_size);
+    if (!avio_buf) {
+        err = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    s->pb = avio_alloc_context(avio_buf, packet_size, 1, s, NULL, paced_write, NULL);
+    if (!s->pb) {
+        av_free(avio_buf);
+        err = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    s->pb->max_packet_size = s->inner->max_packet_size;
+    s->pb->seekable = 0;
+
+    err = pthread_create(&s->thread, NULL, paced_io_thread, s);
+    if (err) {
+        err = AVERROR(err);
+        goto fail;
+    }
+
+    sp_log(log_ctx, SP_LOG_VERBOSE, "Pacing %s at %" PRIi64 " bps, burst of %i bytes, "
+           "packets of %i bytes\n", url, rate, (int)s->burst, packet_size);
+
+    *pb = s->pb;
+    *s_ptr = s;
+
+    return 1;
+
+fail:
+    paced_io_free(s);
+    return err;
+}
+
+int sp_paced_io_close(SPPacedIO **s_ptr)
+{
+    SPPacedIO *s = *s_ptr;
+    if (!s)
+        return 0;
+
+    avio_flush(s->pb);
+
+    pthread_mutex_lock(&s->lock);
+    s->quit = 1;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+
+    pthread_join(s->thread, NULL);
+
+    int err = s->err;
+    paced_io_free(s);
+    *s_ptr = NULL;
+
+    return err;
+}
+
+void sp_paced_io_stats(SPPacedIO *s, int64_t *rate, int64_t *queue_delay)
+{
+    pthread_mutex_lock(&s->lock);
+    *rate = s->achieved_rate;
+    *queue_delay = s->avg_delay;
+    pthread_mutex_unlock(&s->lock);
+}
@@ -0,0 +1,45 @@
+/*
+ * This file is part of txproto.
+ *
+ * txproto is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * txproto is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with txproto; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <libavformat/avio.h>
+#include <libavutil/dict.h>
+
+/* A write-only AVIOContext which smooths out bursts, e.g. large keyframes,
+ * before they reach the network. Writes are queued, and sent one packet at a
+ * time by a separate thread, at the rate allowed by a token bucket.
+ *
+ * Options:
+ *     pace_rate  - bucket fill rate, in bits per second, enables pacing
+ *     pace_burst - bucket size, in bytes (default 4 packets)
+ *     pace_queue - maximum queued data, in bytes, writers wait once reached
+ *                  (default 4 MiB)
+ */
+typedef struct SPPacedIO SPPacedIO;
+
+/* Returns 0 and leaves *s NULL if the options don't enable pacing, 1 if opened */
+int sp_paced_io_open(void *log_ctx, SPPacedIO **s, AVIOContext **pb,
+                     const char *url, AVDictionary *opts);
+
+/* Sends out everything queued and closes the output */
+int sp_paced_io_close(SPPacedIO **s);
+
+/* Achieved rate, in bits per second, and average time spent queued, in
+ * microseconds, over the last second */
+void sp_paced_io_stats(SPPacedIO *s, int64_t *rate, int64_t *queue_delay);
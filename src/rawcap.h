@@ -0,0 +1,78 @@
+/*
+ * This file is part of txproto.
+ *
+ * txproto is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * txproto is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with txproto; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <libavutil/avutil.h>
+#include <libavutil/buffer.h>
+#include <libavutil/dict.h>
+
+/* Raw capture files hold uncompressed frames, each at an aligned offset, in
+ * the layout av_image_fill_arrays()/av_samples_fill_arrays() give for
+ * RAWCAP_LINE_ALIGN, so they can be used straight from a mapping. A compact
+ * timestamp index follows the last frame. Everything is in native byte order.
+ *
+ * | header, RAWCAP_ALIGN | frame | frame | ... | index |
+ */
+#define RAWCAP_MAGIC      "TXRAWCAP"
+#define RAWCAP_VERSION    1
+#define RAWCAP_ALIGN      4096 /* Of the header, every frame and the index */
+#define RAWCAP_LINE_ALIGN 64
+
+typedef struct RawCapHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t media_type; /* enum AVMediaType */
+
+    char format[32]; /* Pixel or sample format name */
+    int32_t width;
+    int32_t height;
+    int32_t sample_rate;
+    int32_t channels;
+    char ch_layout[64];
+
+    int32_t tb_num;
+    int32_t tb_den;
+    int32_t fr_num;
+    int32_t fr_den;
+
+    uint64_t nb_frames;
+    uint64_t index_offset; /* 0 until the file is finished */
+} RawCapHeader;
+
+typedef struct RawCapIndexEntry {
+    int64_t pts;
+    uint64_t offset;
+    uint32_t size;
+    uint32_t nb_samples; /* Audio only */
+} RawCapIndexEntry;
+
+/* Creates an IOSys sink entry which writes all frames it receives into a raw
+ * capture file at path. type is AVMEDIA_TYPE_VIDEO or AVMEDIA_TYPE_AUDIO.
+ *
+ * Options:
+ *     io        - "mmap" (default) to write through a mapping, or "direct"
+ *                 for O_DIRECT writes, bypassing the page cache
+ *     prealloc  - the file is preallocated in steps of this, in bytes
+ *                 (default 1 GiB)
+ *     fifo_size - maximum number of queued frames (default 64)
+ */
+AVBufferRef *sp_rawcap_sink_create(void *log_ctx, const char *path,
+                                   enum AVMediaType type, AVDictionary *opts);
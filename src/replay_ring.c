@@ -0,0 +1,241 @@
+/*
+ * This file is part of txproto.
+ *
+ * txproto is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * txproto is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with txproto; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <libavutil/mem.h>
+#include <libavutil/mathematics.h>
+
+#include <libtxproto/utils.h>
+#include "replay_ring.h"
+
+#define INITIAL_SIZE 256 /* Must be a power of two */
+
+struct SPReplayRing {
+    AVPacket **pkts;
+    int size;
+    int head;
+    int nb;
+    int next_key; /* Offset of the next anchor keyframe after the head, or -1 */
+    int keyless;  /* The head isn't an anchor keyframe, limits forced it */
+
+    int64_t bytes;
+    int64_t last_ts;
+
+    int64_t duration;
+    int64_t max_bytes;
+    int anchor_stream;
+};
+
+#define ENTRY(r, i) ((r)->pkts[((r)->head + (i)) & ((r)->size - 1)])
+
+static int64_t pkt_ts(const AVPacket *pkt)
+{
+    int64_t ts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+    if (ts == AV_NOPTS_VALUE)
+        return AV_NOPTS_VALUE;
+    return av_rescale_q(ts, pkt->time_base, AV_TIME_BASE_Q);
+}
+
+static int is_anchor(SPReplayRing *r, const AVPacket *pkt)
+{
+    return (pkt->flags & AV_PKT_FLAG_KEY) &&
+           ((r->anchor_stream < 0) || (pkt->stream_index == r->anchor_stream));
+}
+
+static int find_next_key(SPReplayRing *r, int from)
+{
+    for (int i = from; i < r->nb; i++)
+        if (is_anchor(r, ENTRY(r, i)))
+            return i;
+    return -1;
+}
+
+static void drop_head(SPReplayRing *r)
+{
+    AVPacket **pkt = &ENTRY(r, 0);
+    r->bytes -= (*pkt)->size;
+    av_packet_free(pkt);
+    r->head = (r->head + 1) & (r->size - 1);
+    r->nb--;
+}
+
+/* Drops everything before the next anchor keyframe */
+static void drop_gop(SPReplayRing *r)
+{
+    for (int i = r->next_key; i > 0; i--)
+        drop_head(r);
+
+    r->next_key = find_next_key(r, 1);
+    r->keyless = 0;
+}
+
+/* Whether the window starting at from would still cover the whole
+ * duration, or the size limit is exceeded */
+static int over_limits(SPReplayRing *r, int from)
+{
+    int64_t from_ts = pkt_ts(ENTRY(r, from));
+    int over_time = (from_ts != AV_NOPTS_VALUE) && (r->last_ts != AV_NOPTS_VALUE) &&
+                    ((r->last_ts - from_ts) >= r->duration);
+    int over_size = r->max_bytes && (r->bytes > r->max_bytes);
+    return over_time || over_size;
+}
+
+static int grow(SPReplayRing *r)
+{
+    int new_size = r->size << 1;
+    AVPacket **pkts = av_malloc_array(new_size, sizeof(*pkts));
+    if (!pkts)
+        return AVERROR(ENOMEM);
+
+    for (int i = 0; i < r->nb; i++)
+        pkts[i] = ENTRY(r, i);
+
+    av_free(r->pkts);
+    r->pkts = pkts;
+    r->size = new_size;
+    r->head = 0;
+
+    return 0;
+}
+
+SPReplayRing *sp_replay_ring_alloc(int64_t duration, int64_t max_bytes,
+                                   int anchor_stream)
+{
+    SPReplayRing *r = av_mallocz(sizeof(*r));
+    if (!r)
+        return NULL;
+
+    r->pkts = av_malloc_array(INITIAL_SIZE, sizeof(*r->pkts));
+    if (!r->pkts) {
+        av_free(r);
+        return NULL;
+    }
+
+    r->size = INITIAL_SIZE;
+    r->next_key = -1;
+    r->last_ts = AV_NOPTS_VALUE;
+    r->duration = duration;
+    r->max_bytes = max_bytes;
+    r->anchor_stream = anchor_stream;
+
+    return r;
+}
+
+int sp_replay_ring_push(SPReplayRing *r, const AVPacket *pkt)
+{
+    int err;
+    int key = is_anchor(r, pkt);
+
+    /* Nothing can be decoded until the first keyframe */
+    if (!r->nb && !key)
+        return 0;
+
+    if ((r->nb == r->size) && ((err = grow(r)) < 0))
+        return err;
+
+    AVPacket *ref = av_packet_clone(pkt);
+    if (!ref)
+        return AVERROR(ENOMEM);
+
+    ENTRY(r, r->nb) = ref;
+    r->nb++;
+    r->bytes += ref->size;
+
+    if (key && (r->nb > 1) && (r->next_key < 0))
+        r->next_key = r->nb - 1;
+
+    int64_t ts = pkt_ts(ref);
+    if ((ts != AV_NOPTS_VALUE) && ((r->last_ts == AV_NOPTS_VALUE) || (ts > r->last_ts)))
+        r->last_ts = ts;
+
+    /* Start at the latest keyframe which still covers the whole duration,
+     * or as late as needed to fit in the size limit */
+    while ((r->next_key > 0) && over_limits(r, r->next_key))
+        drop_gop(r);
+
+    /* With no later keyframe, as with long GOPs or intra refresh, the limits
+     * still hold, the window just doesn't start at a keyframe anymore */
+    while ((r->next_key < 0) && (r->nb > 1) && over_limits(r, 1)) {
+        drop_head(r);
+        r->keyless = 1;
+    }
+
+    return 0;
+}
+
+int sp_replay_ring_snapshot(SPReplayRing *r, AVPacket ***pkts, int *nb_pkts)
+{
+    *pkts = NULL;
+    *nb_pkts = 0;
+
+    if (!r->nb)
+        return 0;
+
+    AVPacket **list = av_calloc(r->nb, sizeof(*list));
+    if (!list)
+        return AVERROR(ENOMEM);
+
+    for (int i = 0; i < r->nb; i++) {
+        list[i] = av_packet_clone(ENTRY(r, i));
+        if (!list[i]) {
+            while (i--)
+                av_packet_free(&list[i]);
+            av_free(list);
+            return AVERROR(ENOMEM);
+        }
+    }
+
+    *pkts = list;
+    *nb_pkts = r->nb;
+
+    return 0;
+}
+
+int64_t sp_replay_ring_duration(SPReplayRing *r)
+{
+    if (!r->nb || (r->last_ts == AV_NOPTS_VALUE))
+        return 0;
+
+    int64_t first = pkt_ts(ENTRY(r, 0));
+    if (first == AV_NOPTS_VALUE)
+        return 0;
+
+    return r->last_ts - first;
+}
+
+int64_t sp_replay_ring_bytes(SPReplayRing *r)
+{
+    return r->bytes;
+}
+
+int sp_replay_ring_starts_at_key(SPReplayRing *r)
+{
+    return !r->keyless;
+}
+
+void sp_replay_ring_free(SPReplayRing **r_ptr)
+{
+    SPReplayRing *r = *r_ptr;
+    if (!r)
+        return;
+
+    for (int i = 0; i < r->nb; i++)
+        av_packet_free(&ENTRY(r, i));
+
+    av_free(r->pkts);
+    av_freep(r_ptr);
+}
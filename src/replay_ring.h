@@ -0,0 +1,48 @@
+/*
+ * This file is part of txproto.
+ *
+ * txproto is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * txproto is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with txproto; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <libavcodec/packet.h>
+
+/* A rolling window of the last packets of an output, bounded by duration and
+ * by size. It starts at a keyframe of the anchor stream, so that it can be
+ * written out as a playable file at any point, unless no later keyframe came
+ * before the limits were reached. Packets are kept as references, nothing is
+ * copied. Not thread-safe. */
+typedef struct SPReplayRing SPReplayRing;
+
+/* anchor_stream is the stream whose keyframes the window starts at, or -1
+ * if every packet is a keyframe. max_bytes may be 0 for no limit. */
+SPReplayRing *sp_replay_ring_alloc(int64_t duration, int64_t max_bytes,
+                                   int anchor_stream);
+
+/* Takes a new reference to the packet, which must have a time base set */
+int sp_replay_ring_push(SPReplayRing *r, const AVPacket *pkt);
+
+/* Returns new references to all packets in the window, oldest first */
+int sp_replay_ring_snapshot(SPReplayRing *r, AVPacket ***pkts, int *nb_pkts);
+
+/* Duration and size of the window */
+int64_t sp_replay_ring_duration(SPReplayRing *r);
+int64_t sp_replay_ring_bytes(SPReplayRing *r);
+
+/* Whether the window starts at an anchor keyframe */
+int sp_replay_ring_starts_at_key(SPReplayRing *r);
+
+void sp_replay_ring_free(SPReplayRing **r);
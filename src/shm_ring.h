@@ -0,0 +1,106 @@
+/*
+ * This file is part of txproto.
+ *
+ * txproto is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * txproto is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with txproto; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include <libavutil/avutil.h>
+#include <libavutil/buffer.h>
+#include <libavutil/dict.h>
+
+/* A ring of frame slots in a named shared memory object, written by a single
+ * process and read by a single other one. Slot data is laid out the way
+ * av_image_fill_arrays()/av_samples_fill_arrays() do for SHM_RING_LINE_ALIGN,
+ * so the reader can reference it without copying.
+ *
+ * Slots are used in order, slot (seq % nb_slots) for the frame number seq.
+ * The writer takes a slot by moving it from FREE, or from READY if it was
+ * never read, to WRITING, and publishes it as READY. A reader takes a READY
+ * slot as READING, and frees it once the last reference to its frame is gone.
+ * Slots the reader still holds are never written to, the frame is dropped.
+ * A new reader only takes back READING slots if the reader_pid before it is
+ * gone.
+ * Readers sleep on write_seq, a futex bumped on every change. */
+#define SHM_RING_MAGIC      "TXSHMRNG"
+#define SHM_RING_VERSION    2
+#define SHM_RING_PREFIX     "txproto-" /* Of object names, in /dev/shm */
+#define SHM_RING_MAX_SLOTS  32
+#define SHM_RING_ALIGN      4096
+#define SHM_RING_LINE_ALIGN 64
+
+enum ShmSlotState {
+    SHM_SLOT_FREE = 0,
+    SHM_SLOT_WRITING,
+    SHM_SLOT_READY,
+    SHM_SLOT_READING,
+};
+
+typedef struct ShmRingSlot {
+    atomic_uint state; /* enum ShmSlotState */
+    uint32_t seq;
+
+    char format[32]; /* Pixel or sample format name */
+    int32_t width;
+    int32_t height;
+    int32_t sample_rate;
+    int32_t channels;
+    int32_t nb_samples;
+    char ch_layout[64];
+
+    int64_t pts;
+    int32_t tb_num;
+    int32_t tb_den;
+    int32_t fr_num;
+    int32_t fr_den;
+    uint64_t size;
+} ShmRingSlot;
+
+typedef struct ShmRingHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t media_type; /* enum AVMediaType */
+    int32_t pid;         /* Of the writer */
+    atomic_int reader_pid; /* Of the last reader to map the slots, 0 if none */
+
+    /* Only valid once ready is set, which is when the object is resized to
+     * hold all slots */
+    uint32_t nb_slots;
+    uint64_t slot_size;
+    uint64_t data_offset;
+    atomic_uint ready;
+
+    atomic_uint eos;
+    atomic_uint write_seq; /* Number of frames published */
+
+    ShmRingSlot slots[SHM_RING_MAX_SLOTS];
+} ShmRingHeader;
+
+/* Creates an IOSys sink entry which publishes all frames it receives in a
+ * ring named SHM_RING_PREFIX + name. type is AVMEDIA_TYPE_VIDEO or
+ * AVMEDIA_TYPE_AUDIO.
+ *
+ * Options:
+ *     slots     - number of slots (default 4)
+ *     slot_size - size of each slot, in bytes (default: fit the first frame,
+ *                 twice that for audio)
+ *     fifo_size - maximum number of queued frames (default 8)
+ */
+AVBufferRef *sp_shm_sink_create(void *log_ctx, const char *name,
+                                enum AVMediaType type, AVDictionary *opts);
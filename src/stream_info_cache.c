@@ -0,0 +1,389 @@
+/*
+ * This file is part of txproto.
+ *
+ * txproto is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * txproto is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with txproto; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <libavutil/avstring.h>
+#include <libavutil/hash.h>
+#include <libavutil/mem.h>
+
+#include <libtxproto/utils.h>
+#include <libtxproto/log.h>
+#include "stream_info_cache.h"
+#include "mmap_io.h"
+
+#define CACHE_VERSION 1
+#define CACHE_MAX_SIZE (16 << 20)
+
+#define CODECPAR_FIELDS(X)                                            \
+    X(codec_type) X(codec_id) X(codec_tag) X(format) X(bit_rate)      \
+    X(bits_per_coded_sample) X(bits_per_raw_sample) X(profile)        \
+    X(level) X(width) X(height) X(field_order) X(color_range)         \
+    X(color_primaries) X(color_trc) X(color_space) X(chroma_location) \
+    X(video_delay) X(sample_rate) X(block_align) X(frame_size)        \
+    X(initial_padding) X(trailing_padding) X(seek_preroll)
+
+typedef struct CacheEntry {
+    char *path;   /* Resolved path of the input */
+    char *file;   /* Where its entry lives */
+    int64_t size;
+    int64_t mtime;
+} CacheEntry;
+
+static void entry_free(CacheEntry *e)
+{
+    free(e->path); /* From realpath() */
+    av_free(e->file);
+}
+
+static int entry_get(const char *dir, const char *url, CacheEntry *e)
+{
+    int err;
+    uint8_t hash_hex[2*64 + 1];
+    struct AVHashContext *hash = NULL;
+    struct stat st;
+
+    memset(e, 0, sizeof(*e));
+
+    av_strstart(url, SP_MMAP_IO_PREFIX, &url);
+    const char *proto = avio_find_protocol_name(url);
+    if (!proto || strcmp(proto, "file"))
+        return AVERROR(ENOTSUP);
+    av_strstart(url, "file:", &url);
+
+    e->path = realpath(url, NULL);
+    if (!e->path || stat(e->path, &st) < 0 || !S_ISREG(st.st_mode)) {
+        err = AVERROR(ENOTSUP);
+        goto fail;
+    }
+
+    e->size = st.st_size;
+    e->mtime = st.st_mtim.tv_sec*INT64_C(1000000000) + st.st_mtim.tv_nsec;
+
+    char *key = av_asprintf("%s\n%" PRIi64 "\n%" PRIi64, e->path, e->size, e->mtime);
+    if (!key) {
+        err = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    err = av_hash_alloc(&hash, "SHA256");
+    if (err < 0) {
+        av_free(key);
+        goto fail;
+    }
+
+    av_hash_init(hash);
+    av_hash_update(hash, (const uint8_t *)key, strlen(key));
+    av_hash_final_hex(hash, hash_hex, sizeof(hash_hex));
+    av_hash_freep(&hash);
+    av_free(key);
+
+    e->file = av_asprintf("%s/%s.info", dir, (char *)hash_hex);
+    if (!e->file) {
+        err = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    entry_free(e);
+    return err;
+}
+
+static int64_t get_int(AVDictionary *dict, int idx, const char *name, int *missing)
+{
+    char key[64];
+    if (idx >= 0)
+        snprintf(key, sizeof(key), "%i.%s", idx, name);
+    else
+        av_strlcpy(key, name, sizeof(key));
+
+    AVDictionaryEntry *e = av_dict_get(dict, key, NULL, 0);
+    if (!e) {
+        *missing = 1;
+        return 0;
+    }
+
+    return strtoll(e->value, NULL, 10);
+}
+
+static int set_int(AVDictionary **dict, int idx, const char *name, int64_t val)
+{
+    char key[64];
+    if (idx >= 0)
+        snprintf(key, sizeof(key), "%i.%s", idx, name);
+    else
+        av_strlcpy(key, name, sizeof(key));
+
+    return av_dict_set_int(dict, key, val, 0);
+}
+
+static int load_stream(AVDictionary *dict, int i, AVStream *st)
+{
+    int missing = 0;
+    AVCodecParameters *par = st->codecpar;
+
+    /* Whatever the header said must agree with what's cached */
+    int type = get_int(dict, i, "codec_type", &missing);
+    int id = get_int(dict, i, "codec_id", &missing);
+    if (missing ||
+        ((par->codec_type != AVMEDIA_TYPE_UNKNOWN) && (par->codec_type != type)) ||
+        ((par->codec_id != AV_CODEC_ID_NONE) && (par->codec_id != id)))
+        return 0;
+
+#define X(field) par->field = get_int(dict, i, #field, &missing);
+    CODECPAR_FIELDS(X)
+#undef X
+
+    par->sample_aspect_ratio.num = get_int(dict, i, "sar_num", &missing);
+    par->sample_aspect_ratio.den = get_int(dict, i, "sar_den", &missing);
+    st->avg_frame_rate.num = get_int(dict, i, "avg_frame_rate_num", &missing);
+    st->avg_frame_rate.den = get_int(dict, i, "avg_frame_rate_den", &missing);
+    st->r_frame_rate.num = get_int(dict, i, "r_frame_rate_num", &missing);
+    st->r_frame_rate.den = get_int(dict, i, "r_frame_rate_den", &missing);
+    st->start_time = get_int(dict, i, "start_time", &missing);
+    st->duration = get_int(dict, i, "duration", &missing);
+
+    if (par->codec_type == AVMEDIA_TYPE_AUDIO) {
+        av_channel_layout_uninit(&par->ch_layout);
+        par->ch_layout.order = get_int(dict, i, "ch_order", &missing);
+        par->ch_layout.nb_channels = get_int(dict, i, "ch_nb", &missing);
+        par->ch_layout.u.mask = get_int(dict, i, "ch_mask", &missing);
+    }
+
+    char key[64];
+    snprintf(key, sizeof(key), "%i.extradata", i);
+    AVDictionaryEntry *e = av_dict_get(dict, key, NULL, 0);
+    if (e) {
+        int len = strlen(e->value) >> 1;
+        uint8_t *data = av_mallocz(len + AV_INPUT_BUFFER_PADDING_SIZE);
+        if (!data)
+            return AVERROR(ENOMEM);
+        for (int j = 0; j < len; j++)
+            sscanf(e->value + 2*j, "%2hhx", &data[j]);
+        av_freep(&par->extradata);
+        par->extradata = data;
+        par->extradata_size = len;
+    }
+
+    return missing ? 0 : 1;
+}
+
+int sp_stream_info_cache_load(void *log_ctx, const char *dir,
+                              const char *url, AVFormatContext *avf)
+{
+    int err, missing = 0;
+    CacheEntry e;
+    AVDictionary *dict = NULL;
+    char *buf = NULL;
+
+    if (entry_get(dir, url, &e) < 0)
+        return 0;
+
+    FILE *f = fopen(e.file, "r");
+    if (!f) {
+        err = 0;
+        goto end;
+    }
+
+    struct stat st;
+    if (fstat(fileno(f), &st) < 0 || st.st_size <= 0) {
+        fclose(f);
+        err = 0;
+        goto end;
+    }
+
+    size_t size = SPMIN(st.st_size, CACHE_MAX_SIZE);
+    buf = av_malloc(size + 1);
+    if (!buf) {
+        fclose(f);
+        err = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    size_t len = fread(buf, 1, size, f);
+    fclose(f);
+    buf[len] = '\0';
+
+    err = av_dict_parse_string(&dict, buf, "=", "\n", 0);
+    if (err < 0) {
+        err = 0;
+        goto end;
+    }
+
+    /* Hash collisions, or a stale entry */
+    const char *path = dict_get(dict, "path");
+    if ((get_int(dict, -1, "version", &missing) != CACHE_VERSION) ||
+        !path || strcmp(path, e.path) ||
+        (get_int(dict, -1, "size", &missing) != e.size) ||
+        (get_int(dict, -1, "mtime", &missing) != e.mtime) ||
+        (get_int(dict, -1, "nb_streams", &missing) != avf->nb_streams) || missing) {
+        err = 0;
+        goto end;
+    }
+
+    for (int i = 0; i < avf->nb_streams; i++) {
+        err = load_stream(dict, i, avf->streams[i]);
+        if (err <= 0)
+            goto end;
+    }
+
+    avf->start_time = get_int(dict, -1, "start_time", &missing);
+    avf->duration = get_int(dict, -1, "duration", &missing);
+    avf->bit_rate = get_int(dict, -1, "bit_rate", &missing);
+
+    sp_log(log_ctx, SP_LOG_VERBOSE, "Stream info for %s loaded from %s\n",
+           e.path, e.file);
+
+    err = 1;
+
+end:
+    av_dict_free(&dict);
+    av_free(buf);
+    entry_free(&e);
+    return err;
+}
+
+static int store_stream(AVDictionary **dict, int i, AVStream *st)
+{
+    int err = 0;
+    AVCodecParameters *par = st->codecpar;
+
+#define X(field) err |= set_int(dict, i, #field, par->field);
+    CODECPAR_FIELDS(X)
+#undef X
+
+    err |= set_int(dict, i, "sar_num", par->sample_aspect_ratio.num);
+    err |= set_int(dict, i, "sar_den", par->sample_aspect_ratio.den);
+    err |= set_int(dict, i, "avg_frame_rate_num", st->avg_frame_rate.num);
+    err |= set_int(dict, i, "avg_frame_rate_den", st->avg_frame_rate.den);
+    err |= set_int(dict, i, "r_frame_rate_num", st->r_frame_rate.num);
+    err |= set_int(dict, i, "r_frame_rate_den", st->r_frame_rate.den);
+    err |= set_int(dict, i, "start_time", st->start_time);
+    err |= set_int(dict, i, "duration", st->duration);
+
+    if (par->codec_type == AVMEDIA_TYPE_AUDIO) {
+        /* Custom channel maps aren't worth caching */
+        if (par->ch_layout.order == AV_CHANNEL_ORDER_CUSTOM)
+            return AVERROR(ENOTSUP);
+        err |= set_int(dict, i, "ch_order", par->ch_layout.order);
+        err |= set_int(dict, i, "ch_nb", par->ch_layout.nb_channels);
+        err |= set_int(dict, i, "ch_mask", par->ch_layout.u.mask);
+    }
+
+    if (par->extradata_size) {
+        char key[64];
+        char *hex = av_malloc(2*par->extradata_size + 1);
+        if (!hex)
+            return AVERROR(ENOMEM);
+        for (int j = 0; j < par->extradata_size; j++)
+            snprintf(hex + 2*j, 3, "%02x", par->extradata[j]);
+        snprintf(key, sizeof(key), "%i.extradata", i);
+        err |= av_dict_set(dict, key, hex, AV_DICT_DONT_STRDUP_VAL);
+    }
+
+    return err < 0 ? AVERROR(ENOMEM) : 0;
+}
+
+int sp_stream_info_cache_store(void *log_ctx, const char *dir,
+                               const char *url, AVFormatContext *avf)
+{
+    int err;
+    CacheEntry e;
+    AVDictionary *dict = NULL;
+    char *buf = NULL, *tmp = NULL;
+
+    err = entry_get(dir, url, &e);
+    if (err < 0)
+        return err == AVERROR(ENOTSUP) ? 0 : err;
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        err = AVERROR(errno);
+        sp_log(log_ctx, SP_LOG_WARN, "Unable to create cache directory %s: %s!\n",
+               dir, av_err2str(err));
+        goto end;
+    }
+
+    err  = set_int(&dict, -1, "version", CACHE_VERSION);
+    err |= av_dict_set(&dict, "path", e.path, 0);
+    err |= set_int(&dict, -1, "size", e.size);
+    err |= set_int(&dict, -1, "mtime", e.mtime);
+    err |= set_int(&dict, -1, "nb_streams", avf->nb_streams);
+    err |= set_int(&dict, -1, "start_time", avf->start_time);
+    err |= set_int(&dict, -1, "duration", avf->duration);
+    err |= set_int(&dict, -1, "bit_rate", avf->bit_rate);
+    if (err < 0) {
+        err = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    for (int i = 0; i < avf->nb_streams; i++) {
+        err = store_stream(&dict, i, avf->streams[i]);
+        if (err == AVERROR(ENOTSUP)) {
+            err = 0;
+            goto end;
+        } else if (err < 0) {
+            goto end;
+        }
+    }
+
+    err = av_dict_get_string(dict, &buf, '=', '\n');
+    if (err < 0)
+        goto end;
+
+    /* Written aside and renamed, so concurrent jobs never see half an entry */
+    tmp = av_asprintf("%s.%i.tmp", e.file, (int)getpid());
+    if (!tmp) {
+        err = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    FILE *f = fopen(tmp, "w");
+    if (!f) {
+        err = AVERROR(errno);
+        goto end;
+    }
+
+    size_t len = strlen(buf);
+    int werr = fwrite(buf, 1, len, f) != len;
+    werr |= fclose(f) != 0;
+    if (werr || rename(tmp, e.file) < 0) {
+        err = AVERROR(errno);
+        unlink(tmp);
+        goto end;
+    }
+
+    sp_log(log_ctx, SP_LOG_VERBOSE, "Stream info for %s saved to %s\n",
+           e.path, e.file);
+
+end:
+    if (err < 0)
+        sp_log(log_ctx, SP_LOG_WARN, "Unable to cache stream info: %s!\n",
+               av_err2str(err));
+    av_dict_free(&dict);
+    av_free(buf);
+    av_free(tmp);
+    entry_free(&e);
+    return err;
+}
@@ -0,0 +1,34 @@
+/*
+ * This file is part of txproto.
+ *
+ * txproto is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * txproto is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with txproto; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <libavformat/avformat.h>
+
+/* On-disk cache of what avformat_find_stream_info() found for a local file,
+ * keyed by its path, size and modification time. One small text file per
+ * input is kept in the given directory. */
+
+/* Fills in the streams of an opened context, returns 1 on a hit, 0 on a miss
+ * (including files which aren't local, or whose streams don't match) */
+int sp_stream_info_cache_load(void *log_ctx, const char *dir,
+                              const char *url, AVFormatContext *avf);
+
+/* Saves the stream info of a probed context */
+int sp_stream_info_cache_store(void *log_ctx, const char *dir,
+                               const char *url, AVFormatContext *avf);
@@ -1,7 +1,10 @@
+#include "../config.h"
+
 #include <libavutil/buffer.h>
 #include <libavutil/opt.h>
 #include <libavutil/time.h>
 
+#include <libtxproto/bsf.h>
 #include <libtxproto/control.h>
 #include <libtxproto/decode.h>
 #include <libtxproto/demux.h>
@@ -13,6 +16,10 @@
 #include <libtxproto/txproto_main.h>
 #include <libtxproto/txproto.h>
 #include "iosys_common.h"
+#include "rawcap.h"
+#include "callback_sink.h"
+#include "app_source.h"
+#include "shm_ring.h"
 
 TXMainContext *tx_new(void)
 {
@@ -224,6 +231,44 @@ err:
     return NULL;
 }
 
+AVBufferRef *tx_bsf_create(
+    TXMainContext *ctx,
+    const char *filters,
+    const char *name,
+    AVDictionary *options,
+    AVDictionary *init_opts
+) {
+    int err;
+    AVBufferRef *bctx_ref = sp_bsf_alloc();
+    BSFContext *bctx = (BSFContext *)bctx_ref->data;
+
+    bctx->filters = filters;
+    bctx->name = name;
+    bctx->bsf_opts = options;
+
+    err = sp_bsf_init(bctx_ref);
+    if (err < 0) {
+        sp_log(ctx, SP_LOG_ERROR, "Unable to init bitstream filter: %s!", av_err2str(err));
+        goto err;
+    }
+
+    if (init_opts) {
+        err = sp_bsf_ctrl(bctx_ref, SP_EVENT_CTRL_OPTS | SP_EVENT_FLAG_IMMEDIATE, init_opts);
+        if (err < 0) {
+            sp_log(ctx, SP_LOG_ERROR, "Unable to set options: %s!", av_err2str(err));
+            goto err;
+        }
+    }
+
+    sp_bufferlist_append_noref(ctx->ext_buf_refs, bctx_ref);
+
+    return bctx_ref;
+
+err:
+    av_buffer_unref(&bctx_ref);
+    return NULL;
+}
+
 AVBufferRef *tx_muxer_create(
     TXMainContext *ctx,
     const char *out_url,
@@ -269,6 +314,97 @@ err:
     return NULL;
 }
 
+AVBufferRef *tx_rawcap_sink_create(
+    TXMainContext *ctx,
+    const char *path,
+    enum AVMediaType type,
+    AVDictionary *options
+) {
+    AVBufferRef *entry = sp_rawcap_sink_create(ctx, path, type, options);
+    if (!entry) {
+        sp_log(ctx, SP_LOG_ERROR, "Unable to create raw capture sink!");
+        return NULL;
+    }
+
+    sp_bufferlist_append_noref(ctx->ext_buf_refs, entry);
+
+    return entry;
+}
+
+AVBufferRef *tx_sink_create(
+    TXMainContext *ctx,
+    enum AVMediaType type,
+    int (*frame_cb)(AVFrame *frame, void *userdata),
+    int (*packet_cb)(AVPacket *pkt, void *userdata),
+    void *userdata,
+    AVDictionary *options
+) {
+    AVBufferRef *entry = sp_callback_sink_create(ctx, type, frame_cb, packet_cb,
+                                                 userdata, options);
+    if (!entry) {
+        sp_log(ctx, SP_LOG_ERROR, "Unable to create callback sink!");
+        return NULL;
+    }
+
+    sp_bufferlist_append_noref(ctx->ext_buf_refs, entry);
+
+    return entry;
+}
+
+AVBufferRef *tx_shm_sink_create(
+    TXMainContext *ctx,
+    const char *name,
+    enum AVMediaType type,
+    AVDictionary *options
+) {
+#ifdef HAVE_SHM_RING
+    AVBufferRef *entry = sp_shm_sink_create(ctx, name, type, options);
+    if (!entry) {
+        sp_log(ctx, SP_LOG_ERROR, "Unable to create shared memory sink!");
+        return NULL;
+    }
+
+    sp_bufferlist_append_noref(ctx->ext_buf_refs, entry);
+
+    return entry;
+#else
+    sp_log(ctx, SP_LOG_ERROR, "Shared memory transport not compiled in!");
+    return NULL;
+#endif
+}
+
+AVBufferRef *tx_source_create(
+    TXMainContext *ctx,
+    const TXSourceParams *params
+) {
+    AVBufferRef *entry = sp_app_source_create(ctx, params->name, params->type,
+                                              params->time_base, params->frame_rate,
+                                              params->fifo_size);
+    if (!entry) {
+        sp_log(ctx, SP_LOG_ERROR, "Unable to create application source!");
+        return NULL;
+    }
+
+    sp_bufferlist_append_noref(ctx->ext_buf_refs, entry);
+
+    return entry;
+}
+
+int tx_source_push(
+    AVBufferRef *source,
+    AVFrame *frame,
+    int64_t timeout
+) {
+    return sp_app_source_push(source, frame, timeout);
+}
+
+int tx_source_try_push(
+    AVBufferRef *source,
+    AVFrame *frame
+) {
+    return sp_app_source_push(source, frame, 0);
+}
+
 AVBufferRef *tx_filtergraph_create(
     TXMainContext *ctx,
     const char *graph,
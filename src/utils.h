@@ -18,9 +18,38 @@
 
 #pragma once
 
+#include <libavutil/time.h>
+
 #include <libtxproto/fifo_frame.h>
 #include <libtxproto/fifo_packet.h>
 
+/* How far behind the pipeline clock a frame is, in microseconds */
+static inline int64_t sp_frame_lag(AVFrame *frame, int64_t epoch)
+{
+    FormatExtraData *fe = (FormatExtraData *)frame->opaque_ref->data;
+    if (frame->pts == AV_NOPTS_VALUE)
+        return 0;
+
+    return av_gettime_relative() - epoch -
+           av_rescale_q(frame->pts, fe->time_base, AV_TIME_BASE_Q);
+}
+
+/* Empty packet sent in-band after a seek, ahead of the new position.
+ * Consumers drop any codec or filter state, and pass it on if they output
+ * packets. */
+static inline AVPacket *sp_packet_flush_marker(void)
+{
+    AVPacket *pkt = av_packet_alloc();
+    if (pkt)
+        pkt->flags = AV_PKT_FLAG_DISCARD;
+    return pkt;
+}
+
+static inline int sp_packet_is_flush_marker(const AVPacket *pkt)
+{
+    return pkt && !pkt->data && !pkt->size && (pkt->flags & AV_PKT_FLAG_DISCARD);
+}
+
 static inline void sp_event_send_eos_frame(void *ctx, SPBufferList *events, AVBufferRef *fifo, int reason)
 {
     int tmp = reason;
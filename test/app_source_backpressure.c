@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <libavutil/buffer.h>
+#include <libavutil/dict.h>
+#include <libavutil/frame.h>
+
+#include <libtxproto/txproto.h>
+
+/* Pushes frames as fast as it can into an encoder whose output is taken in
+ * by a deliberately slow sink, which must not make the source drop any. */
+
+#define NB_FRAMES 100
+
+struct SinkState {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int received;
+    int eos;
+};
+
+static int packet_cb(AVPacket *pkt, void *userdata)
+{
+    struct SinkState *state = userdata;
+
+    pthread_mutex_lock(&state->lock);
+    if (pkt)
+        state->received++;
+    else
+        state->eos = 1;
+    pthread_cond_signal(&state->cond);
+    pthread_mutex_unlock(&state->lock);
+
+    av_packet_free(&pkt);
+
+    /* Slower than the source is pushed into */
+    usleep(2000);
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int err;
+
+    struct SinkState state = { 0 };
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.cond, NULL);
+
+    TXMainContext *ctx = tx_new();
+    err = tx_init(ctx);
+    assert(err == 0);
+
+    err = tx_epoch_set(ctx, 0);
+    assert(err == 0);
+
+    TXSourceParams params = {
+        .name = "backpressure_src",
+        .type = AVMEDIA_TYPE_VIDEO,
+        .time_base = (AVRational){ 1, 25 },
+        .frame_rate = (AVRational){ 25, 1 },
+        .fifo_size = 4,
+    };
+    AVBufferRef *source = tx_source_create(ctx, &params);
+    assert(source);
+
+    AVBufferRef *encoder = tx_encoder_create(ctx, "rawvideo", NULL, NULL, NULL);
+    assert(encoder);
+
+    AVDictionary *sink_opts = NULL;
+    av_dict_set(&sink_opts, "fifo_size", "2", 0);
+    av_dict_set(&sink_opts, "drop", "none", 0);
+    AVBufferRef *sink = tx_sink_create(ctx, AVMEDIA_TYPE_VIDEO, NULL, packet_cb,
+                                       &state, sink_opts);
+    av_dict_free(&sink_opts);
+    assert(sink);
+
+    err = tx_link(ctx, source, encoder, 0);
+    assert(err == 0);
+
+    err = tx_link(ctx, encoder, sink, 0);
+    assert(err == 0);
+
+    err = tx_commit(ctx);
+    assert(err == 0);
+
+    AVFrame *frame = av_frame_alloc();
+    assert(frame);
+    frame->format = AV_PIX_FMT_GRAY8;
+    frame->width = 64;
+    frame->height = 64;
+    err = av_frame_get_buffer(frame, 0);
+    assert(err == 0);
+
+    for (int i = 0; i < NB_FRAMES; i++) {
+        err = av_frame_make_writable(frame);
+        assert(err == 0);
+        for (int y = 0; y < frame->height; y++)
+            memset(frame->data[0] + y*frame->linesize[0], i, frame->width);
+        frame->pts = i;
+
+        /* Waits for the encoder to catch up instead of having frames dropped */
+        err = tx_source_push(source, frame, -1);
+        assert(err == 0);
+    }
+
+    err = tx_source_push(source, NULL, -1);
+    assert(err == 0);
+
+    pthread_mutex_lock(&state.lock);
+    while (!state.eos)
+        pthread_cond_wait(&state.cond, &state.lock);
+    pthread_mutex_unlock(&state.lock);
+
+    printf("Received %i out of %i frames\n", state.received, NB_FRAMES);
+    assert(state.received == NB_FRAMES);
+
+    av_frame_free(&frame);
+    tx_free(ctx);
+    pthread_cond_destroy(&state.cond);
+    pthread_mutex_destroy(&state.lock);
+
+    return 0;
+}
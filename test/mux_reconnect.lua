@@ -0,0 +1,72 @@
+common = require "common"
+
+-- Writing to /dev/full always fails with ENOSPC once the output buffer gets
+-- flushed, while opening it, and writing a header into the buffer, always
+-- succeeds. So the muxer keeps going down and reconnecting until the input
+-- ends, which it must outlive.
+saw_down = false
+reconnects = 0
+
+function muxer_stats(stats)
+	if stats.reconnecting == 1 then
+		saw_down = true
+	end
+	if stats.reconnects and stats.reconnects > reconnects then
+		reconnects = stats.reconnects
+	end
+end
+
+function muxer_eos(event)
+	print("EOS on muxer, reconnected "..reconnects.." times")
+	muxer_a.destroy()
+	assert(saw_down, "muxer never reported its output as down")
+	assert(reconnects > 0, "muxer never reconnected")
+	tx.quit()
+end
+
+function main(...)
+    local arg = {...}
+    src = arg[1]
+
+    common.create_audio_sample(src)
+
+    tx.set_epoch(0)
+
+    -- In real time, so that the muxer stays up long enough to report stats
+    source_f = tx.create_demuxer({
+            in_url = src,
+            priv_options = { realtime = true },
+        })
+
+    dec_f = tx.create_decoder({
+            decoder = "flac",
+        })
+    dec_f.link(source_f);
+
+    encoder_a = tx.create_encoder({
+            encoder = "flac",
+	    options = {
+		    sample_rate = 48000,
+		    frame_duration = 20,
+    	    },
+            priv_options = {
+		fifo_size = 10,
+		fifo_flags = "block_no_input,block_max_output" },
+        })
+    encoder_a.link(dec_f)
+
+    muxer_a = tx.create_muxer({
+            out_url = "/dev/full",
+            out_format = "flac",
+            priv_options = {
+		low_latency = false,
+		reconnect = true,
+		reconnect_delay_max_ms = 250,
+	    },
+        })
+    muxer_a.link(encoder_a)
+    muxer_a.schedule("stats", muxer_stats);
+    muxer_a.schedule("eos", muxer_eos);
+
+    tx.commit()
+end